@@ -17,13 +17,274 @@
 
 #include "aes-crypt.h"
 
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
 #define RETURN_FAILURE -1
 #define RETURN_SUCCESS 0
 
 
+/* Derive the MAC and wrap keys from key->key and set up the contexts,
+ * once key->key and key->iv are set */
+static int setupKey(cryptKey_t* key){
+
+    unsigned char gmacKey[32];
+
+    /* Separate MAC keys, so no key is used for two things */
+    if(!HMAC(EVP_sha256(), key->key, sizeof(key->key),
+             (const unsigned char*) "encfs chunk mac", 15,
+             key->macKey, NULL) ||
+       !HMAC(EVP_sha256(), key->key, sizeof(key->key),
+             (const unsigned char*) "encfs chunk gmac", 16,
+             gmacKey, NULL) ||
+       !HMAC(EVP_sha256(), key->key, sizeof(key->key),
+             (const unsigned char*) "encfs key wrap", 14,
+             key->wrapKey, NULL)){
+        fprintf(stderr, "ERROR HMAC failed\n");
+        return RETURN_FAILURE;
+    }
+
+    /* Init Engines */
+    key->encCtx = EVP_CIPHER_CTX_new();
+    key->decCtx = EVP_CIPHER_CTX_new();
+    key->ctrCtx = EVP_CIPHER_CTX_new();
+    key->macCtx = EVP_CIPHER_CTX_new();
+    if(!key->encCtx || !key->decCtx || !key->ctrCtx || !key->macCtx ||
+       !EVP_CipherInit_ex(key->encCtx, EVP_aes_256_cbc(), NULL,
+                          key->key, key->iv, ACT_ENCRYPT) ||
+       !EVP_CipherInit_ex(key->decCtx, EVP_aes_256_cbc(), NULL,
+                          key->key, key->iv, ACT_DECRYPT) ||
+       !EVP_CipherInit_ex(key->ctrCtx, EVP_aes_256_ctr(), NULL,
+                          key->key, NULL, ACT_ENCRYPT) ||
+       !EVP_CipherInit_ex(key->macCtx, EVP_aes_256_gcm(), NULL,
+                          NULL, NULL, ACT_ENCRYPT) ||
+       !EVP_CIPHER_CTX_ctrl(key->macCtx, EVP_CTRL_GCM_SET_IVLEN, 16, NULL) ||
+       !EVP_CipherInit_ex(key->macCtx, NULL, NULL,
+                          gmacKey, NULL, ACT_ENCRYPT)){
+        fprintf(stderr, "ERROR EVP_CipherInit_ex failed\n");
+        OPENSSL_cleanse(gmacKey, sizeof(gmacKey));
+        return RETURN_FAILURE;
+    }
+    OPENSSL_cleanse(gmacKey, sizeof(gmacKey));
+
+    return RETURN_SUCCESS;
+
+}
+
+extern cryptKey_t* crypt_createKey(const char* key_str){
+
+    cryptKey_t* key = NULL;
+    int nrounds = 5;
+    int i;
+
+    if(!key_str){
+        fprintf(stderr, "ERROR Key_str must not be NULL\n");
+        return NULL;
+    }
+
+    key = calloc(1, sizeof(*key));
+    if(!key){
+        fprintf(stderr, "ERROR calloc failed\n");
+        return NULL;
+    }
+
+    /* Build Key from String */
+    i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
+                       (unsigned char*)key_str, strlen(key_str), nrounds,
+                       key->key, key->iv);
+    if (i != 32) {
+        /* Error */
+        fprintf(stderr, "ERROR Key size is %d bits - should be 256 bits\n", i*8);
+        crypt_destroyKey(key);
+        return NULL;
+    }
+
+    if(setupKey(key) < 0){
+        crypt_destroyKey(key);
+        return NULL;
+    }
+
+    return key;
+
+}
+
+/* AES key wrap of len bytes in under kek (enc) or unwrap (!enc) into out
+ *
+ * Return: Bytes written to out, -1 on error or failed unwrap check */
+static int wrapBytes(const unsigned char* kek, int enc,
+                     const unsigned char* in, int len, unsigned char* out){
+
+    int outLen = 0;
+    int finalLen = 0;
+    EVP_CIPHER_CTX* ctx = NULL;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx){
+        fprintf(stderr, "ERROR EVP_CIPHER_CTX_new failed\n");
+        return RETURN_FAILURE;
+    }
+    EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+    if(!EVP_CipherInit_ex(ctx, EVP_aes_256_wrap(), NULL, kek, NULL, enc) ||
+       !EVP_CipherUpdate(ctx, out, &outLen, in, len) ||
+       !EVP_CipherFinal_ex(ctx, out + outLen, &finalLen)){
+        EVP_CIPHER_CTX_free(ctx);
+        return RETURN_FAILURE;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    return outLen + finalLen;
+
+}
+
+/* A data key from its CRYPT_DATAKEYSIZE raw bytes and their wrapped form */
+static cryptKey_t* dataKey(const unsigned char* raw,
+                           const unsigned char* wrapped){
+
+    cryptKey_t* key = NULL;
+
+    key = calloc(1, sizeof(*key));
+    if(!key){
+        fprintf(stderr, "ERROR calloc failed\n");
+        return NULL;
+    }
+
+    /* Formats that use data keys pick IVs per chunk; iv is only for the
+       CBC contexts every key has */
+    memcpy(key->key, raw, CRYPT_DATAKEYSIZE);
+    if(!HMAC(EVP_sha256(), key->key, sizeof(key->key),
+             (const unsigned char*) "encfs data iv", 13, key->iv, NULL) ||
+       setupKey(key) < 0){
+        fprintf(stderr, "ERROR data key setup failed\n");
+        crypt_destroyKey(key);
+        return NULL;
+    }
+    memcpy(key->wrapped, wrapped, CRYPT_WRAPSIZE);
+    key->isData = 1;
+
+    return key;
+
+}
+
+extern cryptKey_t* crypt_createDataKey(const cryptKey_t* master){
+
+    cryptKey_t* key = NULL;
+    unsigned char raw[CRYPT_DATAKEYSIZE];
+    unsigned char wrapped[CRYPT_WRAPSIZE];
+
+    if(!master){
+        fprintf(stderr, "ERROR master must not be NULL\n");
+        return NULL;
+    }
+
+    if(RAND_bytes(raw, sizeof(raw)) != 1){
+        fprintf(stderr, "ERROR RAND_bytes failed\n");
+        return NULL;
+    }
+    if(wrapBytes(master->wrapKey, ACT_ENCRYPT, raw, sizeof(raw), wrapped) !=
+       CRYPT_WRAPSIZE){
+        fprintf(stderr, "ERROR data key wrap failed\n");
+        OPENSSL_cleanse(raw, sizeof(raw));
+        return NULL;
+    }
+
+    key = dataKey(raw, wrapped);
+    OPENSSL_cleanse(raw, sizeof(raw));
+
+    return key;
+
+}
+
+extern cryptKey_t* crypt_unwrapDataKey(const cryptKey_t* master,
+                                       const unsigned char* wrapped){
+
+    cryptKey_t* key = NULL;
+    unsigned char raw[CRYPT_WRAPSIZE];
+
+    if(!master || !wrapped){
+        fprintf(stderr, "ERROR master and wrapped must not be NULL\n");
+        return NULL;
+    }
+
+    if(wrapBytes(master->wrapKey, ACT_DECRYPT, wrapped, CRYPT_WRAPSIZE, raw) !=
+       CRYPT_DATAKEYSIZE){
+        fprintf(stderr, "ERROR data key unwrap failed\n");
+        OPENSSL_cleanse(raw, sizeof(raw));
+        return NULL;
+    }
+
+    key = dataKey(raw, wrapped);
+    OPENSSL_cleanse(raw, sizeof(raw));
+
+    return key;
+
+}
+
+extern int crypt_rewrapDataKey(const cryptKey_t* from, const cryptKey_t* to,
+                               const unsigned char* wrapped, unsigned char* out){
+
+    int ret = RETURN_SUCCESS;
+    unsigned char raw[CRYPT_WRAPSIZE];
+
+    if(!from || !to || !wrapped || !out){
+        fprintf(stderr, "ERROR rewrap arguments must not be NULL\n");
+        return RETURN_FAILURE;
+    }
+
+    if(wrapBytes(from->wrapKey, ACT_DECRYPT, wrapped, CRYPT_WRAPSIZE, raw) !=
+       CRYPT_DATAKEYSIZE ||
+       wrapBytes(to->wrapKey, ACT_ENCRYPT, raw, CRYPT_DATAKEYSIZE, out) !=
+       CRYPT_WRAPSIZE){
+        fprintf(stderr, "ERROR data key rewrap failed\n");
+        ret = RETURN_FAILURE;
+    }
+    OPENSSL_cleanse(raw, sizeof(raw));
+
+    return ret;
+
+}
+
+extern int crypt_init(void){
+
+    cryptKey_t* key = NULL;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    if(!OPENSSL_init_crypto(OPENSSL_INIT_ADD_ALL_CIPHERS |
+                            OPENSSL_INIT_ADD_ALL_DIGESTS, NULL)){
+        fprintf(stderr, "ERROR OPENSSL_init_crypto failed\n");
+        return RETURN_FAILURE;
+    }
+#endif
+
+    /* One throwaway key sets up every cipher context a key needs */
+    key = crypt_createKey("crypt_init");
+    if(!key){
+        return RETURN_FAILURE;
+    }
+    crypt_destroyKey(key);
+
+    return RETURN_SUCCESS;
+
+}
+
+extern void crypt_destroyKey(cryptKey_t* key){
+
+    if(!key){
+        return;
+    }
+
+    EVP_CIPHER_CTX_free(key->encCtx);
+    EVP_CIPHER_CTX_free(key->decCtx);
+    EVP_CIPHER_CTX_free(key->ctrCtx);
+    EVP_CIPHER_CTX_free(key->macCtx);
+    OPENSSL_cleanse(key, sizeof(*key));
+    free(key);
+
+}
+
 extern int crypt_copy(FILE* in, FILE* out){
 
-    return do_crypt(in, out, ACT_COPY, NULL);
+    return do_cryptKey(in, out, ACT_COPY, NULL);
 
 }
 
@@ -39,8 +300,42 @@ extern int crypt_encrypt(FILE* in, FILE* out, char* key_str){
 
 }
 
+extern int crypt_decryptKey(FILE* in, FILE* out, const cryptKey_t* key){
+
+    return do_cryptKey(in, out, ACT_DECRYPT, key);
+
+}
+
+extern int crypt_encryptKey(FILE* in, FILE* out, const cryptKey_t* key){
+
+    return do_cryptKey(in, out, ACT_ENCRYPT, key);
+
+}
+
 extern int do_crypt(FILE* in, FILE* out, cryptAction_t action, char* key_str){
 
+    int ret;
+    cryptKey_t* key = NULL;
+
+    /* Setup Encryption Key if in cipher mode */
+    if(action >= 0){
+        key = crypt_createKey(key_str);
+        if(!key){
+            return RETURN_FAILURE;
+        }
+    }
+
+    ret = do_cryptKey(in, out, action, key);
+
+    crypt_destroyKey(key);
+
+    return ret;
+
+}
+
+extern int do_cryptKey(FILE* in, FILE* out, cryptAction_t action,
+                       const cryptKey_t* key){
+
     /* Buffers */
     unsigned char inbuf[BLOCKSIZE];
     int inlen;
@@ -50,36 +345,27 @@ extern int do_crypt(FILE* in, FILE* out, cryptAction_t action, char* key_str){
     int writelen;
 
     /* OpenSSL libcrypto vars */
-    EVP_CIPHER_CTX ctx;
-    unsigned char key[32];
-    unsigned char iv[32];
-    int nrounds = 5;
-
-    /* tmp vars */
-    int i;
+    EVP_CIPHER_CTX* ctx = NULL;
 
     /* Rewind Files */
     rewind(in);
     rewind(out);
 
-    /* Setup Encryption Key and Cipher Engine if in cipher mode */
+    /* Setup Cipher Engine from the key's ready context if in cipher mode */
     if(action >= 0){
-        if(!key_str){
+        if(!key){
             /* Error */
-            fprintf(stderr, "ERROR Key_str must not be NULL\n");
+            fprintf(stderr, "ERROR Key must not be NULL\n");
             return RETURN_FAILURE;
         }
-        /* Build Key from String */
-        i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
-                           (unsigned char*)key_str, strlen(key_str), nrounds, key, iv);
-        if (i != 32) {
-            /* Error */
-            fprintf(stderr, "ERROR Key size is %d bits - should be 256 bits\n", i*8);
+        ctx = EVP_CIPHER_CTX_new();
+        if(!ctx ||
+           !EVP_CIPHER_CTX_copy(ctx, (action == ACT_ENCRYPT) ?
+                                key->encCtx : key->decCtx)){
+            fprintf(stderr, "ERROR EVP_CIPHER_CTX_copy failed\n");
+            EVP_CIPHER_CTX_free(ctx);
             return RETURN_FAILURE;
         }
-        /* Init Engine */
-        EVP_CIPHER_CTX_init(&ctx);
-        EVP_CipherInit_ex(&ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
     }
 
     /* Loop through Input File*/
@@ -93,10 +379,10 @@ extern int do_crypt(FILE* in, FILE* out, cryptAction_t action, char* key_str){
 
         /* If in cipher mode, perform cipher transform on block */
         if(action >= 0){
-            if(!EVP_CipherUpdate(&ctx, outbuf, &outlen, inbuf, inlen)){
+            if(!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen)){
                 /* Error */
                 fprintf(stderr, "ERROR EVP_CipherUpdate failed\n");
-                EVP_CIPHER_CTX_cleanup(&ctx);
+                EVP_CIPHER_CTX_free(ctx);
                 return RETURN_FAILURE;
             }
         }
@@ -111,7 +397,7 @@ extern int do_crypt(FILE* in, FILE* out, cryptAction_t action, char* key_str){
         if(writelen != outlen){
             /* Error */
             perror("ERROR fwrite body error");
-            EVP_CIPHER_CTX_cleanup(&ctx);
+            EVP_CIPHER_CTX_free(ctx);
             return RETURN_FAILURE;
         }
     }
@@ -119,11 +405,11 @@ extern int do_crypt(FILE* in, FILE* out, cryptAction_t action, char* key_str){
     /* If in cipher mode, handle necessary padding */
     if(action >= 0){
         /* Handle remaining cipher block + padding */
-        if(!EVP_CipherFinal_ex(&ctx, outbuf, &outlen))
+        if(!EVP_CipherFinal_ex(ctx, outbuf, &outlen))
             {
                 /* Error */
                 fprintf(stderr, "ERROR EVP_CipherFinal failed\n");
-                EVP_CIPHER_CTX_cleanup(&ctx);
+                EVP_CIPHER_CTX_free(ctx);
                 return RETURN_FAILURE;
             }
         /* Write remainign cipher block + padding*/
@@ -131,10 +417,10 @@ extern int do_crypt(FILE* in, FILE* out, cryptAction_t action, char* key_str){
         if(writelen != outlen){
             /* Error */
             perror("ERROR fwrite padding error");
-            EVP_CIPHER_CTX_cleanup(&ctx);
+            EVP_CIPHER_CTX_free(ctx);
             return RETURN_FAILURE;
         }
-        EVP_CIPHER_CTX_cleanup(&ctx);
+        EVP_CIPHER_CTX_free(ctx);
     }
 
     /* Rewind Files */
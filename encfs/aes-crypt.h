@@ -27,15 +27,93 @@
 
 #define BLOCKSIZE 1024
 
+/* Data keys: random per-file keys, stored wrapped (AES key wrap, RFC 3394)
+ * under a master key */
+#define CRYPT_DATAKEYSIZE 32
+#define CRYPT_WRAPSIZE    (CRYPT_DATAKEYSIZE + 8)
+
 typedef enum {
     ACT_COPY    = -1,
     ACT_DECRYPT = 0,
     ACT_ENCRYPT = 1
 } cryptAction_t;
 
+/* Derived key material plus cipher contexts with the key schedule already
+ * set up, so repeated operations under one key skip EVP_BytesToKey and
+ * key expansion. Safe to share between threads; each operation works on
+ * its own copy of the contexts. ctrCtx is AES-256-CTR under the same key
+ * with no IV set, for formats that pick an IV per chunk. For formats that
+ * authenticate data, macKey is an HMAC-SHA256 key derived from key, and
+ * macCtx is AES-256-GCM under another derived key, taking 16-byte IVs,
+ * for GMACs. wrapKey, derived the same way, wraps data keys. A data key
+ * (isData) also keeps its wrapped form, as files store it. */
+typedef struct cryptKey {
+    unsigned char   key[32];
+    unsigned char   iv[32];
+    unsigned char   macKey[32];
+    unsigned char   wrapKey[32];
+    unsigned char   wrapped[CRYPT_WRAPSIZE];
+    int             isData;
+    EVP_CIPHER_CTX* encCtx;
+    EVP_CIPHER_CTX* decCtx;
+    EVP_CIPHER_CTX* ctrCtx;
+    EVP_CIPHER_CTX* macCtx;
+} cryptKey_t;
+
+/* cryptKey_t* crypt_createKey(const char* key_str)
+ *
+ * Purpose: Derive a key from passphrase key_str, as do_crypt does
+ *
+ * Return: New key on success, NULL on error
+ */
+extern cryptKey_t* crypt_createKey(const char* key_str);
+extern void crypt_destroyKey(cryptKey_t* key);
+
+/* cryptKey_t* crypt_createDataKey(const cryptKey_t* master)
+ *
+ * Purpose: Make a new random data key, wrapped under master
+ *
+ * Return: New key on success, NULL on error
+ */
+extern cryptKey_t* crypt_createDataKey(const cryptKey_t* master);
+
+/* cryptKey_t* crypt_unwrapDataKey(const cryptKey_t* master,
+ *                                 const unsigned char* wrapped)
+ *
+ * Purpose: Recover the data key wrapped, CRYPT_WRAPSIZE bytes, under master
+ *
+ * Return: New key on success, NULL on error or if wrapped was not
+ *         wrapped under master
+ */
+extern cryptKey_t* crypt_unwrapDataKey(const cryptKey_t* master,
+                                       const unsigned char* wrapped);
+
+/* int crypt_rewrapDataKey(const cryptKey_t* from, const cryptKey_t* to,
+ *                         const unsigned char* wrapped, unsigned char* out)
+ *
+ * Purpose: Wrap the data key wrapped under from again under to, into out
+ *          (both CRYPT_WRAPSIZE bytes), without making a key of it
+ *
+ * Return: 0 on success, -1 on error or if wrapped was not wrapped under from
+ */
+extern int crypt_rewrapDataKey(const cryptKey_t* from, const cryptKey_t* to,
+                               const unsigned char* wrapped, unsigned char* out);
+
+/* int crypt_init(void)
+ *
+ * Purpose: Initialize libcrypto and load the ciphers and digests keys
+ *          use, so the first crypt_createKey doesn't pay for it. Call
+ *          once, before any other thread uses libcrypto.
+ *
+ * Return: 0 on success, -1 on error
+ */
+extern int crypt_init(void);
+
 extern int crypt_copy(FILE* in, FILE* out);
 extern int crypt_decrypt(FILE* in, FILE* out, char* key_str);
 extern int crypt_encrypt(FILE* in, FILE* out, char* key_str);
+extern int crypt_decryptKey(FILE* in, FILE* out, const cryptKey_t* key);
+extern int crypt_encryptKey(FILE* in, FILE* out, const cryptKey_t* key);
 
 /* int do_crypt(FILE* in, FILE* out, int action, char* key_str)
  *
@@ -52,4 +130,12 @@ extern int crypt_encrypt(FILE* in, FILE* out, char* key_str);
  */
 extern int do_crypt(FILE* in, FILE* out, cryptAction_t action, char* key_str);
 
+/* int do_cryptKey(FILE* in, FILE* out, cryptAction_t action,
+ *                 const cryptKey_t* key)
+ *
+ * As do_crypt, with a key from crypt_createKey (NULL for ACT_COPY)
+ */
+extern int do_cryptKey(FILE* in, FILE* out, cryptAction_t action,
+                       const cryptKey_t* key);
+
 #endif
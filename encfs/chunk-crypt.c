@@ -0,0 +1,3015 @@
+/* chunk-crypt.c
+ * Chunked, hole-aware on-disk format for encrypted files
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "chunk-crypt.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+#define CLUSTERSIZE ((off_t) CHUNK_TABLESIZE + (off_t) CHUNK_PERTABLE * CHUNK_SIZE)
+
+/* Header layout */
+#define HDR_MAGIC     0
+#define HDR_VERSION   8
+#define HDR_CHUNKSIZE 12
+#define HDR_PLAINSIZE 16
+#define HDR_FLAGS     24
+#define HDR_ROOT      32
+#define HDR_MAC       48
+#define HDR_WRAPPED   64    /* CHUNK_VERSION_WRAPPED; not under HDR_MAC */
+#define HDR_SPARE     (HDR_WRAPPED + CRYPT_WRAPSIZE)  /* staged, likewise */
+#define HDR_LEN       (HDR_SPARE + CRYPT_WRAPSIZE)
+
+/* Table entry layout */
+#define ENT_IV        0
+#define ENT_LEN       16
+#define ENT_FLAGS     20
+#define ENT_CLEN      24
+#define ENT_MAC       32
+#define ENT_NODE      48    /* MAC of child table, not part of the entry */
+
+/* Tree depth for the largest file: 64^9 clusters is past any off_t */
+#define TREE_DEPTH    9
+
+#define NOCLUSTER UINT64_MAX
+
+typedef struct chunkEntry {
+    unsigned char iv[CHUNK_IVSIZE];
+    uint32_t      len;      /* plain length */
+    uint32_t      flags;
+    uint32_t      clen;     /* stored length */
+    unsigned char mac[CHUNK_MACSIZE];
+} chunkEntry_t;
+
+/* Checked path from the root to the table last read, so reads of nearby
+ * clusters only check their own table */
+typedef struct treePath {
+    const unsigned char* macKey;
+    unsigned char        root[CHUNK_MACSIZE];
+    const chunkMap_t*    trusted;   /* tables written since root, or NULL */
+    uint64_t             cluster[TREE_DEPTH];
+    unsigned char*       tables;    /* TREE_DEPTH tables, block aligned */
+} treePath_t;
+
+/* Codec new chunks are compressed with, and whether files are
+ * authenticated; set once at startup */
+static int chunkCodec = CHUNK_CODEC_NONE;
+static int chunkLevel = 0;
+static int chunkIntegrity = 1;
+
+/* Where the time reads and writes take is counted, if anywhere */
+static spanTrace_t* chunkSpans = NULL;
+
+static uint32_t getLE32(const unsigned char* p) {
+
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+
+}
+
+static uint64_t getLE64(const unsigned char* p) {
+
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+
+}
+
+static void putLE32(unsigned char* p, uint32_t v) {
+
+    v = htole32(v);
+    memcpy(p, &v, sizeof(v));
+
+}
+
+static void putLE64(unsigned char* p, uint64_t v) {
+
+    v = htole64(v);
+    memcpy(p, &v, sizeof(v));
+
+}
+
+static off_t clusterOffset(uint64_t cluster) {
+    return CHUNK_HDRSIZE + (off_t) cluster * CLUSTERSIZE;
+}
+
+static off_t chunkOffset(uint64_t chunk) {
+    return clusterOffset(chunk / CHUNK_PERTABLE) + CHUNK_TABLESIZE +
+        (off_t) (chunk % CHUNK_PERTABLE) * CHUNK_SIZE;
+}
+
+static uint64_t numChunks(uint64_t plainSize) {
+    return (plainSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
+
+static uint64_t numClusters(uint64_t plainSize) {
+    return (numChunks(plainSize) + CHUNK_PERTABLE - 1) / CHUNK_PERTABLE;
+}
+
+/* Clusters a backing file of size bytes reaches into */
+static uint64_t clustersIn(off_t size) {
+
+    if(size <= CHUNK_HDRSIZE) {
+        return 0;
+    }
+
+    return (size - CHUNK_HDRSIZE + CLUSTERSIZE - 1) / CLUSTERSIZE;
+
+}
+
+/* Length of the backing file holding plainSize bytes */
+static off_t encSize(uint64_t plainSize) {
+
+    uint64_t chunks = numChunks(plainSize);
+
+    if(chunks == 0) {
+        return CHUNK_HDRSIZE;
+    }
+
+    return chunkOffset(chunks - 1) + (plainSize - (chunks - 1) * CHUNK_SIZE);
+
+}
+
+
+static int isZero(const unsigned char* buf, size_t len) {
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+static ssize_t preadFull(int fd, void* buf, size_t len, off_t offset) {
+
+    ssize_t ret;
+    size_t done = 0;
+    uint64_t begun = spantrace_ioBegin(chunkSpans);
+
+    while(done < len) {
+        ret = pread(fd, (char*) buf + done, len - done, offset + done);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            spantrace_ioEnd(chunkSpans, begun);
+            return -errno;
+        }
+        if(ret == 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    spantrace_ioEnd(chunkSpans, begun);
+    return done;
+
+}
+
+static int pwriteFull(int fd, const void* buf, size_t len, off_t offset) {
+
+    ssize_t ret;
+    size_t done = 0;
+    uint64_t begun = spantrace_ioBegin(chunkSpans);
+
+    while(done < len) {
+        ret = pwrite(fd, (const char*) buf + done, len - done, offset + done);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            spantrace_ioEnd(chunkSpans, begun);
+            return -errno;
+        }
+        done += ret;
+    }
+
+    spantrace_ioEnd(chunkSpans, begun);
+    return RETURN_SUCCESS;
+
+}
+
+static EVP_CIPHER_CTX* copyCtx(const EVP_CIPHER_CTX* from) {
+
+    EVP_CIPHER_CTX* ctx = NULL;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx || !EVP_CIPHER_CTX_copy(ctx, from)) {
+        fprintf(stderr, "ERROR copyCtx: EVP_CIPHER_CTX_copy failed\n");
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+
+}
+
+/* Per-operation copy of the key's CTR context */
+static EVP_CIPHER_CTX* newCtx(const cryptKey_t* key) {
+
+    if(!key || !key->ctrCtx) {
+        fprintf(stderr, "ERROR newCtx: key must not be NULL\n");
+        return NULL;
+    }
+
+    return copyCtx(key->ctrCtx);
+
+}
+
+/* Per-operation copy of the key's GMAC context */
+static EVP_CIPHER_CTX* newMacCtx(const cryptKey_t* key) {
+
+    if(!key || !key->macCtx) {
+        fprintf(stderr, "ERROR newMacCtx: key must not be NULL\n");
+        return NULL;
+    }
+
+    return copyCtx(key->macCtx);
+
+}
+
+/* CTR is its own inverse, so this both encrypts and decrypts */
+static int cryptChunk(EVP_CIPHER_CTX* ctx, const unsigned char* iv,
+                      const unsigned char* in, unsigned char* out, int len) {
+
+    int outlen;
+
+    if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1) ||
+       !EVP_CipherUpdate(ctx, out, &outlen, in, len) ||
+       outlen != len) {
+        fprintf(stderr, "ERROR cryptChunk: EVP_CipherUpdate failed\n");
+        return -EIO;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+static void getEntry(const unsigned char* table, size_t idx, chunkEntry_t* ent) {
+
+    const unsigned char* p = table + idx * CHUNK_ENTRYSIZE;
+
+    memcpy(ent->iv, p + ENT_IV, CHUNK_IVSIZE);
+    ent->len = getLE32(p + ENT_LEN);
+    ent->flags = getLE32(p + ENT_FLAGS);
+    ent->clen = CHUNK_CODEC(ent->flags) ? getLE32(p + ENT_CLEN) : ent->len;
+    memcpy(ent->mac, p + ENT_MAC, CHUNK_MACSIZE);
+
+}
+
+/* Entries leave the child table MAC sharing their bytes alone */
+static void putEntry(unsigned char* table, size_t idx, const chunkEntry_t* ent) {
+
+    unsigned char* p = table + idx * CHUNK_ENTRYSIZE;
+
+    memset(p, 0, ENT_NODE);
+    memcpy(p + ENT_IV, ent->iv, CHUNK_IVSIZE);
+    putLE32(p + ENT_LEN, ent->len);
+    putLE32(p + ENT_FLAGS, ent->flags);
+    if(CHUNK_CODEC(ent->flags)) {
+        putLE32(p + ENT_CLEN, ent->clen);
+    }
+    memcpy(p + ENT_MAC, ent->mac, CHUNK_MACSIZE);
+
+}
+
+static void clearEntries(unsigned char* table, size_t idx, size_t count) {
+
+    for(; count > 0; idx++, count--) {
+        memset(table + idx * CHUNK_ENTRYSIZE, 0, ENT_NODE);
+    }
+
+}
+
+/* Where the parent table of child keeps its MAC */
+static size_t nodeOffset(uint64_t child) {
+    return ((child - 1) % CHUNK_PERTABLE) * CHUNK_ENTRYSIZE + ENT_NODE;
+}
+
+/* HMAC-SHA256 of len bytes of buf under macKey, cut to CHUNK_MACSIZE */
+static int macBuf(const unsigned char* macKey, const unsigned char* buf,
+                  size_t len, unsigned char* mac) {
+
+    unsigned char md[EVP_MAX_MD_SIZE];
+
+    if(!HMAC(EVP_sha256(), macKey, 32, buf, len, md, NULL)) {
+        fprintf(stderr, "ERROR macBuf: HMAC failed\n");
+        return -EIO;
+    }
+    memcpy(mac, md, CHUNK_MACSIZE);
+
+    return RETURN_SUCCESS;
+
+}
+
+/* GMAC of ent and the ent->clen bytes stored for it, with the chunk's
+ * IV as nonce; several times cheaper than HMAC on every chunk. It doesn't
+ * cover where the chunk sits; the table MAC does. */
+static int macChunk(EVP_CIPHER_CTX* macCtx, const chunkEntry_t* ent,
+                    const unsigned char* data, unsigned char* mac) {
+
+    int outlen;
+    unsigned char fields[ENT_MAC - ENT_LEN];
+
+    memset(fields, 0, sizeof(fields));
+    putLE32(fields + ENT_LEN - ENT_LEN, ent->len);
+    putLE32(fields + ENT_FLAGS - ENT_LEN, ent->flags);
+    putLE32(fields + ENT_CLEN - ENT_LEN, ent->clen);
+
+    if(!EVP_EncryptInit_ex(macCtx, NULL, NULL, NULL, ent->iv) ||
+       !EVP_EncryptUpdate(macCtx, NULL, &outlen, fields, sizeof(fields)) ||
+       !EVP_EncryptUpdate(macCtx, NULL, &outlen, data, ent->clen) ||
+       !EVP_EncryptFinal_ex(macCtx, NULL, &outlen) ||
+       !EVP_CIPHER_CTX_ctrl(macCtx, EVP_CTRL_GCM_GET_TAG, CHUNK_MACSIZE, mac)) {
+        fprintf(stderr, "ERROR macChunk: GMAC failed\n");
+        return -EIO;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+static int checkChunk(EVP_CIPHER_CTX* macCtx, const chunkEntry_t* ent,
+                      const unsigned char* data, uint64_t chunk) {
+
+    int ret;
+    unsigned char mac[CHUNK_MACSIZE];
+
+    ret = macChunk(macCtx, ent, data, mac);
+    if(ret == RETURN_SUCCESS &&
+       CRYPTO_memcmp(mac, ent->mac, CHUNK_MACSIZE) != 0) {
+        fprintf(stderr, "ERROR checkChunk: chunk %"PRIu64" fails its MAC\n",
+                chunk);
+        ret = -EIO;
+    }
+
+    return ret;
+
+}
+
+/* MAC of a whole table, child table MACs included; zero for an empty one,
+ * so clusters never written need no table */
+static int macTable(const unsigned char* macKey, const unsigned char* table,
+                    unsigned char* mac) {
+
+    if(isZero(table, CHUNK_TABLESIZE)) {
+        memset(mac, 0, CHUNK_MACSIZE);
+        return RETURN_SUCCESS;
+    }
+
+    return macBuf(macKey, table, CHUNK_TABLESIZE, mac);
+
+}
+
+#ifdef HAVE_ZSTD
+/* zstd contexts are too costly to make per 4 KiB chunk; keep one of each
+ * per thread */
+static pthread_key_t zstdCKey;
+static pthread_key_t zstdDKey;
+static pthread_once_t zstdOnce = PTHREAD_ONCE_INIT;
+
+static void freeCCtx(void* cctx) {
+    ZSTD_freeCCtx(cctx);
+}
+
+static void freeDCtx(void* dctx) {
+    ZSTD_freeDCtx(dctx);
+}
+
+static void zstdInit(void) {
+    pthread_key_create(&zstdCKey, freeCCtx);
+    pthread_key_create(&zstdDKey, freeDCtx);
+}
+
+static void* zstdCtx(pthread_key_t* key, void* (*create)(void)) {
+
+    void* ctx;
+
+    pthread_once(&zstdOnce, zstdInit);
+    ctx = pthread_getspecific(*key);
+    if(!ctx) {
+        ctx = create();
+        if(ctx) {
+            pthread_setspecific(*key, ctx);
+        }
+    }
+
+    return ctx;
+
+}
+
+static void* newCCtx(void) {
+    return ZSTD_createCCtx();
+}
+
+static void* newDCtx(void) {
+    return ZSTD_createDCtx();
+}
+#endif
+
+extern int chunk_setCodec(int codec, int level) {
+
+    switch(codec) {
+    case CHUNK_CODEC_NONE:
+        break;
+#ifdef HAVE_LZ4
+    case CHUNK_CODEC_LZ4:
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case CHUNK_CODEC_ZSTD:
+        break;
+#endif
+    default:
+        fprintf(stderr, "ERROR chunk_setCodec: codec %d not built in\n", codec);
+        return -ENOTSUP;
+    }
+
+    chunkCodec = codec;
+    chunkLevel = level;
+
+    return RETURN_SUCCESS;
+
+}
+
+extern void chunk_setIntegrity(int on) {
+    chunkIntegrity = on;
+}
+
+extern void chunk_setSpans(spanTrace_t* spans) {
+    chunkSpans = spans;
+}
+
+/* Compress len bytes of in with the current codec
+ *
+ * Return: compressed length, or 0 if the chunk doesn't shrink and is
+ *         stored raw */
+static size_t packChunk(const unsigned char* in, size_t len, unsigned char* out) {
+
+    size_t size = 0;
+
+#ifdef HAVE_LZ4
+    if(chunkCodec == CHUNK_CODEC_LZ4) {
+        /* For LZ4 the level is the acceleration: higher is faster */
+        int ret = LZ4_compress_fast((const char*) in, (char*) out, len, len - 1,
+                                    chunkLevel > 0 ? chunkLevel : 1);
+        size = ret > 0 ? (size_t) ret : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if(chunkCodec == CHUNK_CODEC_ZSTD) {
+        ZSTD_CCtx* cctx = zstdCtx(&zstdCKey, newCCtx);
+        if(cctx) {
+            size = ZSTD_compressCCtx(cctx, out, len - 1, in, len,
+                                     chunkLevel ? chunkLevel : ZSTD_CLEVEL_DEFAULT);
+            if(ZSTD_isError(size)) {
+                size = 0;
+            }
+        }
+    }
+#endif
+    (void) in;
+    (void) out;
+
+    return size < len ? size : 0;
+
+}
+
+/* Decompress clen bytes of in, which must give exactly len bytes */
+static int unpackChunk(int codec, const unsigned char* in, size_t clen,
+                       unsigned char* out, size_t len) {
+
+    size_t size = 0;
+
+    switch(codec) {
+#ifdef HAVE_LZ4
+    case CHUNK_CODEC_LZ4: {
+        int ret = LZ4_decompress_safe((const char*) in, (char*) out, clen, len);
+        size = ret > 0 ? (size_t) ret : 0;
+        break;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CHUNK_CODEC_ZSTD: {
+        ZSTD_DCtx* dctx = zstdCtx(&zstdDKey, newDCtx);
+        if(dctx) {
+            size = ZSTD_decompressDCtx(dctx, out, len, in, clen);
+            if(ZSTD_isError(size)) {
+                size = 0;
+            }
+        }
+        break;
+    }
+#endif
+    default:
+        fprintf(stderr, "ERROR unpackChunk: codec %d not built in\n", codec);
+        (void) in;
+        (void) clen;
+        (void) out;
+        return -ENOTSUP;
+    }
+
+    if(size != len) {
+        fprintf(stderr, "ERROR unpackChunk: chunk does not decompress\n");
+        return -EIO;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Is ent something this build can read back */
+static int checkEntry(const chunkEntry_t* ent) {
+
+    if(ent->len == 0 || ent->len > CHUNK_SIZE ||
+       ent->clen == 0 || ent->clen > ent->len) {
+        return -EIO;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Compress (if it pays) and encrypt len bytes of plain under a fresh IV
+ * into out, filling in *ent, with its MAC unless macCtx is NULL;
+ * ent->clen bytes of out are to be stored */
+static int sealData(EVP_CIPHER_CTX* ctx, EVP_CIPHER_CTX* macCtx,
+                    const unsigned char* plain, size_t len,
+                    unsigned char* out, chunkEntry_t* ent) {
+
+    int ret;
+    size_t clen;
+    unsigned char packed[CHUNK_SIZE];
+
+    if(RAND_bytes(ent->iv, sizeof(ent->iv)) != 1) {
+        fprintf(stderr, "ERROR sealData: RAND_bytes failed\n");
+        return -EIO;
+    }
+
+    ent->len = len;
+    ent->flags = CHUNK_PRESENT;
+    ent->clen = len;
+    memset(ent->mac, 0, sizeof(ent->mac));
+
+    clen = (chunkCodec != CHUNK_CODEC_NONE) ? packChunk(plain, len, packed) : 0;
+    if(clen) {
+        ent->flags |= (uint32_t) chunkCodec << CHUNK_CODEC_SHIFT;
+        ent->clen = clen;
+        ret = cryptChunk(ctx, ent->iv, packed, out, clen);
+        OPENSSL_cleanse(packed, clen);
+    }
+    else {
+        ret = cryptChunk(ctx, ent->iv, plain, out, len);
+    }
+    if(ret == RETURN_SUCCESS && macCtx) {
+        ret = macChunk(macCtx, ent, out, ent->mac);
+    }
+
+    return ret;
+
+}
+
+/* Decrypt and decompress the ent->clen stored bytes in into ent->len
+ * bytes of out */
+static int openData(EVP_CIPHER_CTX* ctx, const chunkEntry_t* ent,
+                    const unsigned char* in, unsigned char* out) {
+
+    int ret;
+    unsigned char packed[CHUNK_SIZE];
+
+    if(!CHUNK_CODEC(ent->flags)) {
+        return cryptChunk(ctx, ent->iv, in, out, ent->len);
+    }
+
+    ret = cryptChunk(ctx, ent->iv, in, packed, ent->clen);
+    if(ret == RETURN_SUCCESS) {
+        ret = unpackChunk(CHUNK_CODEC(ent->flags), packed, ent->clen,
+                          out, ent->len);
+    }
+    OPENSSL_cleanse(packed, ent->clen);
+
+    return ret;
+
+}
+
+/* Parse the got bytes of header read into buf
+ *
+ * Return: 1 and *hdr filled if chunked, 0 if legacy, negative errno if
+ *         the header is from an unsupported version */
+static int parseHeader(const unsigned char* buf, size_t got, chunkHeader_t* hdr) {
+
+    if(got == 0) {
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->version = CHUNK_VERSION;
+        hdr->chunkSize = CHUNK_SIZE;
+        return 1;
+    }
+    if(got < HDR_FLAGS + 4 ||
+       memcmp(buf + HDR_MAGIC, CHUNK_MAGIC, CHUNK_MAGICSIZE) != 0) {
+        return 0;
+    }
+
+    hdr->version = getLE32(buf + HDR_VERSION);
+    hdr->chunkSize = getLE32(buf + HDR_CHUNKSIZE);
+    hdr->plainSize = getLE64(buf + HDR_PLAINSIZE);
+    hdr->flags = getLE32(buf + HDR_FLAGS);
+
+    if((hdr->version != CHUNK_VERSION &&
+        hdr->version != CHUNK_VERSION_WRAPPED) ||
+       hdr->chunkSize != CHUNK_SIZE) {
+        fprintf(stderr, "ERROR parseHeader: unsupported version %u "
+                "chunk size %u\n", hdr->version, hdr->chunkSize);
+        return -EINVAL;
+    }
+
+    memset(hdr->root, 0, sizeof(hdr->root));
+    memset(hdr->mac, 0, sizeof(hdr->mac));
+    memset(hdr->wrapped, 0, sizeof(hdr->wrapped));
+    memset(hdr->spare, 0, sizeof(hdr->spare));
+    if(hdr->version == CHUNK_VERSION_WRAPPED) {
+        if(got < HDR_SPARE) {
+            fprintf(stderr, "ERROR parseHeader: header truncated\n");
+            return -EIO;
+        }
+        memcpy(hdr->wrapped, buf + HDR_WRAPPED, CRYPT_WRAPSIZE);
+        if(got >= HDR_LEN) {
+            memcpy(hdr->spare, buf + HDR_SPARE, CRYPT_WRAPSIZE);
+        }
+    }
+    if(hdr->flags & CHUNK_HDR_TREE) {
+        if(got < HDR_WRAPPED) {
+            fprintf(stderr, "ERROR parseHeader: header truncated\n");
+            return -EIO;
+        }
+        memcpy(hdr->root, buf + HDR_ROOT, CHUNK_MACSIZE);
+        memcpy(hdr->mac, buf + HDR_MAC, CHUNK_MACSIZE);
+    }
+
+    return 1;
+
+}
+
+extern int chunk_readHeader(int encFD, chunkHeader_t* hdr) {
+
+    ssize_t ret;
+    unsigned char buf[HDR_LEN];
+
+    ret = preadFull(encFD, buf, sizeof(buf), 0);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR chunk_readHeader: pread failed with error %zd\n",
+                -ret);
+        return ret;
+    }
+
+    return parseHeader(buf, ret, hdr);
+
+}
+
+/* The wrapped form key's files keep in their header; NULL for a master key */
+static const unsigned char* wrappedOf(const cryptKey_t* key) {
+    return key->isData ? key->wrapped : NULL;
+}
+
+/* Was the file hdr describes written under key: a file under a data key
+ * names it in its header (in either slot), and any other is under a
+ * master key. Nothing in an empty file without a tree depends on its
+ * key. */
+static int keyFits(const chunkHeader_t* hdr, const cryptKey_t* key) {
+
+    if(hdr->version == CHUNK_VERSION_WRAPPED) {
+        return key->isData &&
+            (memcmp(hdr->wrapped, key->wrapped, CRYPT_WRAPSIZE) == 0 ||
+             memcmp(hdr->spare, key->wrapped, CRYPT_WRAPSIZE) == 0);
+    }
+
+    return !key->isData ||
+        (hdr->plainSize == 0 && !(hdr->flags & CHUNK_HDR_TREE));
+
+}
+
+/* Fill in the header of a plainSize byte file; with wrapped, one of a
+ * file under that data key; with macKey, one that carries tree root and
+ * is authenticated under macKey */
+static int fillHeader(unsigned char* buf, size_t len, uint64_t plainSize,
+                      const unsigned char* wrapped,
+                      const unsigned char* macKey, const unsigned char* root) {
+
+    memset(buf, 0, len);
+    memcpy(buf + HDR_MAGIC, CHUNK_MAGIC, CHUNK_MAGICSIZE);
+    putLE32(buf + HDR_VERSION, wrapped ? CHUNK_VERSION_WRAPPED : CHUNK_VERSION);
+    putLE32(buf + HDR_CHUNKSIZE, CHUNK_SIZE);
+    putLE64(buf + HDR_PLAINSIZE, plainSize);
+    putLE32(buf + HDR_FLAGS, 0);
+    if(wrapped) {
+        memcpy(buf + HDR_WRAPPED, wrapped, CRYPT_WRAPSIZE);
+    }
+    if(!macKey) {
+        return RETURN_SUCCESS;
+    }
+
+    putLE32(buf + HDR_FLAGS, CHUNK_HDR_TREE);
+    memcpy(buf + HDR_ROOT, root, CHUNK_MACSIZE);
+
+    return macBuf(macKey, buf, HDR_MAC, buf + HDR_MAC);
+
+}
+
+static int writeHeader(int encFD, uint64_t plainSize, const cryptKey_t* key,
+                       const unsigned char* macKey, const unsigned char* root) {
+
+    int ret;
+    unsigned char buf[HDR_LEN];
+
+    ret = fillHeader(buf, sizeof(buf), plainSize, wrappedOf(key), macKey, root);
+    if(ret < 0) {
+        return ret;
+    }
+
+    return pwriteFull(encFD, buf, sizeof(buf), 0);
+
+}
+
+/* Check the MAC of a header with CHUNK_HDR_TREE set */
+static int checkHeader(const chunkHeader_t* hdr, const unsigned char* macKey) {
+
+    int ret;
+    unsigned char buf[HDR_LEN];
+
+    ret = fillHeader(buf, sizeof(buf), hdr->plainSize,
+                     (hdr->version == CHUNK_VERSION_WRAPPED) ? hdr->wrapped : NULL,
+                     macKey, hdr->root);
+    if(ret == RETURN_SUCCESS &&
+       CRYPTO_memcmp(buf + HDR_MAC, hdr->mac, CHUNK_MACSIZE) != 0) {
+        fprintf(stderr, "ERROR checkHeader: header fails its MAC\n");
+        ret = -EIO;
+    }
+
+    return ret;
+
+}
+
+/* Is the file hdr describes authenticated, and are its MACs checked */
+static int hasTree(const chunkHeader_t* hdr) {
+    return chunkIntegrity && (hdr->flags & CHUNK_HDR_TREE);
+}
+
+/* Are slots [from, to) of expected, MACs of tables not read, all zero */
+static int noTables(const unsigned char* expected, uint64_t from, uint64_t to) {
+
+    if(from >= to) {
+        return 1;
+    }
+    if(!isZero(expected + from * CHUNK_MACSIZE, (to - from) * CHUNK_MACSIZE)) {
+        fprintf(stderr, "ERROR chunk_decrypt: table missing from cluster "
+                "%"PRIu64" .. %"PRIu64"\n", from, to - 1);
+        return 0;
+    }
+
+    return 1;
+
+}
+
+static int growMap(chunkMap_t* map, uint64_t words) {
+
+    uint64_t size = map->words ? map->words : 16;
+    uint64_t* bits = NULL;
+
+    if(words <= map->words) {
+        return RETURN_SUCCESS;
+    }
+    while(size < words) {
+        size *= 2;
+    }
+
+    bits = realloc(map->bits, size * sizeof(*bits));
+    if(!bits) {
+        return -ENOMEM;
+    }
+    memset(bits + map->words, 0, (size - map->words) * sizeof(*bits));
+    map->bits = bits;
+    map->words = size;
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Cluster sets reuse chunkMap_t, one bit per cluster */
+static void markCluster(chunkMap_t* map, uint64_t cluster) {
+
+    if(map->all) {
+        return;
+    }
+    if(growMap(map, cluster / 64 + 1) < 0) {
+        map->all = 1;
+        return;
+    }
+    map->bits[cluster / 64] |= 1ULL << (cluster % 64);
+
+}
+
+/* Last cluster at or before cluster in map, NOCLUSTER if none */
+static uint64_t prevMarked(const chunkMap_t* map, uint64_t cluster) {
+
+    uint64_t word;
+    uint64_t w;
+
+    if(map->all) {
+        return cluster;
+    }
+    if(map->words == 0) {
+        return NOCLUSTER;
+    }
+    if(cluster / 64 >= map->words) {
+        cluster = map->words * 64 - 1;
+    }
+
+    w = cluster / 64;
+    word = map->bits[w] & (UINT64_MAX >> (63 - cluster % 64));
+    while(!word) {
+        if(w-- == 0) {
+            return NOCLUSTER;
+        }
+        word = map->bits[w];
+    }
+
+    return w * 64 + 63 - __builtin_clzll(word);
+
+}
+
+/* Mark the tables holding MACs of clusters [newClusters, oldClusters),
+ * which a truncate cuts off */
+static void markCut(chunkMap_t* map, uint64_t oldClusters, uint64_t newClusters) {
+
+    uint64_t parent;
+    uint64_t last;
+
+    if(newClusters == 0 || oldClusters <= newClusters) {
+        return;
+    }
+    last = (oldClusters - 2) / CHUNK_PERTABLE;
+    if(last >= newClusters) {
+        last = newClusters - 1;
+    }
+    for(parent = (newClusters - 1) / CHUNK_PERTABLE; parent <= last; parent++) {
+        markCluster(map, parent);
+    }
+
+}
+
+static int readTable(int encFD, unsigned char* table, uint64_t cluster) {
+
+    ssize_t got;
+
+    got = preadFull(encFD, table, CHUNK_TABLESIZE, clusterOffset(cluster));
+    if(got < 0) {
+        fprintf(stderr, "ERROR readTable: pread failed with error %zd\n", -got);
+        return got;
+    }
+    memset(table + got, 0, CHUNK_TABLESIZE - got);
+
+    return RETURN_SUCCESS;
+
+}
+
+static int writeTable(int encFD, const unsigned char* table, uint64_t cluster) {
+
+    int ret;
+
+    ret = pwriteFull(encFD, table, CHUNK_TABLESIZE, clusterOffset(cluster));
+    if(ret < 0) {
+        fprintf(stderr, "ERROR writeTable: pwrite failed with error %d\n", -ret);
+    }
+
+    return ret;
+
+}
+
+/* int fixTree(int encFD, const unsigned char* macKey, chunkMap_t* changed,
+ *             uint64_t clusters, unsigned char* root, unsigned char* buf)
+ *
+ * Purpose: Bring the tree of a file of clusters clusters up to date after
+ *          the tables in changed were rewritten, adding the tables above
+ *          them to changed. Tables are visited from the last one back, so
+ *          each is hashed once, after all of its children. buf is scratch
+ *          space for two tables, block aligned if encFD is O_DIRECT.
+ *
+ * Return: 0 and the new root on success, negative errno on error
+ */
+static int fixTree(int encFD, const unsigned char* macKey, chunkMap_t* changed,
+                   uint64_t clusters, unsigned char* root, unsigned char* buf) {
+
+    int ret = RETURN_SUCCESS;
+    int dirty;
+    size_t j;
+    uint64_t cluster;
+    uint64_t parent;
+    uint64_t held = NOCLUSTER;
+    int heldDirty = 0;
+    unsigned char mac[CHUNK_MACSIZE];
+    unsigned char* table = buf;
+    unsigned char* ptable = buf + CHUNK_TABLESIZE;
+
+    memset(root, 0, CHUNK_MACSIZE);
+    if(clusters == 0) {
+        return RETURN_SUCCESS;
+    }
+    markCluster(changed, 0);
+
+    for(cluster = prevMarked(changed, clusters - 1); cluster != NOCLUSTER;
+        cluster = cluster ? prevMarked(changed, cluster - 1) : NOCLUSTER) {
+
+        /* The parent table held for earlier children is this one */
+        if(cluster == held) {
+            if(heldDirty) {
+                ret = writeTable(encFD, ptable, held);
+                if(ret < 0) {
+                    return ret;
+                }
+            }
+            held = NOCLUSTER;
+            heldDirty = 0;
+        }
+
+        ret = readTable(encFD, table, cluster);
+        if(ret < 0) {
+            return ret;
+        }
+
+        /* MACs of children a truncate cut off */
+        dirty = 0;
+        j = (cluster * CHUNK_PERTABLE + 1 < clusters) ?
+            clusters - cluster * CHUNK_PERTABLE - 1 : 0;
+        for(; j < CHUNK_PERTABLE; j++) {
+            if(!isZero(table + j * CHUNK_ENTRYSIZE + ENT_NODE, CHUNK_MACSIZE)) {
+                memset(table + j * CHUNK_ENTRYSIZE + ENT_NODE, 0, CHUNK_MACSIZE);
+                dirty = 1;
+            }
+        }
+        if(dirty) {
+            ret = writeTable(encFD, table, cluster);
+            if(ret < 0) {
+                return ret;
+            }
+        }
+
+        ret = macTable(macKey, table, mac);
+        if(ret < 0) {
+            return ret;
+        }
+        if(cluster == 0) {
+            memcpy(root, mac, CHUNK_MACSIZE);
+            break;
+        }
+
+        parent = (cluster - 1) / CHUNK_PERTABLE;
+        if(parent != held) {
+            if(heldDirty) {
+                ret = writeTable(encFD, ptable, held);
+                if(ret < 0) {
+                    return ret;
+                }
+            }
+            heldDirty = 0;
+            held = NOCLUSTER;
+            ret = readTable(encFD, ptable, parent);
+            if(ret < 0) {
+                return ret;
+            }
+            held = parent;
+        }
+        if(memcmp(ptable + nodeOffset(cluster), mac, CHUNK_MACSIZE) != 0) {
+            memcpy(ptable + nodeOffset(cluster), mac, CHUNK_MACSIZE);
+            heldDirty = 1;
+            markCluster(changed, parent);
+        }
+
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Forget the tables path holds from depth down */
+static void resetPath(treePath_t* path, int depth) {
+
+    for(; depth < TREE_DEPTH; depth++) {
+        path->cluster[depth] = NOCLUSTER;
+    }
+
+}
+
+/* int checkTable(int encFD, treePath_t* path, uint64_t cluster,
+ *                const unsigned char* table)
+ *
+ * Purpose: Check table, just read for cluster, against the root, reading
+ *          and checking whichever tables above it path doesn't hold yet.
+ *          Tables in path->trusted pass unchecked.
+ *
+ * Return: 0 on success, -EIO on a mismatch, negative errno on error
+ */
+static int checkTable(int encFD, treePath_t* path, uint64_t cluster,
+                      const unsigned char* table) {
+
+    int ret;
+    int d;
+    int depth;
+    uint64_t c;
+    uint64_t nodes[TREE_DEPTH];
+    const unsigned char* expect = path->root;
+    unsigned char* t;
+    unsigned char mac[CHUNK_MACSIZE];
+
+    /* nodes[0] is the root, nodes[depth - 1] is cluster */
+    for(c = cluster, depth = 1; c; c = (c - 1) / CHUNK_PERTABLE) {
+        depth++;
+    }
+    if(depth > TREE_DEPTH) {
+        return -EFBIG;
+    }
+    for(c = cluster, d = depth - 1; d >= 0; d--) {
+        nodes[d] = c;
+        c = c ? (c - 1) / CHUNK_PERTABLE : 0;
+    }
+
+    for(d = 0; d < depth; d++) {
+
+        t = (unsigned char*) table;
+        if(d < depth - 1) {
+            t = path->tables + d * CHUNK_TABLESIZE;
+            if(path->cluster[d] == nodes[d]) {
+                expect = t + nodeOffset(nodes[d + 1]);
+                continue;
+            }
+            resetPath(path, d);
+            ret = readTable(encFD, t, nodes[d]);
+            if(ret < 0) {
+                return ret;
+            }
+        }
+
+        if(!path->trusted || !chunkmap_test(path->trusted, nodes[d])) {
+            ret = macTable(path->macKey, t, mac);
+            if(ret < 0) {
+                return ret;
+            }
+            if(CRYPTO_memcmp(mac, expect, CHUNK_MACSIZE) != 0) {
+                fprintf(stderr, "ERROR checkTable: table %"PRIu64" fails its "
+                        "MAC\n", nodes[d]);
+                return -EIO;
+            }
+        }
+
+        if(d < depth - 1) {
+            path->cluster[d] = nodes[d];
+            expect = t + nodeOffset(nodes[d + 1]);
+        }
+
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+extern int chunk_decrypt(int encFD, int clearFD, const cryptKey_t* key) {
+
+    int ret;
+    size_t j;
+    uint64_t chunk;
+    uint64_t cluster;
+    uint64_t chunks;
+    uint64_t plainLen;
+    uint64_t clusters;
+    uint64_t next = 0;
+    off_t pos;
+    off_t data;
+    chunkHeader_t hdr;
+    chunkEntry_t ent;
+    EVP_CIPHER_CTX* ctx = NULL;
+    EVP_CIPHER_CTX* macCtx = NULL;
+    int tree;
+    unsigned char* expected = NULL;
+    unsigned char mac[CHUNK_MACSIZE];
+    unsigned char table[CHUNK_TABLESIZE];
+    unsigned char in[CHUNK_SIZE];
+    unsigned char out[CHUNK_SIZE];
+
+    ret = chunk_readHeader(encFD, &hdr);
+    if(ret < 0) {
+        return ret;
+    }
+    if(ret == 0) {
+        fprintf(stderr, "ERROR chunk_decrypt: not a chunked file\n");
+        return -EINVAL;
+    }
+    if(!keyFits(&hdr, key)) {
+        fprintf(stderr, "ERROR chunk_decrypt: file is under another key\n");
+        return -EINVAL;
+    }
+
+    /* Check the header before trusting the size in it */
+    tree = hasTree(&hdr);
+    if(tree) {
+        ret = checkHeader(&hdr, key->macKey);
+        if(ret < 0) {
+            return ret;
+        }
+    }
+
+    /* Size the clear file first: whatever we don't write stays a hole */
+    if(ftruncate(clearFD, 0) < 0 || ftruncate(clearFD, hdr.plainSize) < 0) {
+        perror("ERROR chunk_decrypt: ftruncate");
+        return -errno;
+    }
+
+    chunks = numChunks(hdr.plainSize);
+    if(chunks == 0) {
+        return RETURN_SUCCESS;
+    }
+
+    ctx = newCtx(key);
+    if(!ctx) {
+        return -EIO;
+    }
+
+    /* Table MACs expected, each filled in from its parent table before
+       the table itself is reached */
+    clusters = numClusters(hdr.plainSize);
+    if(tree) {
+        macCtx = newMacCtx(key);
+        if(!macCtx) {
+            ret = -EIO;
+            goto CLEANUP;
+        }
+        expected = calloc(clusters, CHUNK_MACSIZE);
+        if(!expected) {
+            fprintf(stderr, "ERROR chunk_decrypt: calloc failed\n");
+            ret = -ENOMEM;
+            goto CLEANUP;
+        }
+        memcpy(expected, hdr.root, CHUNK_MACSIZE);
+    }
+
+    ret = RETURN_SUCCESS;
+    pos = clusterOffset(0);
+    for(;;) {
+
+        /* Jump over clusters that were never written */
+        data = lseek(encFD, pos, SEEK_DATA);
+        if(data < 0) {
+            if(errno != ENXIO) {
+                perror("ERROR chunk_decrypt: lseek(SEEK_DATA)");
+                ret = -errno;
+            }
+            break;
+        }
+        cluster = (data - CHUNK_HDRSIZE) / CLUSTERSIZE;
+        if(cluster * CHUNK_PERTABLE >= chunks) {
+            break;
+        }
+        pos = clusterOffset(cluster + 1);
+
+        ret = preadFull(encFD, table, sizeof(table), clusterOffset(cluster));
+        if(ret < 0) {
+            fprintf(stderr, "ERROR chunk_decrypt: table pread failed\n");
+            break;
+        }
+        if((size_t) ret < sizeof(table)) {
+            memset(table + ret, 0, sizeof(table) - ret);
+        }
+        ret = RETURN_SUCCESS;
+
+        /* Clusters jumped over must have had no table to read */
+        if(tree) {
+            if(!noTables(expected, next, cluster)) {
+                ret = -EIO;
+                break;
+            }
+            ret = macTable(key->macKey, table, mac);
+            if(ret == RETURN_SUCCESS &&
+               CRYPTO_memcmp(mac, expected + cluster * CHUNK_MACSIZE,
+                             CHUNK_MACSIZE) != 0) {
+                fprintf(stderr, "ERROR chunk_decrypt: table %"PRIu64" fails "
+                        "its MAC\n", cluster);
+                ret = -EIO;
+            }
+            if(ret < 0) {
+                break;
+            }
+            for(j = 0; j < CHUNK_PERTABLE &&
+                    cluster * CHUNK_PERTABLE + j + 1 < clusters; j++) {
+                memcpy(expected + (cluster * CHUNK_PERTABLE + j + 1) * CHUNK_MACSIZE,
+                       table + j * CHUNK_ENTRYSIZE + ENT_NODE, CHUNK_MACSIZE);
+            }
+            next = cluster + 1;
+        }
+
+        for(j = 0; j < CHUNK_PERTABLE; j++) {
+
+            chunk = cluster * CHUNK_PERTABLE + j;
+            if(chunk >= chunks) {
+                break;
+            }
+            getEntry(table, j, &ent);
+            if(!(ent.flags & CHUNK_PRESENT)) {
+                continue;
+            }
+
+            plainLen = hdr.plainSize - chunk * CHUNK_SIZE;
+            if(plainLen > CHUNK_SIZE) {
+                plainLen = CHUNK_SIZE;
+            }
+            if(ent.len != plainLen || checkEntry(&ent) < 0) {
+                fprintf(stderr, "ERROR chunk_decrypt: chunk %"PRIu64" has "
+                        "length %u, expected %"PRIu64"\n",
+                        chunk, ent.len, plainLen);
+                ret = -EIO;
+                break;
+            }
+
+            ret = preadFull(encFD, in, ent.clen, chunkOffset(chunk));
+            if(ret >= 0 && (size_t) ret != ent.clen) {
+                fprintf(stderr, "ERROR chunk_decrypt: chunk %"PRIu64" truncated\n",
+                        chunk);
+                ret = -EIO;
+            }
+            if(ret >= 0 && tree) {
+                ret = checkChunk(macCtx, &ent, in, chunk);
+            }
+            if(ret < 0) {
+                break;
+            }
+            ret = openData(ctx, &ent, in, out);
+            if(ret < 0) {
+                break;
+            }
+            ret = pwriteFull(clearFD, out, ent.len, (off_t) chunk * CHUNK_SIZE);
+            if(ret < 0) {
+                fprintf(stderr, "ERROR chunk_decrypt: pwrite failed\n");
+                break;
+            }
+
+        }
+        if(ret < 0) {
+            break;
+        }
+
+    }
+    if(ret >= 0 && tree && !noTables(expected, next, clusters)) {
+        ret = -EIO;
+    }
+
+ CLEANUP:
+    OPENSSL_cleanse(out, sizeof(out));
+    EVP_CIPHER_CTX_free(ctx);
+    EVP_CIPHER_CTX_free(macCtx);
+    free(expected);
+
+    return ret;
+
+}
+
+extern int chunk_decryptRange(int encFD, int clearFD, const cryptKey_t* key,
+                              uint64_t offset, uint64_t length) {
+
+    int ret;
+    ssize_t got;
+    size_t skip;
+    size_t take;
+    uint64_t chunk;
+    uint64_t last;
+    uint64_t plainLen;
+    uint64_t cluster = NOCLUSTER;
+    chunkHeader_t hdr;
+    chunkEntry_t ent;
+    treePath_t path;
+    EVP_CIPHER_CTX* ctx = NULL;
+    EVP_CIPHER_CTX* macCtx = NULL;
+    unsigned char table[CHUNK_TABLESIZE];
+    unsigned char in[CHUNK_SIZE];
+    unsigned char out[CHUNK_SIZE];
+
+    memset(&path, 0, sizeof(path));
+
+    ret = chunk_readHeader(encFD, &hdr);
+    if(ret < 0) {
+        return ret;
+    }
+    if(ret == 0) {
+        fprintf(stderr, "ERROR chunk_decryptRange: not a chunked file\n");
+        return -EINVAL;
+    }
+    if(!keyFits(&hdr, key)) {
+        fprintf(stderr, "ERROR chunk_decryptRange: file is under another key\n");
+        return -EINVAL;
+    }
+
+    if(offset >= hdr.plainSize || length == 0) {
+        return RETURN_SUCCESS;
+    }
+    if(length > hdr.plainSize - offset) {
+        length = hdr.plainSize - offset;
+    }
+
+    /* Tables are checked from the root down, as far as path doesn't
+       hold them yet */
+    if(hasTree(&hdr)) {
+        ret = checkHeader(&hdr, key->macKey);
+        if(ret < 0) {
+            return ret;
+        }
+        path.macKey = key->macKey;
+        memcpy(path.root, hdr.root, CHUNK_MACSIZE);
+        resetPath(&path, 0);
+        path.tables = malloc((size_t) TREE_DEPTH * CHUNK_TABLESIZE);
+        macCtx = newMacCtx(key);
+        if(!path.tables || !macCtx) {
+            fprintf(stderr, "ERROR chunk_decryptRange: setup failed\n");
+            ret = -ENOMEM;
+            goto CLEANUP;
+        }
+    }
+
+    ctx = newCtx(key);
+    if(!ctx) {
+        ret = -EIO;
+        goto CLEANUP;
+    }
+
+    ret = RETURN_SUCCESS;
+    last = (offset + length - 1) / CHUNK_SIZE;
+    for(chunk = offset / CHUNK_SIZE; chunk <= last; chunk++) {
+
+        if(chunk / CHUNK_PERTABLE != cluster) {
+            cluster = chunk / CHUNK_PERTABLE;
+            got = preadFull(encFD, table, sizeof(table), clusterOffset(cluster));
+            if(got < 0) {
+                fprintf(stderr, "ERROR chunk_decryptRange: table pread failed\n");
+                ret = got;
+                break;
+            }
+            memset(table + got, 0, sizeof(table) - got);
+            if(path.macKey) {
+                ret = checkTable(encFD, &path, cluster, table);
+                if(ret < 0) {
+                    break;
+                }
+            }
+        }
+
+        getEntry(table, chunk % CHUNK_PERTABLE, &ent);
+        if(!(ent.flags & CHUNK_PRESENT)) {
+            continue;
+        }
+
+        plainLen = hdr.plainSize - chunk * CHUNK_SIZE;
+        if(plainLen > CHUNK_SIZE) {
+            plainLen = CHUNK_SIZE;
+        }
+        if(ent.len != plainLen || checkEntry(&ent) < 0) {
+            fprintf(stderr, "ERROR chunk_decryptRange: chunk %"PRIu64" has "
+                    "length %u, expected %"PRIu64"\n", chunk, ent.len, plainLen);
+            ret = -EIO;
+            break;
+        }
+
+        got = preadFull(encFD, in, ent.clen, chunkOffset(chunk));
+        if(got >= 0 && (size_t) got != ent.clen) {
+            fprintf(stderr, "ERROR chunk_decryptRange: chunk %"PRIu64
+                    " truncated\n", chunk);
+            got = -EIO;
+        }
+        ret = got;
+        if(ret >= 0 && macCtx) {
+            ret = checkChunk(macCtx, &ent, in, chunk);
+        }
+        if(ret >= 0) {
+            ret = openData(ctx, &ent, in, out);
+        }
+        if(ret < 0) {
+            break;
+        }
+
+        /* Only the bytes asked for; the chunks at either end may hold
+           more */
+        skip = (offset > chunk * CHUNK_SIZE) ? offset - chunk * CHUNK_SIZE : 0;
+        take = plainLen - skip;
+        if(chunk * CHUNK_SIZE + skip + take > offset + length) {
+            take = offset + length - (chunk * CHUNK_SIZE + skip);
+        }
+        ret = pwriteFull(clearFD, out + skip, take,
+                         (off_t) (chunk * CHUNK_SIZE + skip));
+        if(ret < 0) {
+            fprintf(stderr, "ERROR chunk_decryptRange: pwrite failed\n");
+            break;
+        }
+
+    }
+
+ CLEANUP:
+    OPENSSL_cleanse(out, sizeof(out));
+    EVP_CIPHER_CTX_free(ctx);
+    EVP_CIPHER_CTX_free(macCtx);
+    free(path.tables);
+
+    return ret;
+
+}
+
+/* Deallocate [offset, offset + len) of fd. Where the backing FS can't
+ * punch holes the range is zeroed instead if zeroFallback is set, and
+ * otherwise left alone. */
+static int punchRange(int fd, off_t offset, off_t len, int zeroFallback) {
+
+    int ret;
+    off_t done;
+    static const unsigned char zeros[CHUNK_TABLESIZE];
+
+    if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 offset, len) == 0) {
+        return RETURN_SUCCESS;
+    }
+    if(errno != EOPNOTSUPP) {
+        return -errno;
+    }
+    if(!zeroFallback) {
+        return RETURN_SUCCESS;
+    }
+
+    for(done = 0; done < len; done += sizeof(zeros)) {
+        ret = pwriteFull(fd, zeros, (len - done) < (off_t) sizeof(zeros) ?
+                         (size_t) (len - done) : sizeof(zeros), offset + done);
+        if(ret < 0) {
+            return ret;
+        }
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Clear the tables of clusters [from, to) that still hold entries from an
+ * earlier version of the file, adding them to changed; clusters never
+ * written stay sparse */
+static int clearTables(int encFD, uint64_t from, uint64_t to,
+                       chunkMap_t* changed) {
+
+    int ret;
+    off_t data;
+    uint64_t cluster = from;
+
+    while(cluster < to) {
+        data = lseek(encFD, clusterOffset(cluster), SEEK_DATA);
+        if(data < 0) {
+            return (errno == ENXIO) ? RETURN_SUCCESS : -errno;
+        }
+        cluster = (data - CHUNK_HDRSIZE) / CLUSTERSIZE;
+        if(cluster >= to) {
+            break;
+        }
+        if(data < clusterOffset(cluster) + CHUNK_TABLESIZE) {
+            ret = punchRange(encFD, clusterOffset(cluster), CHUNK_TABLESIZE, 1);
+            if(ret < 0) {
+                return ret;
+            }
+            markCluster(changed, cluster);
+        }
+        cluster++;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Write out the table of *cluster if any of its chunks hold data, clear
+ * stale tables up to next, and move on to cluster next. Tables written or
+ * cleared are added to changed. */
+static int switchCluster(int encFD, uint64_t* cluster, uint64_t next,
+                         unsigned char* table, size_t* used,
+                         chunkMap_t* changed) {
+
+    int ret;
+    uint64_t from = *cluster;
+
+    if(*used) {
+        ret = pwriteFull(encFD, table, CHUNK_TABLESIZE, clusterOffset(*cluster));
+        if(ret < 0) {
+            fprintf(stderr, "ERROR switchCluster: pwrite failed\n");
+            return ret;
+        }
+        markCluster(changed, *cluster);
+        from++;
+    }
+    memset(table, 0, CHUNK_TABLESIZE);
+    *used = 0;
+
+    ret = clearTables(encFD, from, next, changed);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR switchCluster: clearTables failed with error %d\n",
+                -ret);
+        return ret;
+    }
+    *cluster = next;
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Size encFD for plainSize bytes, first clearing out legacy contents,
+ * which share nothing with the chunked layout. Anything else already
+ * allocated is kept: slots of chunks with data are overwritten in place,
+ * and slots of chunks that are now holes keep their space, like zeros
+ * written to a real file would. Space is only given back by truncation
+ * and PUNCH_HOLE (chunk_punch). Sets *oldClusters to the clusters the
+ * file reached into before. */
+static int prepareEnc(int encFD, uint64_t plainSize, uint64_t* oldClusters) {
+
+    int ret;
+    struct stat st;
+    chunkHeader_t hdr;
+
+    ret = chunk_readHeader(encFD, &hdr);
+    if(ret < 0) {
+        return ret;
+    }
+    if(ret == 0 && ftruncate(encFD, 0) < 0) {
+        perror("ERROR prepareEnc: ftruncate");
+        return -errno;
+    }
+
+    if(fstat(encFD, &st) < 0) {
+        perror("ERROR prepareEnc: fstat");
+        return -errno;
+    }
+    *oldClusters = clustersIn(st.st_size);
+    if(st.st_size != encSize(plainSize) &&
+       ftruncate(encFD, encSize(plainSize)) < 0) {
+        perror("ERROR prepareEnc: ftruncate");
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Encrypt chunk of clearFD into its slot in encFD under a fresh IV, with
+ * a MAC unless macCtx is NULL
+ *
+ * Return: 1 with *ent filled if the chunk holds data, 0 if it is all
+ *         zeros (a hole, nothing written), negative errno on error */
+static int sealChunk(EVP_CIPHER_CTX* ctx, EVP_CIPHER_CTX* macCtx,
+                     int clearFD, int encFD,
+                     uint64_t chunk, uint64_t plainSize, chunkEntry_t* ent) {
+
+    int ret;
+    ssize_t got;
+    size_t len;
+    unsigned char in[CHUNK_SIZE];
+    unsigned char out[CHUNK_SIZE];
+
+    len = (plainSize - chunk * CHUNK_SIZE) < CHUNK_SIZE ?
+        (plainSize - chunk * CHUNK_SIZE) : CHUNK_SIZE;
+
+    got = preadFull(clearFD, in, len, (off_t) chunk * CHUNK_SIZE);
+    if(got >= 0 && (size_t) got != len) {
+        got = -EIO;
+    }
+    if(got < 0) {
+        fprintf(stderr, "ERROR sealChunk: pread failed\n");
+        ret = got;
+        goto CLEANUP;
+    }
+    if(isZero(in, len)) {
+        ret = 0;
+        goto CLEANUP;
+    }
+
+    ret = sealData(ctx, macCtx, in, len, out, ent);
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+    ret = pwriteFull(encFD, out, ent->clen, chunkOffset(chunk));
+    if(ret < 0) {
+        fprintf(stderr, "ERROR sealChunk: pwrite failed\n");
+        goto CLEANUP;
+    }
+
+    ret = 1;
+
+ CLEANUP:
+    OPENSSL_cleanse(in, sizeof(in));
+    return ret;
+
+}
+
+extern int chunk_encrypt(int clearFD, int encFD, const cryptKey_t* key) {
+
+    int ret;
+    size_t used = 0;
+    uint64_t chunk;
+    uint64_t cluster = 0;
+    uint64_t chunks;
+    uint64_t plainSize;
+    uint64_t oldClusters;
+    off_t pos;
+    off_t data;
+    off_t hole;
+    struct stat st;
+    chunkEntry_t ent;
+    chunkMap_t changed;
+    EVP_CIPHER_CTX* ctx = NULL;
+    EVP_CIPHER_CTX* macCtx = NULL;
+    const unsigned char* macKey;
+    unsigned char root[CHUNK_MACSIZE];
+    unsigned char table[CHUNK_TABLESIZE];
+    unsigned char tree[2 * CHUNK_TABLESIZE];
+
+    if(fstat(clearFD, &st) < 0) {
+        perror("ERROR chunk_encrypt: fstat");
+        return -errno;
+    }
+    plainSize = st.st_size;
+    chunks = numChunks(plainSize);
+
+    ret = prepareEnc(encFD, plainSize, &oldClusters);
+    if(ret < 0) {
+        return ret;
+    }
+
+    ctx = newCtx(key);
+    if(!ctx) {
+        return -EIO;
+    }
+    macKey = chunkIntegrity ? key->macKey : NULL;
+    memset(&changed, 0, sizeof(changed));
+    if(macKey) {
+        macCtx = newMacCtx(key);
+        if(!macCtx) {
+            ret = -EIO;
+            goto CLEANUP;
+        }
+    }
+
+    memset(table, 0, sizeof(table));
+    ret = RETURN_SUCCESS;
+    pos = 0;
+    while((uint64_t) pos < plainSize) {
+
+        /* Only visit chunks overlapping allocated ranges of the clear file */
+        data = lseek(clearFD, pos, SEEK_DATA);
+        if(data < 0) {
+            if(errno != ENXIO) {
+                perror("ERROR chunk_encrypt: lseek(SEEK_DATA)");
+                ret = -errno;
+            }
+            break;
+        }
+        hole = lseek(clearFD, data, SEEK_HOLE);
+        if(hole < 0) {
+            hole = plainSize;
+        }
+
+        for(chunk = data / CHUNK_SIZE;
+            chunk < chunks && (off_t) (chunk * CHUNK_SIZE) < hole; chunk++) {
+
+            if(chunk / CHUNK_PERTABLE != cluster) {
+                ret = switchCluster(encFD, &cluster, chunk / CHUNK_PERTABLE,
+                                    table, &used, &changed);
+                if(ret < 0) {
+                    goto CLEANUP;
+                }
+            }
+
+            ret = sealChunk(ctx, macCtx, clearFD, encFD, chunk, plainSize, &ent);
+            if(ret < 0) {
+                goto CLEANUP;
+            }
+            if(ret > 0) {
+                putEntry(table, chunk % CHUNK_PERTABLE, &ent);
+                used++;
+            }
+
+        }
+
+        pos = (off_t) chunk * CHUNK_SIZE;
+
+    }
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+
+    ret = switchCluster(encFD, &cluster, numClusters(plainSize),
+                        table, &used, &changed);
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+
+    /* Tables rewritten from scratch lost the MACs of their children */
+    if(macKey) {
+        markCut(&changed, oldClusters, numClusters(plainSize));
+        ret = fixTree(encFD, macKey, &changed, numClusters(plainSize),
+                      root, tree);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR chunk_encrypt: fixTree failed\n");
+            goto CLEANUP;
+        }
+    }
+
+    ret = writeHeader(encFD, plainSize, key, macKey, root);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR chunk_encrypt: writeHeader failed\n");
+    }
+
+ CLEANUP:
+    EVP_CIPHER_CTX_free(ctx);
+    EVP_CIPHER_CTX_free(macCtx);
+    chunkmap_free(&changed);
+
+    return ret;
+
+}
+
+/* First chunk at or after chunk that is in dirty or is extra */
+static uint64_t nextDirty(const chunkMap_t* dirty, uint64_t extra,
+                          uint64_t chunk) {
+
+    uint64_t next = chunkmap_next(dirty, chunk);
+
+    if(extra >= chunk && extra < next) {
+        return extra;
+    }
+
+    return next;
+
+}
+
+/* Must chunk_update rewrite whole, under key, the file chunk_readHeader
+ * returned found and hdr for */
+static int updateWhole(int found, const chunkHeader_t* hdr,
+                       const cryptKey_t* key) {
+
+    /* Legacy files are rewritten chunked. Chunks written without MACs
+       can't join a tree, nor chunks under another key a file under key. */
+    return found == 0 ||
+        (chunkIntegrity && !(hdr->flags & CHUNK_HDR_TREE) && hdr->plainSize > 0) ||
+        !keyFits(hdr, key);
+
+}
+
+extern int chunk_updatesWhole(int encFD, const cryptKey_t* key,
+                              const chunkMap_t* dirty) {
+
+    int ret;
+    chunkHeader_t hdr;
+
+    if(!dirty || dirty->all) {
+        return 1;
+    }
+    ret = chunk_readHeader(encFD, &hdr);
+    if(ret < 0) {
+        return ret;
+    }
+
+    return updateWhole(ret, &hdr, key);
+
+}
+
+extern int chunk_update(int clearFD, int encFD, const cryptKey_t* key,
+                        const chunkMap_t* dirty) {
+
+    int ret;
+    size_t j;
+    uint64_t chunk;
+    uint64_t cluster = 0;
+    uint64_t chunks;
+    uint64_t plainSize;
+    off_t data;
+    off_t holeEnd = 0;
+    struct stat st;
+    chunkHeader_t hdr;
+    chunkEntry_t ent;
+    chunkMap_t changed;
+    EVP_CIPHER_CTX* ctx = NULL;
+    EVP_CIPHER_CTX* macCtx = NULL;
+    const unsigned char* macKey;
+    unsigned char root[CHUNK_MACSIZE];
+    unsigned char table[CHUNK_TABLESIZE];
+    unsigned char tree[2 * CHUNK_TABLESIZE];
+    int wasEmpty;
+    uint64_t resized;
+    uint64_t oldClusters;
+
+    if(!dirty || dirty->all) {
+        return chunk_encrypt(clearFD, encFD, key);
+    }
+    ret = chunk_readHeader(encFD, &hdr);
+    if(ret < 0) {
+        return ret;
+    }
+    if(updateWhole(ret, &hdr, key)) {
+        return chunk_encrypt(clearFD, encFD, key);
+    }
+
+    if(fstat(clearFD, &st) < 0) {
+        perror("ERROR chunk_update: fstat");
+        return -errno;
+    }
+    plainSize = st.st_size;
+    chunks = numChunks(plainSize);
+
+    ret = prepareEnc(encFD, plainSize, &oldClusters);
+    if(ret < 0) {
+        return ret;
+    }
+
+    ctx = newCtx(key);
+    if(!ctx) {
+        return -EIO;
+    }
+    macKey = chunkIntegrity ? key->macKey : NULL;
+    memset(&changed, 0, sizeof(changed));
+    if(macKey) {
+        macCtx = newMacCtx(key);
+        if(!macCtx) {
+            ret = -EIO;
+            goto CLEANUP;
+        }
+    }
+
+    /* A size change also changes the length of the chunk at the smaller
+       end, even if a write past the end never touched it */
+    resized = (plainSize < hdr.plainSize) ? plainSize : hdr.plainSize;
+    if(plainSize != hdr.plainSize && resized % CHUNK_SIZE) {
+        resized /= CHUNK_SIZE;
+    }
+    else {
+        resized = UINT64_MAX;
+    }
+
+    /* Visit only clusters with dirty chunks; every other entry stands */
+    for(chunk = nextDirty(dirty, resized, 0);
+        chunk != UINT64_MAX && (chunk / CHUNK_PERTABLE) * CHUNK_PERTABLE < chunks;
+        chunk = nextDirty(dirty, resized, (cluster + 1) * CHUNK_PERTABLE)) {
+
+        cluster = chunk / CHUNK_PERTABLE;
+
+        ret = preadFull(encFD, table, sizeof(table), clusterOffset(cluster));
+        if(ret < 0) {
+            fprintf(stderr, "ERROR chunk_update: table pread failed\n");
+            goto CLEANUP;
+        }
+        if((size_t) ret < sizeof(table)) {
+            memset(table + ret, 0, sizeof(table) - ret);
+        }
+        wasEmpty = isZero(table, sizeof(table));
+
+        for(j = 0; j < CHUNK_PERTABLE; j++) {
+
+            chunk = cluster * CHUNK_PERTABLE + j;
+            if(chunk >= chunks) {
+                /* Cut off by a truncate */
+                clearEntries(table, j, CHUNK_PERTABLE - j);
+                break;
+            }
+            if(!chunkmap_test(dirty, chunk) && chunk != resized) {
+                continue;
+            }
+            clearEntries(table, j, 1);
+
+            /* Chunks inside a hole of the clear file need no reading */
+            if((off_t) ((chunk + 1) * CHUNK_SIZE) <= holeEnd) {
+                continue;
+            }
+            data = lseek(clearFD, (off_t) chunk * CHUNK_SIZE, SEEK_DATA);
+            if(data < 0 && errno != ENXIO) {
+                perror("ERROR chunk_update: lseek(SEEK_DATA)");
+                ret = -errno;
+                goto CLEANUP;
+            }
+            holeEnd = (data < 0) ? (off_t) plainSize : data;
+            if((off_t) ((chunk + 1) * CHUNK_SIZE) <= holeEnd ||
+               (uint64_t) holeEnd >= plainSize) {
+                continue;
+            }
+
+            ret = sealChunk(ctx, macCtx, clearFD, encFD, chunk, plainSize, &ent);
+            if(ret < 0) {
+                goto CLEANUP;
+            }
+            if(ret > 0) {
+                putEntry(table, j, &ent);
+            }
+
+        }
+        markCluster(&changed, cluster);
+
+        if(!isZero(table, sizeof(table))) {
+            ret = pwriteFull(encFD, table, sizeof(table), clusterOffset(cluster));
+        }
+        else if(!wasEmpty) {
+            ret = punchRange(encFD, clusterOffset(cluster), CHUNK_TABLESIZE, 1);
+        }
+        else {
+            ret = RETURN_SUCCESS;
+        }
+        if(ret < 0) {
+            fprintf(stderr, "ERROR chunk_update: table write failed\n");
+            goto CLEANUP;
+        }
+
+    }
+
+    /* Only the paths from the tables rewritten up to the root */
+    if(macKey) {
+        markCut(&changed, oldClusters, numClusters(plainSize));
+        ret = fixTree(encFD, macKey, &changed, numClusters(plainSize),
+                      root, tree);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR chunk_update: fixTree failed\n");
+            goto CLEANUP;
+        }
+    }
+
+    ret = writeHeader(encFD, plainSize, key, macKey, root);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR chunk_update: writeHeader failed\n");
+    }
+
+ CLEANUP:
+    EVP_CIPHER_CTX_free(ctx);
+    EVP_CIPHER_CTX_free(macCtx);
+    chunkmap_free(&changed);
+
+    return ret;
+
+}
+
+extern int chunk_reserve(int encFD, uint64_t offset, uint64_t length) {
+
+    uint64_t first;
+    uint64_t last;
+    off_t start;
+
+    if(length == 0) {
+        return RETURN_SUCCESS;
+    }
+    first = offset / CHUNK_SIZE;
+    last = (offset + length - 1) / CHUNK_SIZE;
+
+    /* Slots and the tables describing them; the file size is left to
+       chunk_encrypt, which sets it from the plain size */
+    start = clusterOffset(first / CHUNK_PERTABLE);
+    if(fallocate(encFD, FALLOC_FL_KEEP_SIZE, start,
+                 chunkOffset(last) + CHUNK_SIZE - start) < 0) {
+        if(errno == EOPNOTSUPP) {
+            return RETURN_SUCCESS;
+        }
+        perror("ERROR chunk_reserve: fallocate");
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+extern int chunk_punch(int encFD, uint64_t offset, uint64_t length,
+                       uint64_t plainSize) {
+
+    int ret = RETURN_SUCCESS;
+    uint64_t chunk;
+    uint64_t end;
+    uint64_t stop;
+    uint64_t run;
+    chunkEntry_t ent;
+    unsigned char* table = NULL;
+
+    /* Only chunks wholly inside the range; partial ones are rewritten */
+    chunk = (offset + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if(offset + length >= plainSize) {
+        end = numChunks(plainSize);
+    }
+    else {
+        end = (offset + length) / CHUNK_SIZE;
+    }
+    if(chunk >= end) {
+        return RETURN_SUCCESS;
+    }
+
+    table = malloc(CHUNK_TABLESIZE);
+    if(!table) {
+        return -ENOMEM;
+    }
+
+    /* Runs of holes within each cluster, keeping the tables; a chunk
+       the table lists was written since and keeps its slot */
+    while(chunk < end) {
+        stop = (chunk / CHUNK_PERTABLE + 1) * CHUNK_PERTABLE;
+        if(stop > end) {
+            stop = end;
+        }
+        ret = readTable(encFD, table, chunk / CHUNK_PERTABLE);
+        if(ret < 0) {
+            goto CLEANUP;
+        }
+        while(chunk < stop) {
+            for(run = chunk; run < stop; run++) {
+                getEntry(table, run % CHUNK_PERTABLE, &ent);
+                if(ent.flags & CHUNK_PRESENT) {
+                    break;
+                }
+            }
+            if(run > chunk) {
+                ret = punchRange(encFD, chunkOffset(chunk),
+                                 (off_t) (run - chunk) * CHUNK_SIZE, 0);
+                if(ret < 0) {
+                    fprintf(stderr, "ERROR chunk_punch: punchRange failed with error %d\n",
+                            -ret);
+                    goto CLEANUP;
+                }
+            }
+            chunk = run + 1;
+        }
+        chunk = stop;
+    }
+
+ CLEANUP:
+    free(table);
+    return ret;
+
+}
+
+/* Copy len bytes between backing files, in the kernel (and by reflink
+ * where the FS can) when possible */
+static int copyRange(int srcFD, off_t srcOff, int dstFD, off_t dstOff,
+                     size_t len) {
+
+    int ret;
+    ssize_t got;
+    unsigned char buf[CHUNK_SIZE];
+
+    while(len > 0) {
+        got = copy_file_range(srcFD, &srcOff, dstFD, &dstOff, len, 0);
+        if(got < 0 && errno == EINTR) {
+            continue;
+        }
+        if(got < 0 && errno != EXDEV && errno != EINVAL &&
+           errno != ENOSYS && errno != EOPNOTSUPP) {
+            return -errno;
+        }
+        if(got <= 0) {
+            break;
+        }
+        len -= got;
+    }
+
+    /* Fall back to copying through user space */
+    while(len > 0) {
+        got = preadFull(srcFD, buf, len < sizeof(buf) ? len : sizeof(buf), srcOff);
+        if(got <= 0) {
+            return (got < 0) ? got : -EIO;
+        }
+        ret = pwriteFull(dstFD, buf, got, dstOff);
+        if(ret < 0) {
+            return ret;
+        }
+        srcOff += got;
+        dstOff += got;
+        len -= got;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+extern int chunk_clone(int srcFD, int dstFD) {
+    return chunk_clonePaced(srcFD, dstFD, 0, NULL, NULL);
+}
+
+extern int chunk_clonePaced(int srcFD, int dstFD, uint64_t slice,
+                            int (*pace)(void* arg, uint64_t len), void* arg) {
+
+    int ret;
+    off_t data;
+    off_t hole = 0;
+    off_t len;
+    struct stat st;
+
+    if(fstat(srcFD, &st) < 0) {
+        perror("ERROR chunk_clone: fstat");
+        return -errno;
+    }
+
+    /* Share every extent where the FS supports it */
+    if(ioctl(dstFD, FICLONE, srcFD) == 0) {
+        return RETURN_SUCCESS;
+    }
+
+    if(ftruncate(dstFD, st.st_size) < 0) {
+        perror("ERROR chunk_clone: ftruncate");
+        return -errno;
+    }
+
+    /* Otherwise copy the allocated ranges, so holes stay holes */
+    for(;;) {
+        data = lseek(srcFD, hole, SEEK_DATA);
+        if(data < 0) {
+            return (errno == ENXIO) ? RETURN_SUCCESS : -errno;
+        }
+        hole = lseek(srcFD, data, SEEK_HOLE);
+        if(hole < 0) {
+            hole = st.st_size;
+        }
+        for(; data < hole; data += len) {
+            len = (slice && hole - data > (off_t) slice) ? (off_t) slice :
+                hole - data;
+            if(pace) {
+                ret = pace(arg, len);
+                if(ret < 0) {
+                    return ret;
+                }
+            }
+            ret = copyRange(srcFD, data, dstFD, data, len);
+            if(ret < 0) {
+                fprintf(stderr, "ERROR chunk_clone: copyRange failed with error %d\n",
+                        -ret);
+                return ret;
+            }
+        }
+    }
+
+}
+
+/* Write len bytes of buf at off in the header of the CHUNK_VERSION_WRAPPED
+ * file on encFD, for caller */
+static int writeWrapped(int encFD, const unsigned char* buf, size_t len,
+                        off_t off, const char* caller) {
+
+    int ret;
+    chunkHeader_t hdr;
+
+    ret = chunk_readHeader(encFD, &hdr);
+    if(ret < 0) {
+        return ret;
+    }
+    if(ret == 0 || hdr.version != CHUNK_VERSION_WRAPPED) {
+        fprintf(stderr, "ERROR %s: file has no data key\n", caller);
+        return -EINVAL;
+    }
+
+    /* Outside the header MAC, which the data key itself keys */
+    ret = pwriteFull(encFD, buf, len, off);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR %s: pwrite failed with error %d\n", caller, -ret);
+    }
+
+    return ret;
+
+}
+
+extern int chunk_rewrap(int encFD, const unsigned char* wrapped) {
+
+    unsigned char buf[2 * CRYPT_WRAPSIZE];
+
+    /* One write, dropping any staged form along with the old one */
+    memcpy(buf, wrapped, CRYPT_WRAPSIZE);
+    memset(buf + CRYPT_WRAPSIZE, 0, CRYPT_WRAPSIZE);
+
+    return writeWrapped(encFD, buf, sizeof(buf), HDR_WRAPPED, "chunk_rewrap");
+
+}
+
+extern int chunk_stageWrap(int encFD, const unsigned char* wrapped) {
+    return writeWrapped(encFD, wrapped, CRYPT_WRAPSIZE, HDR_SPARE,
+                        "chunk_stageWrap");
+}
+
+/* Streams: direct chunk I/O with no clear-text staging file
+ *
+ * Every backing read and write covers whole 4096-byte blocks from aligned
+ * buffers, as O_DIRECT requires. Consecutive chunks written together go
+ * out as a single write. Without O_DIRECT the ranges touched are dropped
+ * from the page cache instead. Present entries always have the length
+ * the current plain size gives them, so the file is valid as soon as the
+ * tables and header are written out. The tree is brought up to date on
+ * flush; until then tables the stream wrote itself are trusted. */
+
+struct chunkStream {
+    pthread_mutex_t  lock;
+    int              encFD;
+    int              direct;
+    uint64_t         plainSize;
+    EVP_CIPHER_CTX*  ctx;
+    EVP_CIPHER_CTX*  macCtx;        /* NULL with no tree */
+    int              dataKey;       /* written under a data key, */
+    unsigned char    wrapped[CRYPT_WRAPSIZE];   /* kept wrapped thus */
+
+    unsigned char*   table;         /* table of tableCluster */
+    uint64_t         tableCluster;
+    int              tableDirty;
+
+    unsigned char*   io;            /* slots of the pending run, or reads */
+    uint64_t         runFirst;      /* first chunk of the pending run */
+    uint64_t         runCount;
+
+    unsigned char*   plain;         /* one chunk of plain text */
+
+    treePath_t       path;
+    chunkMap_t       changed;       /* tables written since the last flush */
+};
+
+/* Forget the page cache copy of [offset, offset + len) of fd */
+static void dropCache(chunkStream_t* s, off_t offset, off_t len) {
+
+    if(!s->direct) {
+        posix_fadvise(s->encFD, offset, len, POSIX_FADV_DONTNEED);
+    }
+
+}
+
+/* Write out the pending run of sealed slots */
+static int flushRun(chunkStream_t* s) {
+
+    int ret;
+    off_t offset;
+    size_t len;
+
+    if(s->runCount == 0) {
+        return RETURN_SUCCESS;
+    }
+
+    offset = chunkOffset(s->runFirst);
+    len = s->runCount * CHUNK_SIZE;
+    s->runCount = 0;
+
+    ret = pwriteFull(s->encFD, s->io, len, offset);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR flushRun: pwrite failed with error %d\n", -ret);
+        return ret;
+    }
+    dropCache(s, offset, len);
+
+    return RETURN_SUCCESS;
+
+}
+
+static int storeTable(chunkStream_t* s) {
+
+    int ret;
+
+    /* Slots first, so no table written points at a slot that isn't */
+    ret = flushRun(s);
+    if(ret < 0) {
+        return ret;
+    }
+    if(s->tableCluster == NOCLUSTER || !s->tableDirty) {
+        return RETURN_SUCCESS;
+    }
+
+    ret = pwriteFull(s->encFD, s->table, CHUNK_TABLESIZE,
+                     clusterOffset(s->tableCluster));
+    if(ret < 0) {
+        fprintf(stderr, "ERROR storeTable: pwrite failed with error %d\n", -ret);
+        return ret;
+    }
+    markCluster(&s->changed, s->tableCluster);
+    s->tableDirty = 0;
+
+    return RETURN_SUCCESS;
+
+}
+
+static int loadTable(chunkStream_t* s, uint64_t cluster) {
+
+    ssize_t got;
+    int ret;
+
+    if(s->tableCluster == cluster) {
+        return RETURN_SUCCESS;
+    }
+
+    ret = storeTable(s);
+    if(ret < 0) {
+        return ret;
+    }
+    s->tableCluster = NOCLUSTER;
+
+    got = preadFull(s->encFD, s->table, CHUNK_TABLESIZE, clusterOffset(cluster));
+    if(got < 0) {
+        fprintf(stderr, "ERROR loadTable: pread failed with error %zd\n", -got);
+        return got;
+    }
+    memset(s->table + got, 0, CHUNK_TABLESIZE - got);
+    if(s->path.macKey) {
+        ret = checkTable(s->encFD, &s->path, cluster, s->table);
+        if(ret < 0) {
+            return ret;
+        }
+    }
+    s->tableCluster = cluster;
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Read chunk into s->plain as it is stored now, zero padded */
+static int openChunk(chunkStream_t* s, uint64_t chunk) {
+
+    int ret;
+    ssize_t got;
+    chunkEntry_t ent;
+
+    if(s->runCount && chunk >= s->runFirst &&
+       chunk < s->runFirst + s->runCount) {
+        ret = flushRun(s);
+        if(ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = loadTable(s, chunk / CHUNK_PERTABLE);
+    if(ret < 0) {
+        return ret;
+    }
+    memset(s->plain, 0, CHUNK_SIZE);
+    getEntry(s->table, chunk % CHUNK_PERTABLE, &ent);
+    if(!(ent.flags & CHUNK_PRESENT)) {
+        return RETURN_SUCCESS;
+    }
+    if(checkEntry(&ent) < 0) {
+        fprintf(stderr, "ERROR openChunk: chunk %"PRIu64" is damaged\n", chunk);
+        return -EIO;
+    }
+
+    /* The run buffer is free now: slots are only read with no run pending */
+    ret = flushRun(s);
+    if(ret < 0) {
+        return ret;
+    }
+    got = preadFull(s->encFD, s->io, CHUNK_SIZE, chunkOffset(chunk));
+    if(got >= 0 && (size_t) got < ent.clen) {
+        fprintf(stderr, "ERROR openChunk: chunk %"PRIu64" truncated\n", chunk);
+        got = -EIO;
+    }
+    if(got < 0) {
+        return got;
+    }
+    dropCache(s, chunkOffset(chunk), CHUNK_SIZE);
+    if(s->macCtx) {
+        ret = checkChunk(s->macCtx, &ent, s->io, chunk);
+        if(ret < 0) {
+            return ret;
+        }
+    }
+
+    return openData(s->ctx, &ent, s->io, s->plain);
+
+}
+
+/* Encrypt len bytes of plain as chunk under a fresh IV, adding its slot
+ * to the pending run; all zeros make it a hole */
+static int storeChunk(chunkStream_t* s, uint64_t chunk,
+                      const unsigned char* plain, size_t len) {
+
+    int ret;
+    unsigned char* slot = NULL;
+    chunkEntry_t ent;
+
+    ret = loadTable(s, chunk / CHUNK_PERTABLE);
+    if(ret < 0) {
+        return ret;
+    }
+
+    memset(&ent, 0, sizeof(ent));
+    if(isZero(plain, len)) {
+        putEntry(s->table, chunk % CHUNK_PERTABLE, &ent);
+        s->tableDirty = 1;
+        return RETURN_SUCCESS;
+    }
+
+    /* Runs hold consecutive slots of one cluster */
+    if(s->runCount &&
+       (chunk != s->runFirst + s->runCount ||
+        chunk / CHUNK_PERTABLE != s->runFirst / CHUNK_PERTABLE)) {
+        ret = flushRun(s);
+        if(ret < 0) {
+            return ret;
+        }
+    }
+    if(s->runCount == 0) {
+        s->runFirst = chunk;
+    }
+    slot = s->io + s->runCount * CHUNK_SIZE;
+
+    ret = sealData(s->ctx, s->macCtx, plain, len, slot, &ent);
+    if(ret < 0) {
+        return ret;
+    }
+    memset(slot + ent.clen, 0, CHUNK_SIZE - ent.clen);
+    s->runCount++;
+
+    putEntry(s->table, chunk % CHUNK_PERTABLE, &ent);
+    s->tableDirty = 1;
+
+    return RETURN_SUCCESS;
+
+}
+
+static size_t chunkLen(uint64_t chunk, uint64_t plainSize) {
+    return (plainSize - chunk * CHUNK_SIZE) < CHUNK_SIZE ?
+        (plainSize - chunk * CHUNK_SIZE) : CHUNK_SIZE;
+}
+
+/* Re-store the chunk that ended the file at oldSize for its length at
+ * newSize, as chunk_decrypt checks entry lengths against the plain size */
+static int resizeTail(chunkStream_t* s, uint64_t oldSize, uint64_t newSize) {
+
+    int ret;
+    uint64_t tail;
+
+    tail = (newSize < oldSize ? newSize : oldSize) / CHUNK_SIZE;
+    if(oldSize % CHUNK_SIZE == 0 && newSize > oldSize) {
+        return RETURN_SUCCESS;
+    }
+    if(newSize % CHUNK_SIZE == 0 && newSize < oldSize) {
+        return RETURN_SUCCESS;
+    }
+
+    ret = openChunk(s, tail);
+    if(ret < 0) {
+        return ret;
+    }
+
+    return storeChunk(s, tail, s->plain, chunkLen(tail, newSize));
+
+}
+
+/* Bring the tree and s->path.root up to date with the tables written */
+static int syncTree(chunkStream_t* s) {
+
+    int ret;
+
+    if(!s->path.macKey) {
+        return RETURN_SUCCESS;
+    }
+
+    ret = storeTable(s);
+    if(ret < 0) {
+        return ret;
+    }
+
+    /* fixTree writes tables behind the cached ones' back */
+    s->tableCluster = NOCLUSTER;
+    resetPath(&s->path, 0);
+    ret = fixTree(s->encFD, s->path.macKey, &s->changed,
+                  numClusters(s->plainSize), s->path.root, s->path.tables);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR syncTree: fixTree failed with error %d\n", -ret);
+        return ret;
+    }
+    chunkmap_reset(&s->changed);
+
+    return RETURN_SUCCESS;
+
+}
+
+extern int chunk_streamOpen(int encFD, const cryptKey_t* key,
+                            chunkStream_t** stream) {
+
+    int ret;
+    int flags;
+    ssize_t got;
+    chunkHeader_t hdr;
+    chunkStream_t* s = NULL;
+
+    s = calloc(1, sizeof(*s));
+    if(!s) {
+        fprintf(stderr, "ERROR chunk_streamOpen: calloc failed\n");
+        return -ENOMEM;
+    }
+    s->encFD = encFD;
+    s->tableCluster = NOCLUSTER;
+
+    flags = fcntl(encFD, F_GETFL);
+    s->direct = (flags >= 0 && (flags & O_DIRECT));
+
+    if(posix_memalign((void**) &s->table, CHUNK_TABLESIZE, CHUNK_TABLESIZE) ||
+       posix_memalign((void**) &s->io, CHUNK_SIZE,
+                      (size_t) CHUNK_PERTABLE * CHUNK_SIZE) ||
+       posix_memalign((void**) &s->plain, CHUNK_SIZE, CHUNK_SIZE) ||
+       posix_memalign((void**) &s->path.tables, CHUNK_TABLESIZE,
+                      (size_t) TREE_DEPTH * CHUNK_TABLESIZE)) {
+        fprintf(stderr, "ERROR chunk_streamOpen: posix_memalign failed\n");
+        ret = -ENOMEM;
+        goto CLEANUP;
+    }
+
+    got = preadFull(encFD, s->io, CHUNK_HDRSIZE, 0);
+    if(got < 0) {
+        fprintf(stderr, "ERROR chunk_streamOpen: pread failed with error %zd\n",
+                -got);
+        ret = got;
+        goto CLEANUP;
+    }
+    ret = parseHeader(s->io, got, &hdr);
+    if(ret <= 0) {
+        goto CLEANUP;
+    }
+    if(!keyFits(&hdr, key)) {
+        fprintf(stderr, "ERROR chunk_streamOpen: file is under another key\n");
+        ret = -EINVAL;
+        goto CLEANUP;
+    }
+    s->plainSize = hdr.plainSize;
+    s->dataKey = key->isData;
+    memcpy(s->wrapped, key->wrapped, CRYPT_WRAPSIZE);
+
+    s->ctx = newCtx(key);
+    if(!s->ctx) {
+        ret = -EIO;
+        goto CLEANUP;
+    }
+
+    /* An empty file can start a tree; one written without can't */
+    resetPath(&s->path, 0);
+    if(hasTree(&hdr)) {
+        ret = checkHeader(&hdr, key->macKey);
+        if(ret < 0) {
+            goto CLEANUP;
+        }
+        s->path.macKey = key->macKey;
+        memcpy(s->path.root, hdr.root, CHUNK_MACSIZE);
+    }
+    else if(chunkIntegrity && hdr.plainSize == 0) {
+        s->path.macKey = key->macKey;
+    }
+    s->path.trusted = &s->changed;
+    if(s->path.macKey) {
+        s->macCtx = newMacCtx(key);
+        if(!s->macCtx) {
+            ret = -EIO;
+            goto CLEANUP;
+        }
+    }
+    pthread_mutex_init(&s->lock, NULL);
+
+    *stream = s;
+    return 1;
+
+ CLEANUP:
+    EVP_CIPHER_CTX_free(s->ctx);
+    EVP_CIPHER_CTX_free(s->macCtx);
+    free(s->table);
+    free(s->io);
+    free(s->plain);
+    free(s->path.tables);
+    free(s);
+    return ret;
+
+}
+
+extern uint64_t chunk_streamSize(chunkStream_t* s) {
+
+    uint64_t size;
+
+    pthread_mutex_lock(&s->lock);
+    size = s->plainSize;
+    pthread_mutex_unlock(&s->lock);
+
+    return size;
+
+}
+
+extern ssize_t chunk_streamRead(chunkStream_t* s, char* buf, size_t size,
+                                uint64_t offset) {
+
+    ssize_t ret = RETURN_SUCCESS;
+    ssize_t got;
+    size_t done = 0;
+    size_t len;
+    size_t skip;
+    size_t take;
+    uint64_t chunk;
+    uint64_t first;
+    uint64_t last;
+    chunkEntry_t ent;
+
+    pthread_mutex_lock(&s->lock);
+
+    if(offset >= s->plainSize) {
+        goto UNLOCK;
+    }
+    if(size > s->plainSize - offset) {
+        size = s->plainSize - offset;
+    }
+
+    ret = flushRun(s);
+    if(ret < 0) {
+        goto UNLOCK;
+    }
+
+    while(done < size) {
+
+        /* The rest of the request in this cluster, in one read */
+        first = (offset + done) / CHUNK_SIZE;
+        last = (offset + size - 1) / CHUNK_SIZE;
+        if(last / CHUNK_PERTABLE != first / CHUNK_PERTABLE) {
+            last = (first / CHUNK_PERTABLE + 1) * CHUNK_PERTABLE - 1;
+        }
+
+        ret = loadTable(s, first / CHUNK_PERTABLE);
+        if(ret < 0) {
+            goto UNLOCK;
+        }
+        got = preadFull(s->encFD, s->io, (last - first + 1) * CHUNK_SIZE,
+                        chunkOffset(first));
+        if(got < 0) {
+            fprintf(stderr, "ERROR chunk_streamRead: pread failed with error "
+                    "%zd\n", -got);
+            ret = got;
+            goto UNLOCK;
+        }
+        dropCache(s, chunkOffset(first), (last - first + 1) * CHUNK_SIZE);
+
+        for(chunk = first; chunk <= last; chunk++) {
+
+            len = chunkLen(chunk, s->plainSize);
+            skip = (offset + done) - chunk * CHUNK_SIZE;
+            take = (len - skip) < (size - done) ? (len - skip) : (size - done);
+
+            getEntry(s->table, chunk % CHUNK_PERTABLE, &ent);
+            if(!(ent.flags & CHUNK_PRESENT)) {
+                memset(buf + done, 0, take);
+                done += take;
+                continue;
+            }
+            if(ent.len != len || checkEntry(&ent) < 0 ||
+               got < (ssize_t) ((chunk - first) * CHUNK_SIZE + ent.clen)) {
+                fprintf(stderr, "ERROR chunk_streamRead: chunk %"PRIu64" is "
+                        "damaged\n", chunk);
+                ret = -EIO;
+                goto UNLOCK;
+            }
+
+            if(s->macCtx) {
+                ret = checkChunk(s->macCtx, &ent,
+                                 s->io + (chunk - first) * CHUNK_SIZE, chunk);
+                if(ret < 0) {
+                    goto UNLOCK;
+                }
+            }
+
+            /* Whole chunks decrypt straight into the caller's buffer */
+            if(skip == 0 && take == len) {
+                ret = openData(s->ctx, &ent, s->io + (chunk - first) * CHUNK_SIZE,
+                               (unsigned char*) buf + done);
+            }
+            else {
+                ret = openData(s->ctx, &ent, s->io + (chunk - first) * CHUNK_SIZE,
+                               s->plain);
+                memcpy(buf + done, s->plain + skip, take);
+            }
+            if(ret < 0) {
+                goto UNLOCK;
+            }
+            done += take;
+
+        }
+
+    }
+    ret = done;
+
+ UNLOCK:
+    OPENSSL_cleanse(s->plain, CHUNK_SIZE);
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+
+}
+
+extern ssize_t chunk_streamWrite(chunkStream_t* s, const char* buf, size_t size,
+                                 uint64_t offset) {
+
+    ssize_t ret = RETURN_SUCCESS;
+    size_t done = 0;
+    size_t len;
+    size_t skip;
+    size_t take;
+    uint64_t chunk;
+    uint64_t chunkEnd;
+
+    pthread_mutex_lock(&s->lock);
+
+    /* The file grows one chunk at a time, so it is consistent after every
+       chunk stored: a failure leaves a short write, as with pwrite */
+    while(done < size) {
+
+        chunk = (offset + done) / CHUNK_SIZE;
+        skip = (offset + done) - chunk * CHUNK_SIZE;
+        take = (CHUNK_SIZE - skip) < (size - done) ?
+            (CHUNK_SIZE - skip) : (size - done);
+        chunkEnd = offset + done + take;
+
+        /* A partial last chunk this one passes grows to full length */
+        if(chunkEnd > s->plainSize && s->plainSize % CHUNK_SIZE &&
+           s->plainSize / CHUNK_SIZE != chunk) {
+            ret = resizeTail(s, s->plainSize, chunkEnd);
+            if(ret < 0) {
+                break;
+            }
+            s->plainSize = chunkEnd;
+        }
+        len = chunkLen(chunk, chunkEnd > s->plainSize ? chunkEnd : s->plainSize);
+
+        if(skip == 0 && take == len) {
+            ret = storeChunk(s, chunk, (const unsigned char*) buf + done, len);
+        }
+        else {
+            ret = openChunk(s, chunk);
+            if(ret == RETURN_SUCCESS) {
+                memcpy(s->plain + skip, buf + done, take);
+                ret = storeChunk(s, chunk, s->plain, len);
+            }
+        }
+        if(ret < 0) {
+            break;
+        }
+        if(chunkEnd > s->plainSize) {
+            s->plainSize = chunkEnd;
+        }
+        done += take;
+
+    }
+    if(done > 0) {
+        ret = done;
+    }
+
+    OPENSSL_cleanse(s->plain, CHUNK_SIZE);
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+
+}
+
+extern int chunk_streamTruncate(chunkStream_t* s, uint64_t size) {
+
+    int ret = RETURN_SUCCESS;
+    uint64_t chunks;
+
+    pthread_mutex_lock(&s->lock);
+
+    if(size == s->plainSize) {
+        goto UNLOCK;
+    }
+
+    ret = resizeTail(s, s->plainSize, size);
+    if(ret < 0) {
+        goto UNLOCK;
+    }
+
+    if(size < s->plainSize) {
+
+        /* Entries past the end in the new last cluster go; later clusters
+           are cut off with the file */
+        chunks = numChunks(size);
+        if(chunks % CHUNK_PERTABLE) {
+            ret = loadTable(s, chunks / CHUNK_PERTABLE);
+            if(ret < 0) {
+                goto UNLOCK;
+            }
+            clearEntries(s->table, chunks % CHUNK_PERTABLE,
+                         CHUNK_PERTABLE - chunks % CHUNK_PERTABLE);
+            s->tableDirty = 1;
+        }
+        ret = storeTable(s);
+        if(ret < 0) {
+            goto UNLOCK;
+        }
+        s->tableCluster = NOCLUSTER;
+
+        if(ftruncate(s->encFD, encSize(size)) < 0) {
+            perror("ERROR chunk_streamTruncate: ftruncate");
+            ret = -errno;
+            goto UNLOCK;
+        }
+
+        /* Clusters written again later must not find their old MACs */
+        markCut(&s->changed, numClusters(s->plainSize), numClusters(size));
+        s->plainSize = size;
+        ret = syncTree(s);
+        goto UNLOCK;
+
+    }
+    s->plainSize = size;
+
+ UNLOCK:
+    OPENSSL_cleanse(s->plain, CHUNK_SIZE);
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+
+}
+
+extern int chunk_streamFlush(chunkStream_t* s) {
+
+    int ret;
+    struct stat st;
+
+    pthread_mutex_lock(&s->lock);
+
+    ret = storeTable(s);
+    if(ret < 0) {
+        goto UNLOCK;
+    }
+
+    ret = syncTree(s);
+    if(ret < 0) {
+        goto UNLOCK;
+    }
+
+    /* The slot of a partial last chunk was written whole */
+    if(fstat(s->encFD, &st) < 0) {
+        perror("ERROR chunk_streamFlush: fstat");
+        ret = -errno;
+        goto UNLOCK;
+    }
+    if(st.st_size != encSize(s->plainSize) &&
+       ftruncate(s->encFD, encSize(s->plainSize)) < 0) {
+        perror("ERROR chunk_streamFlush: ftruncate");
+        ret = -errno;
+        goto UNLOCK;
+    }
+
+    ret = fillHeader(s->io, CHUNK_HDRSIZE, s->plainSize,
+                     s->dataKey ? s->wrapped : NULL, s->path.macKey,
+                     s->path.root);
+    if(ret < 0) {
+        goto UNLOCK;
+    }
+    ret = pwriteFull(s->encFD, s->io, CHUNK_HDRSIZE, 0);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR chunk_streamFlush: pwrite failed with error %d\n",
+                -ret);
+        goto UNLOCK;
+    }
+    dropCache(s, 0, CHUNK_HDRSIZE);
+
+ UNLOCK:
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+
+}
+
+extern int chunk_streamClose(chunkStream_t* s) {
+
+    int ret;
+
+    if(!s) {
+        return RETURN_SUCCESS;
+    }
+
+    ret = chunk_streamFlush(s);
+
+    pthread_mutex_destroy(&s->lock);
+    EVP_CIPHER_CTX_free(s->ctx);
+    EVP_CIPHER_CTX_free(s->macCtx);
+    OPENSSL_cleanse(s->io, (size_t) CHUNK_PERTABLE * CHUNK_SIZE);
+    free(s->table);
+    free(s->io);
+    free(s->plain);
+    free(s->path.tables);
+    chunkmap_free(&s->changed);
+    free(s);
+
+    return ret;
+
+}
+
+extern void chunkmap_mark(chunkMap_t* map, uint64_t offset, uint64_t length) {
+
+    uint64_t chunk;
+    uint64_t last;
+
+    if(length == 0 || map->all) {
+        return;
+    }
+    chunk = offset / CHUNK_SIZE;
+    last = (offset + length - 1) / CHUNK_SIZE;
+
+    if(growMap(map, last / 64 + 1) < 0) {
+        /* Can't track it, so everything is dirty */
+        map->all = 1;
+        return;
+    }
+
+    while(chunk <= last) {
+        if(chunk % 64 == 0 && last - chunk >= 63) {
+            map->bits[chunk / 64] = UINT64_MAX;
+            chunk += 64;
+        }
+        else {
+            map->bits[chunk / 64] |= 1ULL << (chunk % 64);
+            chunk++;
+        }
+    }
+
+}
+
+extern void chunkmap_merge(chunkMap_t* map, const chunkMap_t* from) {
+
+    uint64_t w;
+
+    if(map->all) {
+        return;
+    }
+    if(from->all || growMap(map, from->words) < 0) {
+        map->all = 1;
+        return;
+    }
+
+    for(w = 0; w < from->words; w++) {
+        map->bits[w] |= from->bits[w];
+    }
+
+}
+
+extern void chunkmap_markAll(chunkMap_t* map) {
+    map->all = 1;
+}
+
+extern int chunkmap_test(const chunkMap_t* map, uint64_t chunk) {
+
+    if(map->all) {
+        return 1;
+    }
+    if(chunk / 64 >= map->words) {
+        return 0;
+    }
+
+    return (map->bits[chunk / 64] >> (chunk % 64)) & 1;
+
+}
+
+extern uint64_t chunkmap_next(const chunkMap_t* map, uint64_t chunk) {
+
+    uint64_t word;
+    uint64_t w;
+
+    if(map->all) {
+        return chunk;
+    }
+
+    w = chunk / 64;
+    if(w >= map->words) {
+        return UINT64_MAX;
+    }
+    word = map->bits[w] & (UINT64_MAX << (chunk % 64));
+    while(!word) {
+        if(++w >= map->words) {
+            return UINT64_MAX;
+        }
+        word = map->bits[w];
+    }
+
+    return w * 64 + __builtin_ctzll(word);
+
+}
+
+extern void chunkmap_reset(chunkMap_t* map) {
+
+    if(map->bits) {
+        memset(map->bits, 0, map->words * sizeof(*map->bits));
+    }
+    map->all = 0;
+
+}
+
+extern void chunkmap_free(chunkMap_t* map) {
+
+    free(map->bits);
+    map->bits = NULL;
+    map->words = 0;
+    map->all = 0;
+
+}
@@ -0,0 +1,316 @@
+/* chunk-crypt.h
+ * Chunked, hole-aware on-disk format for encrypted files
+ *
+ * A chunked file starts with a CHUNK_HDRSIZE header and continues with
+ * clusters. Each cluster is one table block of CHUNK_PERTABLE entries
+ * followed by the fixed-size slots of the chunks those entries describe:
+ *
+ *   | header | table 0 | chunk 0 .. chunk 63 | table 1 | chunk 64 .. |
+ *
+ * Each chunk is encrypted on its own with AES-256-CTR under a fresh IV,
+ * so a stored chunk is exactly as long as its plain text. An all-zero
+ * chunk is a hole: its table entry stays zero and its slot is never
+ * written, so the backing file stays sparse. A cluster with no data has
+ * no table written either. On decryption holes are left unallocated in
+ * the clear file, so reads of them return zeros without any crypto.
+ *
+ * Unless integrity is turned off, files are also authenticated. Each
+ * entry carries a MAC of its chunk's ciphertext, and the tables form a
+ * 64-ary tree: table c also holds the MACs of tables 64c+1 .. 64c+64, and
+ * the MAC of table 0 is the root, kept in the header under a MAC of its
+ * own. A read checks only its own chunks and the tables on the path from
+ * the root to theirs, and a write recomputes only those paths.
+ *
+ * Files are written under the key they are given. Under a data key
+ * (aes-crypt.h) the file is CHUNK_VERSION_WRAPPED and its header keeps
+ * the key in wrapped form, outside the header MAC: a file is then moved
+ * to another master key by rewrapping that alone (chunk_rewrap), and a
+ * wrapped form that is swapped for another only yields a key the MACs
+ * fail under. A spare slot beside it can hold the key wrapped under the
+ * next master key (chunk_stageWrap), so the move survives a crash part
+ * way: the file is read under whichever form its master key unwraps. Files must be read and updated under the key they were
+ * written with; chunk_update rewrites a file under another key whole.
+ *
+ * Files without the header magic are in the legacy whole-file CBC
+ * format (aes-crypt.h) and are rewritten chunked the next time they are
+ * saved. An empty backing file is an empty chunked file.
+ *
+ * All header and table fields are stored little-endian.
+ *
+ */
+
+#ifndef CHUNK_CRYPT_H
+#define CHUNK_CRYPT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+#include "span-trace.h"
+
+#define CHUNK_MAGIC      "ENCFSCHK"
+#define CHUNK_MAGICSIZE  8
+#define CHUNK_VERSION    1
+#define CHUNK_VERSION_WRAPPED 2 /* under a data key, kept in the header */
+#define CHUNK_HDRSIZE    4096
+#define CHUNK_SIZE       4096
+#define CHUNK_IVSIZE     16
+#define CHUNK_ENTRYSIZE  64
+#define CHUNK_TABLESIZE  4096
+#define CHUNK_PERTABLE   (CHUNK_TABLESIZE / CHUNK_ENTRYSIZE)
+#define CHUNK_MACSIZE    16
+
+/* Header flags */
+#define CHUNK_HDR_TREE   0x1    /* chunk MACs and table tree are kept */
+
+/* Chunk entry flags */
+#define CHUNK_PRESENT    0x1
+#define CHUNK_CODEC_SHIFT 8
+#define CHUNK_CODEC_MASK 0xff00
+#define CHUNK_CODEC(flags) (((flags) & CHUNK_CODEC_MASK) >> CHUNK_CODEC_SHIFT)
+
+/* Chunk compression codecs; each is built in only with its library
+ * (HAVE_LZ4, HAVE_ZSTD) */
+#define CHUNK_CODEC_NONE 0
+#define CHUNK_CODEC_LZ4  1
+#define CHUNK_CODEC_ZSTD 2
+
+typedef struct chunkHeader {
+    uint32_t version;
+    uint32_t chunkSize;
+    uint64_t plainSize;
+    uint32_t flags;
+    unsigned char root[CHUNK_MACSIZE];  /* with CHUNK_HDR_TREE */
+    unsigned char mac[CHUNK_MACSIZE];
+    unsigned char wrapped[CRYPT_WRAPSIZE];  /* CHUNK_VERSION_WRAPPED */
+    unsigned char spare[CRYPT_WRAPSIZE];    /* staged form, or zeros */
+} chunkHeader_t;
+
+/* Set of chunks changed since a file was last written, so a flush
+ * re-encrypts only those. Zero-initialize before use. */
+typedef struct chunkMap {
+    uint64_t* bits;
+    uint64_t  words;
+    int       all;      /* every chunk is dirty */
+} chunkMap_t;
+
+/* int chunk_readHeader(int encFD, chunkHeader_t* hdr)
+ *
+ * Purpose: Read and check the header of the backing file open on encFD
+ *
+ * Return: 1 and *hdr filled if the file is chunked, 0 if it is in the
+ *         legacy format, negative errno on error
+ */
+extern int chunk_readHeader(int encFD, chunkHeader_t* hdr);
+
+/* int chunk_setCodec(int codec, int level)
+ *
+ * Purpose: Compress chunks written from now on with codec at level (0 for
+ *          the codec's default) before they are encrypted. Chunks that
+ *          don't shrink are stored raw. Each chunk records its codec, so
+ *          files read back the same whatever codec is set.
+ *
+ * Return: 0 on success, -ENOTSUP if codec isn't built in
+ */
+extern int chunk_setCodec(int codec, int level);
+
+/* void chunk_setIntegrity(int on)
+ *
+ * Purpose: Turn chunk MACs and the table tree on (the default) or off.
+ *          While on, files are written with them and files that have them
+ *          are checked on every read, failing with -EIO on a mismatch.
+ *          Files written while off carry neither and are not checked.
+ */
+extern void chunk_setIntegrity(int on);
+
+/* Count the time chunk reads and writes take in spans (NULL: don't);
+ * set once at startup */
+extern void chunk_setSpans(spanTrace_t* spans);
+
+/* int chunk_decrypt(int encFD, int clearFD, const cryptKey_t* key)
+ *
+ * Purpose: Replace the contents of clearFD with the plain text of the
+ *          chunked file open on encFD, leaving holes unallocated
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int chunk_decrypt(int encFD, int clearFD, const cryptKey_t* key);
+
+/* int chunk_decryptRange(int encFD, int clearFD, const cryptKey_t* key,
+ *                        uint64_t offset, uint64_t length)
+ *
+ * Purpose: As chunk_decrypt, but only plain bytes [offset, offset + length)
+ *          of the file, written to their place in clearFD and nothing
+ *          else. Holes are left as clearFD has them, so the range should
+ *          read as zeros beforehand. The tables read are checked up to
+ *          the root, as stream reads check them.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int chunk_decryptRange(int encFD, int clearFD, const cryptKey_t* key,
+                              uint64_t offset, uint64_t length);
+
+/* int chunk_encrypt(int clearFD, int encFD, const cryptKey_t* key)
+ *
+ * Purpose: Replace the contents of encFD with clearFD in the chunked
+ *          format. Unallocated ranges of clearFD are skipped without
+ *          being read. Space already allocated to encFD is kept.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int chunk_encrypt(int clearFD, int encFD, const cryptKey_t* key);
+
+/* int chunk_update(int clearFD, int encFD, const cryptKey_t* key,
+ *                  const chunkMap_t* dirty)
+ *
+ * Purpose: As chunk_encrypt, but re-encrypt only the chunks in dirty and
+ *          keep every other chunk of encFD as it is. Falls back to
+ *          chunk_encrypt for legacy files, files under another key, or
+ *          when dirty is NULL.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int chunk_update(int clearFD, int encFD, const cryptKey_t* key,
+                        const chunkMap_t* dirty);
+
+/* int chunk_updatesWhole(int encFD, const cryptKey_t* key,
+ *                        const chunkMap_t* dirty)
+ *
+ * Purpose: Tell whether chunk_update with these arguments would fall back
+ *          to chunk_encrypt, and so read all of the clear file rather
+ *          than its dirty chunks and the chunk at the old end of the file
+ *
+ * Return: 1 if so, 0 if not, negative errno on error
+ */
+extern int chunk_updatesWhole(int encFD, const cryptKey_t* key,
+                              const chunkMap_t* dirty);
+
+/* int chunk_clone(int srcFD, int dstFD)
+ *
+ * Purpose: Make empty file dstFD a copy of backing file srcFD, by reflink
+ *          where the FS supports it and otherwise by copying only the
+ *          allocated ranges
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int chunk_clone(int srcFD, int dstFD);
+
+/* int chunk_clonePaced(int srcFD, int dstFD, uint64_t slice,
+ *                      int (*pace)(void* arg, uint64_t len), void* arg)
+ *
+ * Purpose: As chunk_clone, but where it has to copy, copy at most slice
+ *          bytes at a time (0: no limit), calling pace with arg and the
+ *          length of each slice before it is copied
+ *
+ * Return: 0 on success, what pace returned if negative, negative errno
+ *         on other errors
+ */
+extern int chunk_clonePaced(int srcFD, int dstFD, uint64_t slice,
+                            int (*pace)(void* arg, uint64_t len), void* arg);
+
+/* int chunk_rewrap(int encFD, const unsigned char* wrapped)
+ *
+ * Purpose: Replace the wrapped data key in the header of the
+ *          CHUNK_VERSION_WRAPPED file on encFD with wrapped, the same key
+ *          wrapped under another master key (crypt_rewrapDataKey), and
+ *          clear the spare slot
+ *
+ * Return: 0 on success, -EINVAL if the file has no data key, negative
+ *         errno on other errors
+ */
+extern int chunk_rewrap(int encFD, const unsigned char* wrapped);
+
+/* int chunk_stageWrap(int encFD, const unsigned char* wrapped)
+ *
+ * Purpose: Keep wrapped, the file's data key wrapped under another master
+ *          key, in the spare slot of the header of the file on encFD,
+ *          leaving the current form in place. Sync it before the file
+ *          names the new master key, then chunk_rewrap to finish.
+ *
+ * Return: 0 on success, -EINVAL if the file has no data key, negative
+ *         errno on other errors
+ */
+extern int chunk_stageWrap(int encFD, const unsigned char* wrapped);
+
+/* int chunk_reserve(int encFD, uint64_t offset, uint64_t length)
+ *
+ * Purpose: Allocate backing space for the chunks holding plain bytes
+ *          [offset, offset + length), without writing anything. A no-op
+ *          where the backing FS doesn't support fallocate.
+ *
+ * Return: 0 on success, negative errno on error (e.g. -ENOSPC)
+ */
+extern int chunk_reserve(int encFD, uint64_t offset, uint64_t length);
+
+/* int chunk_punch(int encFD, uint64_t offset, uint64_t length,
+ *                 uint64_t plainSize)
+ *
+ * Purpose: Give back the backing space of the chunks wholly inside plain
+ *          bytes [offset, offset + length) of a plainSize byte file that
+ *          its tables list as holes. Call after chunk_encrypt has written
+ *          the chunks as holes; any the table lists are left alone, so no
+ *          table entry ever points at a punched slot.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int chunk_punch(int encFD, uint64_t offset, uint64_t length,
+                       uint64_t plainSize);
+
+/* Open chunked file for direct reads and writes: chunks are encrypted and
+ * decrypted between the caller's buffers and the backing file, with no
+ * clear-text copy. Backing I/O is block aligned, so encFD may be opened
+ * O_DIRECT; otherwise the pages it touches are dropped from the cache.
+ * Calls on one stream may come from several threads. */
+typedef struct chunkStream chunkStream_t;
+
+/* int chunk_streamOpen(int encFD, const cryptKey_t* key,
+ *                      chunkStream_t** stream)
+ *
+ * Purpose: Start streaming the chunked (or empty) file open on encFD
+ *
+ * Return: 1 and *stream set on success, 0 if the file is in the legacy
+ *         format and can't be streamed, -EINVAL if it is under another
+ *         key, negative errno on other errors
+ */
+extern int chunk_streamOpen(int encFD, const cryptKey_t* key,
+                            chunkStream_t** stream);
+
+/* Read and write plain bytes like pread and pwrite. Return the byte count
+ * or negative errno. */
+extern ssize_t chunk_streamRead(chunkStream_t* stream, char* buf, size_t size,
+                                uint64_t offset);
+extern ssize_t chunk_streamWrite(chunkStream_t* stream, const char* buf,
+                                 size_t size, uint64_t offset);
+
+extern int chunk_streamTruncate(chunkStream_t* stream, uint64_t size);
+extern uint64_t chunk_streamSize(chunkStream_t* stream);
+
+/* int chunk_streamFlush(chunkStream_t* stream)
+ *
+ * Purpose: Write out the cached table and the header, after which the
+ *          backing file holds everything written so far
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int chunk_streamFlush(chunkStream_t* stream);
+
+/* Flush and free stream; the caller still closes encFD */
+extern int chunk_streamClose(chunkStream_t* stream);
+
+/* Mark the chunks holding plain bytes [offset, offset + length) dirty;
+ * if the map can't grow, everything is marked */
+extern void chunkmap_mark(chunkMap_t* map, uint64_t offset, uint64_t length);
+
+/* Mark every chunk of from dirty in map as well */
+extern void chunkmap_merge(chunkMap_t* map, const chunkMap_t* from);
+
+extern void chunkmap_markAll(chunkMap_t* map);
+extern int chunkmap_test(const chunkMap_t* map, uint64_t chunk);
+
+/* First dirty chunk at or after chunk, UINT64_MAX if none */
+extern uint64_t chunkmap_next(const chunkMap_t* map, uint64_t chunk);
+
+extern void chunkmap_reset(chunkMap_t* map);
+extern void chunkmap_free(chunkMap_t* map);
+
+#endif
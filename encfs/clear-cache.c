@@ -0,0 +1,623 @@
+/* clear-cache.c
+ * Mount-wide budget for the plain text of open files
+ *
+ * Units in the clear are kept in one chained hash table on (file, unit)
+ * and one LRU list across all files, under one mutex. Each file also has
+ * a mutex of its own, held while its units are filled and while it is
+ * saved or resized; evictions only trylock it, skipping files busy that
+ * way, so the two locks are always taken file first.
+ *
+ * Units held for a read or write are pinned, and punched out of their
+ * clear file only once unpinned, so no read or write in flight ever sees
+ * a unit turn into zeros.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "clear-cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+#define MIN_BUCKETS 256
+
+typedef struct clearUnit {
+    clearFile_t*      file;
+    uint64_t          unit;
+    unsigned int      pins;
+    int               dirty;
+    struct clearUnit* hnext;
+    struct clearUnit* lprev;
+    struct clearUnit* lnext;
+    struct clearUnit* fprev;    /* units of the same file */
+    struct clearUnit* fnext;
+} clearUnit_t;
+
+struct clearFile {
+    clearCache_t*   cache;
+    pthread_mutex_t lock;       /* fills, saves and resizes */
+    int             fd;
+    clearFillFunc_t fill;
+    void*           arg;
+
+    /* The rest under the cache's lock */
+    uint64_t        size;
+    uint64_t        fillLimit;
+    int             writeback;  /* asked to save early */
+    clearUnit_t*    units;
+    chunkMap_t      evicted;    /* bit u set once unit u was evicted */
+};
+
+struct clearCache {
+    pthread_mutex_t lock;
+    clearUnit_t**   buckets;
+    size_t          numBuckets;
+    clearUnit_t*    lruHead;    /* most recently used */
+    clearUnit_t*    lruTail;
+    uint64_t        budget;
+    uint64_t        resident;
+    size_t          files;
+
+    uint64_t        peak;
+    uint64_t        dirty;
+    uint64_t        fills;
+    uint64_t        redecrypts;
+    uint64_t        evictions;
+    uint64_t        writebacks;
+    uint64_t        overruns;
+};
+
+static size_t bucketOf(const clearCache_t* cache, const clearFile_t* file,
+                       uint64_t unit) {
+
+    uint64_t h = ((uint64_t) (uintptr_t) file >> 4) ^ unit;
+
+    h *= 0x9e3779b97f4a7c15ULL;
+    return (h >> 32) & (cache->numBuckets - 1);
+
+}
+
+static void lruUnlink(clearCache_t* cache, clearUnit_t* u) {
+
+    if(u->lprev) {
+        u->lprev->lnext = u->lnext;
+    }
+    else {
+        cache->lruHead = u->lnext;
+    }
+    if(u->lnext) {
+        u->lnext->lprev = u->lprev;
+    }
+    else {
+        cache->lruTail = u->lprev;
+    }
+    u->lprev = NULL;
+    u->lnext = NULL;
+
+}
+
+static void lruPushHead(clearCache_t* cache, clearUnit_t* u) {
+
+    u->lprev = NULL;
+    u->lnext = cache->lruHead;
+    if(cache->lruHead) {
+        cache->lruHead->lprev = u;
+    }
+    cache->lruHead = u;
+    if(!cache->lruTail) {
+        cache->lruTail = u;
+    }
+
+}
+
+static clearUnit_t* findUnit(clearCache_t* cache, const clearFile_t* file,
+                             uint64_t unit) {
+
+    clearUnit_t* u = cache->buckets[bucketOf(cache, file, unit)];
+
+    while(u && (u->file != file || u->unit != unit)) {
+        u = u->hnext;
+    }
+
+    return u;
+
+}
+
+static clearUnit_t* addUnit(clearCache_t* cache, clearFile_t* file,
+                            uint64_t unit) {
+
+    size_t b;
+    clearUnit_t* u = NULL;
+
+    u = calloc(1, sizeof(*u));
+    if(!u) {
+        return NULL;
+    }
+    u->file = file;
+    u->unit = unit;
+
+    b = bucketOf(cache, file, unit);
+    u->hnext = cache->buckets[b];
+    cache->buckets[b] = u;
+    lruPushHead(cache, u);
+    u->fnext = file->units;
+    if(file->units) {
+        file->units->fprev = u;
+    }
+    file->units = u;
+
+    cache->resident += CLEARCACHE_UNIT;
+    if(cache->resident > cache->peak) {
+        cache->peak = cache->resident;
+    }
+
+    return u;
+
+}
+
+static void removeUnit(clearCache_t* cache, clearUnit_t* u) {
+
+    clearUnit_t** pp = &cache->buckets[bucketOf(cache, u->file, u->unit)];
+
+    while(*pp != u) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = u->hnext;
+
+    lruUnlink(cache, u);
+    if(u->fprev) {
+        u->fprev->fnext = u->fnext;
+    }
+    else {
+        u->file->units = u->fnext;
+    }
+    if(u->fnext) {
+        u->fnext->fprev = u->fprev;
+    }
+
+    cache->resident -= CLEARCACHE_UNIT;
+    if(u->dirty) {
+        cache->dirty -= CLEARCACHE_UNIT;
+    }
+    free(u);
+
+}
+
+/* Get resident under budget by punching out the least recently used
+ * clean units no one holds; with the cache locked. What can't be evicted
+ * is dirty or held: the files with the oldest dirty units, enough of
+ * them to cover the excess, are asked to save early. */
+static void evict(clearCache_t* cache) {
+
+    uint64_t excess;
+    clearUnit_t* u = NULL;
+    clearUnit_t* prev = NULL;
+    clearFile_t* file = NULL;
+
+    for(u = cache->lruTail; u && cache->resident > cache->budget; u = prev) {
+
+        prev = u->lprev;
+        file = u->file;
+        if(u->pins || u->dirty || pthread_mutex_trylock(&file->lock) != 0) {
+            continue;
+        }
+
+        if(fallocate(file->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t) (u->unit * CLEARCACHE_UNIT),
+                     (off_t) CLEARCACHE_UNIT) < 0) {
+            perror("ERROR evict: fallocate(PUNCH_HOLE)");
+            pthread_mutex_unlock(&file->lock);
+            break;
+        }
+        chunkmap_mark(&file->evicted, u->unit * CHUNK_SIZE, 1);
+        removeUnit(cache, u);
+        cache->evictions++;
+        pthread_mutex_unlock(&file->lock);
+
+    }
+
+    if(cache->resident <= cache->budget) {
+        return;
+    }
+    cache->overruns++;
+
+    excess = cache->resident - cache->budget;
+    for(u = cache->lruTail; u && excess; u = u->lprev) {
+        if(!u->dirty) {
+            continue;
+        }
+        if(!u->file->writeback) {
+            u->file->writeback = 1;
+            cache->writebacks++;
+        }
+        excess -= (excess < CLEARCACHE_UNIT) ? excess : CLEARCACHE_UNIT;
+    }
+
+}
+
+/* Bring unit of file into the clear, pinning it if pin is set, with file
+ * locked. With whole set the caller overwrites all of it, so it isn't
+ * filled. */
+static int bringIn(clearFile_t* file, uint64_t unit, int whole, int pin) {
+
+    int ret;
+    int again;
+    uint64_t start = unit * CLEARCACHE_UNIT;
+    uint64_t end;
+    clearCache_t* cache = file->cache;
+    clearUnit_t* u = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    u = findUnit(cache, file, unit);
+    if(u) {
+        if(pin) {
+            u->pins++;
+        }
+        lruUnlink(cache, u);
+        lruPushHead(cache, u);
+        pthread_mutex_unlock(&cache->lock);
+        return RETURN_SUCCESS;
+    }
+
+    u = addUnit(cache, file, unit);
+    if(!u) {
+        pthread_mutex_unlock(&cache->lock);
+        fprintf(stderr, "ERROR bringIn: calloc failed\n");
+        return -ENOMEM;
+    }
+    u->pins = pin ? 1 : 0;
+    end = start + CLEARCACHE_UNIT;
+    if(end > file->fillLimit) {
+        end = file->fillLimit;
+    }
+    again = chunkmap_test(&file->evicted, unit);
+
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Past the fill limit there is nothing to fill */
+    if(whole || end <= start) {
+        return RETURN_SUCCESS;
+    }
+
+    ret = file->fill(file->arg, start, end - start);
+
+    pthread_mutex_lock(&cache->lock);
+    if(ret < 0) {
+        removeUnit(cache, u);
+    }
+    else {
+        cache->fills++;
+        if(again) {
+            cache->redecrypts++;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return (ret < 0) ? ret : RETURN_SUCCESS;
+
+}
+
+extern clearCache_t* clearcache_create(uint64_t budget) {
+
+    size_t size = MIN_BUCKETS;
+    clearCache_t* cache = NULL;
+
+    if(budget < CLEARCACHE_UNIT) {
+        budget = CLEARCACHE_UNIT;
+    }
+    while(size < 2 * (budget / CLEARCACHE_UNIT)) {
+        size *= 2;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    if(!cache) {
+        fprintf(stderr, "ERROR clearcache_create: calloc failed\n");
+        return NULL;
+    }
+
+    cache->buckets = calloc(size, sizeof(*cache->buckets));
+    if(!cache->buckets) {
+        fprintf(stderr, "ERROR clearcache_create: calloc(buckets) failed\n");
+        free(cache);
+        return NULL;
+    }
+    cache->numBuckets = size;
+    cache->budget = budget;
+
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+
+}
+
+extern void clearcache_destroy(clearCache_t* cache) {
+
+    if(!cache) {
+        return;
+    }
+
+    if(cache->files) {
+        fprintf(stderr, "WARNING clearcache_destroy: %zd files still open\n",
+                cache->files);
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+
+}
+
+extern clearFile_t* clearcache_open(clearCache_t* cache, int fd, uint64_t size,
+                                    clearFillFunc_t fill, void* arg) {
+
+    clearFile_t* file = NULL;
+
+    file = calloc(1, sizeof(*file));
+    if(!file) {
+        fprintf(stderr, "ERROR clearcache_open: calloc failed\n");
+        return NULL;
+    }
+    file->cache = cache;
+    file->fd = fd;
+    file->fill = fill;
+    file->arg = arg;
+    file->size = size;
+    file->fillLimit = size;
+    pthread_mutex_init(&file->lock, NULL);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->files++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return file;
+
+}
+
+extern void clearcache_close(clearFile_t* file) {
+
+    clearCache_t* cache = NULL;
+
+    if(!file) {
+        return;
+    }
+    cache = file->cache;
+
+    pthread_mutex_lock(&file->lock);
+    pthread_mutex_lock(&cache->lock);
+    while(file->units) {
+        removeUnit(cache, file->units);
+    }
+    cache->files--;
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_unlock(&file->lock);
+
+    pthread_mutex_destroy(&file->lock);
+    chunkmap_free(&file->evicted);
+    free(file);
+
+}
+
+extern int clearcache_hold(clearFile_t* file, uint64_t offset, uint64_t length,
+                           int flags, clearHold_t* hold) {
+
+    int ret = RETURN_SUCCESS;
+    int whole;
+    uint64_t i;
+    uint64_t end = offset + length;
+    uint64_t unitStart;
+    clearCache_t* cache = file->cache;
+
+    hold->first = offset / CLEARCACHE_UNIT;
+    hold->count = 0;
+
+    pthread_mutex_lock(&file->lock);
+
+    pthread_mutex_lock(&cache->lock);
+    if(!(flags & CLEARCACHE_WRITE) && end > file->size) {
+        end = file->size;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if(end > offset) {
+        for(i = hold->first; i <= (end - 1) / CLEARCACHE_UNIT; i++) {
+            unitStart = i * CLEARCACHE_UNIT;
+            whole = (flags & CLEARCACHE_WRITE) && offset <= unitStart &&
+                end >= unitStart + CLEARCACHE_UNIT;
+            ret = bringIn(file, i, whole, 1);
+            if(ret < 0) {
+                break;
+            }
+            hold->count++;
+        }
+    }
+
+    pthread_mutex_unlock(&file->lock);
+
+    if(ret < 0) {
+        clearcache_release(file, hold);
+        hold->count = 0;
+        return ret;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    evict(cache);
+    ret = file->writeback;
+    file->writeback = 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+
+}
+
+extern void clearcache_release(clearFile_t* file, const clearHold_t* hold) {
+
+    uint64_t i;
+    clearCache_t* cache = file->cache;
+    clearUnit_t* u = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    for(i = 0; i < hold->count; i++) {
+        u = findUnit(cache, file, hold->first + i);
+        if(u && u->pins) {
+            u->pins--;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+extern void clearcache_dirty(clearFile_t* file, uint64_t offset,
+                             uint64_t length) {
+
+    uint64_t i;
+    clearCache_t* cache = file->cache;
+    clearUnit_t* u = NULL;
+
+    if(length == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for(i = offset / CLEARCACHE_UNIT;
+        i <= (offset + length - 1) / CLEARCACHE_UNIT; i++) {
+        u = findUnit(cache, file, i);
+        if(u && !u->dirty) {
+            u->dirty = 1;
+            cache->dirty += CLEARCACHE_UNIT;
+        }
+    }
+    if(offset + length > file->size) {
+        file->size = offset + length;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+extern void clearcache_lock(clearFile_t* file) {
+    pthread_mutex_lock(&file->lock);
+}
+
+extern void clearcache_unlock(clearFile_t* file) {
+    pthread_mutex_unlock(&file->lock);
+}
+
+extern int clearcache_fill(clearFile_t* file, uint64_t offset, uint64_t length) {
+
+    int ret;
+    uint64_t i;
+    uint64_t end = offset + length;
+
+    pthread_mutex_lock(&file->cache->lock);
+    if(end > file->fillLimit) {
+        end = file->fillLimit;
+    }
+    pthread_mutex_unlock(&file->cache->lock);
+
+    for(i = offset / CLEARCACHE_UNIT; end > offset &&
+            i <= (end - 1) / CLEARCACHE_UNIT; i++) {
+        ret = bringIn(file, i, 0, 0);
+        if(ret < 0) {
+            return ret;
+        }
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+extern int clearcache_fillChunks(clearFile_t* file, const chunkMap_t* map) {
+
+    int ret;
+    uint64_t chunk;
+    uint64_t limit;
+
+    pthread_mutex_lock(&file->cache->lock);
+    limit = file->fillLimit;
+    pthread_mutex_unlock(&file->cache->lock);
+
+    for(chunk = chunkmap_next(map, 0);
+        chunk != UINT64_MAX && chunk * CHUNK_SIZE < limit;
+        chunk = chunkmap_next(map, (chunk / CHUNK_PERTABLE + 1) * CHUNK_PERTABLE)) {
+        ret = bringIn(file, chunk / CHUNK_PERTABLE, 0, 0);
+        if(ret < 0) {
+            return ret;
+        }
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+extern void clearcache_resize(clearFile_t* file, uint64_t size) {
+
+    clearCache_t* cache = file->cache;
+    clearUnit_t* u = NULL;
+    clearUnit_t* next = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    /* Units wholly past the end went with it */
+    for(u = file->units; u; u = next) {
+        next = u->fnext;
+        if(u->unit * CLEARCACHE_UNIT >= size) {
+            removeUnit(cache, u);
+        }
+    }
+    file->size = size;
+    if(size < file->fillLimit) {
+        file->fillLimit = size;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+extern void clearcache_clean(clearFile_t* file, uint64_t size) {
+
+    clearCache_t* cache = file->cache;
+    clearUnit_t* u = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for(u = file->units; u; u = u->fnext) {
+        if(u->dirty) {
+            u->dirty = 0;
+            cache->dirty -= CLEARCACHE_UNIT;
+        }
+    }
+    file->size = size;
+    file->fillLimit = size;
+
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+extern void clearcache_stats(clearCache_t* cache, clearCacheStats_t* stats) {
+
+    if(!cache || !stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    stats->budget = cache->budget;
+    stats->resident = cache->resident;
+    stats->peak = cache->peak;
+    stats->dirty = cache->dirty;
+    stats->fills = cache->fills;
+    stats->redecrypts = cache->redecrypts;
+    stats->evictions = cache->evictions;
+    stats->writebacks = cache->writebacks;
+    stats->overruns = cache->overruns;
+    stats->files = cache->files;
+    pthread_mutex_unlock(&cache->lock);
+
+}
@@ -0,0 +1,135 @@
+/* clear-cache.h
+ * Mount-wide budget for the plain text of open files
+ *
+ * Each open file's plain text lives in a clear file (an unlinked temp
+ * file next to the backing file). Under a budget, clear files are filled
+ * lazily, one unit (a cluster of chunks) at a time as reads and writes
+ * reach it, and units unused for longest are evicted, by punching them
+ * out of their clear file, once the units in the clear across the mount
+ * exceed the budget. An evicted unit is decrypted again the next time it
+ * is used.
+ *
+ * Only clean units are evicted. Units written since their file was last
+ * saved hold the only copy of their data, so they are kept; when nothing
+ * else is left to evict, the files holding them are asked to save early,
+ * which makes them clean.
+ *
+ * Every unit not in the clear reads as zeros from its clear file, and is
+ * filled from the backing file's plain text up to the file's fill limit:
+ * the smallest size the file has had since it was last saved, beyond
+ * which the clear file alone knows what the file holds.
+ *
+ */
+
+#ifndef CLEAR_CACHE_H
+#define CLEAR_CACHE_H
+
+#include <stdint.h>
+
+#include "chunk-crypt.h"
+
+/* Units are clusters: one chunk table's worth of chunks */
+#define CLEARCACHE_UNIT ((uint64_t) CHUNK_PERTABLE * CHUNK_SIZE)
+
+/* The caller writes the range: it may extend the file, and units it
+ * covers whole are not filled first */
+#define CLEARCACHE_WRITE 0x1
+
+typedef struct clearCache clearCache_t;
+typedef struct clearFile clearFile_t;
+
+/* Write the plain text of [offset, offset + length) to the clear file */
+typedef int (*clearFillFunc_t)(void* arg, uint64_t offset, uint64_t length);
+
+/* Units pinned by one clearcache_hold */
+typedef struct clearHold {
+    uint64_t first;
+    uint64_t count;
+} clearHold_t;
+
+typedef struct clearCacheStats {
+    uint64_t budget;
+    uint64_t resident;   /* bytes of units in the clear */
+    uint64_t peak;
+    uint64_t dirty;      /* of them, written since their file was saved */
+    uint64_t fills;      /* units decrypted as they were reached */
+    uint64_t redecrypts; /* of them, units evicted before */
+    uint64_t evictions;
+    uint64_t writebacks; /* early saves asked of files */
+    uint64_t overruns;   /* over budget with nothing left to evict */
+    size_t   files;
+} clearCacheStats_t;
+
+/* clearCache_t* clearcache_create(uint64_t budget)
+ *
+ * Purpose: Create a cache keeping about budget bytes of plain text in
+ *          the clear across all its files (at least one unit)
+ *
+ * Return: New cache on success, NULL on error
+ */
+extern clearCache_t* clearcache_create(uint64_t budget);
+
+/* Every file must be closed first */
+extern void clearcache_destroy(clearCache_t* cache);
+
+/* clearFile_t* clearcache_open(clearCache_t* cache, int fd, uint64_t size,
+ *                              clearFillFunc_t fill, void* arg)
+ *
+ * Purpose: Start tracking the clear file open on fd, size bytes long and
+ *          all holes, whose units fill(arg, ...) fills
+ *
+ * Return: New file on success, NULL on error
+ */
+extern clearFile_t* clearcache_open(clearCache_t* cache, int fd, uint64_t size,
+                                    clearFillFunc_t fill, void* arg);
+
+/* Forget file; call before its clear file is closed */
+extern void clearcache_close(clearFile_t* file);
+
+/* int clearcache_hold(clearFile_t* file, uint64_t offset, uint64_t length,
+ *                     int flags, clearHold_t* hold)
+ *
+ * Purpose: Bring the units holding plain bytes [offset, offset + length)
+ *          (clipped to the file's size, unless flags has CLEARCACHE_WRITE)
+ *          into the clear, and keep them there until clearcache_release.
+ *          Then evict whatever the budget calls for.
+ *
+ * Return: 1 if file was asked to save early, 0 if not, negative errno on
+ *         error (nothing held)
+ */
+extern int clearcache_hold(clearFile_t* file, uint64_t offset, uint64_t length,
+                           int flags, clearHold_t* hold);
+
+extern void clearcache_release(clearFile_t* file, const clearHold_t* hold);
+
+/* Note that plain bytes [offset, offset + length), held, were written */
+extern void clearcache_dirty(clearFile_t* file, uint64_t offset,
+                             uint64_t length);
+
+/* Keep fills and evictions off file, as while its backing file is saved
+ * or its clear file resized */
+extern void clearcache_lock(clearFile_t* file);
+extern void clearcache_unlock(clearFile_t* file);
+
+/* int clearcache_fill(clearFile_t* file, uint64_t offset, uint64_t length)
+ *
+ * Purpose: With file locked, bring the units holding plain bytes
+ *          [offset, offset + length) into the clear, without holding them
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int clearcache_fill(clearFile_t* file, uint64_t offset, uint64_t length);
+
+/* As clearcache_fill, for the units holding the chunks in map */
+extern int clearcache_fillChunks(clearFile_t* file, const chunkMap_t* map);
+
+/* With file locked, note that its clear file is now size bytes long */
+extern void clearcache_resize(clearFile_t* file, uint64_t size);
+
+/* With file locked, note that its backing file now holds all of its clear
+ * file, size bytes long */
+extern void clearcache_clean(clearFile_t* file, uint64_t size);
+
+extern void clearcache_stats(clearCache_t* cache, clearCacheStats_t* stats);
+
+#endif
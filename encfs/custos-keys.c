@@ -0,0 +1,233 @@
+/* custos-keys.c
+ * Key retrieval from a custos server, batched and backed by a key cache
+ *
+ */
+
+#include "custos-keys.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+/* Build a request for uuids[0..num) plus the PSK attribute */
+static custosReq_t* buildKeyReq(const char* url, const char* psk,
+                                const uuid_t* uuids, size_t num) {
+
+    size_t i;
+    custosReq_t*     req     = NULL;
+    custosKey_t*     key     = NULL;
+    custosKeyReq_t*  keyreq  = NULL;
+    custosAttr_t*    attr    = NULL;
+    custosAttrReq_t* attrreq = NULL;
+
+    /* Setup a new request */
+    req = custos_createReq(url);
+    if(!req) {
+        fprintf(stderr, "ERROR buildKeyReq: custos_createReq() failed\n");
+        return NULL;
+    }
+
+    /* Add Keys to Request */
+    for(i = 0; i < num; i++) {
+        key = custos_createKey(uuids[i], 1, 0, NULL);
+        if(!key) {
+            fprintf(stderr, "ERROR buildKeyReq: custos_createKey() failed\n");
+            goto ERROR;
+        }
+        keyreq = custos_createKeyReq(true);
+        if(!keyreq) {
+            fprintf(stderr, "ERROR buildKeyReq: custos_createKeyReq() failed\n");
+            goto ERROR;
+        }
+        if(custos_updateKeyReqAddKey(keyreq, key) < 0) {
+            fprintf(stderr, "ERROR buildKeyReq: custos_updateKeyReqAddKey() failed\n");
+            goto ERROR;
+        }
+        if(custos_updateReqAddKeyReq(req, keyreq) < 0) {
+            fprintf(stderr, "ERROR buildKeyReq: custos_updateReqAddKeyReq() failed\n");
+            goto ERROR;
+        }
+    }
+
+    /* Add attr to request */
+    attr = custos_createAttr(CUS_ATTRCLASS_EXPLICIT, CUS_ATTRTYPE_EXP_PSK, 0,
+                             (strlen(psk) + 1), (uint8_t*) psk);
+    if(!attr) {
+        fprintf(stderr, "ERROR buildKeyReq: custos_createAttr() failed\n");
+        goto ERROR;
+    }
+    attrreq = custos_createAttrReq(true);
+    if(!attrreq) {
+        fprintf(stderr, "ERROR buildKeyReq: custos_createAttrReq() failed\n");
+        goto ERROR;
+    }
+    if(custos_updateAttrReqAddAttr(attrreq, attr) < 0) {
+        fprintf(stderr, "ERROR buildKeyReq: custos_updateAttrReqAddAttr() failed\n");
+        goto ERROR;
+    }
+    if(custos_updateReqAddAttrReq(req, attrreq) < 0) {
+        fprintf(stderr, "ERROR buildKeyReq: custos_updateReqAddAttrReq() failed\n");
+        goto ERROR;
+    }
+
+    return req;
+
+ ERROR:
+    custos_destroyReq(&req);
+    return NULL;
+
+}
+
+/* Move every accepted key in res into cache; return the number stored */
+static int storeKeyRes(keyCache_t* cache, const custosRes_t* res) {
+
+    size_t i;
+    int stored = 0;
+    const custosKeyRes_t* keyres = NULL;
+
+    if(res->status != CUS_RESSTAT_ACCEPTED) {
+        fprintf(stderr, "ERROR storeKeyRes: Bad response status %d\n", res->status);
+        return -EACCES;
+    }
+
+    for(i = 0; i < res->num_keys; i++) {
+        keyres = res->keys[i];
+        if(!keyres) {
+            fprintf(stderr, "ERROR storeKeyRes: Key response struct must not be NULL\n");
+            continue;
+        }
+        if(keyres->status != CUS_KEYSTAT_ACCEPTED) {
+            fprintf(stderr, "ERROR storeKeyRes: Bad key response status: %d\n",
+                    keyres->status);
+            continue;
+        }
+        if(!keyres->key || !keyres->key->val) {
+            fprintf(stderr, "ERROR storeKeyRes: Key value must not be NULL\n");
+            continue;
+        }
+        if(keycache_put(cache, keyres->key->uuid,
+                        keyres->key->val, keyres->key->size) < 0) {
+            fprintf(stderr, "ERROR storeKeyRes: keycache_put() failed\n");
+            continue;
+        }
+        stored++;
+    }
+
+    return stored;
+
+}
+
+/* Send one request for uuids[0..num); return the number of keys stored */
+static int fetchBatch(keyCache_t* cache, custosSession_t* session,
+                      const uuid_t* uuids, size_t num) {
+
+    int ret;
+    custosReq_t* req = NULL;
+    custosRes_t* res = NULL;
+
+    if(custosSession_standin(session)) {
+        return custosSession_fetchLocal(session, cache, uuids, num);
+    }
+
+    req = buildKeyReq(custosSession_url(session), custosSession_psk(session),
+                      uuids, num);
+    if(!req) {
+        fprintf(stderr, "ERROR fetchBatch: buildKeyReq() failed\n");
+        return -ENOMEM;
+    }
+
+    res = custosSession_getRes(session, req);
+    custos_destroyReq(&req);
+    if(!res) {
+        fprintf(stderr, "ERROR fetchBatch: custosSession_getRes() failed\n");
+        return -EIO;
+    }
+
+    ret = storeKeyRes(cache, res);
+    custos_destroyRes(&res);
+
+    return ret;
+
+}
+
+extern int custosKeys_fetch(keyCache_t* cache, custosSession_t* session,
+                            const uuid_t* uuids, size_t num) {
+
+    int ret;
+    int stored = 0;
+    int err = RETURN_SUCCESS;
+    size_t i;
+    size_t j;
+    size_t batch = 0;
+    uuid_t pending[CUSTOS_KEYS_PER_REQ];
+
+    if(!cache || !session || (!uuids && num)) {
+        fprintf(stderr, "ERROR custosKeys_fetch: arguments must not be NULL\n");
+        return -EINVAL;
+    }
+
+    for(i = 0; i <= num; i++) {
+
+        /* Queue keys we don't have yet, dropping duplicates within the batch */
+        if(i < num && !keycache_contains(cache, uuids[i])) {
+            for(j = 0; j < batch; j++) {
+                if(uuid_compare(pending[j], uuids[i]) == 0) {
+                    break;
+                }
+            }
+            if(j == batch) {
+                uuid_copy(pending[batch++], uuids[i]);
+            }
+        }
+
+        /* Send a full batch, or whatever is left at the end */
+        if(batch == 0 || (batch < CUSTOS_KEYS_PER_REQ && i < num)) {
+            continue;
+        }
+
+        /* A failed batch doesn't stop the rest; report it if nothing landed */
+        ret = fetchBatch(cache, session, (const uuid_t*) pending, batch);
+        batch = 0;
+        if(ret < 0) {
+            fprintf(stderr, "ERROR custosKeys_fetch: fetchBatch() failed\n");
+            err = ret;
+            continue;
+        }
+        stored += ret;
+
+    }
+
+    return (stored == 0 && err < 0) ? err : stored;
+
+}
+
+extern keyHandle_t* custosKeys_acquire(keyCache_t* cache, custosSession_t* session,
+                                       const uuid_t uuid) {
+
+    int ret;
+    keyHandle_t* handle = NULL;
+
+    handle = keycache_acquire(cache, uuid);
+    if(handle) {
+        return handle;
+    }
+
+    ret = custosKeys_fetch(cache, session, (const uuid_t*) uuid, 1);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR custosKeys_acquire: custosKeys_fetch() failed\n");
+        return NULL;
+    }
+
+    handle = keycache_acquire(cache, uuid);
+    if(!handle) {
+        fprintf(stderr, "ERROR custosKeys_acquire: server did not return the key\n");
+    }
+
+    return handle;
+
+}
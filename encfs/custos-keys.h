@@ -0,0 +1,47 @@
+/* custos-keys.h
+ * Key retrieval from a custos server, batched and backed by a key cache
+ *
+ * The custos request format already allows many keys per request; these
+ * helpers use that to fetch the keys for a whole set of files in a
+ * handful of round trips and store them in a keyCache_t.
+ *
+ */
+
+#ifndef CUSTOS_KEYS_H
+#define CUSTOS_KEYS_H
+
+#include <stddef.h>
+#include <uuid/uuid.h>
+
+#include "custos-session.h"
+#include "key-cache.h"
+
+/* Upper bound on keys sent in a single custos request */
+#define CUSTOS_KEYS_PER_REQ 64
+
+/* int custosKeys_fetch(keyCache_t* cache, custosSession_t* session,
+ *                      const uuid_t* uuids, size_t num)
+ *
+ * Purpose: Fetch the keys for uuids[0..num) from the session's server,
+ *          CUSTOS_KEYS_PER_REQ per request, and add them to cache.
+ *          UUIDs already in the cache and duplicates are skipped.
+ *          A failed request does not stop the remaining ones.
+ *
+ * Return: Number of keys added, or negative errno if none were added
+ *          and a request failed
+ */
+extern int custosKeys_fetch(keyCache_t* cache, custosSession_t* session,
+                            const uuid_t* uuids, size_t num);
+
+/* keyHandle_t* custosKeys_acquire(keyCache_t* cache, custosSession_t* session,
+ *                                 const uuid_t uuid)
+ *
+ * Purpose: Take a reference to the key handle for uuid, fetching the key
+ *          first on a cache miss
+ *
+ * Return: Handle on success (release with keycache_release), NULL on error
+ */
+extern keyHandle_t* custosKeys_acquire(keyCache_t* cache, custosSession_t* session,
+                                       const uuid_t uuid);
+
+#endif
@@ -0,0 +1,370 @@
+/* custos-session.c
+ * Long-lived custos client session shared by all FUSE threads
+ *
+ */
+
+#include "custos-session.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+/* Seconds of idle before TCP keep-alive probes start */
+#define KEEPALIVE_IDLE 60
+
+typedef struct custosSlot {
+    CURL*  curl;
+    size_t next;            /* next free slot, when on the free list */
+} custosSlot_t;
+
+struct custosSession {
+    char*            url;
+    char*            psk;
+    custosStandin_t* standin;
+
+    CURLSH*          share;
+    pthread_mutex_t  shareLocks[CURL_LOCK_DATA_LAST];
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   freed;
+    custosSlot_t*    slots;
+    size_t           numSlots;
+    size_t           freeHead;  /* numSlots when none are free */
+    size_t           inUse;
+
+    uint64_t         requests;
+    uint64_t         failures;
+    uint64_t         waits;
+};
+
+static void shareLock(CURL* handle, curl_lock_data data,
+                      curl_lock_access access, void* userp) {
+
+    custosSession_t* session = userp;
+
+    (void) handle;
+    (void) access;
+
+    pthread_mutex_lock(&session->shareLocks[data]);
+
+}
+
+static void shareUnlock(CURL* handle, curl_lock_data data, void* userp) {
+
+    custosSession_t* session = userp;
+
+    (void) handle;
+
+    pthread_mutex_unlock(&session->shareLocks[data]);
+
+}
+
+static int setupShare(custosSession_t* session) {
+
+    int i;
+
+    for(i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&session->shareLocks[i], NULL);
+    }
+
+    session->share = curl_share_init();
+    if(!session->share) {
+        fprintf(stderr, "ERROR setupShare: curl_share_init() failed\n");
+        return RETURN_FAILURE;
+    }
+
+    if(curl_share_setopt(session->share, CURLSHOPT_LOCKFUNC, shareLock) ||
+       curl_share_setopt(session->share, CURLSHOPT_UNLOCKFUNC, shareUnlock) ||
+       curl_share_setopt(session->share, CURLSHOPT_USERDATA, session) ||
+       curl_share_setopt(session->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) ||
+       curl_share_setopt(session->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION)) {
+        fprintf(stderr, "ERROR setupShare: curl_share_setopt() failed\n");
+        return RETURN_FAILURE;
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x073900
+    /* Connection cache sharing arrived in libcurl 7.57.0 */
+    if(curl_share_setopt(session->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT)) {
+        fprintf(stderr, "ERROR setupShare: share CURL_LOCK_DATA_CONNECT failed\n");
+        return RETURN_FAILURE;
+    }
+#endif
+
+    return RETURN_SUCCESS;
+
+}
+
+static CURL* createHandle(custosSession_t* session) {
+
+    CURL* curl = NULL;
+
+    curl = curl_easy_init();
+    if(!curl) {
+        fprintf(stderr, "ERROR createHandle: curl_easy_init() failed\n");
+        return NULL;
+    }
+
+    if(curl_easy_setopt(curl, CURLOPT_SHARE, session->share) ||
+       curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L) ||
+       curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L) ||
+       curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, (long) KEEPALIVE_IDLE) ||
+       curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, (long) KEEPALIVE_IDLE)) {
+        fprintf(stderr, "ERROR createHandle: curl_easy_setopt() failed\n");
+        curl_easy_cleanup(curl);
+        return NULL;
+    }
+
+    return curl;
+
+}
+
+extern custosSession_t* custosSession_create(const char* url, const char* psk,
+                                             size_t slots) {
+
+    size_t i;
+    custosSession_t* session = NULL;
+
+    if(!url || !psk) {
+        fprintf(stderr, "ERROR custosSession_create: url and psk must not be NULL\n");
+        return NULL;
+    }
+    if(slots == 0) {
+        slots = CUSTOS_SESSION_SLOTS;
+    }
+
+    if(curl_global_init(CURL_GLOBAL_ALL)) {
+        fprintf(stderr, "ERROR custosSession_create: curl_global_init() failed\n");
+        return NULL;
+    }
+
+    session = calloc(1, sizeof(*session));
+    if(!session) {
+        fprintf(stderr, "ERROR custosSession_create: calloc failed\n");
+        goto CLEANUP_0;
+    }
+
+    session->url = strdup(url);
+    session->psk = strdup(psk);
+    if(!session->url || !session->psk) {
+        fprintf(stderr, "ERROR custosSession_create: strdup failed\n");
+        goto CLEANUP_1;
+    }
+
+    if(strncmp(url, CUSTOS_STANDIN_PREFIX, strlen(CUSTOS_STANDIN_PREFIX)) == 0) {
+        session->standin = custosStandin_create(url);
+        if(!session->standin) {
+            fprintf(stderr, "ERROR custosSession_create: custosStandin_create() failed\n");
+            goto CLEANUP_1;
+        }
+    }
+
+    if(setupShare(session) < 0) {
+        fprintf(stderr, "ERROR custosSession_create: setupShare() failed\n");
+        goto CLEANUP_1;
+    }
+
+    session->slots = calloc(slots, sizeof(*session->slots));
+    if(!session->slots) {
+        fprintf(stderr, "ERROR custosSession_create: calloc(slots) failed\n");
+        goto CLEANUP_1;
+    }
+    session->numSlots = slots;
+
+    for(i = 0; i < slots; i++) {
+        session->slots[i].curl = createHandle(session);
+        if(!session->slots[i].curl) {
+            fprintf(stderr, "ERROR custosSession_create: createHandle() failed\n");
+            goto CLEANUP_1;
+        }
+        session->slots[i].next = i + 1;
+    }
+    session->freeHead = 0;
+
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->freed, NULL);
+
+    return session;
+
+ CLEANUP_1:
+    for(i = 0; i < session->numSlots; i++) {
+        if(session->slots[i].curl) {
+            curl_easy_cleanup(session->slots[i].curl);
+        }
+    }
+    free(session->slots);
+    if(session->share) {
+        curl_share_cleanup(session->share);
+    }
+    custosStandin_destroy(session->standin);
+    free(session->url);
+    free(session->psk);
+    free(session);
+
+ CLEANUP_0:
+    curl_global_cleanup();
+    return NULL;
+
+}
+
+extern void custosSession_destroy(custosSession_t* session) {
+
+    size_t i;
+
+    if(!session) {
+        return;
+    }
+
+    pthread_mutex_lock(&session->lock);
+    while(session->inUse) {
+        pthread_cond_wait(&session->freed, &session->lock);
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    for(i = 0; i < session->numSlots; i++) {
+        curl_easy_cleanup(session->slots[i].curl);
+    }
+    curl_share_cleanup(session->share);
+    for(i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&session->shareLocks[i]);
+    }
+
+    pthread_cond_destroy(&session->freed);
+    pthread_mutex_destroy(&session->lock);
+    custosStandin_destroy(session->standin);
+    free(session->slots);
+    free(session->url);
+    free(session->psk);
+    free(session);
+
+    curl_global_cleanup();
+
+}
+
+extern const char* custosSession_url(const custosSession_t* session) {
+    return session->url;
+}
+
+extern const char* custosSession_psk(const custosSession_t* session) {
+    return session->psk;
+}
+
+static custosSlot_t* acquireSlot(custosSession_t* session) {
+
+    custosSlot_t* slot = NULL;
+
+    pthread_mutex_lock(&session->lock);
+
+    if(session->freeHead == session->numSlots) {
+        session->waits++;
+        while(session->freeHead == session->numSlots) {
+            pthread_cond_wait(&session->freed, &session->lock);
+        }
+    }
+    slot = &session->slots[session->freeHead];
+    session->freeHead = slot->next;
+    session->inUse++;
+    session->requests++;
+
+    pthread_mutex_unlock(&session->lock);
+
+    return slot;
+
+}
+
+static void releaseSlot(custosSession_t* session, custosSlot_t* slot) {
+
+    pthread_mutex_lock(&session->lock);
+
+    slot->next = session->freeHead;
+    session->freeHead = slot - session->slots;
+    session->inUse--;
+
+    pthread_mutex_unlock(&session->lock);
+    pthread_cond_broadcast(&session->freed);
+
+}
+
+/* Perform req using slot
+ * custos_getRes() opens and drives its own easy handle, so for now the
+ * slot bounds concurrency and the shared caches are primed for when
+ * libcustos can be pointed at slot->curl. */
+static custosRes_t* sendReq(custosSlot_t* slot, const custosReq_t* req) {
+
+    (void) slot;
+
+    return custos_getRes(req);
+
+}
+
+extern custosRes_t* custosSession_getRes(custosSession_t* session,
+                                         const custosReq_t* req) {
+
+    custosSlot_t* slot = NULL;
+    custosRes_t* res = NULL;
+
+    if(!session || !req) {
+        fprintf(stderr, "ERROR custosSession_getRes: arguments must not be NULL\n");
+        return NULL;
+    }
+    if(session->standin) {
+        fprintf(stderr, "ERROR custosSession_getRes: local session, use fetchLocal\n");
+        return NULL;
+    }
+
+    slot = acquireSlot(session);
+    res = sendReq(slot, req);
+    if(!res) {
+        __sync_fetch_and_add(&session->failures, 1);
+    }
+    releaseSlot(session, slot);
+
+    return res;
+
+}
+
+extern int custosSession_fetchLocal(custosSession_t* session, keyCache_t* cache,
+                                    const uuid_t* uuids, size_t num) {
+
+    int ret;
+    custosSlot_t* slot = NULL;
+
+    if(!session || !session->standin) {
+        fprintf(stderr, "ERROR custosSession_fetchLocal: not a local session\n");
+        return -EINVAL;
+    }
+
+    slot = acquireSlot(session);
+    ret = custosStandin_fetch(session->standin, cache, uuids, num);
+    if(ret < 0) {
+        __sync_fetch_and_add(&session->failures, 1);
+    }
+    releaseSlot(session, slot);
+
+    return ret;
+
+}
+
+extern custosStandin_t* custosSession_standin(custosSession_t* session) {
+    return session ? session->standin : NULL;
+}
+
+extern void custosSession_stats(custosSession_t* session,
+                                custosSessionStats_t* stats) {
+
+    if(!session || !stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&session->lock);
+    stats->requests = session->requests;
+    stats->failures = session->failures;
+    stats->waits = session->waits;
+    stats->slots = session->numSlots;
+    pthread_mutex_unlock(&session->lock);
+
+}
@@ -0,0 +1,90 @@
+/* custos-session.h
+ * Long-lived custos client session shared by all FUSE threads
+ *
+ * A session is created once per mount (from the FUSE init callback) and
+ * holds the server URL and PSK along with a pool of request slots. Each
+ * slot owns a libcurl easy handle; all handles share one connection,
+ * DNS and TLS session cache, so a connection to the custos server can
+ * stay alive between key fetches. Threads take a free slot for the
+ * duration of a request, so concurrent fetches proceed in parallel up to
+ * the pool size instead of serializing on a single handle.
+ *
+ * A URL starting with "local:" puts the session in front of an in-process
+ * stand-in server instead (see custos-standin.h); requests still go
+ * through the slot pool, so concurrency behaves as it would on the wire.
+ *
+ * Note: custos_getRes() still drives the transfer on a handle of its own;
+ * the slot handles only carry the connection once libcustos can be given
+ * one (see sendReq() in custos-session.c).
+ *
+ */
+
+#ifndef CUSTOS_SESSION_H
+#define CUSTOS_SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <curl/curl.h>
+
+#include "custos-standin.h"
+#include "key-cache.h"
+#include "libcustos/custos_client.h"
+
+/* Request slots per session unless told otherwise */
+#define CUSTOS_SESSION_SLOTS 8
+
+typedef struct custosSession custosSession_t;
+
+typedef struct custosSessionStats {
+    uint64_t requests;
+    uint64_t failures;
+    uint64_t waits;     /* requests that found every slot busy */
+    size_t   slots;
+} custosSessionStats_t;
+
+/* custosSession_t* custosSession_create(const char* url, const char* psk,
+ *                                       size_t slots)
+ *
+ * Purpose: Initialize libcurl and create a session with slots request slots
+ *          (CUSTOS_SESSION_SLOTS if 0) talking to the server at url,
+ *          or to a stand-in if url starts with CUSTOS_STANDIN_PREFIX
+ *
+ * Return: New session on success, NULL on error
+ */
+extern custosSession_t* custosSession_create(const char* url, const char* psk,
+                                             size_t slots);
+
+/* Waits for in-flight requests, then releases libcurl */
+extern void custosSession_destroy(custosSession_t* session);
+
+extern const char* custosSession_url(const custosSession_t* session);
+extern const char* custosSession_psk(const custosSession_t* session);
+
+/* custosRes_t* custosSession_getRes(custosSession_t* session,
+ *                                   const custosReq_t* req)
+ *
+ * Purpose: Send req on a free slot and return the server's response,
+ *          blocking while all slots are busy
+ *
+ * Return: Response on success (free with custos_destroyRes), NULL on error
+ */
+extern custosRes_t* custosSession_getRes(custosSession_t* session,
+                                         const custosReq_t* req);
+
+/* int custosSession_fetchLocal(custosSession_t* session, keyCache_t* cache,
+ *                              const uuid_t* uuids, size_t num)
+ *
+ * Purpose: custosStandin_fetch() on a free slot, for local sessions
+ *
+ * Return: Number of keys added on success, negative errno on error
+ */
+extern int custosSession_fetchLocal(custosSession_t* session, keyCache_t* cache,
+                                    const uuid_t* uuids, size_t num);
+
+/* Stand-in behind a local session, NULL for a real server */
+extern custosStandin_t* custosSession_standin(custosSession_t* session);
+
+extern void custosSession_stats(custosSession_t* session,
+                                custosSessionStats_t* stats);
+
+#endif
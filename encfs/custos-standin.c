@@ -0,0 +1,246 @@
+/* custos-standin.c
+ * In-process stand-in for a custos server, for offline testing
+ *
+ */
+
+#include "custos-standin.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+#define SETTINGBUFSIZE 256
+#define STANDIN_KEYBUFSIZE 64
+
+struct custosStandin {
+    long     latencyMS;
+    long     jitterMS;
+    double   errorRate;
+    double   denyRate;
+
+    pthread_mutex_t lock;
+    uint64_t rng;
+
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t keys;
+    uint64_t denied;
+};
+
+static uint64_t mix64(uint64_t x) {
+
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+
+}
+
+/* Uniform double in [0, 1) from the shared generator */
+static double nextRandom(custosStandin_t* standin) {
+
+    uint64_t x;
+
+    pthread_mutex_lock(&standin->lock);
+    standin->rng += 0x9e3779b97f4a7c15ULL;
+    x = mix64(standin->rng);
+    pthread_mutex_unlock(&standin->lock);
+
+    return (x >> 11) * (1.0 / 9007199254740992.0);
+
+}
+
+/* Fixed per-key value in [0, 1), so deny decisions are stable */
+static double keyRandom(const uuid_t uuid) {
+
+    uint64_t lo;
+    uint64_t hi;
+
+    memcpy(&lo, uuid, sizeof(lo));
+    memcpy(&hi, uuid + sizeof(lo), sizeof(hi));
+
+    return (mix64(lo ^ mix64(hi)) >> 11) * (1.0 / 9007199254740992.0);
+
+}
+
+static int parseSetting(custosStandin_t* standin, const char* setting) {
+
+    char* end = NULL;
+    const char* value = NULL;
+
+    value = strchr(setting, '=');
+    if(!value) {
+        fprintf(stderr, "ERROR parseSetting: '%s' is not name=value\n", setting);
+        return -EINVAL;
+    }
+    value++;
+
+    if(strncmp(setting, "latency=", 8) == 0) {
+        standin->latencyMS = strtol(value, &end, 10);
+    }
+    else if(strncmp(setting, "jitter=", 7) == 0) {
+        standin->jitterMS = strtol(value, &end, 10);
+    }
+    else if(strncmp(setting, "error=", 6) == 0) {
+        standin->errorRate = strtod(value, &end);
+    }
+    else if(strncmp(setting, "deny=", 5) == 0) {
+        standin->denyRate = strtod(value, &end);
+    }
+    else if(strncmp(setting, "seed=", 5) == 0) {
+        standin->rng = strtoull(value, &end, 10);
+    }
+    else {
+        fprintf(stderr, "ERROR parseSetting: unknown setting '%s'\n", setting);
+        return -EINVAL;
+    }
+
+    if(end == value || *end != '\0') {
+        fprintf(stderr, "ERROR parseSetting: bad value in '%s'\n", setting);
+        return -EINVAL;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+extern custosStandin_t* custosStandin_create(const char* url) {
+
+    size_t length;
+    char buf[SETTINGBUFSIZE];
+    char* setting = NULL;
+    char* save = NULL;
+    custosStandin_t* standin = NULL;
+
+    if(!url || strncmp(url, CUSTOS_STANDIN_PREFIX, strlen(CUSTOS_STANDIN_PREFIX))) {
+        fprintf(stderr, "ERROR custosStandin_create: url must start with %s\n",
+                CUSTOS_STANDIN_PREFIX);
+        return NULL;
+    }
+
+    length = snprintf(buf, sizeof(buf), "%s", url + strlen(CUSTOS_STANDIN_PREFIX));
+    if(length > (sizeof(buf) - 1)) {
+        fprintf(stderr, "ERROR custosStandin_create: url too long\n");
+        return NULL;
+    }
+
+    standin = calloc(1, sizeof(*standin));
+    if(!standin) {
+        fprintf(stderr, "ERROR custosStandin_create: calloc failed\n");
+        return NULL;
+    }
+    standin->rng = 1;
+
+    for(setting = strtok_r(buf, ":", &save); setting;
+        setting = strtok_r(NULL, ":", &save)) {
+        if(parseSetting(standin, setting) < 0) {
+            free(standin);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&standin->lock, NULL);
+
+    fprintf(stderr, "INFO custosStandin_create: latency %ldms jitter %ldms "
+            "error %g deny %g\n", standin->latencyMS, standin->jitterMS,
+            standin->errorRate, standin->denyRate);
+
+    return standin;
+
+}
+
+extern void custosStandin_destroy(custosStandin_t* standin) {
+
+    if(!standin) {
+        return;
+    }
+
+    pthread_mutex_destroy(&standin->lock);
+    free(standin);
+
+}
+
+static void simulateLatency(custosStandin_t* standin) {
+
+    long delayMS = standin->latencyMS;
+    struct timespec ts;
+
+    if(standin->jitterMS > 0) {
+        delayMS += (long) (nextRandom(standin) * (standin->jitterMS + 1));
+    }
+    if(delayMS <= 0) {
+        return;
+    }
+
+    ts.tv_sec = delayMS / 1000;
+    ts.tv_nsec = (delayMS % 1000) * 1000000L;
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        continue;
+    }
+
+}
+
+extern int custosStandin_fetch(custosStandin_t* standin, keyCache_t* cache,
+                               const uuid_t* uuids, size_t num) {
+
+    size_t i;
+    int stored = 0;
+    int length;
+    char uuidStr[37];
+    char key[STANDIN_KEYBUFSIZE];
+
+    if(!standin || !cache || (!uuids && num)) {
+        fprintf(stderr, "ERROR custosStandin_fetch: arguments must not be NULL\n");
+        return -EINVAL;
+    }
+
+    __sync_fetch_and_add(&standin->requests, 1);
+    simulateLatency(standin);
+
+    if(standin->errorRate > 0 && nextRandom(standin) < standin->errorRate) {
+        __sync_fetch_and_add(&standin->errors, 1);
+        fprintf(stderr, "ERROR custosStandin_fetch: simulated request failure\n");
+        return -EIO;
+    }
+
+    for(i = 0; i < num; i++) {
+        if(standin->denyRate > 0 && keyRandom(uuids[i]) < standin->denyRate) {
+            __sync_fetch_and_add(&standin->denied, 1);
+            continue;
+        }
+        uuid_unparse_lower(uuids[i], uuidStr);
+        length = snprintf(key, sizeof(key), "standin-%s", uuidStr);
+        if(keycache_put(cache, uuids[i], (uint8_t*) key, length) < 0) {
+            fprintf(stderr, "ERROR custosStandin_fetch: keycache_put() failed\n");
+            continue;
+        }
+        stored++;
+    }
+    __sync_fetch_and_add(&standin->keys, stored);
+
+    return stored;
+
+}
+
+extern void custosStandin_stats(custosStandin_t* standin,
+                                custosStandinStats_t* stats) {
+
+    if(!standin || !stats) {
+        return;
+    }
+
+    stats->requests = __sync_fetch_and_add(&standin->requests, 0);
+    stats->errors = __sync_fetch_and_add(&standin->errors, 0);
+    stats->keys = __sync_fetch_and_add(&standin->keys, 0);
+    stats->denied = __sync_fetch_and_add(&standin->denied, 0);
+
+}
@@ -0,0 +1,66 @@
+/* custos-standin.h
+ * In-process stand-in for a custos server, for offline testing
+ *
+ * A session whose URL starts with "local:" answers key requests from
+ * here instead of the network. The rest of the URL is a ':' separated
+ * list of settings (',' is taken by the FUSE -o parser):
+ *
+ *   latency=MS    delay added to every request (default 0)
+ *   jitter=MS     extra random delay, 0..MS, per request (default 0)
+ *   error=P       probability a whole request fails (default 0)
+ *   deny=P        fraction of keys the server refuses (default 0);
+ *                 chosen from the key UUID, so a refused key stays refused
+ *   seed=N        seed for latency jitter and errors (default 1)
+ *
+ * e.g. -o custos,custos_url=local:latency=20:jitter=5:error=0.01
+ *
+ * Keys are derived from the UUID, so files written under one mount
+ * decrypt under the next.
+ *
+ */
+
+#ifndef CUSTOS_STANDIN_H
+#define CUSTOS_STANDIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uuid/uuid.h>
+
+#include "key-cache.h"
+
+#define CUSTOS_STANDIN_PREFIX "local:"
+
+typedef struct custosStandin custosStandin_t;
+
+typedef struct custosStandinStats {
+    uint64_t requests;
+    uint64_t errors;    /* requests failed by the error setting */
+    uint64_t keys;      /* keys returned */
+    uint64_t denied;    /* keys refused by the deny setting */
+} custosStandinStats_t;
+
+/* custosStandin_t* custosStandin_create(const char* url)
+ *
+ * Purpose: Create a stand-in from a "local:..." URL
+ *
+ * Return: New stand-in on success, NULL on error or unknown setting
+ */
+extern custosStandin_t* custosStandin_create(const char* url);
+
+extern void custosStandin_destroy(custosStandin_t* standin);
+
+/* int custosStandin_fetch(custosStandin_t* standin, keyCache_t* cache,
+ *                         const uuid_t* uuids, size_t num)
+ *
+ * Purpose: Answer one request for uuids[0..num) and add the granted keys
+ *          to cache, as the server would
+ *
+ * Return: Number of keys added on success, -EIO on a failed request
+ */
+extern int custosStandin_fetch(custosStandin_t* standin, keyCache_t* cache,
+                               const uuid_t* uuids, size_t num);
+
+extern void custosStandin_stats(custosStandin_t* standin,
+                                custosStandinStats_t* stats);
+
+#endif
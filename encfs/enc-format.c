@@ -0,0 +1,535 @@
+/* enc-format.c
+ * Backing file formats, and dispatch between them
+ *
+ * The chunked entry wraps chunk-crypt.c. The legacy entry is the one
+ * fuseenc_fh used to open-code: decryption through aes-crypt's FILE*
+ * interface, and a size found from the CBC padding in the last block
+ * instead of by decrypting the whole file.
+ *
+ * The envelope entry is chunk-crypt.c under the file's data key: each
+ * operation finds it from the wrapped form in the header (through the key
+ * cache, if set), or for a file that has none yet makes one.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "enc-format.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+#define LEGACY_BLOCKSIZE 16
+
+/* Open envelope file: its stream holds the data key's contexts, dataKey
+ * the reference that keeps the key itself */
+typedef struct envelopeHandle {
+    chunkStream_t* stream;
+    keyHandle_t*   dataKey;
+} envelopeHandle_t;
+
+static keyCache_t* dataKeys = NULL;
+
+static uint32_t getLE32(const unsigned char* p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+        ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Legacy: the plain size is the ciphertext's less the PKCS#7 padding,
+ * which the last block holds; CBC needs only the block before it (or
+ * the key's IV) to decrypt it */
+static int legacySize(int encFD, const cryptKey_t* key, uint64_t* size) {
+
+    int ret = RETURN_SUCCESS;
+    int len;
+    int finalLen;
+    struct stat st;
+    unsigned char blocks[2 * LEGACY_BLOCKSIZE];
+    unsigned char out[2 * LEGACY_BLOCKSIZE];
+    const unsigned char* iv;
+    EVP_CIPHER_CTX* ctx = NULL;
+
+    if(fstat(encFD, &st) < 0) {
+        return -errno;
+    }
+    if(st.st_size < LEGACY_BLOCKSIZE || st.st_size % LEGACY_BLOCKSIZE) {
+        fprintf(stderr, "ERROR legacySize: %jd bytes is no CBC file\n",
+                (intmax_t) st.st_size);
+        return -EIO;
+    }
+
+    if(st.st_size == LEGACY_BLOCKSIZE) {
+        if(pread(encFD, blocks + LEGACY_BLOCKSIZE, LEGACY_BLOCKSIZE, 0) !=
+           LEGACY_BLOCKSIZE) {
+            return -EIO;
+        }
+        iv = key->iv;
+    }
+    else {
+        if(pread(encFD, blocks, sizeof(blocks),
+                 st.st_size - sizeof(blocks)) != sizeof(blocks)) {
+            return -EIO;
+        }
+        iv = blocks;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx ||
+       !EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->key, iv) ||
+       !EVP_DecryptUpdate(ctx, out, &len, blocks + LEGACY_BLOCKSIZE,
+                          LEGACY_BLOCKSIZE) ||
+       !EVP_DecryptFinal_ex(ctx, out + len, &finalLen)) {
+        fprintf(stderr, "ERROR legacySize: bad padding\n");
+        ret = -EIO;
+    }
+    else {
+        *size = st.st_size - LEGACY_BLOCKSIZE + len + finalLen;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ret;
+
+}
+
+/* Legacy: decrypt the whole file through aes-crypt's FILE* interface */
+static int legacyDecrypt(int encFD, int clearFD, const cryptKey_t* key) {
+
+    int ret;
+    int fd;
+    FILE* encFP = NULL;
+    FILE* clearFP = NULL;
+
+    if(lseek(encFD, 0, SEEK_SET) < 0 || lseek(clearFD, 0, SEEK_SET) < 0 ||
+       ftruncate(clearFD, 0) < 0) {
+        perror("ERROR legacyDecrypt");
+        return -errno;
+    }
+
+    fd = dup(encFD);
+    if(fd < 0 || !(encFP = fdopen(fd, "r"))) {
+        perror("ERROR legacyDecrypt: encFD");
+        ret = -errno;
+        if(fd >= 0) {
+            close(fd);
+        }
+        return ret;
+    }
+    fd = dup(clearFD);
+    if(fd < 0 || !(clearFP = fdopen(fd, "w"))) {
+        perror("ERROR legacyDecrypt: clearFD");
+        ret = -errno;
+        if(fd >= 0) {
+            close(fd);
+        }
+        fclose(encFP);
+        return ret;
+    }
+
+    ret = RETURN_SUCCESS;
+    if(crypt_decryptKey(encFP, clearFP, key) < 0) {
+        fprintf(stderr, "ERROR legacyDecrypt: crypt_decryptKey() failed\n");
+        ret = -EIO;
+    }
+    if(fclose(clearFP) != 0 && ret == RETURN_SUCCESS) {
+        perror("ERROR legacyDecrypt: fclose");
+        ret = -errno;
+    }
+    fclose(encFP);
+
+    /* The FILE*s shared the offsets; leave them where callers expect */
+    lseek(encFD, 0, SEEK_SET);
+    lseek(clearFD, 0, SEEK_SET);
+
+    return ret;
+
+}
+
+static int chunkedSize(int encFD, const cryptKey_t* key, uint64_t* size) {
+
+    int ret;
+    chunkHeader_t hdr;
+
+    (void) key;
+
+    ret = chunk_readHeader(encFD, &hdr);
+    if(ret <= 0) {
+        return ret ? ret : -EINVAL;
+    }
+    *size = hdr.plainSize;
+
+    return RETURN_SUCCESS;
+
+}
+
+static int chunkedOpen(int encFD, const cryptKey_t* key, void** handle) {
+
+    int ret;
+    chunkStream_t* stream = NULL;
+
+    ret = chunk_streamOpen(encFD, key, &stream);
+    if(ret <= 0) {
+        return ret ? ret : -EINVAL;
+    }
+    *handle = stream;
+
+    return RETURN_SUCCESS;
+
+}
+
+static ssize_t chunkedRead(void* handle, char* buf, size_t size,
+                           uint64_t offset) {
+    return chunk_streamRead(handle, buf, size, offset);
+}
+
+static ssize_t chunkedWrite(void* handle, const char* buf, size_t size,
+                            uint64_t offset) {
+    return chunk_streamWrite(handle, buf, size, offset);
+}
+
+static int chunkedTruncate(void* handle, uint64_t size) {
+    return chunk_streamTruncate(handle, size);
+}
+
+static uint64_t chunkedHandleSize(void* handle) {
+    return chunk_streamSize(handle);
+}
+
+static int chunkedFlush(void* handle) {
+    return chunk_streamFlush(handle);
+}
+
+static int chunkedClose(void* handle) {
+    return chunk_streamClose(handle);
+}
+
+/* Is slot, a wrapped form from a header, set */
+static int hasWrapped(const unsigned char* slot) {
+
+    static const unsigned char zeros[CRYPT_WRAPSIZE];
+
+    return memcmp(slot, zeros, CRYPT_WRAPSIZE) != 0;
+
+}
+
+/* Envelope: the data key of the file on encFD, wrapped under key in
+ * either slot of its header. A file without one (empty, or in another
+ * format) gets a new one if create is set, and otherwise *dataKey is
+ * NULL. */
+static int findDataKey(int encFD, const cryptKey_t* key, int create,
+                       keyHandle_t** dataKey) {
+
+    int ret;
+    chunkHeader_t hdr;
+
+    *dataKey = NULL;
+
+    ret = chunk_readHeader(encFD, &hdr);
+    if(ret < 0) {
+        return ret;
+    }
+
+    if(ret > 0 && hdr.version == CHUNK_VERSION_WRAPPED) {
+        *dataKey = keycache_acquireData(dataKeys, key, hdr.wrapped);
+        if(!*dataKey && hasWrapped(hdr.spare)) {
+            /* Moved to key by a rewrap cut short */
+            *dataKey = keycache_acquireData(dataKeys, key, hdr.spare);
+        }
+        if(!*dataKey) {
+            fprintf(stderr, "ERROR findDataKey: data key is not under "
+                    "the file's key\n");
+            return -EIO;
+        }
+    }
+    else if(create) {
+        *dataKey = keycache_createData(dataKeys, key);
+        if(!*dataKey) {
+            fprintf(stderr, "ERROR findDataKey: keycache_createData failed\n");
+            return -EIO;
+        }
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Envelope: only files with a data key, or empty ones, are detected as
+ * envelope files, and nothing in an empty one needs a key */
+static int envelopeDecrypt(int encFD, int clearFD, const cryptKey_t* key) {
+
+    int ret;
+    keyHandle_t* dataKey = NULL;
+
+    ret = findDataKey(encFD, key, 0, &dataKey);
+    if(ret < 0) {
+        return ret;
+    }
+    ret = chunk_decrypt(encFD, clearFD, dataKey ? dataKey->crypt : key);
+    keycache_release(dataKey);
+
+    return ret;
+
+}
+
+static int envelopeDecryptRange(int encFD, int clearFD, const cryptKey_t* key,
+                                uint64_t offset, uint64_t length) {
+
+    int ret;
+    keyHandle_t* dataKey = NULL;
+
+    ret = findDataKey(encFD, key, 0, &dataKey);
+    if(ret < 0) {
+        return ret;
+    }
+    ret = chunk_decryptRange(encFD, clearFD, dataKey ? dataKey->crypt : key,
+                             offset, length);
+    keycache_release(dataKey);
+
+    return ret;
+
+}
+
+/* Envelope: a file saved without a data key (new, legacy or chunked
+ * under key itself) gets one, and chunk_update then rewrites it whole */
+static int envelopeSave(int clearFD, int encFD, const cryptKey_t* key,
+                        const chunkMap_t* dirty) {
+
+    int ret;
+    keyHandle_t* dataKey = NULL;
+
+    ret = findDataKey(encFD, key, 1, &dataKey);
+    if(ret < 0) {
+        return ret;
+    }
+    ret = chunk_update(clearFD, encFD, dataKey->crypt, dirty);
+    keycache_release(dataKey);
+
+    return ret;
+
+}
+
+/* Envelope: a file without a data key yet is rewritten whole */
+static int envelopeSaveWhole(int encFD, const cryptKey_t* key,
+                             const chunkMap_t* dirty) {
+
+    int ret;
+    keyHandle_t* dataKey = NULL;
+
+    ret = findDataKey(encFD, key, 0, &dataKey);
+    if(ret < 0) {
+        return ret;
+    }
+    ret = dataKey ? chunk_updatesWhole(encFD, dataKey->crypt, dirty) : 1;
+    keycache_release(dataKey);
+
+    return ret;
+
+}
+
+static int envelopeOpen(int encFD, const cryptKey_t* key, void** handle) {
+
+    int ret;
+    envelopeHandle_t* h = NULL;
+
+    h = calloc(1, sizeof(*h));
+    if(!h) {
+        fprintf(stderr, "ERROR envelopeOpen: calloc failed\n");
+        return -ENOMEM;
+    }
+
+    ret = findDataKey(encFD, key, 1, &h->dataKey);
+    if(ret < 0) {
+        free(h);
+        return ret;
+    }
+    ret = chunkedOpen(encFD, h->dataKey->crypt, (void**) &h->stream);
+    if(ret < 0) {
+        keycache_release(h->dataKey);
+        free(h);
+        return ret;
+    }
+    *handle = h;
+
+    return RETURN_SUCCESS;
+
+}
+
+static ssize_t envelopeRead(void* handle, char* buf, size_t size,
+                            uint64_t offset) {
+    return chunk_streamRead(((envelopeHandle_t*) handle)->stream, buf, size,
+                            offset);
+}
+
+static ssize_t envelopeWrite(void* handle, const char* buf, size_t size,
+                             uint64_t offset) {
+    return chunk_streamWrite(((envelopeHandle_t*) handle)->stream, buf, size,
+                             offset);
+}
+
+static int envelopeTruncate(void* handle, uint64_t size) {
+    return chunk_streamTruncate(((envelopeHandle_t*) handle)->stream, size);
+}
+
+static uint64_t envelopeHandleSize(void* handle) {
+    return chunk_streamSize(((envelopeHandle_t*) handle)->stream);
+}
+
+static int envelopeFlush(void* handle) {
+    return chunk_streamFlush(((envelopeHandle_t*) handle)->stream);
+}
+
+static int envelopeClose(void* handle) {
+
+    int ret;
+    envelopeHandle_t* h = handle;
+
+    ret = chunk_streamClose(h->stream);
+    keycache_release(h->dataKey);
+    free(h);
+
+    return ret;
+
+}
+
+/* Envelope: the data key is rewrapped, not the file re-encrypted */
+static int envelopeRewrap(int encFD, const cryptKey_t* from,
+                          const cryptKey_t* to, int stage) {
+
+    int ret;
+    chunkHeader_t hdr;
+    unsigned char wrapped[CRYPT_WRAPSIZE];
+
+    ret = chunk_readHeader(encFD, &hdr);
+    if(ret < 0) {
+        return ret;
+    }
+    if(ret == 0 || hdr.version != CHUNK_VERSION_WRAPPED) {
+        fprintf(stderr, "ERROR envelopeRewrap: file has no data key\n");
+        return -EINVAL;
+    }
+
+    if(crypt_rewrapDataKey(from, to, hdr.wrapped, wrapped) < 0 &&
+       (!hasWrapped(hdr.spare) ||
+        crypt_rewrapDataKey(from, to, hdr.spare, wrapped) < 0)) {
+        fprintf(stderr, "ERROR envelopeRewrap: crypt_rewrapDataKey failed\n");
+        return -EIO;
+    }
+
+    return stage ? chunk_stageWrap(encFD, wrapped) : chunk_rewrap(encFD, wrapped);
+
+}
+
+static const encFormat_t formats[ENCFORMAT_COUNT] = {
+    [ENCFORMAT_LEGACY] = {
+        .id         = ENCFORMAT_LEGACY,
+        .name       = "legacy",
+        .magic      = NULL,
+        .version    = 0,
+        .sizeKeyed  = 1,
+        .size       = legacySize,
+        .decrypt    = legacyDecrypt,
+    },
+    [ENCFORMAT_CHUNKED] = {
+        .id         = ENCFORMAT_CHUNKED,
+        .name       = "chunked",
+        .magic      = CHUNK_MAGIC,
+        .version    = CHUNK_VERSION,
+        .size       = chunkedSize,
+        .decrypt    = chunk_decrypt,
+        .decryptRange = chunk_decryptRange,
+        .save       = chunk_update,
+        .saveWhole  = chunk_updatesWhole,
+        .open       = chunkedOpen,
+        .read       = chunkedRead,
+        .write      = chunkedWrite,
+        .truncate   = chunkedTruncate,
+        .handleSize = chunkedHandleSize,
+        .flush      = chunkedFlush,
+        .close      = chunkedClose,
+    },
+    [ENCFORMAT_ENVELOPE] = {
+        .id         = ENCFORMAT_ENVELOPE,
+        .name       = "envelope",
+        .magic      = CHUNK_MAGIC,
+        .version    = CHUNK_VERSION_WRAPPED,
+        .size       = chunkedSize,
+        .decrypt    = envelopeDecrypt,
+        .decryptRange = envelopeDecryptRange,
+        .save       = envelopeSave,
+        .saveWhole  = envelopeSaveWhole,
+        .open       = envelopeOpen,
+        .read       = envelopeRead,
+        .write      = envelopeWrite,
+        .truncate   = envelopeTruncate,
+        .handleSize = envelopeHandleSize,
+        .flush      = envelopeFlush,
+        .close      = envelopeClose,
+        .rewrap     = envelopeRewrap,
+    },
+};
+
+extern int encformat_detect(int encFD, const encFormat_t** format) {
+
+    int i;
+    int known = 0;
+    ssize_t got;
+    uint32_t version;
+    unsigned char id[ENCFORMAT_IDSIZE];
+
+    do {
+        got = pread(encFD, id, sizeof(id), 0);
+    } while(got < 0 && errno == EINTR);
+    if(got < 0) {
+        perror("ERROR encformat_detect: pread");
+        return -errno;
+    }
+
+    if(got == 0) {
+        *format = encformat_writer();
+        return RETURN_SUCCESS;
+    }
+
+    if(got == (ssize_t) sizeof(id)) {
+        version = getLE32(id + ENCFORMAT_MAGICSIZE);
+        for(i = 0; i < ENCFORMAT_COUNT; i++) {
+            if(!formats[i].magic ||
+               memcmp(id, formats[i].magic, ENCFORMAT_MAGICSIZE) != 0) {
+                continue;
+            }
+            known = 1;
+            if(formats[i].version == version) {
+                *format = &formats[i];
+                return RETURN_SUCCESS;
+            }
+        }
+        if(known) {
+            fprintf(stderr, "ERROR encformat_detect: unsupported version %u\n",
+                    version);
+            return -EINVAL;
+        }
+    }
+
+    *format = &formats[ENCFORMAT_LEGACY];
+    return RETURN_SUCCESS;
+
+}
+
+extern const encFormat_t* encformat_writer(void) {
+    return &formats[ENCFORMAT_ENVELOPE];
+}
+
+extern const encFormat_t* encformat_get(encFormatID_t id) {
+    return (id < ENCFORMAT_COUNT) ? &formats[id] : NULL;
+}
+
+extern void encformat_setKeyCache(keyCache_t* cache) {
+    dataKeys = cache;
+}
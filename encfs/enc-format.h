@@ -0,0 +1,121 @@
+/* enc-format.h
+ * Backing file formats, and dispatch between them
+ *
+ * A backing file names its format in its first bytes: an 8-byte magic
+ * and a little-endian 32-bit version. Each format known here has an
+ * entry in one table, giving the same set of operations: size, decrypt
+ * into a clear copy, save a clear copy, and (where the format allows it)
+ * decrypt ranges of a clear copy, and read and write directly without
+ * one. fuseenc_fh goes through these, so trees can mix formats and a new
+ * format is one more entry.
+ *
+ * Files with no known magic are in the legacy whole-file CBC format of
+ * aes-crypt.h, which can be read but not saved: files are always saved
+ * in the write format (encformat_writer), so legacy and older chunked
+ * files are upgraded as they are written. An empty file is empty in the
+ * write format.
+ *
+ * The write format is envelope encryption: chunked files under a random
+ * data key per file, kept in the header wrapped under the file's key.
+ * Formats like it can move a file to another key by rewrapping, without
+ * touching its data.
+ *
+ * Compression is not a format of its own; the chunked format records a
+ * codec per chunk (chunk-crypt.h).
+ *
+ */
+
+#ifndef ENC_FORMAT_H
+#define ENC_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+#include "chunk-crypt.h"
+#include "key-cache.h"
+
+#define ENCFORMAT_MAGICSIZE 8
+#define ENCFORMAT_IDSIZE    (ENCFORMAT_MAGICSIZE + 4)
+
+typedef enum encFormatID {
+    ENCFORMAT_LEGACY = 0,   /* whole-file AES-256-CBC */
+    ENCFORMAT_CHUNKED,      /* chunk-crypt.h, CHUNK_VERSION */
+    ENCFORMAT_ENVELOPE,     /* chunk-crypt.h, CHUNK_VERSION_WRAPPED */
+    ENCFORMAT_COUNT
+} encFormatID_t;
+
+typedef struct encFormat {
+    encFormatID_t id;
+    const char*   name;
+    const char*   magic;    /* ENCFORMAT_MAGICSIZE bytes; NULL for legacy */
+    uint32_t      version;
+
+    /* Plain text size of the file on encFD; key may be NULL unless
+     * sizeKeyed is set */
+    int      sizeKeyed;
+    int      (*size)(int encFD, const cryptKey_t* key, uint64_t* size);
+
+    /* Replace clearFD's contents with the plain text of encFD */
+    int      (*decrypt)(int encFD, int clearFD, const cryptKey_t* key);
+
+    /* Write only plain bytes [offset, offset + length) of encFD to their
+     * place in clearFD, leaving its holes there; NULL if the format can
+     * only be decrypted whole */
+    int      (*decryptRange)(int encFD, int clearFD, const cryptKey_t* key,
+                             uint64_t offset, uint64_t length);
+
+    /* Write clearFD to encFD in this format, only the chunks in dirty
+     * (all if NULL) where the format can; NULL if files can't be
+     * saved in this format */
+    int      (*save)(int clearFD, int encFD, const cryptKey_t* key,
+                     const chunkMap_t* dirty);
+
+    /* Would save read all of clearFD, not just the chunks in dirty and
+     * the one at the file's old end: 1 if so, 0 if not, negative errno */
+    int      (*saveWhole)(int encFD, const cryptKey_t* key,
+                          const chunkMap_t* dirty);
+
+    /* Direct access: open a handle on encFD that reads and writes plain
+     * bytes in place. open is NULL if the format has no direct access. */
+    int      (*open)(int encFD, const cryptKey_t* key, void** handle);
+    ssize_t  (*read)(void* handle, char* buf, size_t size, uint64_t offset);
+    ssize_t  (*write)(void* handle, const char* buf, size_t size,
+                      uint64_t offset);
+    int      (*truncate)(void* handle, uint64_t size);
+    uint64_t (*handleSize)(void* handle);
+    int      (*flush)(void* handle);
+    int      (*close)(void* handle);     /* flushes; encFD stays open */
+
+    /* Move the file on encFD from key from to key to in place, without
+     * re-encrypting it; NULL if the format can't. With stage set, the
+     * file is only made readable under to as well, until a rewrap
+     * without it: sync in between, and the move survives a crash. */
+    int      (*rewrap)(int encFD, const cryptKey_t* from, const cryptKey_t* to,
+                       int stage);
+} encFormat_t;
+
+/* int encformat_detect(int encFD, const encFormat_t** format)
+ *
+ * Purpose: Find the format of the backing file open on encFD
+ *
+ * Return: 0 and *format set on success, -EINVAL if the file has a known
+ *         magic but a version this build can't read, negative errno on
+ *         other errors
+ */
+extern int encformat_detect(int encFD, const encFormat_t** format);
+
+/* The format files are saved and created in */
+extern const encFormat_t* encformat_writer(void);
+
+extern const encFormat_t* encformat_get(encFormatID_t id);
+
+/* void encformat_setKeyCache(keyCache_t* cache)
+ *
+ * Purpose: Keep the data keys of files in cache from now on (NULL: unwrap
+ *          them for each operation). Set before any format is used.
+ */
+extern void encformat_setKeyCache(keyCache_t* cache);
+
+#endif
@@ -0,0 +1,292 @@
+/* enc-loadtest.c
+ * Concurrent open/read/close load generator for a mounted encrypted FS
+ *
+ * Creates a set of files under <dir>/loadtest, lists the directory once
+ * (so the FS can prefetch keys), then has several threads open, read and
+ * close random files for a fixed time. Reports throughput and open and
+ * close latency percentiles. See loadtest.sh for a driver that mounts
+ * fuseenc_fh against the local custos stand-in.
+ *
+ * Usage: enc-loadtest [-t threads] [-n files] [-s size] [-d seconds] <dir>
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATHBUFSIZE 1024
+#define READBUFSIZE 65536
+#define SUBDIR "loadtest"
+
+typedef struct samples {
+    uint64_t* vals;
+    size_t    num;
+    size_t    cap;
+} samples_t;
+
+typedef struct worker {
+    pthread_t    thread;
+    unsigned int seed;
+    uint64_t     errors;
+    samples_t    open;
+    samples_t    close;
+} worker_t;
+
+static char     dirPath[PATHBUFSIZE - 64];
+static int      numFiles  = 256;
+static size_t   fileSize  = 4096;
+static double   duration  = 5.0;
+static volatile int stop  = 0;
+
+static uint64_t nowNS(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static int addSample(samples_t* s, uint64_t val) {
+
+    uint64_t* tmp = NULL;
+
+    if(s->num == s->cap) {
+        s->cap = s->cap ? (s->cap * 2) : 1024;
+        tmp = realloc(s->vals, s->cap * sizeof(*s->vals));
+        if(!tmp) {
+            return -ENOMEM;
+        }
+        s->vals = tmp;
+    }
+    s->vals[s->num++] = val;
+
+    return 0;
+
+}
+
+static int cmpU64(const void* a, const void* b) {
+
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+
+    return (x > y) - (x < y);
+
+}
+
+static void report(const char* name, samples_t* s) {
+
+    if(s->num == 0) {
+        printf("%-6s no samples\n", name);
+        return;
+    }
+
+    qsort(s->vals, s->num, sizeof(*s->vals), cmpU64);
+    printf("%-6s n %-8zu p50 %8.1fus  p90 %8.1fus  p99 %8.1fus  max %8.1fus\n",
+           name, s->num,
+           s->vals[s->num / 2] / 1000.0,
+           s->vals[(s->num * 9) / 10] / 1000.0,
+           s->vals[(s->num * 99) / 100] / 1000.0,
+           s->vals[s->num - 1] / 1000.0);
+
+}
+
+static void buildFilePath(char* buf, size_t size, int i) {
+    snprintf(buf, size, "%s/%s/file%05d", dirPath, SUBDIR, i);
+}
+
+static int createFiles(void) {
+
+    int i;
+    int fd;
+    char path[PATHBUFSIZE];
+    char* data = NULL;
+
+    snprintf(path, sizeof(path), "%s/%s", dirPath, SUBDIR);
+    if(mkdir(path, 0755) < 0 && errno != EEXIST) {
+        perror("ERROR createFiles: mkdir");
+        return -errno;
+    }
+
+    data = malloc(fileSize ? fileSize : 1);
+    if(!data) {
+        return -ENOMEM;
+    }
+    for(i = 0; (size_t) i < fileSize; i++) {
+        data[i] = 'a' + (i % 26);
+    }
+
+    for(i = 0; i < numFiles; i++) {
+        buildFilePath(path, sizeof(path), i);
+        if(access(path, F_OK) == 0) {
+            continue;
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            perror("ERROR createFiles: open");
+            free(data);
+            return -errno;
+        }
+        if(write(fd, data, fileSize) != (ssize_t) fileSize) {
+            perror("ERROR createFiles: write");
+        }
+        close(fd);
+    }
+
+    free(data);
+    return 0;
+
+}
+
+static uint64_t listFiles(void) {
+
+    DIR* dp = NULL;
+    char path[PATHBUFSIZE];
+    uint64_t start = nowNS();
+
+    snprintf(path, sizeof(path), "%s/%s", dirPath, SUBDIR);
+    dp = opendir(path);
+    if(!dp) {
+        perror("ERROR listFiles: opendir");
+        return 0;
+    }
+    while(readdir(dp)) {
+        continue;
+    }
+    closedir(dp);
+
+    return nowNS() - start;
+
+}
+
+static void* work(void* arg) {
+
+    worker_t* w = arg;
+    int fd;
+    uint64_t start;
+    char path[PATHBUFSIZE];
+    char buf[READBUFSIZE];
+
+    while(!stop) {
+
+        buildFilePath(path, sizeof(path), rand_r(&w->seed) % numFiles);
+
+        start = nowNS();
+        fd = open(path, O_RDONLY);
+        if(fd < 0) {
+            w->errors++;
+            continue;
+        }
+        addSample(&w->open, nowNS() - start);
+
+        while(read(fd, buf, sizeof(buf)) > 0) {
+            continue;
+        }
+
+        start = nowNS();
+        if(close(fd) < 0) {
+            w->errors++;
+        }
+        addSample(&w->close, nowNS() - start);
+
+    }
+
+    return NULL;
+
+}
+
+static void merge(samples_t* dst, const samples_t* src) {
+
+    size_t i;
+
+    for(i = 0; i < src->num; i++) {
+        addSample(dst, src->vals[i]);
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+
+    int opt;
+    int i;
+    int numThreads = 4;
+    uint64_t errors = 0;
+    uint64_t listNS;
+    worker_t* workers = NULL;
+    samples_t openLat = { NULL, 0, 0 };
+    samples_t closeLat = { NULL, 0, 0 };
+    struct timespec ts;
+
+    while((opt = getopt(argc, argv, "t:n:s:d:")) != -1) {
+        switch(opt) {
+        case 't': numThreads = atoi(optarg); break;
+        case 'n': numFiles = atoi(optarg); break;
+        case 's': fileSize = strtoul(optarg, NULL, 10); break;
+        case 'd': duration = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-n files] [-s size] "
+                    "[-d seconds] <dir>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(optind != argc - 1 || numThreads < 1 || numFiles < 1) {
+        fprintf(stderr, "Usage: %s [-t threads] [-n files] [-s size] "
+                "[-d seconds] <dir>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    snprintf(dirPath, sizeof(dirPath), "%s", argv[optind]);
+
+    if(createFiles() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    listNS = listFiles();
+    printf("list   %d files in %.1fus\n", numFiles, listNS / 1000.0);
+
+    workers = calloc(numThreads, sizeof(*workers));
+    if(!workers) {
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < numThreads; i++) {
+        workers[i].seed = i + 1;
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+
+    ts.tv_sec = (time_t) duration;
+    ts.tv_nsec = (long) ((duration - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    stop = 1;
+
+    for(i = 0; i < numThreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        merge(&openLat, &workers[i].open);
+        merge(&closeLat, &workers[i].close);
+        errors += workers[i].errors;
+        free(workers[i].open.vals);
+        free(workers[i].close.vals);
+    }
+    free(workers);
+
+    printf("ops    %zu in %.1fs (%.0f/s) with %d threads, %"PRIu64" errors\n",
+           openLat.num, duration, openLat.num / duration, numThreads, errors);
+    report("open", &openLat);
+    report("close", &closeLat);
+
+    free(openLat.vals);
+    free(closeLat.vals);
+
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+}
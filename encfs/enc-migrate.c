@@ -0,0 +1,974 @@
+/* enc-migrate.c
+ * Convert the legacy whole-file CBC files under a fuseenc_fh backing
+ * directory to the chunked format, in parallel and in place. Chunked
+ * files from before data keys are converted too, to the write format of
+ * enc-format.h.
+ *
+ * Walks <dir> and hands each regular file to a pool of workers. A
+ * worker decrypts a legacy file into an unnamed temp file, encrypts that
+ * into a new unnamed file next to the original, decrypts the new file
+ * again and compares it with the first plain text, copies the original's
+ * xattrs (key ID included), mode, owner and times, and renames the new
+ * file over the original. Files already chunked are left alone, as are
+ * files with other hard links (a rename would split them).
+ *
+ * fuseenc_fh reads both formats, so the mount can stay up meanwhile. A
+ * file changed after its conversion began is left for the next run; with
+ * atomic_replace on (the default), a save racing the final rename is
+ * applied on top of whichever version the path holds, so it isn't lost.
+ *
+ * Restartable: a converted file is recognized by its header, and with -J
+ * each directory whose files are all done is logged to a journal so a
+ * later run doesn't even open them. An interrupted run leaves no temp
+ * files behind where the backing FS supports O_TMPFILE.
+ *
+ * Keys come from custos with -c URL (as -o custos,custos_url=URL), or
+ * are the built-in test key, as for a mount without custos. -z, -l and
+ * -i match the mount's compress, compress_level and integrity options.
+ *
+ * Usage: enc-migrate [-j threads] [-b MB/s] [-J journal] [-c custos_url]
+ *                    [-z codec] [-l level] [-i 0|1] [-x PATTERN[:PATTERN]]
+ *                    [-n] <dir>
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <uuid/uuid.h>
+
+#include "aes-crypt.h"
+#include "chunk-crypt.h"
+#include "custos-keys.h"
+#include "custos-session.h"
+#include "enc-format.h"
+#include "io-budget.h"
+#include "key-cache.h"
+#include "work-pool.h"
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+/* As in fuseenc_fh.c */
+#define TESTKEY "MySuperSecretKey"
+#define UUID "1b4e28ba-2fa1-11d2-883f-b9a761bde3fb"
+#define GOOD_PSK "It's A Trap!"
+#define TMPNAME_PRE "._"
+#define KEYID_XATTR "user.custos.key"
+#define KEYIDSTRSIZE 37
+#define KEY_CACHE_ENTRIES 4096
+
+#define PATHBUFSIZE 1024
+#define PROCFDPATHSIZE 64
+#define XATTRLISTSIZE 65536
+#define COMPAREBUFSIZE 65536
+#define PATTERN_DELIMINATOR ':'
+#define QUEUED_PER_THREAD 4
+
+/* A directory being migrated; its journal entry is written by whoever
+ * finishes its last file */
+typedef struct dirJob {
+    char*  path;        /* relative to the backing dir, "" for the top */
+    size_t pending;     /* files not yet finished, + 1 while listing */
+    int    incomplete;  /* a file failed or was left for later */
+} dirJob_t;
+
+/* What migrateFile did with a file */
+typedef enum migrateResult {
+    MIGRATE_DONE = 0,   /* converted */
+    MIGRATE_CHUNKED,    /* already in the write format */
+    MIGRATE_LINKED,     /* not a lone regular file; never converted */
+    MIGRATE_CHANGED,    /* written to meanwhile; for the next run */
+    MIGRATE_LEGACY      /* legacy, left as it is by -n */
+} migrateResult_t;
+
+typedef struct fileJob {
+    dirJob_t* dir;
+    char      name[];
+} fileJob_t;
+
+typedef struct migrateStats {
+    uint64_t files;
+    uint64_t migrated;
+    uint64_t chunked;   /* already in the write format */
+    uint64_t linked;    /* hard-linked, left alone */
+    uint64_t changed;   /* written to meanwhile, left for the next run */
+    uint64_t excluded;  /* matched -x */
+    uint64_t legacy;    /* legacy files found by -n */
+    uint64_t failed;
+    uint64_t bytes;     /* legacy bytes converted */
+} migrateStats_t;
+
+static char            basePath[PATHBUFSIZE];
+static keyCache_t*     keyCache = NULL;
+static custosSession_t* session = NULL;
+static workPool_t*     pool = NULL;
+static size_t          numThreads = 4;
+static int             dryRun = 0;
+static const char*     excludes = NULL;
+static migrateStats_t  stats;
+
+/* Bandwidth budget shared by every worker, so the total stays under -b */
+static ioBudget_t*     budget = NULL;
+
+/* Directories done in earlier runs, sorted, and the journal to add to */
+static char**          doneDirs = NULL;
+static size_t          numDoneDirs = 0;
+static int             journalFD = -1;
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t nowNS(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static void count(uint64_t* counter, uint64_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Does path match one of the -x patterns (or lie below a match) */
+static int isExcluded(const char* path) {
+
+    int ret = 0;
+    char* patterns = NULL;
+    char* pattern = NULL;
+    char* next = NULL;
+
+    if(!excludes) {
+        return 0;
+    }
+
+    patterns = strdup(excludes);
+    if(!patterns) {
+        return 0;
+    }
+    for(pattern = patterns; pattern && !ret; pattern = next) {
+        next = strchr(pattern, PATTERN_DELIMINATOR);
+        if(next) {
+            *next++ = '\0';
+        }
+        ret = (*pattern && fnmatch(pattern, path, FNM_LEADING_DIR) == 0);
+    }
+    free(patterns);
+
+    return ret;
+
+}
+
+static int cmpPath(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+static int isDoneDir(const char* path) {
+    return doneDirs &&
+        bsearch(&path, doneDirs, numDoneDirs, sizeof(*doneDirs), cmpPath) != NULL;
+}
+
+/* int openJournal(const char* journalPath)
+ *
+ * Purpose: Load the directories logged done by earlier runs and open
+ *          the journal to log this run's
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int openJournal(const char* journalPath) {
+
+    FILE* fp = NULL;
+    char* line = NULL;
+    char** tmp = NULL;
+    size_t lineSize = 0;
+    size_t cap = 0;
+    ssize_t len;
+
+    fp = fopen(journalPath, "r");
+    if(fp) {
+        while((len = getline(&line, &lineSize, fp)) > 0) {
+            /* A line cut short by a crash has no newline; redo that dir */
+            if(line[len - 1] != '\n') {
+                break;
+            }
+            line[len - 1] = '\0';
+            if(numDoneDirs == cap) {
+                cap = cap ? (cap * 2) : 1024;
+                tmp = realloc(doneDirs, cap * sizeof(*doneDirs));
+                if(!tmp) {
+                    fclose(fp);
+                    free(line);
+                    return -ENOMEM;
+                }
+                doneDirs = tmp;
+            }
+            doneDirs[numDoneDirs] = strdup(line);
+            if(!doneDirs[numDoneDirs]) {
+                fclose(fp);
+                free(line);
+                return -ENOMEM;
+            }
+            numDoneDirs++;
+        }
+        free(line);
+        fclose(fp);
+        qsort(doneDirs, numDoneDirs, sizeof(*doneDirs), cmpPath);
+    }
+    else if(errno != ENOENT) {
+        perror("ERROR openJournal: fopen");
+        return -errno;
+    }
+
+    journalFD = open(journalPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if(journalFD < 0) {
+        perror("ERROR openJournal: open");
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* One file of dir finished; log dir once all of them have, if all went */
+static void finishDirFile(dirJob_t* dir, int incomplete) {
+
+    char line[PATHBUFSIZE + 1];
+    int len;
+
+    if(incomplete) {
+        __atomic_store_n(&dir->incomplete, 1, __ATOMIC_RELAXED);
+    }
+    if(__atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    if(journalFD >= 0 && !__atomic_load_n(&dir->incomplete, __ATOMIC_RELAXED)) {
+        len = snprintf(line, sizeof(line), "%s\n", dir->path);
+        pthread_mutex_lock(&journalLock);
+        if(write(journalFD, line, len) != len || fdatasync(journalFD) < 0) {
+            perror("ERROR finishDirFile: journal write");
+        }
+        pthread_mutex_unlock(&journalLock);
+    }
+
+    free(dir->path);
+    free(dir);
+
+}
+
+/* Key handle for keyID, as fuseenc_fh's acquireKey gets it */
+static keyHandle_t* acquireKey(const uuid_t keyID) {
+
+    keyHandle_t* key = NULL;
+
+    key = keycache_acquire(keyCache, keyID);
+    if(key) {
+        return key;
+    }
+
+    if(!session) {
+        if(keycache_put(keyCache, keyID,
+                        (const uint8_t*) TESTKEY, strlen(TESTKEY)) < 0) {
+            fprintf(stderr, "ERROR acquireKey: keycache_put() failed\n");
+            return NULL;
+        }
+        return keycache_acquire(keyCache, keyID);
+    }
+
+    return custosKeys_acquire(keyCache, session, keyID);
+
+}
+
+/* Key ID of the file open on fd; files without one use the UUID key */
+static int getFDKeyID(int fd, uuid_t keyID) {
+
+    char val[KEYIDSTRSIZE];
+    ssize_t size;
+
+    size = fgetxattr(fd, KEYID_XATTR, val, sizeof(val) - 1);
+    if(size < 0) {
+        if(errno != ENODATA && errno != ENOTSUP) {
+            return -errno;
+        }
+        uuid_parse(UUID, keyID);
+        return RETURN_SUCCESS;
+    }
+    val[size] = '\0';
+
+    return (uuid_parse(val, keyID) < 0) ? -EINVAL : RETURN_SUCCESS;
+
+}
+
+/* Open an unnamed file in dirPath, or where O_TMPFILE isn't supported
+ * a named one (left in tmpPath, "" if unnamed) */
+static int openTemp(const char* dirPath, char* tmpPath, size_t tmpSize) {
+
+    int fd;
+
+    tmpPath[0] = '\0';
+    fd = open(dirPath, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if(fd >= 0) {
+        return fd;
+    }
+    if(errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+        return -errno;
+    }
+
+    if(snprintf(tmpPath, tmpSize, "%s/%sXXXXXX", dirPath, TMPNAME_PRE) >=
+       (int) tmpSize) {
+        tmpPath[0] = '\0';
+        return -ENAMETOOLONG;
+    }
+    fd = mkostemp(tmpPath, O_CLOEXEC);
+    if(fd < 0) {
+        tmpPath[0] = '\0';
+        return -errno;
+    }
+
+    return fd;
+
+}
+
+/* As openTemp, for a file that only needs to live while open */
+static int openScratch(const char* dirPath) {
+
+    int fd;
+    char tmpPath[PATHBUFSIZE];
+
+    fd = openTemp(dirPath, tmpPath, sizeof(tmpPath));
+    if(fd >= 0 && tmpPath[0]) {
+        unlink(tmpPath);
+    }
+
+    return fd;
+
+}
+
+/* 0 if the files on fd1 and fd2 have the same contents, -EIO if not */
+static int compareFiles(int fd1, int fd2) {
+
+    off_t pos = 0;
+    ssize_t len1;
+    ssize_t len2;
+    char buf1[COMPAREBUFSIZE];
+    char buf2[COMPAREBUFSIZE];
+
+    for(;;) {
+        len1 = pread(fd1, buf1, sizeof(buf1), pos);
+        len2 = pread(fd2, buf2, sizeof(buf2), pos);
+        if(len1 < 0 || len2 < 0) {
+            return -errno;
+        }
+        if(len1 != len2 || memcmp(buf1, buf2, len1) != 0) {
+            return -EIO;
+        }
+        if(len1 == 0) {
+            return RETURN_SUCCESS;
+        }
+        pos += len1;
+    }
+
+}
+
+/* Copy every xattr of srcFD, key ID included, to dstFD */
+static int copyXattrs(int srcFD, int dstFD) {
+
+    int ret = RETURN_SUCCESS;
+    ssize_t listLen;
+    ssize_t valLen;
+    char* name = NULL;
+    char* list = NULL;
+    char* val = NULL;
+
+    list = malloc(XATTRLISTSIZE);
+    val = malloc(XATTRLISTSIZE);
+    if(!list || !val) {
+        ret = -ENOMEM;
+        goto CLEANUP;
+    }
+
+    listLen = flistxattr(srcFD, list, XATTRLISTSIZE);
+    if(listLen < 0) {
+        ret = (errno == ENOTSUP) ? RETURN_SUCCESS : -errno;
+        goto CLEANUP;
+    }
+
+    for(name = list; name < list + listLen; name += strlen(name) + 1) {
+        valLen = fgetxattr(srcFD, name, val, XATTRLISTSIZE);
+        if(valLen < 0 || fsetxattr(dstFD, name, val, valLen, 0) < 0) {
+            ret = -errno;
+            break;
+        }
+    }
+
+ CLEANUP:
+    free(list);
+    free(val);
+    return ret;
+
+}
+
+/* Give the file on fd the ownership, mode and times in st */
+static int copyMeta(int fd, const struct stat* st) {
+
+    struct timespec times[2];
+
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+
+    if(fchmod(fd, st->st_mode & 07777) < 0 ||
+       (fchown(fd, st->st_uid, st->st_gid) < 0 && errno != EPERM) ||
+       futimens(fd, times) < 0) {
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Is the file at fullPath no longer the one st was taken of, or
+ * written since; ctime too unless the file was just renamed */
+static int hasChanged(const char* fullPath, const struct stat* st,
+                      int withCtime) {
+
+    struct stat now;
+
+    return lstat(fullPath, &now) < 0 ||
+        now.st_dev != st->st_dev || now.st_ino != st->st_ino ||
+        now.st_size != st->st_size ||
+        now.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+        now.st_mtim.tv_nsec != st->st_mtim.tv_nsec ||
+        (withCtime && (now.st_ctim.tv_sec != st->st_ctim.tv_sec ||
+                   now.st_ctim.tv_nsec != st->st_ctim.tv_nsec));
+
+}
+
+/* int publish(char* tmpPath, const char* fullPath, const struct stat* st)
+ *
+ * Purpose: Put the new file at tmpPath in place of the original at
+ *          fullPath, if that is still the unchanged file st describes.
+ *          The two are exchanged, so a file deleted meanwhile isn't
+ *          brought back, and then the original (now at tmpPath) is
+ *          checked again and swapped back if it changed in between.
+ *          Where the FS can't exchange, checks and renames over.
+ *
+ * Return: MIGRATE_DONE with tmpPath holding the original,
+ *         MIGRATE_CHANGED with tmpPath holding the new file,
+ *         negative errno on error
+ */
+static int publish(char* tmpPath, const char* fullPath, const struct stat* st) {
+
+    int ret;
+
+    if(hasChanged(fullPath, st, 1)) {
+        return MIGRATE_CHANGED;
+    }
+
+    if(renameat2(AT_FDCWD, tmpPath, AT_FDCWD, fullPath, RENAME_EXCHANGE) < 0) {
+        if(errno == ENOENT) {
+            return MIGRATE_CHANGED;
+        }
+        if(errno != EINVAL && errno != ENOSYS) {
+            return -errno;
+        }
+        if(rename(tmpPath, fullPath) < 0) {
+            return -errno;
+        }
+        tmpPath[0] = '\0';
+        return MIGRATE_DONE;
+    }
+
+    if(hasChanged(tmpPath, st, 0)) {
+        if(renameat2(AT_FDCWD, tmpPath, AT_FDCWD, fullPath, RENAME_EXCHANGE) < 0) {
+            ret = -errno;
+            fprintf(stderr, "ERROR publish: %s changed and can't be put back "
+                    "from %s\n", fullPath, tmpPath);
+            tmpPath[0] = '\0';
+            return ret;
+        }
+        return MIGRATE_CHANGED;
+    }
+
+    return MIGRATE_DONE;
+
+}
+
+/* Give the unnamed file on fd a temp name in dirPath, left in tmpPath */
+static int nameTemp(int fd, const char* dirPath, char* tmpPath, size_t tmpSize) {
+
+    int tries;
+    char procPath[PROCFDPATHSIZE];
+    char suffix[KEYIDSTRSIZE];
+    uuid_t rnd;
+
+    snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", fd);
+    for(tries = 0; ; tries++) {
+        uuid_generate_random(rnd);
+        uuid_unparse_lower(rnd, suffix);
+        suffix[8] = '\0';
+        if(snprintf(tmpPath, tmpSize, "%s/%s%s", dirPath, TMPNAME_PRE, suffix) >=
+           (int) tmpSize) {
+            return -ENAMETOOLONG;
+        }
+        if(linkat(AT_FDCWD, procPath, AT_FDCWD, tmpPath, AT_SYMLINK_FOLLOW) == 0) {
+            return RETURN_SUCCESS;
+        }
+        if(errno != EEXIST || tries >= 8) {
+            return -errno;
+        }
+    }
+
+}
+
+/* int migrateFile(const char* dirPath, const char* fullPath)
+ *
+ * Purpose: Convert the file at fullPath (in dirPath) to the chunked
+ *          format, verify it and atomically put it in place
+ *
+ * Return: What was done (migrateResult_t), negative errno on error
+ */
+static int migrateFile(const char* dirPath, const char* fullPath) {
+
+    int ret;
+    int encFD = -1;
+    int clearFD = -1;
+    int newFD = -1;
+    int checkFD = -1;
+    struct stat st;
+    const encFormat_t* format;
+    uuid_t keyID;
+    keyHandle_t* key = NULL;
+    char tmpPath[PATHBUFSIZE] = "";
+
+    encFD = open(fullPath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(encFD < 0) {
+        return (errno == ENOENT) ? MIGRATE_CHANGED : -errno;
+    }
+    if(fstat(encFD, &st) < 0) {
+        ret = -errno;
+        goto CLEANUP;
+    }
+    if(!S_ISREG(st.st_mode) || st.st_nlink != 1) {
+        ret = MIGRATE_LINKED;
+        goto CLEANUP;
+    }
+
+    ret = encformat_detect(encFD, &format);
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+    if(format == encformat_writer()) {
+        ret = MIGRATE_CHUNKED;
+        goto CLEANUP;
+    }
+    if(dryRun) {
+        count(&stats.bytes, st.st_size);
+        ret = MIGRATE_LEGACY;
+        goto CLEANUP;
+    }
+
+    ret = getFDKeyID(encFD, keyID);
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+    key = acquireKey(keyID);
+    if(!key) {
+        ret = -EACCES;
+        goto CLEANUP;
+    }
+
+    /* Old format -> plain text */
+    clearFD = openScratch(dirPath);
+    if(clearFD < 0) {
+        ret = clearFD;
+        goto CLEANUP;
+    }
+    iobudget_charge(budget, st.st_size, NULL, NULL);
+    ret = format->decrypt(encFD, clearFD, key->crypt);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR migrateFile: %s: %s decrypt failed\n",
+                fullPath, format->name);
+        goto CLEANUP;
+    }
+
+    /* Plain text -> write format */
+    newFD = openTemp(dirPath, tmpPath, sizeof(tmpPath));
+    if(newFD < 0) {
+        ret = newFD;
+        goto CLEANUP;
+    }
+    iobudget_charge(budget, st.st_size, NULL, NULL);
+    ret = encformat_writer()->save(clearFD, newFD, key->crypt, NULL);
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+
+    /* And back to plain text, which must match */
+    checkFD = openScratch(dirPath);
+    if(checkFD < 0) {
+        ret = checkFD;
+        goto CLEANUP;
+    }
+    iobudget_charge(budget, st.st_size, NULL, NULL);
+    ret = encformat_writer()->decrypt(newFD, checkFD, key->crypt);
+    if(ret == 0) {
+        ret = compareFiles(clearFD, checkFD);
+    }
+    if(ret < 0) {
+        fprintf(stderr, "ERROR migrateFile: %s: verify failed\n", fullPath);
+        goto CLEANUP;
+    }
+
+    ret = copyXattrs(encFD, newFD);
+    if(ret == 0) {
+        ret = copyMeta(newFD, &st);
+    }
+    if(ret == 0 && fsync(newFD) < 0) {
+        ret = -errno;
+    }
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+
+    if(!tmpPath[0]) {
+        ret = nameTemp(newFD, dirPath, tmpPath, sizeof(tmpPath));
+        if(ret < 0) {
+            tmpPath[0] = '\0';
+            goto CLEANUP;
+        }
+    }
+
+    /* Whichever version ends up at tmpPath is removed below */
+    ret = publish(tmpPath, fullPath, &st);
+    if(ret == MIGRATE_DONE) {
+        count(&stats.bytes, st.st_size);
+    }
+
+ CLEANUP:
+    if(tmpPath[0]) {
+        unlink(tmpPath);
+    }
+    if(checkFD >= 0) {
+        close(checkFD);
+    }
+    if(newFD >= 0) {
+        close(newFD);
+    }
+    if(clearFD >= 0) {
+        close(clearFD);
+    }
+    if(key) {
+        keycache_release(key);
+    }
+    close(encFD);
+    return ret;
+
+}
+
+/* Worker job: migrate one file of a directory */
+static void migrateJob(workPool_t* workers, void* arg) {
+
+    int ret;
+    fileJob_t* job = arg;
+    char dirPath[PATHBUFSIZE];
+    char fullPath[PATHBUFSIZE];
+
+    (void) workers;
+
+    snprintf(dirPath, sizeof(dirPath), "%s%s", basePath, job->dir->path);
+    ret = snprintf(fullPath, sizeof(fullPath), "%s/%s", dirPath, job->name);
+    if(ret >= (int) sizeof(fullPath)) {
+        ret = -ENAMETOOLONG;
+    }
+    else {
+        ret = migrateFile(dirPath, fullPath);
+    }
+
+    switch(ret) {
+    case MIGRATE_DONE:    count(&stats.migrated, 1); break;
+    case MIGRATE_CHUNKED: count(&stats.chunked, 1);  break;
+    case MIGRATE_LINKED:  count(&stats.linked, 1);   break;
+    case MIGRATE_CHANGED: count(&stats.changed, 1);  break;
+    case MIGRATE_LEGACY:  count(&stats.legacy, 1);   break;
+    default:
+        fprintf(stderr, "ERROR migrateJob: %s: %s\n", fullPath, strerror(-ret));
+        count(&stats.failed, 1);
+    }
+
+    finishDirFile(job->dir, ret < 0 || ret == MIGRATE_CHANGED ||
+                  ret == MIGRATE_LEGACY);
+    free(job);
+
+}
+
+/* int walkDir(const char* path)
+ *
+ * Purpose: Queue every regular file in the backing directory path
+ *          (relative, "" for the top) for migration, then walk its
+ *          subdirectories. Directories the journal has are not listed
+ *          for files again, only for subdirectories.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int walkDir(const char* path) {
+
+    int ret = RETURN_SUCCESS;
+    int isDir;
+    int isReg;
+    int done;
+    size_t len;
+    DIR* dp = NULL;
+    struct dirent* entry = NULL;
+    dirJob_t* dir = NULL;
+    fileJob_t* job = NULL;
+    struct stat st;
+    char dirPath[PATHBUFSIZE];
+    char entryPath[PATHBUFSIZE];
+    char subPath[PATHBUFSIZE];
+
+    snprintf(dirPath, sizeof(dirPath), "%s%s", basePath, path);
+    dp = opendir(dirPath);
+    if(!dp) {
+        fprintf(stderr, "ERROR walkDir: opendir(%s): %s\n", dirPath,
+                strerror(errno));
+        count(&stats.failed, 1);
+        return -errno;
+    }
+
+    done = isDoneDir(path);
+    if(!done) {
+        dir = calloc(1, sizeof(*dir));
+        if(!dir || !(dir->path = strdup(path))) {
+            free(dir);
+            closedir(dp);
+            return -ENOMEM;
+        }
+        dir->pending = 1;
+    }
+
+    /* Files first */
+    while(dir && (entry = readdir(dp)) != NULL) {
+
+        if(strncmp(entry->d_name, TMPNAME_PRE, strlen(TMPNAME_PRE)) == 0 ||
+           strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if(snprintf(entryPath, sizeof(entryPath), "%s/%s", dirPath,
+                    entry->d_name) >= (int) sizeof(entryPath)) {
+            continue;
+        }
+        isReg = (entry->d_type == DT_REG);
+        if(entry->d_type == DT_UNKNOWN) {
+            isReg = (lstat(entryPath, &st) == 0 && S_ISREG(st.st_mode));
+        }
+        if(!isReg) {
+            continue;
+        }
+
+        count(&stats.files, 1);
+        snprintf(subPath, sizeof(subPath), "%s/%s", path, entry->d_name);
+        if(isExcluded(subPath)) {
+            count(&stats.excluded, 1);
+            continue;
+        }
+
+        len = strlen(entry->d_name) + 1;
+        job = malloc(sizeof(*job) + len);
+        if(!job) {
+            ret = -ENOMEM;
+            break;
+        }
+        job->dir = dir;
+        memcpy(job->name, entry->d_name, len);
+
+        workpool_waitPending(pool, numThreads * QUEUED_PER_THREAD);
+        __atomic_add_fetch(&dir->pending, 1, __ATOMIC_RELAXED);
+        if(workpool_submit(pool, migrateJob, job) < 0) {
+            __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_RELAXED);
+            free(job);
+            ret = -ENOMEM;
+            break;
+        }
+
+    }
+    if(dir) {
+        finishDirFile(dir, ret < 0);
+    }
+
+    /* Then subdirectories */
+    rewinddir(dp);
+    while(ret == RETURN_SUCCESS && (entry = readdir(dp)) != NULL) {
+
+        if(strncmp(entry->d_name, TMPNAME_PRE, strlen(TMPNAME_PRE)) == 0 ||
+           strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if(snprintf(entryPath, sizeof(entryPath), "%s/%s", dirPath,
+                    entry->d_name) >= (int) sizeof(entryPath) ||
+           snprintf(subPath, sizeof(subPath), "%s/%s", path,
+                    entry->d_name) >= (int) sizeof(subPath)) {
+            continue;
+        }
+        isDir = (entry->d_type == DT_DIR);
+        if(entry->d_type == DT_UNKNOWN) {
+            isDir = (lstat(entryPath, &st) == 0 && S_ISDIR(st.st_mode));
+        }
+        if(!isDir || isExcluded(subPath)) {
+            continue;
+        }
+
+        if(walkDir(subPath) == -ENOMEM) {
+            ret = -ENOMEM;
+        }
+
+    }
+    closedir(dp);
+
+    return ret;
+
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-j threads] [-b MB/s] [-J journal] [-c custos_url]\n"
+            "          [-z none|lz4|zstd] [-l level] [-i 0|1] [-x PATTERN[:PATTERN...]]\n"
+            "          [-n] <dir>\n"
+            "  -j  files converted at once (default 4)\n"
+            "  -b  cap on read plus write bandwidth, MB/s (default none)\n"
+            "  -J  journal of finished directories, to restart from\n"
+            "  -c  fetch keys from this custos server\n"
+            "  -z, -l, -i  as the mount's compress, compress_level, integrity\n"
+            "  -x  leave paths matching these patterns (e.g. -o passthrough's)\n"
+            "  -n  only count the legacy files\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+
+    int opt;
+    int ret;
+    int codec = CHUNK_CODEC_NONE;
+    int level = 0;
+    int integrity = 1;
+    double mbPerSec = 0;
+    uint64_t start;
+    uint64_t elapsed;
+    const char* journalPath = NULL;
+    const char* custosURL = NULL;
+    char* real = NULL;
+
+    while((opt = getopt(argc, argv, "j:b:J:c:z:l:i:x:n")) != -1) {
+        switch(opt) {
+        case 'j': numThreads = strtoul(optarg, NULL, 10); break;
+        case 'b': mbPerSec = atof(optarg); break;
+        case 'J': journalPath = optarg; break;
+        case 'c': custosURL = optarg; break;
+        case 'z':
+            if(strcmp(optarg, "lz4") == 0) {
+                codec = CHUNK_CODEC_LZ4;
+            }
+            else if(strcmp(optarg, "zstd") == 0) {
+                codec = CHUNK_CODEC_ZSTD;
+            }
+            else if(strcmp(optarg, "none") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'l': level = atoi(optarg); break;
+        case 'i': integrity = atoi(optarg); break;
+        case 'x': excludes = optarg; break;
+        case 'n': dryRun = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || numThreads == 0 || mbPerSec < 0) {
+        usage(argv[0]);
+    }
+
+    real = realpath(argv[optind], NULL);
+    if(!real || strlen(real) >= sizeof(basePath)) {
+        fprintf(stderr, "ERROR main: bad directory %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    snprintf(basePath, sizeof(basePath), "%s", real);
+    free(real);
+
+    if(chunk_setCodec(codec, level) < 0) {
+        fprintf(stderr, "ERROR main: codec not available\n");
+        exit(EXIT_FAILURE);
+    }
+    chunk_setIntegrity(integrity);
+
+    if(crypt_init() < 0) {
+        fprintf(stderr, "ERROR main: crypt_init failed\n");
+        exit(EXIT_FAILURE);
+    }
+    keyCache = keycache_create(KEY_CACHE_ENTRIES);
+    if(!keyCache) {
+        exit(EXIT_FAILURE);
+    }
+    encformat_setKeyCache(keyCache);
+    if(custosURL) {
+        session = custosSession_create(custosURL, GOOD_PSK, numThreads);
+        if(!session) {
+            fprintf(stderr, "ERROR main: custosSession_create failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(journalPath && !dryRun && openJournal(journalPath) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if(mbPerSec > 0) {
+        budget = iobudget_create((uint64_t) (mbPerSec * 1000000), 0);
+        if(!budget) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pool = workpool_create(numThreads);
+    if(!pool) {
+        exit(EXIT_FAILURE);
+    }
+
+    start = nowNS();
+    ret = walkDir("");
+    workpool_wait(pool);
+    elapsed = nowNS() - start;
+    workpool_destroy(pool);
+
+    printf("%s %"PRIu64" of %"PRIu64" files (%.1f MB) in %.1fs\n",
+           dryRun ? "found legacy" : "migrated",
+           dryRun ? stats.legacy : stats.migrated, stats.files,
+           stats.bytes / 1e6, elapsed / 1e9);
+    printf("already chunked %"PRIu64", hard-linked %"PRIu64", changed %"PRIu64
+           ", excluded %"PRIu64", failed %"PRIu64"\n", stats.chunked,
+           stats.linked, stats.changed, stats.excluded, stats.failed);
+
+    if(journalFD >= 0) {
+        close(journalFD);
+    }
+    while(numDoneDirs > 0) {
+        free(doneDirs[--numDoneDirs]);
+    }
+    free(doneDirs);
+    custosSession_destroy(session);
+    keycache_destroy(keyCache);
+    iobudget_destroy(budget);
+
+    return (ret < 0 || stats.failed || stats.changed) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+}
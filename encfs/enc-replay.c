@@ -0,0 +1,960 @@
+/* enc-replay.c
+ * Replay an op-trace log (fuseenc_fh -o trace=FILE) against a mount
+ *
+ * Paths in the trace are hashes, so every traced path gets a stand-in
+ * name (its hash in hex) in the same place of a stand-in tree under
+ * <dir>. Files and directories the trace uses without creating them are
+ * made first, files filled up to the largest size the trace saw. Then
+ * one thread per traced thread issues its ops at their original times,
+ * scaled by -s (0: as fast as possible).
+ *
+ * Ops are replayed as the system calls that cause them: getattr as
+ * lstat, read as pread on the file opened by the traced open, and so on.
+ * A flush directly followed by its release is replayed as one close. The
+ * kernel still caches and merges as it likes, so the callbacks the
+ * replay causes are close to the traced ones, not the same.
+ *
+ * Reports, per op, the count, mean latency traced and replayed, and how
+ * many replayed ops failed where the traced one succeeded or the other
+ * way round.
+ *
+ * Usage: enc-replay [-s speed] [-n] <trace> <dir>
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "op-trace.h"
+
+#define PATHBUFSIZE 1024
+#define DATABUFSIZE 65536
+#define MAXDEPTH 64
+#define REPLAY_XATTR "user.replay"
+#define REPLAY_LINK "replay-target"
+
+/* Hash map from nonzero 64-bit keys to 64-bit values */
+typedef struct u64map {
+    uint64_t* keys;
+    uint64_t* vals;
+    size_t    cap;      /* power of two */
+    size_t    num;
+} u64map_t;
+
+typedef struct replayOp {
+    opTraceRecord_t rec;
+    int             folded; /* flush replayed by the close of its release */
+} replayOp_t;
+
+typedef struct opStats {
+    uint64_t num;
+    uint64_t tracedNS;
+    uint64_t replayNS;
+    uint64_t mismatches;
+} opStats_t;
+
+typedef struct worker {
+    pthread_t   thread;
+    replayOp_t** ops;
+    size_t      numOps;
+    opStats_t   stats[OPTRACE_OPS];
+    char*       buf;
+    size_t      bufSize;
+} worker_t;
+
+static char      dirPath[PATHBUFSIZE - 64];
+static double    speed = 1.0;
+static uint64_t  rootHash;
+static uint64_t  replayStart;
+static u64map_t  parents;   /* path hash -> directory hash */
+static u64map_t  names;     /* path hash -> stand-in path (char*) */
+static int*      handleFDs; /* by handle id; -1 when not open */
+static DIR**     handleDirs;
+static char      data[DATABUFSIZE];
+
+static uint64_t nowNS(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static int mapGrow(u64map_t* map);
+
+static int mapPut(u64map_t* map, uint64_t key, uint64_t val) {
+
+    size_t i;
+
+    if((map->num + 1) * 2 > map->cap && mapGrow(map) < 0) {
+        return -ENOMEM;
+    }
+
+    for(i = key & (map->cap - 1); map->keys[i] && map->keys[i] != key;
+        i = (i + 1) & (map->cap - 1)) {
+        continue;
+    }
+    if(!map->keys[i]) {
+        map->keys[i] = key;
+        map->num++;
+    }
+    map->vals[i] = val;
+
+    return 0;
+
+}
+
+static int mapGet(const u64map_t* map, uint64_t key, uint64_t* val) {
+
+    size_t i;
+
+    if(!map->cap) {
+        return 0;
+    }
+
+    for(i = key & (map->cap - 1); map->keys[i];
+        i = (i + 1) & (map->cap - 1)) {
+        if(map->keys[i] == key) {
+            *val = map->vals[i];
+            return 1;
+        }
+    }
+
+    return 0;
+
+}
+
+static int mapGrow(u64map_t* map) {
+
+    size_t i;
+    u64map_t bigger;
+
+    bigger.cap = map->cap ? (map->cap * 2) : 1024;
+    bigger.num = 0;
+    bigger.keys = calloc(bigger.cap, sizeof(*bigger.keys));
+    bigger.vals = calloc(bigger.cap, sizeof(*bigger.vals));
+    if(!bigger.keys || !bigger.vals) {
+        free(bigger.keys);
+        free(bigger.vals);
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < map->cap; i++) {
+        if(map->keys[i]) {
+            mapPut(&bigger, map->keys[i], map->vals[i]);
+        }
+    }
+    free(map->keys);
+    free(map->vals);
+    *map = bigger;
+
+    return 0;
+
+}
+
+static int cmpStart(const void* a, const void* b) {
+
+    const replayOp_t* x = a;
+    const replayOp_t* y = b;
+
+    return (x->rec.start > y->rec.start) - (x->rec.start < y->rec.start);
+
+}
+
+/* replayOp_t* loadTrace(const char* tracePath, size_t* pnum)
+ *
+ * Purpose: Read every record of the trace at tracePath, sorted by start
+ *          time and rebased to start at 0
+ *
+ * Return: Array of *pnum ops on success, NULL on error
+ */
+static replayOp_t* loadTrace(const char* tracePath, size_t* pnum) {
+
+    FILE* fp = NULL;
+    size_t num = 0;
+    size_t cap = 0;
+    size_t i;
+    uint64_t base;
+    replayOp_t* ops = NULL;
+    replayOp_t* tmp = NULL;
+    opTraceHeader_t hdr;
+    opTraceRecord_t rec;
+
+    fp = fopen(tracePath, "r");
+    if(!fp) {
+        perror("ERROR loadTrace: fopen");
+        return NULL;
+    }
+
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+       memcmp(hdr.magic, OPTRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.version != OPTRACE_VERSION || hdr.recordSize != sizeof(rec)) {
+        fprintf(stderr, "ERROR loadTrace: %s is not a version %d trace\n",
+                tracePath, OPTRACE_VERSION);
+        fclose(fp);
+        return NULL;
+    }
+
+    while(fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if(num == cap) {
+            cap = cap ? (cap * 2) : 4096;
+            tmp = realloc(ops, cap * sizeof(*ops));
+            if(!tmp) {
+                free(ops);
+                fclose(fp);
+                return NULL;
+            }
+            ops = tmp;
+        }
+        ops[num].rec = rec;
+        ops[num].folded = 0;
+        num++;
+    }
+    fclose(fp);
+
+    if(num == 0) {
+        fprintf(stderr, "ERROR loadTrace: %s has no records\n", tracePath);
+        free(ops);
+        return NULL;
+    }
+
+    qsort(ops, num, sizeof(*ops), cmpStart);
+    base = ops[0].rec.start;
+    for(i = 0; i < num; i++) {
+        ops[i].rec.start -= base;
+        ops[i].rec.end -= base;
+    }
+
+    *pnum = num;
+    return ops;
+
+}
+
+static int opensHandle(const opTraceRecord_t* rec) {
+    return (rec->op == OPTRACE_OPEN || rec->op == OPTRACE_CREATE ||
+            rec->op == OPTRACE_OPENDIR) && rec->result >= 0;
+}
+
+/* size_t numberHandles(replayOp_t* ops, size_t num)
+ *
+ * Purpose: Replace the traced handles, which are reused once released,
+ *          by ids numbered from 1 in open order, and mark the flushes
+ *          their release's close will replay
+ *
+ * Return: Highest id given
+ */
+static size_t numberHandles(replayOp_t* ops, size_t num) {
+
+    size_t i;
+    size_t ids = 0;
+    uint64_t id;
+    uint64_t flush;
+    u64map_t handles = { NULL, NULL, 0, 0 };
+    u64map_t flushes = { NULL, NULL, 0, 0 };   /* id -> index + 1 */
+    opTraceRecord_t* rec;
+
+    for(i = 0; i < num; i++) {
+
+        rec = &ops[i].rec;
+
+        if(rec->op == OPTRACE_COPY_FILE_RANGE) {
+            rec->aux = mapGet(&handles, rec->aux, &id) ? id : 0;
+        }
+        if(!rec->fh) {
+            continue;
+        }
+
+        if(opensHandle(rec)) {
+            mapPut(&handles, rec->fh, ++ids);
+            rec->fh = ids;
+            continue;
+        }
+        rec->fh = mapGet(&handles, rec->fh, &id) ? id : 0;
+        if(!rec->fh) {
+            continue;
+        }
+
+        if(rec->op == OPTRACE_FLUSH) {
+            mapPut(&flushes, rec->fh, i + 1);
+        }
+        else if(rec->op == OPTRACE_RELEASE && mapGet(&flushes, rec->fh, &flush) &&
+                flush) {
+            ops[flush - 1].folded = 1;
+        }
+        else {
+            mapPut(&flushes, rec->fh, 0);
+        }
+
+    }
+
+    free(handles.keys);
+    free(handles.vals);
+    free(flushes.keys);
+    free(flushes.vals);
+
+    return ids;
+
+}
+
+/* Stand-in path of the traced path hash, under dirPath; NULL if it
+ * can't be built */
+static const char* standIn(uint64_t hash) {
+
+    int depth = 0;
+    size_t len;
+    uint64_t val;
+    uint64_t chain[MAXDEPTH];
+    char* path = NULL;
+    char* prefix = dirPath;
+
+    if(hash == rootHash) {
+        return dirPath;
+    }
+    if(mapGet(&names, hash, &val)) {
+        return (const char*) (uintptr_t) val;
+    }
+
+    /* Walk up to the nearest directory with a name already */
+    while(depth < MAXDEPTH && hash != rootHash) {
+        if(mapGet(&names, hash, &val)) {
+            prefix = (char*) (uintptr_t) val;
+            break;
+        }
+        chain[depth++] = hash;
+        if(!mapGet(&parents, hash, &hash) || depth == MAXDEPTH) {
+            hash = rootHash;
+        }
+    }
+
+    while(depth > 0) {
+        hash = chain[--depth];
+        len = strlen(prefix) + 18;
+        if(len >= PATHBUFSIZE) {
+            return NULL;
+        }
+        path = malloc(len);
+        if(!path) {
+            return NULL;
+        }
+        snprintf(path, len, "%s/%016"PRIx64, prefix, hash);
+        mapPut(&names, hash, (uintptr_t) path);
+        prefix = path;
+    }
+
+    return prefix;
+
+}
+
+/* Make the stand-in directory of hash and the ones above it */
+static int makeDir(uint64_t hash) {
+
+    int depth;
+    uint64_t chain[MAXDEPTH];
+
+    for(depth = 0; depth < MAXDEPTH && hash != rootHash; depth++) {
+        chain[depth] = hash;
+        if(!mapGet(&parents, hash, &hash)) {
+            break;
+        }
+    }
+
+    while(depth > 0) {
+        if(mkdir(standIn(chain[--depth]), 0755) < 0 && errno != EEXIST) {
+            return -errno;
+        }
+    }
+
+    return 0;
+
+}
+
+static int makeFile(uint64_t hash, uint64_t size) {
+
+    int fd;
+    ssize_t ret;
+    uint64_t done = 0;
+
+    fd = open(standIn(hash), O_WRONLY | O_CREAT, 0644);
+    if(fd < 0) {
+        return -errno;
+    }
+    while(done < size) {
+        ret = write(fd, data, (size - done) < sizeof(data) ?
+                    (size - done) : sizeof(data));
+        if(ret <= 0) {
+            close(fd);
+            return (ret < 0) ? -errno : -EIO;
+        }
+        done += ret;
+    }
+
+    return (close(fd) < 0) ? -errno : 0;
+
+}
+
+static int createsPath(const opTraceRecord_t* rec) {
+    return rec->result >= 0 &&
+        (rec->op == OPTRACE_CREATE || rec->op == OPTRACE_MKNOD ||
+         rec->op == OPTRACE_MKDIR || rec->op == OPTRACE_SYMLINK);
+}
+
+static int wantsDir(const opTraceRecord_t* rec) {
+    return rec->op == OPTRACE_OPENDIR || rec->op == OPTRACE_RMDIR ||
+        ((rec->op == OPTRACE_GETATTR || rec->op == OPTRACE_FGETATTR) &&
+         S_ISDIR(rec->mode));
+}
+
+/* int prepare(replayOp_t* ops, size_t num)
+ *
+ * Purpose: Make the stand-ins of every path the trace finds in place
+ *          (uses successfully before creating it, if ever), files sized
+ *          to the largest size or read extent seen, and all their
+ *          directories
+ *
+ * Return: Number of paths made on success, negative errno on error
+ */
+static int prepare(replayOp_t* ops, size_t num, size_t handles) {
+
+    int ret;
+    int made = 0;
+    size_t i;
+    uint64_t val;
+    uint64_t* handlePaths = NULL;
+    u64map_t seen = { NULL, NULL, 0, 0 };     /* hash -> 1 */
+    u64map_t sizes = { NULL, NULL, 0, 0 };    /* needed file -> size + 1 */
+    u64map_t dirs = { NULL, NULL, 0, 0 };     /* needed dir -> 1 */
+    opTraceRecord_t* rec;
+
+    handlePaths = calloc(handles + 1, sizeof(*handlePaths));
+    if(!handlePaths) {
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < num; i++) {
+
+        rec = &ops[i].rec;
+
+        if(opensHandle(rec)) {
+            handlePaths[rec->fh] = rec->path;
+        }
+        /* Directories are needed unless the trace made them first */
+        if(rec->dir && rec->dir != rootHash) {
+            if(!mapGet(&seen, rec->dir, &val)) {
+                mapPut(&seen, rec->dir, 1);
+                mapPut(&dirs, rec->dir, 1);
+            }
+            else if(mapGet(&sizes, rec->dir, &val)) {
+                mapPut(&dirs, rec->dir, 1);
+            }
+        }
+
+        /* Reads past the end of a file the trace found get it sized */
+        if(rec->op == OPTRACE_READ && rec->fh && rec->result > 0 &&
+           mapGet(&sizes, handlePaths[rec->fh], &val) &&
+           val < rec->offset + rec->result + 1) {
+            mapPut(&sizes, handlePaths[rec->fh], rec->offset + rec->result + 1);
+        }
+
+        if(!rec->path || rec->path == rootHash ||
+           mapGet(&seen, rec->path, &val)) {
+            if(wantsDir(rec) && mapGet(&sizes, rec->path, &val)) {
+                mapPut(&dirs, rec->path, 1);
+            }
+            continue;
+        }
+        mapPut(&seen, rec->path, 1);
+
+        if(createsPath(rec) || rec->result < 0) {
+            continue;
+        }
+        if(wantsDir(rec)) {
+            mapPut(&dirs, rec->path, 1);
+        }
+        else {
+            mapPut(&sizes, rec->path,
+                   ((rec->op == OPTRACE_GETATTR) ? rec->size : 0) + 1);
+        }
+
+    }
+
+    /* A path used as a directory is one, whatever else was seen */
+    for(i = 0; i < dirs.cap; i++) {
+        if(dirs.keys[i]) {
+            mapPut(&sizes, dirs.keys[i], 0);
+            ret = makeDir(dirs.keys[i]);
+            if(ret < 0) {
+                fprintf(stderr, "ERROR prepare: mkdir %s: %s\n",
+                        standIn(dirs.keys[i]), strerror(-ret));
+                goto CLEANUP;
+            }
+            made++;
+        }
+    }
+
+    for(i = 0; i < sizes.cap; i++) {
+        if(sizes.keys[i] && sizes.vals[i]) {
+            ret = makeDir(mapGet(&parents, sizes.keys[i], &val) ? val : rootHash);
+            if(ret == 0) {
+                ret = makeFile(sizes.keys[i], sizes.vals[i] - 1);
+            }
+            if(ret < 0) {
+                fprintf(stderr, "ERROR prepare: create %s: %s\n",
+                        standIn(sizes.keys[i]), strerror(-ret));
+                goto CLEANUP;
+            }
+            made++;
+        }
+    }
+    ret = made;
+
+ CLEANUP:
+    free(handlePaths);
+    free(seen.keys);
+    free(seen.vals);
+    free(sizes.keys);
+    free(sizes.vals);
+    free(dirs.keys);
+    free(dirs.vals);
+    return ret;
+
+}
+
+static int getFD(uint64_t id) {
+    return id ? __atomic_load_n(&handleFDs[id], __ATOMIC_ACQUIRE) : -1;
+}
+
+static void setFD(uint64_t id, int fd) {
+    __atomic_store_n(&handleFDs[id], fd, __ATOMIC_RELEASE);
+}
+
+/* Room for size bytes in the worker's buffer */
+static char* workerBuf(worker_t* w, size_t size) {
+
+    char* tmp;
+
+    if(size > w->bufSize) {
+        tmp = realloc(w->buf, size);
+        if(!tmp) {
+            return NULL;
+        }
+        w->buf = tmp;
+        w->bufSize = size;
+    }
+
+    return w->buf;
+
+}
+
+/* int replayOne(worker_t* w, const opTraceRecord_t* rec)
+ *
+ * Purpose: Issue the system call behind rec
+ *
+ * Return: 0 or more on success, negative errno on error, -EBADF if its
+ *         handle isn't open in the replay
+ */
+static int replayOne(worker_t* w, const opTraceRecord_t* rec) {
+
+    int fd = -1;
+    int ret = 0;
+    off_t off;
+    off_t off2;
+    const char* path = NULL;
+    const char* path2 = NULL;
+    char* buf;
+    DIR* dp;
+    struct stat st;
+    struct statvfs stv;
+    struct flock lk;
+
+    if(rec->path) {
+        path = standIn(rec->path);
+        if(!path) {
+            return -ENAMETOOLONG;
+        }
+    }
+    if(rec->fh) {
+        fd = getFD(rec->fh);
+    }
+
+    switch(rec->op) {
+
+    case OPTRACE_GETATTR:
+        ret = lstat(path, &st);
+        break;
+    case OPTRACE_FGETATTR:
+        ret = (fd < 0) ? -EBADF : fstat(fd, &st);
+        break;
+    case OPTRACE_ACCESS:
+        ret = access(path, rec->flags);
+        break;
+    case OPTRACE_READLINK:
+        buf = workerBuf(w, PATHBUFSIZE);
+        ret = buf ? readlink(path, buf, PATHBUFSIZE) : -ENOMEM;
+        break;
+    case OPTRACE_OPENDIR:
+        dp = opendir(path);
+        if(!dp) {
+            return -errno;
+        }
+        __atomic_store_n(&handleDirs[rec->fh], dp, __ATOMIC_RELEASE);
+        break;
+    case OPTRACE_READDIR:
+        /* One traced readdir lists the directory; later offsets continue
+           that listing */
+        dp = rec->fh ? __atomic_load_n(&handleDirs[rec->fh], __ATOMIC_ACQUIRE) :
+            NULL;
+        if(!dp) {
+            return -EBADF;
+        }
+        if(rec->offset == 0) {
+            rewinddir(dp);
+            while(readdir(dp)) {
+                continue;
+            }
+        }
+        break;
+    case OPTRACE_RELEASEDIR:
+        dp = rec->fh ? __atomic_exchange_n(&handleDirs[rec->fh], NULL,
+                                           __ATOMIC_ACQ_REL) : NULL;
+        ret = dp ? closedir(dp) : -EBADF;
+        break;
+    case OPTRACE_MKNOD:
+        ret = mknod(path, rec->mode, 0);
+        break;
+    case OPTRACE_MKDIR:
+        ret = mkdir(path, rec->mode & 07777);
+        break;
+    case OPTRACE_UNLINK:
+        ret = unlink(path);
+        break;
+    case OPTRACE_RMDIR:
+        ret = rmdir(path);
+        break;
+    case OPTRACE_SYMLINK:
+        ret = symlink(REPLAY_LINK, path);
+        break;
+    case OPTRACE_RENAME:
+    case OPTRACE_LINK:
+        path2 = standIn(rec->aux);
+        if(!path2) {
+            return -ENAMETOOLONG;
+        }
+        ret = (rec->op == OPTRACE_RENAME) ? rename(path, path2) :
+            link(path, path2);
+        break;
+    case OPTRACE_CHMOD:
+        ret = chmod(path, rec->mode & 07777);
+        break;
+    case OPTRACE_CHOWN:
+        ret = lchown(path, (uid_t) -1, (gid_t) -1);
+        break;
+    case OPTRACE_TRUNCATE:
+        ret = truncate(path, rec->size);
+        break;
+    case OPTRACE_FTRUNCATE:
+        ret = (fd < 0) ? -EBADF : ftruncate(fd, rec->size);
+        break;
+    case OPTRACE_UTIMENS:
+        ret = utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW);
+        break;
+    case OPTRACE_CREATE:
+    case OPTRACE_OPEN:
+        fd = open(path, rec->flags | ((rec->op == OPTRACE_CREATE) ? O_CREAT : 0),
+                  rec->mode & 07777);
+        if(fd < 0) {
+            return -errno;
+        }
+        setFD(rec->fh, fd);
+        break;
+    case OPTRACE_READ:
+        buf = workerBuf(w, rec->size);
+        if(fd < 0 || !buf) {
+            return (fd < 0) ? -EBADF : -ENOMEM;
+        }
+        ret = pread(fd, buf, rec->size, rec->offset);
+        break;
+    case OPTRACE_WRITE:
+        buf = workerBuf(w, rec->size);
+        if(fd < 0 || !buf) {
+            return (fd < 0) ? -EBADF : -ENOMEM;
+        }
+        memset(buf, 'r', rec->size);
+        ret = pwrite(fd, buf, rec->size, rec->offset);
+        break;
+    case OPTRACE_STATFS:
+        ret = statvfs(path ? path : dirPath, &stv);
+        break;
+    case OPTRACE_FALLOCATE:
+        ret = (fd < 0) ? -EBADF : fallocate(fd, rec->flags, rec->offset,
+                                            rec->size);
+        break;
+    case OPTRACE_COPY_FILE_RANGE:
+        if(fd < 0 || getFD(rec->aux) < 0) {
+            return -EBADF;
+        }
+        off = rec->offset;
+        off2 = rec->offset2;
+        ret = copy_file_range(fd, &off, getFD(rec->aux), &off2, rec->size, 0);
+        break;
+    case OPTRACE_LSEEK:
+        ret = (fd < 0) ? -EBADF : (lseek(fd, rec->offset, rec->flags) < 0 ? -1 : 0);
+        break;
+    case OPTRACE_FLUSH:
+        ret = (fd < 0) ? -EBADF : close(dup(fd));
+        break;
+    case OPTRACE_FSYNC:
+        ret = (fd < 0) ? -EBADF : (rec->flags ? fdatasync(fd) : fsync(fd));
+        break;
+    case OPTRACE_RELEASE:
+        fd = rec->fh ? __atomic_exchange_n(&handleFDs[rec->fh], -1,
+                                           __ATOMIC_ACQ_REL) : -1;
+        ret = (fd < 0) ? -EBADF : close(fd);
+        break;
+    case OPTRACE_LOCK:
+        if(fd < 0) {
+            return -EBADF;
+        }
+        memset(&lk, 0, sizeof(lk));
+        lk.l_type = rec->mode;
+        lk.l_whence = SEEK_SET;
+        lk.l_start = rec->offset;
+        lk.l_len = rec->size;
+        ret = fcntl(fd, rec->flags, &lk);
+        break;
+    case OPTRACE_FLOCK:
+        ret = (fd < 0) ? -EBADF : flock(fd, rec->flags);
+        break;
+    case OPTRACE_SETXATTR:
+        buf = workerBuf(w, rec->size ? rec->size : 1);
+        if(!buf) {
+            return -ENOMEM;
+        }
+        memset(buf, 'x', rec->size);
+        ret = lsetxattr(path, REPLAY_XATTR, buf, rec->size, rec->flags);
+        break;
+    case OPTRACE_GETXATTR:
+        buf = workerBuf(w, rec->size ? rec->size : 1);
+        ret = buf ? lgetxattr(path, REPLAY_XATTR, buf, rec->size) : -ENOMEM;
+        break;
+    case OPTRACE_LISTXATTR:
+        buf = workerBuf(w, rec->size ? rec->size : 1);
+        ret = buf ? llistxattr(path, buf, rec->size) : -ENOMEM;
+        break;
+    case OPTRACE_REMOVEXATTR:
+        ret = lremovexattr(path, REPLAY_XATTR);
+        break;
+    default:
+        return -ENOSYS;
+
+    }
+
+    return (ret < 0) ? ((ret == -1) ? -errno : ret) : ret;
+
+}
+
+static void* work(void* arg) {
+
+    worker_t* w = arg;
+    size_t i;
+    int ret;
+    uint64_t start;
+    uint64_t due;
+    struct timespec ts;
+    opTraceRecord_t* rec;
+    opStats_t* stats;
+
+    for(i = 0; i < w->numOps; i++) {
+
+        rec = &w->ops[i]->rec;
+        if(w->ops[i]->folded || rec->op >= OPTRACE_OPS) {
+            continue;
+        }
+
+        if(speed > 0) {
+            due = replayStart + (uint64_t) (rec->start / speed);
+            ts.tv_sec = due / 1000000000ULL;
+            ts.tv_nsec = due % 1000000000ULL;
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+                  EINTR) {
+                continue;
+            }
+        }
+
+        start = nowNS();
+        ret = replayOne(w, rec);
+        stats = &w->stats[rec->op];
+        stats->replayNS += nowNS() - start;
+        stats->tracedNS += rec->end - rec->start;
+        stats->num++;
+        if((ret < 0) != (rec->result < 0)) {
+            stats->mismatches++;
+        }
+
+    }
+
+    return NULL;
+
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-s speed] [-n] <trace> <dir>\n"
+            "  -s  speed-up over the traced timing; 0 replays without "
+            "waits (default 1)\n"
+            "  -n  don't make the files the trace expects to find\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+
+    int opt;
+    int noPrepare = 0;
+    int ret;
+    size_t i;
+    size_t num = 0;
+    size_t handles;
+    size_t numThreads = 0;
+    unsigned int op;
+    uint64_t val;
+    uint64_t elapsed;
+    uint64_t mismatches = 0;
+    replayOp_t* ops = NULL;
+    worker_t* workers = NULL;
+    opStats_t total[OPTRACE_OPS];
+
+    while((opt = getopt(argc, argv, "s:n")) != -1) {
+        switch(opt) {
+        case 's': speed = atof(optarg); break;
+        case 'n': noPrepare = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - 2 || speed < 0) {
+        usage(argv[0]);
+    }
+    snprintf(dirPath, sizeof(dirPath), "%s", argv[optind + 1]);
+    memset(data, 'p', sizeof(data));
+    rootHash = optrace_hash("/", 1);
+
+    ops = loadTrace(argv[optind], &num);
+    if(!ops) {
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < num; i++) {
+        if(ops[i].rec.path && ops[i].rec.path != rootHash) {
+            mapPut(&parents, ops[i].rec.path, ops[i].rec.dir);
+        }
+        if(ops[i].rec.thread >= numThreads) {
+            numThreads = ops[i].rec.thread + 1;
+        }
+    }
+    handles = numberHandles(ops, num);
+
+    handleFDs = malloc((handles + 1) * sizeof(*handleFDs));
+    handleDirs = calloc(handles + 1, sizeof(*handleDirs));
+    workers = calloc(numThreads, sizeof(*workers));
+    if(!handleFDs || !handleDirs || !workers) {
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i <= handles; i++) {
+        handleFDs[i] = -1;
+    }
+
+    if(!noPrepare) {
+        ret = prepare(ops, num, handles);
+        if(ret < 0) {
+            exit(EXIT_FAILURE);
+        }
+        printf("prepared %d paths\n", ret);
+    }
+
+    /* Each traced thread's ops, in start order */
+    for(i = 0; i < num; i++) {
+        workers[ops[i].rec.thread].numOps++;
+    }
+    for(i = 0; i < numThreads; i++) {
+        workers[i].ops = malloc((workers[i].numOps + 1) * sizeof(*workers[i].ops));
+        if(!workers[i].ops) {
+            exit(EXIT_FAILURE);
+        }
+        workers[i].numOps = 0;
+    }
+    for(i = 0; i < num; i++) {
+        workers[ops[i].rec.thread].ops[workers[ops[i].rec.thread].numOps++] = &ops[i];
+    }
+
+    replayStart = nowNS();
+    for(i = 0; i < numThreads; i++) {
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+    memset(total, 0, sizeof(total));
+    for(i = 0; i < numThreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        for(op = 0; op < OPTRACE_OPS; op++) {
+            total[op].num += workers[i].stats[op].num;
+            total[op].tracedNS += workers[i].stats[op].tracedNS;
+            total[op].replayNS += workers[i].stats[op].replayNS;
+            total[op].mismatches += workers[i].stats[op].mismatches;
+        }
+        free(workers[i].ops);
+        free(workers[i].buf);
+    }
+    elapsed = nowNS() - replayStart;
+
+    printf("replayed %zu ops on %zu threads in %.3fs (traced %.3fs, speed %g)\n",
+           num, numThreads, elapsed / 1e9, ops[num - 1].rec.end / 1e9, speed);
+    printf("%-16s %10s %12s %12s %10s\n", "op", "n", "traced us", "replay us",
+           "mismatch");
+    for(op = 0; op < OPTRACE_OPS; op++) {
+        if(!total[op].num) {
+            continue;
+        }
+        printf("%-16s %10"PRIu64" %12.1f %12.1f %10"PRIu64"\n",
+               optrace_opName(op), total[op].num,
+               total[op].tracedNS / 1000.0 / total[op].num,
+               total[op].replayNS / 1000.0 / total[op].num,
+               total[op].mismatches);
+        mismatches += total[op].mismatches;
+    }
+
+    for(i = 0; i <= handles; i++) {
+        if(handleFDs[i] >= 0) {
+            close(handleFDs[i]);
+        }
+        if(handleDirs[i]) {
+            closedir(handleDirs[i]);
+        }
+    }
+    for(i = 0; i < names.cap; i++) {
+        if(names.keys[i] && mapGet(&names, names.keys[i], &val)) {
+            free((char*) (uintptr_t) val);
+        }
+    }
+    free(names.keys);
+    free(names.vals);
+    free(parents.keys);
+    free(parents.vals);
+    free(handleFDs);
+    free(handleDirs);
+    free(workers);
+    free(ops);
+
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+
+}
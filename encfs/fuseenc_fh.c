@@ -18,6 +18,7 @@
 #define _GNU_SOURCE
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <ulockmgr.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,16 +31,37 @@
 #include <sys/time.h>
 #include <sys/xattr.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <fnmatch.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <linux/fs.h>
 
 #include "aes-crypt.h"
-#include "libcustos/custos_client.h"
+#include "chunk-crypt.h"
+#include "clear-cache.h"
+#include "custos-keys.h"
+#include "custos-session.h"
+#include "enc-format.h"
+#include "inode-table.h"
+#include "io-budget.h"
+#include "key-cache.h"
+#include "op-trace.h"
+#include "span-trace.h"
+#include "work-pool.h"
+#include "xattr-cache.h"
 
 typedef struct fuse_args fuse_args_t;
 typedef struct fuse_bufvec fuse_bufvec_t;
 typedef struct fuse_conn_info fuse_conn_info_t;
+typedef struct fuse_entry_param fuse_entry_param_t;
 typedef struct fuse_file_info fuse_file_info_t;
+typedef struct fuse_forget_data fuse_forget_data_t;
+typedef struct fuse_lowlevel_ops fuse_lowlevel_ops_t;
 
 typedef struct flock flock_t;
 typedef struct stat stat_t;
@@ -59,13 +81,58 @@ typedef struct timespec timespec_t;
 #define PATHDELIMINATOR '/'
 #define NULLTERM '\0'
 #define TMPNAME_PRE  "._"
-#define KEYBUFSIZE 1024
+#define KEYID_XATTR "user.custos.key"
+#define KEYIDSTRSIZE 37
+#define XATTR_CACHE_ENTRIES 4096
+#define KEY_CACHE_ENTRIES 4096
+#define XATTR_TTL_DEFAULT 1000
+#define ATOMIC_REPLACE_DEFAULT 1
+#define INTEGRITY_DEFAULT 1
+#define WARM_THREADS_DEFAULT 4
+#define REKEY_XATTR "user.encfs.rekey"
+#define REKEY_TAGSIZE 64
+#define REKEY_RATE_DEFAULT 16
+#define REKEY_IDLE_MS 100
+#define REKEY_SLICE (1024 * 1024)
+#define REKEY_RETRY_SEC 60
+#define REPLACE_LOCKS 64
+#define SPANS_SIGNAL SIGUSR1
+#define PROCFDPATHSIZE 64
+#define XATTRLISTSIZE 65536
+#define PATTERN_DELIMINATOR ':'
+#define STREAM_NOCLEAR ((uint64_t) -1)
+#define LL_TIMEOUT 1.0
+#define LL_KEYSIZE 48
+
+/* Plain byte range of a file */
+typedef struct byteRange {
+    uint64_t offset;
+    uint64_t length;
+} byteRange_t;
+
+/* What a save writes out: the chunks changed, and the range punched
+ * since the last save, whose holes then give back their space */
+typedef struct dirtySet {
+    chunkMap_t  chunks;
+    byteRange_t punch;
+} dirtySet_t;
 
 typedef struct enc_fhs {
     uint64_t encFH;
-    uint64_t clearFH;
-    char     dirty;
-    char     padding[7];
+    uint64_t     clearFH;
+    keyHandle_t* key;
+    dirtySet_t   pending;       /* under dirtyLock, with dirty */
+    byteRange_t* reserved;      /* fallocated ranges, under saveLock */
+    size_t       numReserved;
+    pthread_mutex_t dirtyLock;
+    pthread_mutex_t saveLock;   /* held by one save at a time */
+    const encFormat_t* format;  /* of the backing file, once known */
+    void*        stream;        /* streaming: no clear file */
+    clearFile_t* clear;         /* clear file filled lazily, under budget */
+    inodeEntry_t* inode;        /* low-level mount: inode opened */
+    char         dirty;
+    char         passthrough;   /* encFH only: no key, no ciphertext */
+    char         padding[6];
 } enc_fhs_t;
 
 static inline enc_fhs_t* get_fhs(uint64_t fh) {
@@ -76,6 +143,37 @@ static inline uint64_t put_fhs(enc_fhs_t* fhs) {
     return (uint64_t) fhs;
 }
 
+static enc_fhs_t* newFHS(void) {
+
+    enc_fhs_t* fhs = NULL;
+
+    fhs = calloc(1, sizeof(*fhs));
+    if(!fhs) {
+        return NULL;
+    }
+    pthread_mutex_init(&fhs->dirtyLock, NULL);
+    pthread_mutex_init(&fhs->saveLock, NULL);
+
+    return fhs;
+
+}
+
+static void freeFHS(enc_fhs_t* fhs) {
+
+    pthread_mutex_destroy(&fhs->dirtyLock);
+    pthread_mutex_destroy(&fhs->saveLock);
+    chunkmap_free(&fhs->pending.chunks);
+    free(fhs->reserved);
+    free(fhs);
+
+}
+
+/* fd holding the plain text of an open file: the clear file, or the
+ * backing file itself for streams and passthrough files */
+static inline int dataFH(const enc_fhs_t* fhs) {
+    return (fhs->stream || fhs->passthrough) ? fhs->encFH : fhs->clearFH;
+}
+
 typedef struct enc_dirp {
     DIR *dp;
     struct dirent *entry;
@@ -86,129 +184,268 @@ static inline enc_dirp_t* get_dirp(fuse_file_info_t* fi) {
     return (enc_dirp_t*) (uintptr_t) fi->fh;
 }
 
+typedef struct rekeyStats {
+    uint64_t files;     /* moved to a new key */
+    uint64_t rewrapped; /* of them, by rewrapping their data key */
+    uint64_t bytes;     /* re-encrypted */
+    uint64_t current;   /* already rotated */
+    uint64_t busy;      /* open meanwhile, left for the next pass */
+    uint64_t skipped;   /* hard-linked, or gone */
+    uint64_t failed;
+    uint64_t passes;
+} rekeyStats_t;
+
 typedef struct fsState {
-    char* basePath;
+    char*            basePath;
+    keyCache_t*      keyCache;
+    custosSession_t* session;
+    int              useCustos;
+    char*            custosURL;
+    unsigned int     custosConns;
+    xattrCache_t*    xattrCache;
+    int              xattrTTL;
+    int              atomicReplace;
+    char*            streamPaths;
+    char*            passthroughPaths;
+    char*            compress;
+    int              compressLevel;
+    int              integrity;
+    int              lowLevel;
+    inodeTable_t*    inodes;
+    char*            tracePath;
+    opTrace_t*       trace;
+    char*            warmPaths;
+    unsigned int     warmThreads;
+    workPool_t*      workers;
+    char*            rekeyTag;
+    unsigned int     rekeyRate;
+    ioBudget_t*      budget;
+    workPool_t*      rekeyer;
+    rekeyStats_t     rekeyStats;
+    unsigned int     clearBudget;
+    clearCache_t*    clearCache;
+    char*            spansPath;
+    spanTrace_t*     spans;
 } fsState_t;
 
 #define GOOD_PSK "It's A Trap!"
 #define UUID "1b4e28ba-2fa1-11d2-883f-b9a761bde3fb"
 #define SERVER_URL "http://custos:5000"
 
-static int getCustosKey(char* buf, size_t bufSize) {
+/* Set by main: the high-level API's private_data, the low-level
+ * API's userdata */
+static fsState_t* fsState = NULL;
 
-    uuid_t uuid;
-    custosReq_t*     req     = NULL;
-    custosKey_t*     key     = NULL;
-    custosKeyReq_t*  keyreq  = NULL;
-    custosAttr_t*    attr    = NULL;
-    custosAttrReq_t* attrreq = NULL;
-    custosRes_t*     res     = NULL;
+static fsState_t* getState(void) {
+    return fsState;
+}
 
-    /* Setup a new request */
-    req = custos_createReq(SERVER_URL);
-    if(!req) {
-        fprintf(stderr, "ERROR getCustosKey: custos_createKeyReq() failed\n");
-        return RETURN_FAILURE;
-    }
+/* Phase spans, or NULL if not kept */
+static spanTrace_t* getSpans(void) {
+    return fsState ? fsState->spans : NULL;
+}
 
-    /* Add Key to Request */
-    if(uuid_parse(UUID, uuid) < 0) {
-        fprintf(stderr, "ERROR getCustosKey: uuid_parse() failed\n");
-        return RETURN_FAILURE;
-    }
-    key = custos_createKey(uuid, 1, 0, NULL);
-    if(!key) {
-        fprintf(stderr, "ERROR getCustosKey: custos_createKey() failed\n");
-        return RETURN_FAILURE;
-    }
-    keyreq = custos_createKeyReq(true);
-    if(!keyreq) {
-        fprintf(stderr, "ERROR getCustosKey: custos_createKeyReq() failed\n");
-        return RETURN_FAILURE;
-    }
-    if(custos_updateKeyReqAddKey(keyreq, key) < 0) {
-        fprintf(stderr, "ERROR getCustosKey: custos_updateKeyReqAddKey() failed\n");
-        return RETURN_FAILURE;
-    }
-    if(custos_updateReqAddKeyReq(req, keyreq) < 0) {
-        fprintf(stderr, "ERROR getCustosKey: custos_updateReqAddKeyReq() failed\n");
-        return RETURN_FAILURE;
-    }
+/* Turn a KEYID_XATTR lookup result into a key ID
+ * Files written before per-file keys have no xattr and use the UUID key */
+static int parseKeyID(const char* val, ssize_t size, uuid_t keyID) {
 
-    /* Add attr to request */
-    attr = custos_createAttr(CUS_ATTRCLASS_EXPLICIT, CUS_ATTRTYPE_EXP_PSK, 0,
-                             (strlen(GOOD_PSK) + 1), (uint8_t*) GOOD_PSK);
-    if(!attr) {
-        fprintf(stderr, "ERROR getCustosKey: custos_createAttr() failed\n");
-        return RETURN_FAILURE;
-    }
-    attrreq = custos_createAttrReq(true);
-    if(!attrreq) {
-        fprintf(stderr, "ERROR getCustosKey: custos_createAttrReq() failed\n");
-        return RETURN_FAILURE;
+    char buf[KEYIDSTRSIZE];
+
+    if(size < 0) {
+        if(errno != ENODATA && errno != ENOTSUP) {
+            perror("ERROR parseKeyID");
+            return -errno;
+        }
+        uuid_parse(UUID, keyID);
+        return RETURN_SUCCESS;
     }
-    if(custos_updateAttrReqAddAttr(attrreq, attr) < 0) {
-        fprintf(stderr, "ERROR getCustosKey: custos_updateAttrReqAddAttr() failed\n");
-        return RETURN_FAILURE;
+
+    if(size != (KEYIDSTRSIZE - 1)) {
+        fprintf(stderr, "ERROR parseKeyID: bad key ID length %zd\n", size);
+        return -EINVAL;
     }
-    if(custos_updateReqAddAttrReq(req, attrreq) < 0) {
-        fprintf(stderr, "ERROR getCustosKey: custos_updateReqAddAttrReq() failed\n");
-        return RETURN_FAILURE;
+    memcpy(buf, val, size);
+    buf[size] = NULLTERM;
+
+    if(uuid_parse(buf, keyID) < 0) {
+        fprintf(stderr, "ERROR parseKeyID: uuid_parse(%s) failed\n", buf);
+        return -EINVAL;
     }
 
-    /* Get Response */
-    res = custos_getRes(req);
-    if(!res) {
-    	fprintf(stderr, "ERROR getCustosKey: custos_getRes() failed\n");
-    	return RETURN_FAILURE;
+    return RETURN_SUCCESS;
+
+}
+
+static int getFileKeyID(const char* fullPath, uuid_t keyID) {
+
+    char val[KEYIDSTRSIZE];
+
+    return parseKeyID(val, lgetxattr(fullPath, KEYID_XATTR, val, sizeof(val)),
+                      keyID);
+
+}
+
+static int getFDKeyID(int fd, uuid_t keyID) {
+
+    char val[KEYIDSTRSIZE];
+
+    return parseKeyID(val, fgetxattr(fd, KEYID_XATTR, val, sizeof(val)), keyID);
+
+}
+
+/* Give a newly created file its own key ID
+ * If the file already had one, or the backing FS has no user xattrs,
+ * report the key ID the file will actually be read with */
+static int setFDKeyID(int fd, uuid_t keyID) {
+
+    char val[KEYIDSTRSIZE];
+
+    uuid_generate(keyID);
+    uuid_unparse_lower(keyID, val);
+
+    if(fsetxattr(fd, KEYID_XATTR, val, KEYIDSTRSIZE - 1, XATTR_CREATE) < 0) {
+        if(errno == ENOTSUP) {
+            fprintf(stderr, "WARNING setFDKeyID: no user xattrs, using shared key\n");
+        }
+        else if(errno != EEXIST) {
+            perror("ERROR setFDKeyID");
+            return -errno;
+        }
+        return getFDKeyID(fd, keyID);
     }
 
-    /* Extract Key */
-    if(res->status != CUS_RESSTAT_ACCEPTED) {
-    	fprintf(stderr, "ERROR getCustosKey: Bad response status %d\n", res->status);
-    	return RETURN_FAILURE;
+    /* A new key needs no rotation */
+    if(getState()->rekeyTag &&
+       fsetxattr(fd, REKEY_XATTR, getState()->rekeyTag,
+                 strlen(getState()->rekeyTag), 0) < 0) {
+        perror("WARNING setFDKeyID: rekey tag");
     }
-    if(res->num_keys != 1) {
-    	fprintf(stderr, "ERROR getCustosKey: Bad number of keys: %zd\n", res->num_keys);
-    	return RETURN_FAILURE;
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Take a ready key handle for keyID, from the key cache if possible */
+static keyHandle_t* acquireKey(const uuid_t keyID) {
+
+    keyHandle_t* key = NULL;
+    fsState_t* state = getState();
+    span_t span;
+
+    if(!state->keyCache) {
+        fprintf(stderr, "ERROR acquireKey: no key cache\n");
+        return NULL;
     }
-    if(!res->keys[0]) {
-    	fprintf(stderr, "ERROR getCustosKey: Key response struct must not be NULL\n");
-    	return RETURN_FAILURE;
+
+    spantrace_begin(getSpans(), &span, SPAN_KEY, "key cache");
+
+    key = keycache_acquire(state->keyCache, keyID);
+    if(key) {
+        goto CLEANUP;
     }
-    if(res->keys[0]->status != CUS_KEYSTAT_ACCEPTED) {
-    	fprintf(stderr, "ERROR getCustosKey: Bad key response status: %d\n", res->keys[0]->status);
-    	return RETURN_FAILURE;
+
+    if(!state->useCustos) {
+        span.name = "test key";
+        if(keycache_put(state->keyCache, keyID,
+                        (const uint8_t*) TESTKEY, strlen(TESTKEY)) < 0) {
+            fprintf(stderr, "ERROR acquireKey: keycache_put() failed\n");
+            goto CLEANUP;
+        }
+        key = keycache_acquire(state->keyCache, keyID);
+        goto CLEANUP;
     }
-    if(!res->keys[0]->key) {
-    	fprintf(stderr, "ERROR getCustosKey: Key struct must not be NULL\n");
-    	return RETURN_FAILURE;
+
+    span.name = "custos fetch";
+    if(!state->session) {
+        fprintf(stderr, "ERROR acquireKey: no custos session\n");
+        goto CLEANUP;
     }
-    if(!res->keys[0]->key->val) {
-    	fprintf(stderr, "ERROR getCustosKey: Key value must not be NULL\n");
-    	return RETURN_FAILURE;
+
+    key = custosKeys_acquire(state->keyCache, state->session, keyID);
+    if(!key) {
+        fprintf(stderr, "ERROR acquireKey: custosKeys_acquire() failed\n");
     }
-    if(res->keys[0]->key->size >= bufSize) {
-    	fprintf(stderr, "ERROR getCustosKey: keySize %zd larger than bufSize %zd\n",
-                res->keys[0]->key->size, bufSize);
-    	return RETURN_FAILURE;
+
+ CLEANUP:
+    spantrace_end(getSpans(), &span, key ? RETURN_SUCCESS : -ENOKEY);
+    return key;
+
+}
+
+/* Drop cached xattrs for a path whose inode or metadata just changed */
+static void invalidateXattrs(const char* fullPath) {
+    xattrcache_invalidate(getState()->xattrCache, fullPath);
+}
+
+/* Fetch the keys for every regular file in dp in as few custos
+ * requests as possible, so the opens that follow hit the key cache */
+static int prefetchDirKeys(DIR* dp, const char* dirPath) {
+
+    int ret = RETURN_SUCCESS;
+    size_t num = 0;
+    size_t cap = 0;
+    uuid_t* keyIDs = NULL;
+    uuid_t* tmp = NULL;
+    struct dirent* entry = NULL;
+    char filePath[PATHBUFSIZE];
+    stat_t st;
+    fsState_t* state = getState();
+
+    if(!state->session) {
+        return RETURN_SUCCESS;
     }
-    strncpy(buf, (char*) res->keys[0]->key->val, res->keys[0]->key->size);
-    buf[res->keys[0]->key->size] = '\0';
 
-    /* Free Response */
-    if(custos_destroyRes(&res) < 0) {
-        fprintf(stderr, "ERROR getCustosKey: custos_destroyRes() failed\n");
-        return RETURN_FAILURE;
+    while((entry = readdir(dp)) != NULL) {
+
+        ret = snprintf(filePath, sizeof(filePath), "%s%c%s",
+                       dirPath, PATHDELIMINATOR, entry->d_name);
+        if(ret > (int)(sizeof(filePath) - 1)) {
+            continue;
+        }
+
+        if(entry->d_type == DT_UNKNOWN) {
+            if(lstat(filePath, &st) < 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+        }
+        else if(entry->d_type != DT_REG) {
+            continue;
+        }
+
+        if(num == cap) {
+            cap = cap ? (cap * 2) : CUSTOS_KEYS_PER_REQ;
+            tmp = realloc(keyIDs, cap * sizeof(*keyIDs));
+            if(!tmp) {
+                fprintf(stderr, "ERROR prefetchDirKeys: realloc failed\n");
+                ret = -ENOMEM;
+                goto CLEANUP;
+            }
+            keyIDs = tmp;
+        }
+
+        if(getFileKeyID(filePath, keyIDs[num]) < 0) {
+            fprintf(stderr, "ERROR prefetchDirKeys: getFileKeyID(%s) failed\n",
+                    filePath);
+            continue;
+        }
+        num++;
+
     }
 
-    /* Free Request */
-    if(custos_destroyReq(&req) < 0) {
-        fprintf(stderr, "ERROR getCustosKey: custos_destroyReq() failed\n");
-        return RETURN_FAILURE;
+    ret = custosKeys_fetch(state->keyCache, state->session,
+                           (const uuid_t*) keyIDs, num);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR prefetchDirKeys: custosKeys_fetch() failed\n");
+        goto CLEANUP;
     }
 
-    return RETURN_SUCCESS;
+    fprintf(stderr, "INFO prefetchDirKeys: %zd files, %d keys fetched\n", num, ret);
+    ret = RETURN_SUCCESS;
+
+ CLEANUP:
+    rewinddir(dp);
+    free(keyIDs);
+    return ret;
 
 }
 
@@ -232,7 +469,7 @@ static int buildPath(const char* path, char* fullPath, size_t fullSize) {
     fprintf(stderr, "INFO buildPath: path = %s\n", path);
 
     /* Get State */
-    state = (fsState_t*)(fuse_get_context()->private_data);
+    state = getState();
     if(state == NULL) {
         fprintf(stderr, "ERROR buildPath: state must not be NULL\n");
         return -EINVAL;
@@ -300,11 +537,164 @@ static int buildTmpPath(const char* path, char* tmpPath, size_t tmpSize) {
 
 }
 
-static enc_fhs_t* createFilePair(const char* encPath, int flags, mode_t mode) {
+/* Dirty chunks
+ *
+ * Writers mark what they changed in the handle's dirty map, under
+ * dirtyLock, once the clear file holds it. A save takes the whole map
+ * from under the lock, leaving an empty one, and encrypts the chunks it
+ * took; writes landing meanwhile are marked in the new map and go out
+ * with the next save. A save that fails puts its chunks back.
+ */
+
+/* Mark plain bytes [offset, offset + length) of fhs changed since its
+ * last save */
+static void markDirty(enc_fhs_t* fhs, off_t offset, off_t length) {
+
+    pthread_mutex_lock(&fhs->dirtyLock);
+    fhs->dirty = FHS_DIRTY;
+    chunkmap_mark(&fhs->pending.chunks, offset, length);
+    pthread_mutex_unlock(&fhs->dirtyLock);
+
+}
+
+/* Grow range to cover [offset, offset + length) as well */
+static void coverRange(byteRange_t* range, uint64_t offset, uint64_t length) {
+
+    uint64_t end;
+
+    if(range->length == 0) {
+        range->offset = offset;
+        range->length = length;
+        return;
+    }
+    end = range->offset + range->length;
+    if(offset + length > end) {
+        end = offset + length;
+    }
+    if(offset < range->offset) {
+        range->offset = offset;
+    }
+    range->length = end - range->offset;
+
+}
+
+/* Mark plain bytes [offset, offset + length) of fhs punched: changed,
+ * and with their chunks' space to give back once saved as holes. Space
+ * of chunks the saved file lists is kept, so the range may cover more. */
+static void markPunch(enc_fhs_t* fhs, off_t offset, off_t length) {
+
+    pthread_mutex_lock(&fhs->dirtyLock);
+    fhs->dirty = FHS_DIRTY;
+    chunkmap_mark(&fhs->pending.chunks, offset, length);
+    coverRange(&fhs->pending.punch, offset, length);
+    pthread_mutex_unlock(&fhs->dirtyLock);
+
+}
+
+/* Record a size change of the clear file: the chunk at the old end
+ * changes length and everything between the two ends is new or gone */
+static void markResize(enc_fhs_t* fhs, off_t oldSize, off_t newSize) {
+
+    if(oldSize < newSize) {
+        markDirty(fhs, oldSize, newSize - oldSize);
+    }
+    else if(oldSize > newSize) {
+        markDirty(fhs, newSize, oldSize - newSize);
+    }
+
+}
+
+/* Move the dirty set of fhs to taken and mark fhs clean
+ * Return: Whether fhs was dirty */
+static int takeDirty(enc_fhs_t* fhs, dirtySet_t* taken) {
+
+    int dirty;
+
+    pthread_mutex_lock(&fhs->dirtyLock);
+    dirty = (fhs->dirty == FHS_DIRTY);
+    *taken = fhs->pending;
+    memset(&fhs->pending, 0, sizeof(fhs->pending));
+    fhs->dirty = FHS_CLEAN;
+    pthread_mutex_unlock(&fhs->dirtyLock);
+
+    return dirty;
+
+}
+
+/* Give the dirty set of a failed save back to fhs */
+static void restoreDirty(enc_fhs_t* fhs, const dirtySet_t* taken) {
+
+    pthread_mutex_lock(&fhs->dirtyLock);
+    fhs->dirty = FHS_DIRTY;
+    chunkmap_merge(&fhs->pending.chunks, &taken->chunks);
+    if(taken->punch.length) {
+        coverRange(&fhs->pending.punch, taken->punch.offset,
+                   taken->punch.length);
+    }
+    pthread_mutex_unlock(&fhs->dirtyLock);
+
+}
+
+/* Open the clear file for a new file pair, unlinked straight away so
+ * no error path can leave plain text behind in the backing directory */
+static int openClearFile(const char* encPath) {
 
     int ret;
+    int fd;
     char tmpPath[PATHBUFSIZE];
+    span_t span;
+
+    /* Build tmpPath */
+    ret = buildTmpPath(encPath, tmpPath, sizeof(tmpPath));
+    if(ret < 0) {
+        fprintf(stderr, "ERROR openClearFile: buildTempPath() failed\n");
+        return ret;
+    }
+
+    /* Open tmpPath */
+    spantrace_begin(getSpans(), &span, SPAN_IO, "clear file");
+    fd = mkostemp(tmpPath, O_CLOEXEC);
+    spantrace_end(getSpans(), &span, fd);
+    if(fd < 0) {
+        fprintf(stderr, "ERROR openClearFile: open(clearPath) failed\n");
+        perror("ERROR openClearFile");
+        return -errno;
+    }
+
+    /* Unlink tmpPath */
+    if(unlink(tmpPath) < 0) {
+        ret = -errno;
+        fprintf(stderr, "ERROR openClearFile: unlink failed\n");
+        perror("ERROR openClearFile");
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+
+}
+
+/* Undo a file pair that failed part way through opening */
+static void abandonFilePair(enc_fhs_t* fhs, int encFD, int clearFD) {
+
+    if(clearFD >= 0) {
+        close(clearFD);
+    }
+    if(encFD >= 0) {
+        close(encFD);
+    }
+    freeFHS(fhs);
+
+}
+
+static enc_fhs_t* createFilePair(const char* encPath, int flags, mode_t mode) {
+
+    int ret;
+    int encFD = -1;
+    int clearFD = -1;
+    uuid_t keyID;
     enc_fhs_t* fhs = NULL;
+    span_t span;
 
     fprintf(stderr, "DEBUG createFilePair called\n");
 
@@ -314,58 +704,63 @@ static enc_fhs_t* createFilePair(const char* encPath, int flags, mode_t mode) {
         return NULL;
     }
 
-    /* Build tmpPath */
-    ret = buildTmpPath(encPath, tmpPath, sizeof(tmpPath));
-    if(ret < 0) {
-        fprintf(stderr, "ERROR createFilePair: buildTempPath() failed\n");
-        return NULL;
-    }
-
     /* Create fhs */
-    fhs = malloc(sizeof(*fhs));
+    fhs = newFHS();
     if(!fhs) {
-        fprintf(stderr, "ERROR createFilePair: malloc failed\n");
+        fprintf(stderr, "ERROR createFilePair: calloc failed\n");
         perror("ERROR createFilePair");
         return NULL;
     }
 
     /* Open encPath */
-    ret = open(encPath, flags, mode);
-    if(ret < 0) {
+    spantrace_begin(getSpans(), &span, SPAN_IO, "open backing");
+    encFD = open(encPath, flags, mode);
+    spantrace_end(getSpans(), &span, encFD);
+    if(encFD < 0) {
         fprintf(stderr, "ERROR createFilePair: open(encPath) failed\n");
         perror("ERROR createFilePair");
-        return NULL;
+        goto CLEANUP;
     }
-    fhs->encFH = ret;
 
     /* Open tmpPath */
-    ret = mkostemp(tmpPath, O_CLOEXEC);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR createFilePair: open(clearPath) failed\n");
-        perror("ERROR createFilePair");
-        return NULL;
+    clearFD = openClearFile(encPath);
+    if(clearFD < 0) {
+        fprintf(stderr, "ERROR createFilePair: openClearFile() failed\n");
+        goto CLEANUP;
     }
-    fhs->clearFH = ret;
 
-    /* Unlink tmpPath */
-    ret = unlink(tmpPath);
+    /* Assign Key ID */
+    ret = setFDKeyID(encFD, keyID);
     if(ret < 0) {
-        fprintf(stderr, "ERROR createFilePairFile: unlink failed\n");
-        perror("ERROR createFilePair");
-        return NULL;
+        fprintf(stderr, "ERROR createFilePair: setFDKeyID() failed\n");
+        goto CLEANUP;
+    }
+    fhs->key = acquireKey(keyID);
+    if(!fhs->key) {
+        fprintf(stderr, "ERROR createFilePair: acquireKey() failed\n");
+        goto CLEANUP;
     }
 
     /* Return */
+    fhs->encFH = encFD;
+    fhs->clearFH = clearFD;
     return fhs;
 
+ CLEANUP:
+    abandonFilePair(fhs, encFD, clearFD);
+    return NULL;
+
 }
 
 static enc_fhs_t* openFilePair(const char* encPath, int flags) {
 
     int ret;
     int newflags;
-    char tmpPath[PATHBUFSIZE];
+    int encFD = -1;
+    int clearFD = -1;
+    uuid_t keyID;
     enc_fhs_t* fhs = NULL;
+    span_t span;
 
     fprintf(stderr, "DEBUG openFilePair called\n");
 
@@ -379,54 +774,62 @@ static enc_fhs_t* openFilePair(const char* encPath, int flags) {
         newflags = flags;
     }
 
-    /* Build tmpPath */
-    ret = buildTmpPath(encPath, tmpPath, sizeof(tmpPath));
-    if(ret < 0) {
-        fprintf(stderr, "ERROR createFilePair: buildTempPath() failed\n");
-        return NULL;
-    }
+    /* The ciphertext is written at fixed chunk offsets, through the page
+       cache, whatever the caller asked for */
+    newflags &= ~(O_APPEND | O_DIRECT);
 
     /* Create fhs */
-    fhs = malloc(sizeof(*fhs));
+    fhs = newFHS();
     if(!fhs) {
-        fprintf(stderr, "ERROR openFilePair: malloc failed\n");
+        fprintf(stderr, "ERROR openFilePair: calloc failed\n");
         perror("ERROR openFilePair");
         return NULL;
     }
 
     /* Open encPath */
-    ret = open(encPath, newflags);
-    if(ret < 0) {
+    spantrace_begin(getSpans(), &span, SPAN_IO, "open backing");
+    encFD = open(encPath, newflags);
+    spantrace_end(getSpans(), &span, encFD);
+    if(encFD < 0) {
         fprintf(stderr, "ERROR openFilePair: open(encPath) failed\n");
         perror("ERROR openFilePair");
-        return NULL;
+        goto CLEANUP;
     }
-    fhs->encFH = ret;
 
     /* Open tmpPath */
-    ret = mkostemp(tmpPath, O_CLOEXEC);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR openFilePair: open(clearPath) failed\n");
-        perror("ERROR openFilePair");
-        return NULL;
+    clearFD = openClearFile(encPath);
+    if(clearFD < 0) {
+        fprintf(stderr, "ERROR openFilePair: openClearFile() failed\n");
+        goto CLEANUP;
     }
-    fhs->clearFH = ret;
 
-    /* Unlink tmpPath */
-    ret = unlink(tmpPath);
+    /* Lookup Key */
+    ret = getFDKeyID(encFD, keyID);
     if(ret < 0) {
-        fprintf(stderr, "ERROR createFilePairFile: unlink failed\n");
-        perror("ERROR createFilePair");
-        return NULL;
+        fprintf(stderr, "ERROR openFilePair: getFDKeyID() failed\n");
+        goto CLEANUP;
+    }
+    fhs->key = acquireKey(keyID);
+    if(!fhs->key) {
+        fprintf(stderr, "ERROR openFilePair: acquireKey() failed\n");
+        goto CLEANUP;
     }
 
     /* Return */
+    fhs->encFH = encFD;
+    fhs->clearFH = clearFD;
     return fhs;
 
+ CLEANUP:
+    abandonFilePair(fhs, encFD, clearFD);
+    return NULL;
+
 }
 
 static int closeFilePair(enc_fhs_t* fhs) {
 
+    int ret;
+
     fprintf(stderr, "DEBUG closeFilePair called\n");
 
     if(!fhs) {
@@ -434,868 +837,1133 @@ static int closeFilePair(enc_fhs_t* fhs) {
         return -EINVAL;
     }
 
+    if(fhs->stream) {
+        ret = fhs->format->close(fhs->stream);
+        fhs->stream = NULL;
+        if(ret < 0) {
+            fprintf(stderr, "ERROR closeFilePair: %s close failed\n",
+                    fhs->format->name);
+            return ret;
+        }
+    }
+
+    /* Evictions punch the clear file, and fills read encFH */
+    clearcache_close(fhs->clear);
+    fhs->clear = NULL;
+
     if(close(fhs->encFH) < 0) {
         fprintf(stderr, "ERROR closeFilePair: close(encFH) failed\n");
         perror("ERROR enc_release");
         return -errno;
     }
 
-    if(close(fhs->clearFH) < 0) {
+    if(fhs->clearFH != STREAM_NOCLEAR && close(fhs->clearFH) < 0) {
         fprintf(stderr, "ERROR closeFilePair: close(clearFH) failed\n");
         perror("ERROR enc_release");
         return -errno;
     }
 
-    free(fhs);
+    keycache_release(fhs->key);
+    freeFHS(fhs);
 
     return RETURN_SUCCESS;
 
 }
 
-static int decryptFH(const uint64_t encFH, const uint64_t clearFH) {
-
-    int ret = RETURN_SUCCESS;
-    int encFD;
-    int clearFD;
-    off_t encOffset;
-    off_t clearOffset;
-    FILE* encFP = NULL;
-    FILE* clearFP = NULL;
-    /* char key[KEYBUFSIZE]; */
-    char* key = NULL;
+/* Does path (relative to the mount) match one of the ':'-separated
+ * fnmatch(3) patterns in list */
+static int matchPath(const char* list, const char* path, int flags) {
 
-    fprintf(stderr, "DEBUG decryptFH called\n");
+    int ret = 0;
+    char* patterns = NULL;
+    char* pattern = NULL;
+    char* next = NULL;
 
-    /* Get Custos Key */
-    /* ret = getCustosKey(key, sizeof(key)); */
-    /* if(ret  < 0) { */
-    /*     fprintf(stderr, "ERROR decryptFH: getCustosKey failed\n"); */
-    /*     goto CLEANUP_0; */
-    /* } */
-    key = TESTKEY;
-
-    /* Save and Rewind Input Offset */
-    encOffset = lseek(encFH, 0, SEEK_CUR);
-    if(encOffset < 0) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR decryptFH: Save enc lseek(%"PRIu64") failed with error %d\n",
-                encFH, -ret);
-        goto CLEANUP_0;
-    }
-    ret = lseek(encFH, 0, SEEK_SET);
-    if(ret < 0) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR decryptFH: Rewind enc lseek(%"PRIu64") failed with error %d\n",
-                encFH, -ret);
-        goto CLEANUP_0;
+    if(!path || !*path || !list) {
+        return 0;
     }
 
-    /* Save, Rewind, and Truncate Output */
-    clearOffset = lseek(clearFH, 0, SEEK_CUR);
-    if(clearOffset < 0) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR decryptFH: Save clr lseek(%"PRIu64") failed with error %d\n",
-                clearFH, -ret);
-        goto CLEANUP_1;
-    }
-    ret = lseek(clearFH, 0, SEEK_SET);
-    if(ret < 0) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR decryptFH: Rewind clr lseek(%"PRIu64") failed with error %d\n",
-                clearFH, -ret);
-        goto CLEANUP_1;
+    patterns = strdup(list);
+    if(!patterns) {
+        return 0;
     }
-    ret = ftruncate(clearFH, 0);
-    if(ret < 0) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR decryptFH: clr ftruncate(%"PRIu64") failed with error %d\n",
-                clearFH, -ret);
-        goto CLEANUP_2;
+    for(pattern = patterns; pattern && !ret; pattern = next) {
+        next = strchr(pattern, PATTERN_DELIMINATOR);
+        if(next) {
+            *next++ = NULLTERM;
+        }
+        ret = (*pattern && fnmatch(pattern, path, flags) == 0);
     }
+    free(patterns);
 
-    /* Dup and get FILE* for encFH */
-    encFD = dup(encFH);
-    if(ret < 0) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR decryptFH: encFH dup(%"PRIu64") failed with error %d\n",
-                encFH, -ret);
-        goto CLEANUP_3;
-    }
-    encFP = fdopen(encFD, "r");
-    if(!encFP) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR decryptFH: encFH fdopen(%d) failed with error %d\n",
-                encFD, -ret);
-        goto CLEANUP_4;
-    }
+    return ret;
 
-    /* Dup and get FILE* for clearFH */
-    clearFD = dup(clearFH);
-    if(ret < 0) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR decryptFH: clearFH dup(%"PRIu64") failed with error %d\n",
-                clearFH, -ret);
-        goto CLEANUP_5;
-    }
-    clearFP = fdopen(clearFD, "w");
-    if(!clearFP) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR decryptFH: clearFH fdopen(%d) failed with error %d\n",
-                clearFD, -ret);
-        goto CLEANUP_6;
-    }
+}
 
-    /* Decrypt */
-    ret = crypt_decrypt(encFP, clearFP, key);
-    //ret = crypt_copy(encFP, clearFP);
-    if(ret < 0) {
-        fprintf(stderr,
-		"ERROR decryptFH: crypt_decrypt() failed\n");
-        goto CLEANUP_7;
-    }
+/* Does path match one of the -o stream patterns */
+static int isStreamPath(const char* path) {
+    return matchPath(getState()->streamPaths, path, 0);
+}
 
- CLEANUP_7:
-    /* Cleanup clearFP */
-    if(fclose(clearFP)) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: fclose(clearFP) failed with error %d\n",
-                -ret);
-    }
-    goto CLEANUP_5;
+/* Is path under the -o passthrough policy: stored unencrypted and served
+ * straight from the backing file. A pattern also covers everything
+ * below what it matches, so a directory's path covers its subtree. */
+static int isPassthroughPath(const char* path) {
+    return matchPath(getState()->passthroughPaths, path, FNM_LEADING_DIR);
+}
 
- CLEANUP_6:
-    /* Cleanup Duped clearFD */
-    if(close(clearFD)) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: close(clearFD) failed with error %d\n",
-                -ret);
-    }
+/* Renames and links can't move a file across policies: its backing
+ * bytes would be read the other way. EXDEV makes mv and cp copy it. */
+static int checkPolicy(const char* from, const char* to) {
 
- CLEANUP_5:
-    /* Cleanup encFP */
-    if(fclose(encFP)) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: fclose(encFP) failed with error %d\n",
-                -ret);
+    if(isPassthroughPath(from) != isPassthroughPath(to)) {
+        return -EXDEV;
     }
-    goto CLEANUP_3;
 
- CLEANUP_4:
-    /* Cleanup Duped encFD */
-    if(close(encFD)) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: close(encFD) failed with error %d\n",
-                -ret);
-    }
+    return RETURN_SUCCESS;
 
- CLEANUP_3:
-    /* No Cleanup */
+}
 
- CLEANUP_2:
-    /* Restore Output Offset*/
-    ret = lseek(clearFH, clearOffset, SEEK_SET);
-    if(ret < 0) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: Restore clr lseek(%"PRIu64") failed, error %d\n",
-                encFH, -ret);
+/* int openPassthrough(const char* fullPath, int flags, mode_t mode,
+ *                     int create, enc_fhs_t** pfhs)
+ *
+ * Purpose: Open fullPath for passthrough, as fusemir_fh does: reads and
+ *          writes go straight to the backing fd, with no key, clear file
+ *          or ciphertext. With create, fullPath is created with mode.
+ *
+ * Return: 0 and *pfhs set on success, negative errno on error
+ */
+static int openPassthrough(const char* fullPath, int flags, mode_t mode,
+                           int create, enc_fhs_t** pfhs) {
+
+    int ret;
+    int fd;
+    enc_fhs_t* fhs;
+
+    fd = create ? open(fullPath, flags | O_CREAT | O_CLOEXEC, mode) :
+        open(fullPath, flags | O_CLOEXEC);
+    if(fd < 0) {
+        return -errno;
     }
 
- CLEANUP_1:
-    /* Restore Input Offset*/
-    ret = lseek(encFH, encOffset, SEEK_SET);
-    if(ret < 0) {
-        perror("ERROR decryptFH");
+    fhs = newFHS();
+    if(!fhs) {
+        fprintf(stderr, "ERROR openPassthrough: calloc failed\n");
         ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: Restore enc lseek(%"PRIu64") failed, error %d\n",
-                encFH, -ret);
+        close(fd);
+        return ret;
     }
+    fhs->encFH = fd;
+    fhs->clearFH = STREAM_NOCLEAR;
+    fhs->passthrough = 1;
+    fhs->dirty = FHS_CLEAN;
 
- CLEANUP_0:
-    /* Return */
-    return ret;
+    *pfhs = fhs;
+
+    return RETURN_SUCCESS;
 
 }
 
-static int encryptFH(const uint64_t clearFH, const uint64_t encFH) {
+/* int openStream(const char* encPath, int flags, mode_t mode, int create,
+ *                enc_fhs_t** pfhs)
+ *
+ * Purpose: Open encPath for streaming: reads and writes go straight
+ *          between the request buffers and the ciphertext chunks, with no
+ *          clear-text temp file, and the backing file is opened O_DIRECT
+ *          where its FS allows. With create, encPath is created with
+ *          mode and given a new key.
+ *
+ * Return: 1 and *pfhs set on success, 0 if encPath is in the legacy
+ *         format (open it with openFilePair instead), negative errno
+ *         on error
+ */
+static int openStream(const char* encPath, int flags, mode_t mode, int create,
+                      enc_fhs_t** pfhs) {
 
-    int ret = RETURN_SUCCESS;
-    int clearFD;
-    int encFD;
-    off_t clearOffset;
-    off_t encOffset;
-    FILE* clearFP = NULL;
-    FILE* encFP = NULL;
-    /* char key[KEYBUFSIZE]; */
-    char* key = NULL;
+    int ret;
+    int newflags;
+    uuid_t keyID;
+    enc_fhs_t* fhs = NULL;
 
-    fprintf(stderr, "DEBUG encryptFH called\n");
+    /* Partial chunks are read back before they are rewritten */
+    newflags = flags & ~(O_APPEND | O_DIRECT | O_ACCMODE);
+    newflags |= O_RDWR;
 
-    /* Get Custos Key */
-    /* ret = getCustosKey(key, sizeof(key)); */
-    /* if(ret  < 0) { */
-    /*     fprintf(stderr, "ERROR decryptFH: getCustosKey failed\n"); */
-    /*     goto CLEANUP_0; */
-    /* } */
-    key = TESTKEY;
-
-    /* Save and Rewind Input Offset */
-    clearOffset = lseek(clearFH, 0, SEEK_CUR);
-    if(clearOffset < 0) {
-        perror("ERROR encryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR encryptFH: Save clr lseek(%"PRIu64") failed with error %d\n",
-                clearFH, -ret);
-        goto CLEANUP_0;
+    fhs = newFHS();
+    if(!fhs) {
+        fprintf(stderr, "ERROR openStream: calloc failed\n");
+        return -ENOMEM;
     }
-    ret = lseek(clearFH, 0, SEEK_SET);
+    fhs->clearFH = STREAM_NOCLEAR;
+
+    ret = create ? open(encPath, newflags, mode) : open(encPath, newflags);
     if(ret < 0) {
-        perror("ERROR encryptFH");
+        fprintf(stderr, "ERROR openStream: open(encPath) failed\n");
+        perror("ERROR openStream");
         ret = -errno;
-        fprintf(stderr,
-		"ERROR encryptFH: Rewind clr lseek(%"PRIu64") failed with error %d\n",
-                clearFH, -ret);
-        goto CLEANUP_0;
+        freeFHS(fhs);
+        return ret;
     }
+    fhs->encFH = ret;
 
-    /* Save, Rewind, and Truncate Output */
-    encOffset = lseek(encFH, 0, SEEK_CUR);
-    if(encOffset < 0) {
-        perror("ERROR encryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR encryptFH: Save enc lseek(%"PRIu64") failed with error %d\n",
-                encFH, -ret);
-        goto CLEANUP_1;
+    /* Not every FS takes O_DIRECT; the stream drops its pages instead */
+    if(fcntl(fhs->encFH, F_SETFL, fcntl(fhs->encFH, F_GETFL) | O_DIRECT) < 0) {
+        fprintf(stderr, "INFO openStream: O_DIRECT not supported on %s\n",
+                encPath);
     }
-    ret = lseek(encFH, 0, SEEK_SET);
+
+    ret = create ? setFDKeyID(fhs->encFH, keyID) : getFDKeyID(fhs->encFH, keyID);
     if(ret < 0) {
-        perror("ERROR encryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR encryptFH: Rewind enc lseek(%"PRIu64") failed with error %d\n",
-                encFH, -ret);
-        goto CLEANUP_1;
+        fprintf(stderr, "ERROR openStream: %s() failed\n",
+                create ? "setFDKeyID" : "getFDKeyID");
+        goto CLEANUP;
     }
-    ret = ftruncate(encFH, 0);
-    if(ret < 0) {
-        perror("ERROR encryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR encryptFH: enc ftruncate(%"PRIu64") failed with error %d\n",
-                encFH, -ret);
-        goto CLEANUP_2;
+    fhs->key = acquireKey(keyID);
+    if(!fhs->key) {
+        fprintf(stderr, "ERROR openStream: acquireKey() failed\n");
+        ret = -EIO;
+        goto CLEANUP;
     }
 
-    /* Dup and get FILE* for clearFH */
-    clearFD = dup(clearFH);
+    ret = encformat_detect(fhs->encFH, &fhs->format);
     if(ret < 0) {
-        perror("ERROR encryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR encryptFH: clearFH dup(%"PRIu64") failed with error %d\n",
-                clearFH, -ret);
-        goto CLEANUP_3;
-    }
-    clearFP = fdopen(clearFD, "r");
-    if(!clearFP) {
-        perror("ERROR encryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR encryptFH: clearFH fdopen(%d) failed with error %d\n",
-                clearFD, -ret);
-        goto CLEANUP_4;
+        fprintf(stderr, "ERROR openStream: encformat_detect() failed\n");
+        goto CLEANUP;
     }
-
-    /* Dup and get FILE* for encFH */
-    encFD = dup(encFH);
-    if(ret < 0) {
-        perror("ERROR encryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR encryptFH: encFH dup(%"PRIu64") failed with error %d\n",
-                encFH, -ret);
-        goto CLEANUP_5;
-    }
-    encFP = fdopen(encFD, "w");
-    if(!encFP) {
-        perror("ERROR encryptFH");
-        ret = -errno;
-        fprintf(stderr,
-		"ERROR encryptFH: encFH fdopen(%d) failed with error %d\n",
-                encFD, -ret);
-        goto CLEANUP_6;
+    if(!fhs->format->open) {
+        ret = 0;
+        goto CLEANUP;
     }
-
-    /* Encrypt */
-    ret = crypt_encrypt(clearFP, encFP, key);
-    //ret = crypt_copy(clearFP, encFP);
+    ret = fhs->format->open(fhs->encFH, fhs->key->crypt, &fhs->stream);
     if(ret < 0) {
-        fprintf(stderr,
-		"ERROR encryptFH: crypt_encrypt() failed\n");
-        goto CLEANUP_7;
+        fprintf(stderr, "ERROR openStream: %s open failed\n",
+                fhs->format->name);
+        goto CLEANUP;
     }
 
- CLEANUP_7:
-    /* Cleanup encFP */
-    if(fclose(encFP)) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: fclose(encFP) failed with error %d\n",
-                -ret);
+    /* A new file is in the write format from the start */
+    if(create) {
+        ret = fhs->format->flush(fhs->stream);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR openStream: %s flush failed\n",
+                    fhs->format->name);
+            goto CLEANUP;
+        }
     }
-    goto CLEANUP_5;
 
- CLEANUP_6:
-    /* Cleanup Duped encFD */
-    if(close(encFD)) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: close(encFD) failed with error %d\n",
-                -ret);
+    *pfhs = fhs;
+    return 1;
+
+ CLEANUP:
+    if(fhs->stream) {
+        fhs->format->close(fhs->stream);
     }
+    if(fhs->key) {
+        keycache_release(fhs->key);
+    }
+    close(fhs->encFH);
+    freeFHS(fhs);
+    return ret;
 
- CLEANUP_5:
-    /* Cleanup clearFP */
-    if(fclose(clearFP)) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: fclose(clearFP) failed with error %d\n",
-                -ret);
+}
+
+/* int decryptFH(uint64_t encFH, uint64_t clearFH, const keyHandle_t* key)
+ *
+ * Purpose: Fill clearFH with the plain text of encFH, in whichever
+ *          format encFH is. Chunked files decrypt chunk by chunk,
+ *          leaving holes unallocated.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int decryptFH(const uint64_t encFH, const uint64_t clearFH,
+                     const keyHandle_t* key) {
+
+    int ret;
+    const encFormat_t* format;
+    span_t span;
+
+    fprintf(stderr, "DEBUG decryptFH called\n");
+
+    ret = encformat_detect(encFH, &format);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR decryptFH: encformat_detect() failed\n");
+        return ret;
     }
-    goto CLEANUP_3;
 
- CLEANUP_4:
-    /* Cleanup Duped clearFD */
-    if(close(clearFD)) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: close(clearFD) failed with error %d\n",
-                -ret);
+    spantrace_begin(getSpans(), &span, SPAN_CRYPTO, "decrypt");
+    ret = format->decrypt(encFH, clearFH, key->crypt);
+    spantrace_end(getSpans(), &span, ret);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR decryptFH: %s decrypt failed\n", format->name);
+        return ret;
     }
 
- CLEANUP_3:
-    /* No Cleanup */
+    return RETURN_SUCCESS;
+
+}
+
+/* Fill [offset, offset + length) of the clear file of fhs (the arg) from
+ * its backing file, for the clear cache */
+static int fillClear(void* arg, uint64_t offset, uint64_t length) {
+
+    int ret;
+    enc_fhs_t* fhs = arg;
+    const encFormat_t* format;
+    span_t span;
 
- CLEANUP_2:
-    /* Restore Output Offset*/
-    ret = lseek(encFH, encOffset, SEEK_SET);
+    ret = encformat_detect(fhs->encFH, &format);
     if(ret < 0) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: Restore enc lseek(%"PRIu64") failed, error %d\n",
-                encFH, -ret);
+        fprintf(stderr, "ERROR fillClear: encformat_detect() failed\n");
+        return ret;
+    }
+    if(!format->decryptRange) {
+        fprintf(stderr, "ERROR fillClear: %s files can't be filled by range\n",
+                format->name);
+        return -EIO;
     }
 
- CLEANUP_1:
-    /* Restore Input Offset*/
-    ret = lseek(clearFH, clearOffset, SEEK_SET);
+    spantrace_begin(getSpans(), &span, SPAN_CRYPTO, "decrypt range");
+    ret = format->decryptRange(fhs->encFH, fhs->clearFH, fhs->key->crypt,
+                               offset, length);
+    spantrace_end(getSpans(), &span, ret);
     if(ret < 0) {
-        perror("ERROR decryptFH");
-        ret = -errno;
-        fprintf(stderr,
-                "ERROR decryptFH: Restore clr lseek(%"PRIu64") failed, error %d\n",
-                encFH, -ret);
+        fprintf(stderr, "ERROR fillClear: %s decryptRange failed\n",
+                format->name);
     }
 
- CLEANUP_0:
-    /* Return */
     return ret;
 
 }
 
-static int enc_getattr(const char* path, stat_t* stbuf) {
+/* int loadClear(enc_fhs_t* fhs)
+ *
+ * Purpose: Give fhs the plain text of its backing file in its clear file.
+ *          Under the clear budget, where the backing file's format can be
+ *          decrypted by range, the clear file is only sized now and filled
+ *          as it is used; otherwise it is decrypted whole, as decryptFH.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int loadClear(enc_fhs_t* fhs) {
 
     int ret;
-    char fullPath[PATHBUFSIZE];
-    enc_fhs_t* fhs;
-    stat_t stTemp;
+    uint64_t size;
+    const encFormat_t* format;
+    clearCache_t* cache = getState()->clearCache;
 
-    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(!cache) {
+        return decryptFH(fhs->encFH, fhs->clearFH, fhs->key);
+    }
+
+    ret = encformat_detect(fhs->encFH, &format);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_getattr: buildPath failed\n");
+        fprintf(stderr, "ERROR loadClear: encformat_detect() failed\n");
         return ret;
     }
-    path = NULL;
+    if(!format->decryptRange) {
+        return decryptFH(fhs->encFH, fhs->clearFH, fhs->key);
+    }
 
-    ret = lstat(fullPath, stbuf);
+    ret = format->size(fhs->encFH, fhs->key->crypt, &size);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_getattr: lstat(fullPath) failed\n");
-        perror("ERROR enc_getattr");
+        fprintf(stderr, "ERROR loadClear: %s size failed\n", format->name);
+        return ret;
+    }
+    if(ftruncate(fhs->clearFH, 0) < 0 || ftruncate(fhs->clearFH, size) < 0) {
+        perror("ERROR loadClear: ftruncate");
         return -errno;
     }
 
-    if(S_ISREG(stbuf->st_mode)) {
+    fhs->clear = clearcache_open(cache, fhs->clearFH, size, fillClear, fhs);
+    if(!fhs->clear) {
+        fprintf(stderr, "ERROR loadClear: clearcache_open failed\n");
+        return -ENOMEM;
+    }
 
-        fhs = openFilePair(fullPath, O_RDONLY);
-        if(!fhs) {
-            fprintf(stderr, "ERROR enc_getattr: openFilePair failed\n");
-            return RETURN_FAILURE;
-        }
+    return RETURN_SUCCESS;
 
-        ret = decryptFH(fhs->encFH, fhs->clearFH);
-        if(ret < 0) {
-            fprintf(stderr, "ERROR enc_getattr: decryptFH failed\n");
-            return ret;
-        }
+}
 
-        ret = fstat(fhs->clearFH, &stTemp);
-        if(ret < 0) {
-            fprintf(stderr, "ERROR enc_getattr: lstat(tempPath) failed\n");
-            perror("ERROR enc_getattr");
-            return -errno;
-        }
+static int encryptFH(const uint64_t clearFH, const uint64_t encFH,
+                     const keyHandle_t* key, chunkMap_t* dirtyChunks) {
 
-        /* Copy over select fields */
-        stbuf->st_size = stTemp.st_size;
-        stbuf->st_blksize = stTemp.st_blksize;
-        stbuf->st_blocks = stTemp.st_blocks;
+    int ret;
+    span_t span;
 
-        ret = closeFilePair(fhs);
-        if(ret < 0) {
-            fprintf(stderr, "ERROR enc_getattr: closeFilePair failed\n");
-            return ret;
-        }
+    fprintf(stderr, "DEBUG encryptFH called\n");
 
+    /* Always write the write format, upgrading older files; with a
+       dirty map only the chunks in it are re-encrypted */
+    spantrace_begin(getSpans(), &span, SPAN_CRYPTO, "save");
+    ret = encformat_writer()->save(clearFH, encFH, key->crypt, dirtyChunks);
+    spantrace_end(getSpans(), &span, ret);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR encryptFH: %s save failed\n",
+                encformat_writer()->name);
+        return ret;
     }
 
     return RETURN_SUCCESS;
 
 }
 
-static int enc_fgetattr(const char* path, stat_t* stbuf,
-                        fuse_file_info_t* fi) {
-
-    (void) path;
+/* int saveClear(enc_fhs_t* fhs, int encFD, dirtySet_t* dirty)
+ *
+ * Purpose: Write the clear file of fhs to encFD as encryptFH does, with
+ *          dirty the set taken from fhs, then give back the space of the
+ *          holes in its punched range. What of a lazily filled clear
+ *          file the save reads is filled first: all of it if the save
+ *          rewrites encFD whole, else the dirty chunks and the chunk at
+ *          the old end of the file. Call with the clear file locked.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int saveClear(enc_fhs_t* fhs, int encFD, dirtySet_t* dirty) {
 
     int ret;
-    enc_fhs_t* fhs;
-    stat_t stTemp;
+    uint64_t oldSize;
+    uint64_t savedSize;
+    stat_t st;
+    const encFormat_t* writer = encformat_writer();
 
-    fhs = get_fhs(fi->fh);
-
-    ret = fstat(fhs->encFH, stbuf);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_fgetattr: fstat(encFH) failed");
-        perror("ERROR enc_fgetattr");
-        return -errno;
-    }
+    if(fhs->clear) {
 
-    if(S_ISREG(stbuf->st_mode)) {
+        if(fstat(fhs->clearFH, &st) < 0) {
+            perror("ERROR saveClear: fstat");
+            return -errno;
+        }
 
-        ret = fstat(fhs->clearFH, &stTemp);
+        ret = writer->saveWhole(encFD, fhs->key->crypt, &dirty->chunks);
+        if(ret > 0) {
+            ret = clearcache_fill(fhs->clear, 0, st.st_size);
+        }
+        else if(ret == 0) {
+            ret = clearcache_fillChunks(fhs->clear, &dirty->chunks);
+            if(ret == RETURN_SUCCESS &&
+               writer->size(encFD, NULL, &oldSize) == RETURN_SUCCESS &&
+               oldSize != (uint64_t) st.st_size) {
+                /* The last byte kept of the chunk at the smaller end */
+                if(oldSize > (uint64_t) st.st_size) {
+                    oldSize = st.st_size;
+                }
+                if(oldSize > 0) {
+                    ret = clearcache_fill(fhs->clear, oldSize - 1, 1);
+                }
+            }
+        }
         if(ret < 0) {
-            fprintf(stderr, "ERROR enc_fgetattr: fstat(clearFH) failed");
-            perror("ERROR enc_fgetattr");
-            return -errno;
+            fprintf(stderr, "ERROR saveClear: filling the clear file failed\n");
+            return ret;
         }
 
-        /* Copy over select fields */
-        stbuf->st_size = stTemp.st_size;
-        stbuf->st_blksize = stTemp.st_blksize;
-        stbuf->st_blocks = stTemp.st_blocks;
+    }
 
+    ret = encryptFH(fhs->clearFH, encFD, fhs->key, &dirty->chunks);
+    if(ret < 0 || dirty->punch.length == 0) {
+        return ret;
     }
 
-    return RETURN_SUCCESS;
+    /* Punch after the chunks are saved as holes, at the size saved */
+    ret = writer->size(encFD, NULL, &savedSize);
+    if(ret == RETURN_SUCCESS) {
+        ret = chunk_punch(encFD, dirty->punch.offset, dirty->punch.length,
+                          savedSize);
+    }
+    if(ret < 0) {
+        fprintf(stderr, "ERROR saveClear: chunk_punch failed\n");
+    }
+    return ret;
 
 }
 
-static int enc_access(const char* path, int mask) {
+/* int resizeClear(enc_fhs_t* fhs, off_t size)
+ *
+ * Purpose: Truncate or extend the clear file of fhs to size bytes
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int resizeClear(enc_fhs_t* fhs, off_t size) {
 
-    int ret;
-    char fullPath[PATHBUFSIZE];
+    int ret = RETURN_SUCCESS;
+    stat_t st;
 
-    ret = buildPath(path, fullPath, sizeof(fullPath));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_access: buildPath failed\n");
-        return ret;
+    if(fhs->clear) {
+        clearcache_lock(fhs->clear);
     }
-    path = NULL;
 
-    ret = access(fullPath, mask);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_access: access failed\n");
-        perror("ERROR enc_access");
-        return -errno;
+    if(fstat(fhs->clearFH, &st) < 0 || ftruncate(fhs->clearFH, size) < 0) {
+        perror("ERROR resizeClear: ftruncate");
+        ret = -errno;
+    }
+    else {
+        if(fhs->clear) {
+            clearcache_resize(fhs->clear, size);
+        }
+        markResize(fhs, st.st_size, size);
     }
 
-    return RETURN_SUCCESS;
+    if(fhs->clear) {
+        clearcache_unlock(fhs->clear);
+    }
+
+    return ret;
 
 }
 
-static int enc_readlink(const char* path, char* buf, size_t size) {
+/* Open an unnamed file next to fullPath to build its replacement in,
+ * or a named temp file (path left in tmpPath) where O_TMPFILE isn't
+ * supported */
+static int openReplacement(const char* fullPath, char* tmpPath, size_t tmpSize,
+                           int* named) {
 
     int ret;
-    char fullPath[PATHBUFSIZE];
+    char dirPath[PATHBUFSIZE];
+    char* pDelim = NULL;
 
-    ret = buildPath(path, fullPath, sizeof(fullPath));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_readlink: buildPath failed\n");
+    ret = buildTmpPath(fullPath, tmpPath, tmpSize);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR openReplacement: buildTmpPath() failed\n");
         return ret;
     }
-    path = NULL;
 
-    /* ToDo: Should this operate on the plain or encrypted file? */
+    snprintf(dirPath, sizeof(dirPath), "%s", tmpPath);
+    pDelim = strrchr(dirPath, PATHDELIMINATOR);
+    *pDelim = NULLTERM;
 
-    ret = readlink(fullPath, buf, (size-1));
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_readlink: readlink failed\n");
-        perror("ERROR enc_readlink");
+    ret = open(dirPath, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if(ret >= 0) {
+        *named = 0;
+        return ret;
+    }
+    if(errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+        perror("ERROR openReplacement: open(O_TMPFILE)");
         return -errno;
     }
 
-    buf[ret] = '\0';
+    ret = mkostemp(tmpPath, O_CLOEXEC);
+    if(ret < 0) {
+        perror("ERROR openReplacement: mkostemp");
+        return -errno;
+    }
+    *named = 1;
 
-    return RETURN_SUCCESS;
+    return ret;
 
 }
 
-static int enc_opendir(const char* path, fuse_file_info_t* fi) {
+/* Give fd, opened by openReplacement, a name at tmpPath if it has none:
+ * an O_TMPFILE file needs one before it can be renamed over */
+static int nameReplacement(int fd, int named, char* tmpPath) {
 
     int ret;
-    enc_dirp_t* d = NULL;
-    char fullPath[PATHBUFSIZE];
-
-    d = malloc(sizeof(*d));
-    if(d == NULL) {
-        fprintf(stderr, "ERROR enc_opendir: malloc failed\n");
-        perror("ERROR enc_opendir");
-        return -errno;
+    int tries;
+    char procPath[PROCFDPATHSIZE];
+    char suffix[KEYIDSTRSIZE];
+    uuid_t rnd;
+
+    if(named) {
+        return RETURN_SUCCESS;
+    }
+
+    snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", fd);
+    for(tries = 0; ; tries++) {
+        uuid_generate_random(rnd);
+        uuid_unparse_lower(rnd, suffix);
+        memcpy(tmpPath + strlen(tmpPath) - 6, suffix, 6);
+        ret = linkat(AT_FDCWD, procPath, AT_FDCWD, tmpPath, AT_SYMLINK_FOLLOW);
+        if(ret == 0) {
+            return RETURN_SUCCESS;
+        }
+        if(errno != EEXIST || tries >= 8) {
+            perror("ERROR nameReplacement: linkat");
+            return -errno;
+        }
     }
 
-    ret = buildPath(path, fullPath, sizeof(fullPath));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_opendir: buildPath failed\n");
+}
+
+/* Atomically make fd, opened by openReplacement, the file at fullPath */
+static int publishReplacement(int fd, int named, char* tmpPath,
+                              const char* fullPath) {
+
+    int ret;
+
+    ret = nameReplacement(fd, named, tmpPath);
+    if(ret < 0) {
         return ret;
     }
-    path = NULL;
 
-    d->dp = opendir(fullPath);
-    if(d->dp == NULL) {
-        fprintf(stderr, "ERROR enc_opendir: opendir failed\n");
-        perror("ERROR enc_opendir");
+    ret = rename(tmpPath, fullPath);
+    if(ret < 0) {
+        perror("ERROR publishReplacement: rename");
         ret = -errno;
-        free(d);
+        unlink(tmpPath);
         return ret;
     }
-    d->offset = 0;
-    d->entry = NULL;
-
-    fi->fh = (unsigned long) d;
 
     return RETURN_SUCCESS;
 
 }
 
-static int enc_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
-                       off_t offset, fuse_file_info_t* fi) {
+/* Replacements of one backing file
+ *
+ * Each handle on a file saves its own dirty chunks into a clone of the
+ * version at the path. Two handles replacing it at once would clone the
+ * same version, and the last rename would drop the other's chunks; so
+ * replacements of a file run one at a time, under a lock picked by its
+ * dev and ino. Every replacement puts a new inode at the path, so one
+ * that waited checks the path still names the inode it locked.
+ */
+static pthread_mutex_t replaceLocks[REPLACE_LOCKS] = {
+    [0 ... REPLACE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 
-    (void) path;
+static pthread_mutex_t* replaceLock(const stat_t* st) {
+    return &replaceLocks[((uint64_t) st->st_dev * 31 + st->st_ino) %
+                         REPLACE_LOCKS];
+}
 
-    enc_dirp_t* d = NULL;
+/* int lockBacking(const char* fullPath, stat_t* st, pthread_mutex_t** lock)
+ *
+ * Purpose: Lstat fullPath into st and take the replace lock of the inode
+ *          it names, such that fullPath still names it once locked
+ *
+ * Return: 0 with *lock held (unlock when done), negative errno on error
+ */
+static int lockBacking(const char* fullPath, stat_t* st,
+                       pthread_mutex_t** lock) {
 
-    d = get_dirp(fi);
+    int ret;
+    stat_t again;
 
-    if (offset != d->offset) {
-        seekdir(d->dp, offset);
-        d->entry = NULL;
-        d->offset = offset;
+    if(lstat(fullPath, st) < 0) {
+        return -errno;
     }
-    while (1) {
-        stat_t st;
-        off_t nextoff;
 
-        if (!d->entry) {
-            d->entry = readdir(d->dp);
-            if (!d->entry)
-                break;
+    for(;;) {
+        *lock = replaceLock(st);
+        pthread_mutex_lock(*lock);
+        if(lstat(fullPath, &again) < 0) {
+            ret = -errno;
+            pthread_mutex_unlock(*lock);
+            return ret;
         }
-
-        memset(&st, 0, sizeof(st));
-        st.st_ino = d->entry->d_ino;
-        st.st_mode = d->entry->d_type << 12;
-        nextoff = telldir(d->dp);
-        if (filler(buf, d->entry->d_name, &st, nextoff))
-            break;
-
-        d->entry = NULL;
-        d->offset = nextoff;
+        if(again.st_dev == st->st_dev && again.st_ino == st->st_ino) {
+            *st = again;
+            return RETURN_SUCCESS;
+        }
+        /* Replaced while we waited; lock the new version instead */
+        pthread_mutex_unlock(*lock);
+        *st = again;
     }
 
-    return RETURN_SUCCESS;
-
 }
 
-static int enc_releasedir(const char* path, fuse_file_info_t* fi) {
+/* Copy every xattr of srcFD, key ID included, to dstFD */
+static int copyXattrs(int srcFD, int dstFD) {
 
-    (void) path;
+    int ret = RETURN_SUCCESS;
+    ssize_t listLen;
+    ssize_t valLen;
+    char* name = NULL;
+    char* list = NULL;
+    char* val = NULL;
 
-    enc_dirp_t* d = NULL;
+    list = malloc(XATTRLISTSIZE);
+    val = malloc(XATTRLISTSIZE);
+    if(!list || !val) {
+        ret = -ENOMEM;
+        goto CLEANUP;
+    }
 
-    d = get_dirp(fi);
-    closedir(d->dp);
-    free(d);
+    listLen = flistxattr(srcFD, list, XATTRLISTSIZE);
+    if(listLen < 0) {
+        ret = (errno == ENOTSUP) ? RETURN_SUCCESS : -errno;
+        goto CLEANUP;
+    }
 
-    return RETURN_SUCCESS;
+    for(name = list; name < list + listLen; name += strlen(name) + 1) {
+        valLen = fgetxattr(srcFD, name, val, XATTRLISTSIZE);
+        if(valLen < 0) {
+            ret = -errno;
+            break;
+        }
+        if(fsetxattr(dstFD, name, val, valLen, 0) < 0) {
+            ret = -errno;
+            break;
+        }
+    }
+    if(ret < 0) {
+        fprintf(stderr, "ERROR copyXattrs: copying %s failed with error %d\n",
+                name, -ret);
+    }
 
-}
+ CLEANUP:
+    free(list);
+    free(val);
+    return ret;
 
-static int enc_mknod(const char* path, mode_t mode, dev_t rdev) {
+}
 
-    int ret;
-    char fullPath[PATHBUFSIZE];
+/* Cache key for the xattrs of a backing inode on the low-level mount,
+ * which has no lasting path to key them by */
+static void xattrKey(dev_t dev, ino_t ino, char* key, size_t size) {
+    snprintf(key, size, "@%ju:%ju", (uintmax_t) dev, (uintmax_t) ino);
+}
 
-    ret = buildPath(path, fullPath, sizeof(fullPath));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_mknod: buildPath failed\n");
-        return ret;
-    }
-    path = NULL;
+/* Backing path of the file fhs has open: the mount path's, or on the
+ * low-level mount the name its inode was last seen under */
+static int backingPath(enc_fhs_t* fhs, const char* path, char* fullPath,
+                       size_t fullSize) {
 
-    if(S_ISFIFO(mode)) {
-        ret = mkfifo(fullPath, mode);
-    }
-    else {
-        ret = mknod(fullPath, mode, rdev);
+    if(fhs->inode) {
+        return inodetable_path(getState()->inodes, fhs->inode,
+                               fullPath, fullSize);
     }
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_mknod: mkfifo/mknode failed\n");
-        perror("ERROR enc_mknod");
-        return -errno;
+    if(!path) {
+        return -ENOENT;
     }
 
-    return RETURN_SUCCESS;
+    return buildPath(path, fullPath, fullSize);
 
 }
 
-static int enc_mkdir(const char* path, mode_t mode) {
+/* Point inode at fd, the backing file that just replaced it */
+static void rebindInode(inodeEntry_t* inode, int fd) {
 
-    int ret;
-    char fullPath[PATHBUFSIZE];
+    char key[LL_KEYSIZE];
 
-    ret = buildPath(path, fullPath, sizeof(fullPath));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_mkdir: buildPath failed\n");
-        return ret;
+    xattrKey(inode->dev, inode->ino, key, sizeof(key));
+    invalidateXattrs(key);
+
+    if(inodetable_rebind(getState()->inodes, inode, fd) < 0) {
+        fprintf(stderr, "WARNING rebindInode: inodetable_rebind failed\n");
     }
-    path = NULL;
 
-    ret = mkdir(fullPath, mode);
+}
+
+/* int reserveBacking(enc_fhs_t* fhs, off_t offset, off_t length)
+ *
+ * Purpose: Reserve backing space for plain bytes [offset, offset + length)
+ *          of fhs, as chunk_reserve does, and remember the range: a clone
+ *          only carries what the old file has allocated below its end,
+ *          so every replacement reserves it again
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int reserveBacking(enc_fhs_t* fhs, off_t offset, off_t length) {
+
+    int ret;
+    byteRange_t* grown;
+
+    pthread_mutex_lock(&fhs->saveLock);
+
+    ret = chunk_reserve(fhs->encFH, offset, length);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_mkdir: mkdir failed\n");
-        perror("ERROR enc_mkdir");
-        return -errno;
+        goto UNLOCK;
     }
 
-    return RETURN_SUCCESS;
+    /* Ranges are kept apart, so nothing between them is reserved */
+    if(fhs->numReserved &&
+       (uint64_t) offset <= fhs->reserved[fhs->numReserved - 1].offset +
+                            fhs->reserved[fhs->numReserved - 1].length &&
+       (uint64_t) (offset + length) >= fhs->reserved[fhs->numReserved - 1].offset) {
+        coverRange(&fhs->reserved[fhs->numReserved - 1], offset, length);
+        goto UNLOCK;
+    }
+    grown = realloc(fhs->reserved, (fhs->numReserved + 1) * sizeof(*grown));
+    if(!grown) {
+        ret = -ENOMEM;
+        goto UNLOCK;
+    }
+    fhs->reserved = grown;
+    fhs->reserved[fhs->numReserved].offset = offset;
+    fhs->reserved[fhs->numReserved].length = length;
+    fhs->numReserved++;
+
+ UNLOCK:
+    pthread_mutex_unlock(&fhs->saveLock);
+    return ret;
 
 }
 
-static int enc_unlink(const char* path) {
+/* Reserve the ranges fhs reserved again, on its replacement fd */
+static int reserveAgain(const enc_fhs_t* fhs, int fd) {
 
     int ret;
-    char fullPath[PATHBUFSIZE];
-
-    ret = buildPath(path, fullPath, sizeof(fullPath));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_unlink: buildPath failed\n");
-        return ret;
-    }
-    path = NULL;
+    size_t i;
 
-    ret = unlink(fullPath);
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_unlink: unlink failed\n");
-        perror("ERROR enc_unlink");
-        return -errno;
+    for(i = 0; i < fhs->numReserved; i++) {
+        ret = chunk_reserve(fd, fhs->reserved[i].offset,
+                            fhs->reserved[i].length);
+        if(ret < 0) {
+            return ret;
+        }
     }
 
     return RETURN_SUCCESS;
 
 }
 
-static int enc_rmdir(const char* path) {
+/* int replaceBacking(enc_fhs_t* fhs, const char* path, dirtySet_t* dirty)
+ *
+ * Purpose: Write fhs back as saveClear does, but into a new backing file
+ *          (a clone of the current one, with the space fhs reserved, plus
+ *          the dirty chunks) that then atomically replaces path. Opens and getattrs running meanwhile
+ *          see the old version in full, readers holding it open keep it,
+ *          and a crash leaves it intact. If another handle already
+ *          replaced the file, the dirty chunks go on top of that version.
+ *          Replacements of one file are serialized (lockBacking).
+ *          Updates in place when atomic replace is off, the file is
+ *          unlinked (no path or inode name), or has other hard links.
+ *          On the low-level mount, the inode is moved to the new file.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int replaceBacking(enc_fhs_t* fhs, const char* path,
+                          dirtySet_t* dirty) {
 
     int ret;
+    int fd = -1;
+    int srcFD = -1;
+    int named = 0;
     char fullPath[PATHBUFSIZE];
+    char tmpPath[PATHBUFSIZE];
+    stat_t st;
+    stat_t stPath;
+    uuid_t keyID;
+    span_t span;
+    pthread_mutex_t* lock;
+
+    if(!getState()->atomicReplace ||
+       backingPath(fhs, path, fullPath, sizeof(fullPath)) < 0 ||
+       lockBacking(fullPath, &stPath, &lock) < 0) {
+        return saveClear(fhs, fhs->encFH, dirty);
+    }
+    if(fstat(fhs->encFH, &st) < 0 ||
+       !S_ISREG(stPath.st_mode) || stPath.st_nlink != 1) {
+        ret = saveClear(fhs, fhs->encFH, dirty);
+        goto CLEANUP;
+    }
+
+    if(st.st_dev == stPath.st_dev && st.st_ino == stPath.st_ino) {
+        srcFD = dup(fhs->encFH);
+    }
+    else if(st.st_nlink == 0) {
+        /* Replaced under us by another handle on the same file: build on
+           its version, as writing in place would have */
+        srcFD = open(fullPath, O_RDONLY | O_CLOEXEC);
+        if(srcFD >= 0 &&
+           (getFDKeyID(srcFD, keyID) < 0 ||
+            uuid_compare(keyID, fhs->key->uuid) != 0 ||
+            fstat(srcFD, &st) < 0 || st.st_dev != stPath.st_dev ||
+            st.st_ino != stPath.st_ino)) {
+            close(srcFD);
+            srcFD = -1;
+        }
+    }
+    if(srcFD < 0) {
+        /* path names some other file now */
+        ret = saveClear(fhs, fhs->encFH, dirty);
+        goto CLEANUP;
+    }
 
-    ret = buildPath(path, fullPath, sizeof(fullPath));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_rmdir: buildPath failed\n");
-        return ret;
+    fd = openReplacement(fullPath, tmpPath, sizeof(tmpPath), &named);
+    if(fd < 0) {
+        fprintf(stderr, "ERROR replaceFH: openReplacement() failed\n");
+        ret = fd;
+        fd = -1;
+        goto CLEANUP;
     }
-    path = NULL;
 
-    ret = rmdir(fullPath);
+    spantrace_begin(getSpans(), &span, SPAN_IO, "clone backing");
+    ret = chunk_clone(srcFD, fd);
+    spantrace_end(getSpans(), &span, ret);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_rmdir: rmdir failed\n");
-        perror("ERROR enc_rmdir");
-        return -errno;
+        fprintf(stderr, "ERROR replaceFH: chunk_clone() failed\n");
+        goto CLEANUP;
+    }
+    ret = reserveAgain(fhs, fd);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR replaceFH: reserveAgain() failed\n");
+        goto CLEANUP;
+    }
+    ret = copyXattrs(srcFD, fd);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR replaceFH: copyXattrs() failed\n");
+        goto CLEANUP;
+    }
+    if(fchmod(fd, st.st_mode & 07777) < 0 ||
+       (fchown(fd, st.st_uid, st.st_gid) < 0 && errno != EPERM)) {
+        perror("ERROR replaceFH: fchmod/fchown");
+        ret = -errno;
+        goto CLEANUP;
     }
 
-    return RETURN_SUCCESS;
+    ret = saveClear(fhs, fd, dirty);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR replaceFH: saveClear() failed\n");
+        goto CLEANUP;
+    }
+
+    /* The new contents must be on disk before any name points at them */
+    spantrace_begin(getSpans(), &span, SPAN_IO, "fdatasync");
+    ret = fdatasync(fd);
+    spantrace_end(getSpans(), &span, ret);
+    if(ret < 0) {
+        perror("ERROR replaceFH: fdatasync");
+        ret = -errno;
+        goto CLEANUP;
+    }
+
+    spantrace_begin(getSpans(), &span, SPAN_IO, "publish");
+    ret = publishReplacement(fd, named, tmpPath, fullPath);
+    spantrace_end(getSpans(), &span, ret);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR replaceFH: publishReplacement() failed\n");
+        named = 0;
+        goto CLEANUP;
+    }
+    invalidateXattrs(fullPath);
+    if(fhs->inode) {
+        rebindInode(fhs->inode, fd);
+    }
+
+    close(fhs->encFH);
+    fhs->encFH = fd;
+    fd = -1;
+    named = 0;
+
+ CLEANUP:
+    if(named) {
+        unlink(tmpPath);
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+    if(srcFD >= 0) {
+        close(srcFD);
+    }
+    pthread_mutex_unlock(lock);
+    return ret;
 
 }
 
-static int enc_symlink(const char* from, const char* to) {
+/* int replaceFH(enc_fhs_t* fhs, const char* path)
+ *
+ * Purpose: Save the chunks of fhs changed since its last save, if any, as
+ *          replaceBacking does. Saves of one handle run one at a time. A
+ *          lazily filled clear file is kept locked meanwhile, so nothing
+ *          is filled from the backing file as it changes, and then counts
+ *          as clean.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int replaceFH(enc_fhs_t* fhs, const char* path) {
 
-    /* ToDo: Are both from and to in the fuse FS? */
+    int ret = RETURN_SUCCESS;
+    stat_t st;
+    dirtySet_t dirty;
 
-    char fullFrom[PATHBUFSIZE];
-    char fullTo[PATHBUFSIZE];
+    pthread_mutex_lock(&fhs->saveLock);
+    if(fhs->clear) {
+        clearcache_lock(fhs->clear);
+    }
 
-    if(buildPath(from, fullFrom, sizeof(fullFrom)) < 0){
-        fprintf(stderr, "ERROR enc_symlink: buildPath failed on from\n");
-        return RETURN_FAILURE;
+    if(!takeDirty(fhs, &dirty)) {
+        goto UNLOCK;
     }
-    from = NULL;
 
-    if(buildPath(to, fullTo, sizeof(fullTo)) < 0){
-        fprintf(stderr, "ERROR enc_symlink: buildPath failed on to\n");
-        return RETURN_FAILURE;
+    ret = replaceBacking(fhs, path, &dirty);
+    if(ret < 0) {
+        restoreDirty(fhs, &dirty);
+    }
+    else if(fhs->clear) {
+        if(fstat(fhs->clearFH, &st) < 0) {
+            perror("ERROR replaceFH: fstat");
+            ret = -errno;
+        }
+        else {
+            clearcache_clean(fhs->clear, st.st_size);
+        }
     }
-    to = NULL;
 
-    if(symlink(fullFrom, fullTo)) {
-        return -errno;
+ UNLOCK:
+    if(fhs->clear) {
+        clearcache_unlock(fhs->clear);
     }
+    pthread_mutex_unlock(&fhs->saveLock);
+    chunkmap_free(&dirty.chunks);
 
-    return RETURN_SUCCESS;
+    return ret;
 
 }
 
-static int enc_link(const char* from, const char* to) {
+/* Save fhs early, as the clear cache asked, if it has anything to save */
+static void writeBack(enc_fhs_t* fhs, const char* path) {
 
-    /* ToDo: Are both from and to in the fuse FS? */
+    if(fhs->dirty != FHS_DIRTY) {
+        return;
+    }
+    if(replaceFH(fhs, path) < 0) {
+        fprintf(stderr, "WARNING writeBack: replaceFH failed\n");
+    }
 
-    char fullFrom[PATHBUFSIZE];
-    char fullTo[PATHBUFSIZE];
+}
 
-    if(buildPath(from, fullFrom, sizeof(fullFrom)) < 0){
-        fprintf(stderr, "ERROR enc_link: buildPath failed on from\n");
-        return RETURN_FAILURE;
+/* int plainAttr(int encFD, stat_t* stbuf)
+ *
+ * Purpose: Turn stbuf, the attributes of the backing file open as encFD,
+ *          into those of its plain text. Chunked files carry their plain
+ *          size in the header, and the backing st_blocks already reflects
+ *          what holes don't use; legacy files need their key, to read
+ *          the padding in the last block.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int plainAttr(int encFD, stat_t* stbuf) {
+
+    int ret;
+    uint64_t size;
+    uuid_t keyID;
+    keyHandle_t* key = NULL;
+    const encFormat_t* format;
+
+    ret = encformat_detect(encFD, &format);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR plainAttr: encformat_detect failed\n");
+        return ret;
     }
-    from = NULL;
 
-    if(buildPath(to, fullTo, sizeof(fullTo)) < 0){
-        fprintf(stderr, "ERROR enc_link: buildPath failed on to\n");
-        return RETURN_FAILURE;
+    if(format->sizeKeyed) {
+        ret = getFDKeyID(encFD, keyID);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR plainAttr: getFDKeyID failed\n");
+            return ret;
+        }
+        key = acquireKey(keyID);
+        if(!key) {
+            fprintf(stderr, "ERROR plainAttr: acquireKey failed\n");
+            return -EIO;
+        }
     }
-    to = NULL;
 
-    if(link(fullFrom, fullTo) < 0) {
-        return -errno;
+    ret = format->size(encFD, key ? key->crypt : NULL, &size);
+    if(key) {
+        keycache_release(key);
+    }
+    if(ret < 0) {
+        fprintf(stderr, "ERROR plainAttr: %s size failed\n", format->name);
+        return ret;
     }
+    stbuf->st_size = size;
 
     return RETURN_SUCCESS;
 
 }
 
-static int enc_rename(const char* from, const char* to) {
+static int enc_getattr(const char* path, stat_t* stbuf) {
 
     int ret;
-    char fullFrom[PATHBUFSIZE];
-    char fullTo[PATHBUFSIZE];
+    int fd;
+    char fullPath[PATHBUFSIZE];
 
-    ret = buildPath(from, fullFrom, sizeof(fullFrom));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_rename: buildPath(from) failed\n");
-        return ret;
-    }
-    from = NULL;
+    iobudget_foreground(getState()->budget);
 
-    ret = buildPath(to, fullTo, sizeof(fullTo));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_rename: buildPath(to) failed\n");
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_getattr: buildPath failed\n");
         return ret;
     }
-    to = NULL;
 
-    ret = rename(fullFrom, fullTo);
+    ret = lstat(fullPath, stbuf);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_rename: rename failed\n");
-        perror("ERROR enc_rename");
+        fprintf(stderr, "ERROR enc_getattr: lstat(fullPath) failed\n");
+        perror("ERROR enc_getattr");
         return -errno;
     }
 
+    if(S_ISREG(stbuf->st_mode) && !isPassthroughPath(path)) {
+
+        fd = open(fullPath, O_RDONLY);
+        if(fd < 0) {
+            fprintf(stderr, "ERROR enc_getattr: open(fullPath) failed\n");
+            perror("ERROR enc_getattr");
+            return -errno;
+        }
+        ret = plainAttr(fd, stbuf);
+        close(fd);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_getattr: plainAttr failed\n");
+            return ret;
+        }
+
+    }
+
     return RETURN_SUCCESS;
 
 }
 
-static int enc_chmod(const char* path, mode_t mode) {
+static int enc_fgetattr(const char* path, stat_t* stbuf,
+                        fuse_file_info_t* fi) {
+
+    (void) path;
 
     int ret;
-    char fullPath[PATHBUFSIZE];
+    enc_fhs_t* fhs;
+    stat_t stTemp;
 
-    ret = buildPath(path, fullPath, sizeof(fullPath));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_chmod: buildPath failed\n");
-        return ret;
-    }
-    path = NULL;
+    fhs = get_fhs(fi->fh);
 
-    ret = chmod(fullPath, mode);
+    ret = fstat(fhs->encFH, stbuf);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_chmod: chmod failed\n");
-        perror("ERROR enc_chmod");
+        fprintf(stderr, "ERROR enc_fgetattr: fstat(encFH) failed");
+        perror("ERROR enc_fgetattr");
         return -errno;
     }
 
+    if(S_ISREG(stbuf->st_mode) && fhs->stream) {
+        stbuf->st_size = fhs->format->handleSize(fhs->stream);
+    }
+    else if(S_ISREG(stbuf->st_mode) && !fhs->passthrough) {
+
+        ret = fstat(fhs->clearFH, &stTemp);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_fgetattr: fstat(clearFH) failed");
+            perror("ERROR enc_fgetattr");
+            return -errno;
+        }
+
+        /* Copy over select fields; a lazily filled clear file has holes
+           where the file has data, so its blocks say nothing */
+        stbuf->st_size = stTemp.st_size;
+        stbuf->st_blksize = stTemp.st_blksize;
+        if(!fhs->clear) {
+            stbuf->st_blocks = stTemp.st_blocks;
+        }
+
+    }
+
     return RETURN_SUCCESS;
 
 }
 
-static int enc_chown(const char* path, uid_t uid, gid_t gid) {
+static int enc_access(const char* path, int mask) {
 
     int ret;
     char fullPath[PATHBUFSIZE];
 
     ret = buildPath(path, fullPath, sizeof(fullPath));
     if(ret < 0){
-        fprintf(stderr, "ERROR enc_chown: buildPath failed\n");
+        fprintf(stderr, "ERROR enc_access: buildPath failed\n");
         return ret;
     }
     path = NULL;
 
-    ret = lchown(fullPath, uid, gid);
+    ret = access(fullPath, mask);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_chown: lchown failed\n");
-        perror("ERROR enc_chown");
+        fprintf(stderr, "ERROR enc_access: access failed\n");
+        perror("ERROR enc_access");
         return -errno;
     }
 
@@ -1303,86 +1971,151 @@ static int enc_chown(const char* path, uid_t uid, gid_t gid) {
 
 }
 
-static int enc_truncate(const char* path, off_t size) {
+static int enc_readlink(const char* path, char* buf, size_t size) {
 
     int ret;
     char fullPath[PATHBUFSIZE];
-    enc_fhs_t* fhs;
 
     ret = buildPath(path, fullPath, sizeof(fullPath));
     if(ret < 0){
-        fprintf(stderr, "ERROR enc_truncate: buildPath failed\n");
+        fprintf(stderr, "ERROR enc_readlink: buildPath failed\n");
         return ret;
     }
     path = NULL;
 
-    fhs = openFilePair(fullPath, O_RDWR);
-    if(!fhs) {
-        fprintf(stderr, "ERROR enc_truncate: openFilePair failed\n");
-        return RETURN_FAILURE;
-    }
+    /* ToDo: Should this operate on the plain or encrypted file? */
 
-    ret = ftruncate(fhs->clearFH, size);
+    ret = readlink(fullPath, buf, (size-1));
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_truncate: ftruncate failed\n");
-        perror("ERROR enc_truncate");
+        fprintf(stderr, "ERROR enc_readlink: readlink failed\n");
+        perror("ERROR enc_readlink");
         return -errno;
     }
 
-    ret = encryptFH(fhs->clearFH, fhs->encFH);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_turncate: encryptFH failed\n");
-        return ret;
-    }
+    buf[ret] = '\0';
 
-    ret = closeFilePair(fhs);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_getattr: closeFilePair failed\n");
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_opendir(const char* path, fuse_file_info_t* fi) {
+
+    int ret;
+    enc_dirp_t* d = NULL;
+    char fullPath[PATHBUFSIZE];
+
+    d = malloc(sizeof(*d));
+    if(d == NULL) {
+        fprintf(stderr, "ERROR enc_opendir: malloc failed\n");
+        perror("ERROR enc_opendir");
+        return -errno;
+    }
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_opendir: buildPath failed\n");
+        return ret;
+    }
+
+    d->dp = opendir(fullPath);
+    if(d->dp == NULL) {
+        fprintf(stderr, "ERROR enc_opendir: opendir failed\n");
+        perror("ERROR enc_opendir");
+        ret = -errno;
+        free(d);
         return ret;
     }
+    d->offset = 0;
+    d->entry = NULL;
+
+    /* Warm the key cache for the files we are about to list */
+    if(!isPassthroughPath(path)) {
+        ret = prefetchDirKeys(d->dp, fullPath);
+        if(ret < 0) {
+            fprintf(stderr, "WARNING enc_opendir: prefetchDirKeys failed\n");
+        }
+    }
+
+    fi->fh = (unsigned long) d;
 
     return RETURN_SUCCESS;
 
 }
 
-static int enc_ftruncate(const char* path, off_t size,
-                         fuse_file_info_t* fi) {
+static int enc_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
+                       off_t offset, fuse_file_info_t* fi) {
 
     (void) path;
 
-    int ret;
-    enc_fhs_t* fhs;
+    enc_dirp_t* d = NULL;
 
-    fhs = get_fhs(fi->fh);
+    d = get_dirp(fi);
 
-    ret = ftruncate(fhs->clearFH, size);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_truncate: ftruncate failed\n");
-        perror("ERROR enc_truncate");
-        return -errno;
+    if (offset != d->offset) {
+        seekdir(d->dp, offset);
+        d->entry = NULL;
+        d->offset = offset;
+    }
+    while (1) {
+        stat_t st;
+        off_t nextoff;
+
+        if (!d->entry) {
+            d->entry = readdir(d->dp);
+            if (!d->entry)
+                break;
+        }
+
+        memset(&st, 0, sizeof(st));
+        st.st_ino = d->entry->d_ino;
+        st.st_mode = d->entry->d_type << 12;
+        nextoff = telldir(d->dp);
+        if (filler(buf, d->entry->d_name, &st, nextoff))
+            break;
+
+        d->entry = NULL;
+        d->offset = nextoff;
     }
 
     return RETURN_SUCCESS;
 
 }
 
-static int enc_utimens(const char* path, const timespec_t ts[2]) {
+static int enc_releasedir(const char* path, fuse_file_info_t* fi) {
+
+    (void) path;
+
+    enc_dirp_t* d = NULL;
+
+    d = get_dirp(fi);
+    closedir(d->dp);
+    free(d);
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_mknod(const char* path, mode_t mode, dev_t rdev) {
 
     int ret;
     char fullPath[PATHBUFSIZE];
 
     ret = buildPath(path, fullPath, sizeof(fullPath));
     if(ret < 0){
-        fprintf(stderr, "ERROR enc_utimens: buildPath failed\n");
+        fprintf(stderr, "ERROR enc_mknod: buildPath failed\n");
         return ret;
     }
     path = NULL;
 
-    /* don't use utime/utimes since they follow symlinks */
-    ret = utimensat(0, fullPath, ts, AT_SYMLINK_NOFOLLOW);
+    if(S_ISFIFO(mode)) {
+        ret = mkfifo(fullPath, mode);
+    }
+    else {
+        ret = mknod(fullPath, mode, rdev);
+    }
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_utimens: utimensat failed\n");
-        perror("ERROR enc_utimens");
+        fprintf(stderr, "ERROR enc_mknod: mkfifo/mknode failed\n");
+        perror("ERROR enc_mknod");
         return -errno;
     }
 
@@ -1390,481 +2123,3977 @@ static int enc_utimens(const char* path, const timespec_t ts[2]) {
 
 }
 
-static int enc_create(const char* path, mode_t mode, fuse_file_info_t* fi) {
+static int enc_mkdir(const char* path, mode_t mode) {
 
     int ret;
-    enc_fhs_t* fhs;
     char fullPath[PATHBUFSIZE];
 
     ret = buildPath(path, fullPath, sizeof(fullPath));
     if(ret < 0){
-        fprintf(stderr, "ERROR enc_create: buildPath failed\n");
+        fprintf(stderr, "ERROR enc_mkdir: buildPath failed\n");
         return ret;
     }
     path = NULL;
 
-    fhs = createFilePair(fullPath, fi->flags, mode);
-    if(!fhs) {
-        fprintf(stderr, "ERROR enc_create: createFilePair failed\n");
-        return RETURN_FAILURE;
-    }
-
-    ret = encryptFH(fhs->clearFH, fhs->encFH);
+    ret = mkdir(fullPath, mode);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_create: encryptFH failed\n");
-        return ret;
+        fprintf(stderr, "ERROR enc_mkdir: mkdir failed\n");
+        perror("ERROR enc_mkdir");
+        return -errno;
     }
 
-    fhs->dirty = FHS_CLEAN;
-    fi->fh = put_fhs(fhs);
-
     return RETURN_SUCCESS;
 
 }
 
-static int enc_open(const char* path, fuse_file_info_t* fi) {
+static int enc_unlink(const char* path) {
 
     int ret;
-    enc_fhs_t* fhs;
     char fullPath[PATHBUFSIZE];
 
     ret = buildPath(path, fullPath, sizeof(fullPath));
     if(ret < 0){
-        fprintf(stderr, "ERROR enc_open: buildPath failed\n");
+        fprintf(stderr, "ERROR enc_unlink: buildPath failed\n");
         return ret;
     }
     path = NULL;
 
-    fhs = openFilePair(fullPath, fi->flags);
-    if(!fhs) {
-        fprintf(stderr, "ERROR enc_open: openFilePair failed\n");
-        return RETURN_FAILURE;
-    }
-
-    ret = decryptFH(fhs->encFH, fhs->clearFH);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_open: decryptFH failed\n");
-        return ret;
+    ret = unlink(fullPath);
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_unlink: unlink failed\n");
+        perror("ERROR enc_unlink");
+        return -errno;
     }
 
-    fhs->dirty = FHS_CLEAN;
-    fi->fh = put_fhs(fhs);
+    invalidateXattrs(fullPath);
 
     return RETURN_SUCCESS;
 
 }
 
-static int enc_read(const char* path, char* buf, size_t size, off_t offset,
-                    fuse_file_info_t* fi) {
-
-    (void) path;
+static int enc_rmdir(const char* path) {
 
     int ret;
-    enc_fhs_t* fhs;
+    char fullPath[PATHBUFSIZE];
 
-    fhs = get_fhs(fi->fh);
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_rmdir: buildPath failed\n");
+        return ret;
+    }
+    path = NULL;
 
-    ret = pread(fhs->clearFH, buf, size, offset);
+    ret = rmdir(fullPath);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_read: pread failed\n");
-        perror("ERROR enc_read");
-        ret = -errno;
+        fprintf(stderr, "ERROR enc_rmdir: rmdir failed\n");
+        perror("ERROR enc_rmdir");
+        return -errno;
     }
 
-    return ret;
+    invalidateXattrs(fullPath);
+
+    return RETURN_SUCCESS;
 
 }
 
-static int enc_write(const char* path, const char* buf, size_t size,
-		     off_t offset, fuse_file_info_t* fi) {
+static int enc_symlink(const char* from, const char* to) {
 
-    (void) path;
+    /* ToDo: Are both from and to in the fuse FS? */
 
-    int ret;
-    enc_fhs_t* fhs;
+    char fullFrom[PATHBUFSIZE];
+    char fullTo[PATHBUFSIZE];
 
-    fhs = get_fhs(fi->fh);
-    fhs->dirty = FHS_DIRTY;
+    if(buildPath(from, fullFrom, sizeof(fullFrom)) < 0){
+        fprintf(stderr, "ERROR enc_symlink: buildPath failed on from\n");
+        return RETURN_FAILURE;
+    }
+    from = NULL;
 
-    ret = pwrite(fhs->clearFH, buf, size, offset);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_write: pwrite failed\n");
-        perror("ERROR enc_write");
-        ret = -errno;
+    if(buildPath(to, fullTo, sizeof(fullTo)) < 0){
+        fprintf(stderr, "ERROR enc_symlink: buildPath failed on to\n");
+        return RETURN_FAILURE;
     }
+    to = NULL;
 
-    return ret;
+    if(symlink(fullFrom, fullTo)) {
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
 
 }
 
-static int enc_statfs(const char* path, statvfs_t* stbuf) {
+static int enc_link(const char* from, const char* to) {
+
+    /* ToDo: Are both from and to in the fuse FS? */
 
     int ret;
-    char fullPath[PATHBUFSIZE];
+    char fullFrom[PATHBUFSIZE];
+    char fullTo[PATHBUFSIZE];
 
-    ret = buildPath(path, fullPath, sizeof(fullPath));
-    if(ret < 0){
-        fprintf(stderr, "ERROR enc_statfs: buildPath failed\n");
+    ret = checkPolicy(from, to);
+    if(ret < 0) {
         return ret;
     }
-    path = NULL;
 
-    ret = statvfs(fullPath, stbuf);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_statfs: statvfs failed\n");
-        perror("ERROR enc_statfs");
+    if(buildPath(from, fullFrom, sizeof(fullFrom)) < 0){
+        fprintf(stderr, "ERROR enc_link: buildPath failed on from\n");
+        return RETURN_FAILURE;
+    }
+    from = NULL;
+
+    if(buildPath(to, fullTo, sizeof(fullTo)) < 0){
+        fprintf(stderr, "ERROR enc_link: buildPath failed on to\n");
+        return RETURN_FAILURE;
+    }
+    to = NULL;
+
+    if(link(fullFrom, fullTo) < 0) {
         return -errno;
     }
 
+    /* The link count cached with fullFrom is now wrong */
+    invalidateXattrs(fullFrom);
+
     return RETURN_SUCCESS;
 
 }
 
-static int enc_flush(const char* path, fuse_file_info_t* fi) {
-
-    /* This is called from every close on an open file, so call the
-       close on the underlying filesystem. But since flush may be
-       called multiple times for an open file, this must not really
-       close the file.  This is important if used on a network
-       filesystem like NFS which flush the data/metadata on close() */
-
-    (void) path;
+static int enc_rename(const char* from, const char* to) {
 
     int ret;
-    enc_fhs_t* fhs;
+    char fullFrom[PATHBUFSIZE];
+    char fullTo[PATHBUFSIZE];
 
-    if(!fi) {
-        fprintf(stderr, "ERROR enc_flush: fi is NULL");
-        return -EINVAL;
+    ret = checkPolicy(from, to);
+    if(ret < 0) {
+        return ret;
     }
 
-    fhs = get_fhs(fi->fh);
+    ret = buildPath(from, fullFrom, sizeof(fullFrom));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_rename: buildPath(from) failed\n");
+        return ret;
+    }
+    from = NULL;
 
+    ret = buildPath(to, fullTo, sizeof(fullTo));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_rename: buildPath(to) failed\n");
+        return ret;
+    }
+    to = NULL;
+
+    ret = rename(fullFrom, fullTo);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_rename: rename failed\n");
+        perror("ERROR enc_rename");
+        return -errno;
+    }
+
+    invalidateXattrs(fullFrom);
+    invalidateXattrs(fullTo);
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_chmod(const char* path, mode_t mode) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_chmod: buildPath failed\n");
+        return ret;
+    }
+    path = NULL;
+
+    ret = chmod(fullPath, mode);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_chmod: chmod failed\n");
+        perror("ERROR enc_chmod");
+        return -errno;
+    }
+
+    invalidateXattrs(fullPath);
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_chown(const char* path, uid_t uid, gid_t gid) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_chown: buildPath failed\n");
+        return ret;
+    }
+    path = NULL;
+
+    ret = lchown(fullPath, uid, gid);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_chown: lchown failed\n");
+        perror("ERROR enc_chown");
+        return -errno;
+    }
+
+    invalidateXattrs(fullPath);
+
+    return RETURN_SUCCESS;
+
+}
+
+/* On the low-level mount, check fhs has the file its inode is open */
+static int checkInode(enc_fhs_t* fhs) {
+
+    stat_t st;
+
+    if(!fhs->inode) {
+        return RETURN_SUCCESS;
+    }
+
+    if(fstat(fhs->encFH, &st) < 0) {
+        perror("ERROR checkInode: fstat");
+        return -errno;
+    }
+    if(st.st_dev != fhs->inode->dev || st.st_ino != fhs->inode->ino) {
+        return -ESTALE;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* int truncateFile(const char* path, const char* fullPath,
+ *                  inodeEntry_t* inode, off_t size)
+ *
+ * Purpose: Truncate the backing file at fullPath, which path names in
+ *          the mount (or which is inode, on the low-level mount), to
+ *          size bytes of plain text
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int truncateFile(const char* path, const char* fullPath,
+                        inodeEntry_t* inode, off_t size) {
+
+    int ret;
+    int closeRet;
+    enc_fhs_t* fhs;
+
+    fhs = openFilePair(fullPath, O_RDWR);
+    if(!fhs) {
+        fprintf(stderr, "ERROR truncateFile: openFilePair failed\n");
+        return RETURN_FAILURE;
+    }
+    fhs->inode = inode;
+
+    ret = checkInode(fhs);
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+
+    ret = loadClear(fhs);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR truncateFile: loadClear failed\n");
+        goto CLEANUP;
+    }
+
+    ret = resizeClear(fhs, size);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR truncateFile: resizeClear failed\n");
+        goto CLEANUP;
+    }
+
+    ret = replaceFH(fhs, path);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR truncateFile: replaceFH failed\n");
+    }
+
+ CLEANUP:
+    closeRet = closeFilePair(fhs);
+    if(closeRet < 0) {
+        fprintf(stderr, "ERROR truncateFile: closeFilePair failed\n");
+        if(ret == RETURN_SUCCESS) {
+            ret = closeRet;
+        }
+    }
+    return ret;
+
+}
+
+static int enc_truncate(const char* path, off_t size) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_truncate: buildPath failed\n");
+        return ret;
+    }
+
+    if(isPassthroughPath(path)) {
+        return (truncate(fullPath, size) < 0) ? -errno : RETURN_SUCCESS;
+    }
+
+    return truncateFile(path, fullPath, NULL, size);
+
+}
+
+static int enc_ftruncate(const char* path, off_t size,
+                         fuse_file_info_t* fi) {
+
+    (void) path;
+
+    int ret;
+    enc_fhs_t* fhs;
+
+    fhs = get_fhs(fi->fh);
+
+    if(fhs->passthrough) {
+        return (ftruncate(fhs->encFH, size) < 0) ? -errno : RETURN_SUCCESS;
+    }
+
+    if(fhs->stream) {
+        ret = fhs->format->truncate(fhs->stream, size);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_ftruncate: stream truncate failed\n");
+        }
+        return ret;
+    }
+
+    ret = resizeClear(fhs, size);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_ftruncate: resizeClear failed\n");
+    }
+
+    return ret;
+
+}
+
+static int enc_utimens(const char* path, const timespec_t ts[2]) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_utimens: buildPath failed\n");
+        return ret;
+    }
+    path = NULL;
+
+    /* don't use utime/utimes since they follow symlinks */
+    ret = utimensat(0, fullPath, ts, AT_SYMLINK_NOFOLLOW);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_utimens: utimensat failed\n");
+        perror("ERROR enc_utimens");
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* int openFile(const char* path, const char* fullPath, int create,
+ *              mode_t mode, fuse_file_info_t* fi)
+ *
+ * Purpose: Open the backing file at fullPath for fi, or with create make
+ *          it with mode and a new key. Files path (inside the mount)
+ *          matches a passthrough pattern for are mirrored unencrypted;
+ *          those matching a stream pattern, or opened O_DIRECT, are
+ *          streamed; the rest are decrypted to a clear file.
+ *
+ * Return: 0 with fi->fh set on success, negative errno on error
+ */
+static int openFile(const char* path, const char* fullPath, int create,
+                    mode_t mode, fuse_file_info_t* fi) {
+
+    int ret;
+    enc_fhs_t* fhs;
+
+    iobudget_foreground(getState()->budget);
+
+    if(isPassthroughPath(path)) {
+        ret = openPassthrough(fullPath, fi->flags, mode, create, &fhs);
+        if(ret < 0) {
+            return ret;
+        }
+        fi->fh = put_fhs(fhs);
+        return RETURN_SUCCESS;
+    }
+
+    /* Streamed files bypass the page cache on both sides of the mount */
+    if(isStreamPath(path) || (fi->flags & O_DIRECT)) {
+        ret = openStream(fullPath, fi->flags, mode, create, &fhs);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR openFile: openStream failed\n");
+            return ret;
+        }
+        if(ret > 0) {
+            fi->fh = put_fhs(fhs);
+            fi->direct_io = 1;
+            if(create) {
+                invalidateXattrs(fullPath);
+            }
+            return RETURN_SUCCESS;
+        }
+    }
+
+    if(create) {
+        fhs = createFilePair(fullPath, fi->flags, mode);
+        if(!fhs) {
+            fprintf(stderr, "ERROR openFile: createFilePair failed\n");
+            return RETURN_FAILURE;
+        }
+        ret = encryptFH(fhs->clearFH, fhs->encFH, fhs->key, NULL);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR openFile: encryptFH failed\n");
+            closeFilePair(fhs);
+            return ret;
+        }
+        ret = loadClear(fhs);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR openFile: loadClear failed\n");
+            closeFilePair(fhs);
+            return ret;
+        }
+        invalidateXattrs(fullPath);
+    }
+    else {
+        fhs = openFilePair(fullPath, fi->flags);
+        if(!fhs) {
+            fprintf(stderr, "ERROR openFile: openFilePair failed\n");
+            return RETURN_FAILURE;
+        }
+        ret = loadClear(fhs);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR openFile: loadClear failed\n");
+            closeFilePair(fhs);
+            return ret;
+        }
+    }
+
+    fhs->dirty = FHS_CLEAN;
+    fi->fh = put_fhs(fhs);
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_create(const char* path, mode_t mode, fuse_file_info_t* fi) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_create: buildPath failed\n");
+        return ret;
+    }
+
+    return openFile(path, fullPath, 1, mode, fi);
+
+}
+
+static int enc_open(const char* path, fuse_file_info_t* fi) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_open: buildPath failed\n");
+        return ret;
+    }
+
+    return openFile(path, fullPath, 0, 0, fi);
+
+}
+
+static int enc_read(const char* path, char* buf, size_t size, off_t offset,
+                    fuse_file_info_t* fi) {
+
+    int ret;
+    int held = 0;
+    enc_fhs_t* fhs;
+    clearHold_t hold;
+
+    iobudget_foreground(getState()->budget);
+
+    fhs = get_fhs(fi->fh);
+
+    if(fhs->stream) {
+        ret = fhs->format->read(fhs->stream, buf, size, offset);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_read: stream read failed\n");
+        }
+        return ret;
+    }
+
+    if(fhs->clear) {
+        held = clearcache_hold(fhs->clear, offset, size, 0, &hold);
+        if(held < 0) {
+            fprintf(stderr, "ERROR enc_read: clearcache_hold failed\n");
+            return held;
+        }
+    }
+
+    ret = pread(dataFH(fhs), buf, size, offset);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_read: pread failed\n");
+        perror("ERROR enc_read");
+        ret = -errno;
+    }
+
+    if(fhs->clear) {
+        clearcache_release(fhs->clear, &hold);
+        if(held > 0) {
+            writeBack(fhs, path);
+        }
+    }
+
+    return ret;
+
+}
+
+static int enc_write(const char* path, const char* buf, size_t size,
+		     off_t offset, fuse_file_info_t* fi) {
+
+    int ret;
+    int held = 0;
+    enc_fhs_t* fhs;
+    clearHold_t hold;
+
+    iobudget_foreground(getState()->budget);
+
+    fhs = get_fhs(fi->fh);
+
+    if(fhs->stream) {
+        ret = fhs->format->write(fhs->stream, buf, size, offset);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_write: stream write failed\n");
+        }
+        return ret;
+    }
+
+    if(fhs->passthrough) {
+        ret = pwrite(fhs->encFH, buf, size, offset);
+        return (ret < 0) ? -errno : ret;
+    }
+
+    if(fhs->clear) {
+        held = clearcache_hold(fhs->clear, offset, size, CLEARCACHE_WRITE,
+                               &hold);
+        if(held < 0) {
+            fprintf(stderr, "ERROR enc_write: clearcache_hold failed\n");
+            return held;
+        }
+    }
+
+    ret = pwrite(fhs->clearFH, buf, size, offset);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_write: pwrite failed\n");
+        perror("ERROR enc_write");
+        ret = -errno;
+    }
+    else {
+        markDirty(fhs, offset, ret);
+        if(fhs->clear) {
+            clearcache_dirty(fhs->clear, offset, ret);
+        }
+    }
+
+    if(fhs->clear) {
+        clearcache_release(fhs->clear, &hold);
+        if(held > 0) {
+            writeBack(fhs, path);
+        }
+    }
+
+    return ret;
+
+}
+
+/* Reads of passthrough files hand libfuse the backing fd, which it
+ * splices to the kernel where it can; the rest are read into memory */
+static int enc_read_buf(const char* path, fuse_bufvec_t** bufp, size_t size,
+                        off_t offset, fuse_file_info_t* fi) {
+
+    int ret;
+    enc_fhs_t* fhs;
+    fuse_bufvec_t* bufv;
+    char* mem;
+
+    fhs = get_fhs(fi->fh);
+
+    bufv = malloc(sizeof(*bufv));
+    if(!bufv) {
+        fprintf(stderr, "ERROR enc_read_buf: malloc failed\n");
+        return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(size);
+
+    if(fhs->passthrough) {
+        bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv->buf[0].fd = fhs->encFH;
+        bufv->buf[0].pos = offset;
+        *bufp = bufv;
+        return RETURN_SUCCESS;
+    }
+
+    mem = malloc(size ? size : 1);
+    if(!mem) {
+        fprintf(stderr, "ERROR enc_read_buf: malloc failed\n");
+        free(bufv);
+        return -ENOMEM;
+    }
+
+    ret = enc_read(path, mem, size, offset, fi);
+    if(ret < 0) {
+        free(mem);
+        free(bufv);
+        return ret;
+    }
+    bufv->buf[0].mem = mem;
+    bufv->buf[0].size = ret;
+    *bufp = bufv;
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_statfs(const char* path, statvfs_t* stbuf) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_statfs: buildPath failed\n");
+        return ret;
+    }
+    path = NULL;
+
+    ret = statvfs(fullPath, stbuf);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_statfs: statvfs failed\n");
+        perror("ERROR enc_statfs");
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_fallocate(const char* path, int mode, off_t offset,
+                         off_t length, fuse_file_info_t* fi) {
+
+    int ret;
+    off_t punched = 0;
+    enc_fhs_t* fhs;
+    stat_t st;
+    clearHold_t hold;
+
+    fhs = get_fhs(fi->fh);
+
+    if(fhs->passthrough) {
+        ret = fallocate(fhs->encFH, mode, offset, length);
+        return (ret < 0) ? -errno : RETURN_SUCCESS;
+    }
+
+    if(fhs->stream || (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))) {
+        return -EOPNOTSUPP;
+    }
+
+    ret = fstat(fhs->clearFH, &st);
+    if(ret < 0) {
+        perror("ERROR enc_fallocate");
+        return -errno;
+    }
+
+    /* A punch keeps the rest of the units at its edges, so they must be
+       in the clear; growing the file must not race its fills */
+    if(fhs->clear && (mode & FALLOC_FL_PUNCH_HOLE)) {
+        punched = (offset >= st.st_size) ? 0 :
+            (offset + length > st.st_size) ? st.st_size - offset : length;
+        ret = clearcache_hold(fhs->clear, offset, punched, CLEARCACHE_WRITE,
+                              &hold);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_fallocate: clearcache_hold failed\n");
+            return ret;
+        }
+    }
+    else if(fhs->clear) {
+        clearcache_lock(fhs->clear);
+    }
+
+    ret = fallocate(fhs->clearFH, mode, offset, length);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_fallocate: fallocate(clearFH) failed\n");
+        perror("ERROR enc_fallocate");
+        ret = -errno;
+    }
+
+    if(fhs->clear && (mode & FALLOC_FL_PUNCH_HOLE)) {
+        if(ret == RETURN_SUCCESS) {
+            clearcache_dirty(fhs->clear, offset, punched);
+        }
+        clearcache_release(fhs->clear, &hold);
+    }
+    else if(fhs->clear) {
+        if(ret == RETURN_SUCCESS && !(mode & FALLOC_FL_KEEP_SIZE) &&
+           offset + length > st.st_size) {
+            clearcache_resize(fhs->clear, offset + length);
+        }
+        clearcache_unlock(fhs->clear);
+    }
+    if(ret < 0) {
+        return ret;
+    }
+
+    if(mode & FALLOC_FL_PUNCH_HOLE) {
+
+        /* The save writes the chunks out as holes, then gives back
+           their slots */
+        markPunch(fhs, offset, length);
+        ret = replaceFH(fhs, path);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_fallocate: replaceFH failed\n");
+            return ret;
+        }
+
+        return RETURN_SUCCESS;
+
+    }
+
+    /* Reserve ciphertext space now, so ENOSPC shows up here and not on
+       flush; the zeros themselves are never encrypted */
+    ret = reserveBacking(fhs, offset, length);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_fallocate: reserveBacking failed\n");
+        return ret;
+    }
+
+    if(!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > st.st_size) {
+        markResize(fhs, st.st_size, offset + length);
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_flush(const char* path, fuse_file_info_t* fi) {
+
+    /* This is called from every close on an open file, so call the
+       close on the underlying filesystem. But since flush may be
+       called multiple times for an open file, this must not really
+       close the file.  This is important if used on a network
+       filesystem like NFS which flush the data/metadata on close() */
+
+    int ret;
+    enc_fhs_t* fhs;
+
+    if(!fi) {
+        fprintf(stderr, "ERROR enc_flush: fi is NULL");
+        return -EINVAL;
+    }
+
+    fhs = get_fhs(fi->fh);
+
+    if(fhs->stream) {
+        ret = fhs->format->flush(fhs->stream);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_flush: stream flush failed\n");
+        }
+        return ret;
+    }
+
+    if(fhs->passthrough) {
+        return (close(dup(fhs->encFH)) < 0) ? -errno : RETURN_SUCCESS;
+    }
+
+    if(fhs->dirty == FHS_DIRTY) {
+
+        ret = replaceFH(fhs, path);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_flush: replaceFH failed\n");
+            return ret;
+        }
+
+    }
+
+    ret = dup(fhs->clearFH);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_flush: dup(clearFH) failed\n");
+        perror("ERROR enc_flush");
+        return -errno;
+    }
+    ret = close(ret);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_flush: close(dup(clearFH)) failed\n");
+        perror("ERROR enc_flush");
+        return -errno;
+    }
+
+    ret = dup(fhs->encFH);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_flush: dup(encFH) failed\n");
+        perror("ERROR enc_flush");
+        return -errno;
+    }
+    ret = close(ret);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_flush: close(dup(encFH)) failed\n");
+        perror("ERROR enc_flush");
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_fsync(const char* path, int isdatasync,
+                     fuse_file_info_t* fi) {
+
+    int ret;
+    enc_fhs_t* fhs;
+
+    if(!fi) {
+        fprintf(stderr, "ERROR enc_fsync: fi is NULL");
+        return -EINVAL;
+    }
+
+    fhs = get_fhs(fi->fh);
+
+    if(fhs->stream) {
+        ret = fhs->format->flush(fhs->stream);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_fsync: stream flush failed\n");
+            return ret;
+        }
+    }
+    else if(fhs->dirty == FHS_DIRTY) {
+
+        ret = replaceFH(fhs, path);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_fsync: replaceFH failed\n");
+            return ret;
+        }
+
+    }
+
+    if(isdatasync) {
+        ret = fdatasync(fhs->encFH);
+    }
+    else {
+        ret = fsync(fhs->encFH);
+    }
+
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_fsync: fdatasync/fsync failed\n");
+        perror("ERROR enc_fsync");
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_release(const char* path, fuse_file_info_t* fi) {
+
+    int ret;
+    enc_fhs_t* fhs;
+
+    if(!fi) {
+        fprintf(stderr, "ERROR enc_release: fi is NULL");
+        return -EINVAL;
+    }
+
+    fhs = get_fhs(fi->fh);
 
     if(fhs->dirty == FHS_DIRTY) {
 
-        ret = encryptFH(fhs->clearFH, fhs->encFH);
+        ret = replaceFH(fhs, path);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR enc_release: replaceFH failed\n");
+            return ret;
+        }
+
+    }
+
+    ret = closeFilePair(fhs);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_release: closeFilePair failed\n");
+        return ret;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_lock(const char* path, fuse_file_info_t* fi, int cmd,
+                    flock_t* lock) {
+
+    (void) path;
+
+    int ret;
+    enc_fhs_t* fhs;
+
+    fhs = get_fhs(fi->fh);
+
+    ret = ulockmgr_op(dataFH(fhs), cmd, lock, &fi->lock_owner,
+                      sizeof(fi->lock_owner));
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_lock: ulockmgr_op failed\n");
+        return ret;
+    }
+
+    return ret;
+
+}
+
+static int enc_flock(const char* path, fuse_file_info_t* fi, int op) {
+
+    (void) path;
+
+    int ret;
+    enc_fhs_t* fhs;
+
+    fhs = get_fhs(fi->fh);
+
+    ret = flock(dataFH(fhs), op);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR enc_flock: flock failed\n");
+        perror("ERROR enc_flock");
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* The key ID attribute belongs to the FS, not to the user; copying it
+ * between files (cp -a, rsync -X) would point a file at the wrong key */
+static int isHiddenXattr(const char* name) {
+    return strcmp(name, KEYID_XATTR) == 0 || strcmp(name, REKEY_XATTR) == 0;
+}
+
+/* Remove hidden names from a listxattr result; return the new length */
+static ssize_t filterXattrList(char* list, ssize_t len) {
+
+    char* p = list;
+    size_t n;
+
+    while(p < list + len) {
+        n = strlen(p) + 1;
+        if(isHiddenXattr(p)) {
+            memmove(p, p + n, (list + len) - (p + n));
+            len -= n;
+        }
+        else {
+            p += n;
+        }
+    }
+
+    return len;
+
+}
+
+/* The xattr calls below work on the backing file at fullPath, cached
+ * under key. With follow, fullPath is a /proc/self/fd link of the
+ * low-level mount, which leads to the file only when followed. */
+
+static int setXattr(const char* key, const char* fullPath, int follow,
+                    const char* name, const char* value, size_t size,
+                    int flags) {
+
+    int ret;
+
+    if(isHiddenXattr(name)) {
+        return -EPERM;
+    }
+
+    ret = follow ? setxattr(fullPath, name, value, size, flags) :
+                   lsetxattr(fullPath, name, value, size, flags);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR setXattr: lsetxattr failed\n");
+        perror("ERROR setXattr");
+        return -errno;
+    }
+
+    invalidateXattrs(key);
+
+    return RETURN_SUCCESS;
+
+}
+
+static int getXattr(const char* key, const char* fullPath, int follow,
+                    const char* name, char* value, size_t size) {
+
+    int err;
+    ssize_t len;
+    char buf[XATTR_CACHE_MAXVAL];
+    stat_t st;
+    fsState_t* state = getState();
+
+    if(isHiddenXattr(name)) {
+        return -ENODATA;
+    }
+
+    /* Cached */
+    if(xattrcache_get(state->xattrCache, key, name, value, size, &len)) {
+        return len;
+    }
+
+    /* Uncached: read into a cacheable buffer, remember it, then answer */
+    if(state->xattrCache) {
+        if((follow ? stat(fullPath, &st) : lstat(fullPath, &st)) < 0) {
+            return -errno;
+        }
+        len = follow ? getxattr(fullPath, name, buf, sizeof(buf)) :
+                       lgetxattr(fullPath, name, buf, sizeof(buf));
+        err = errno;
+        if(len >= 0 || err == ENODATA) {
+            xattrcache_putValue(state->xattrCache, key, &st, name,
+                                buf, (len < 0) ? -ENODATA : len);
+        }
+        if(len >= 0) {
+            if(size == 0) {
+                return len;
+            }
+            if((size_t) len > size) {
+                return -ERANGE;
+            }
+            memcpy(value, buf, len);
+            return len;
+        }
+        if(err != ERANGE) {
+            return -err;
+        }
+    }
+
+    /* Too large to cache */
+    len = follow ? getxattr(fullPath, name, value, size) :
+                   lgetxattr(fullPath, name, value, size);
+    if(len < 0) {
+        return -errno;
+    }
+
+    return len;
+
+}
+
+static int listXattr(const char* key, const char* fullPath, int follow,
+                     char* list, size_t size) {
+
+    int ret;
+    ssize_t len;
+    char* buf = NULL;
+    stat_t st;
+    fsState_t* state = getState();
+
+    /* Cached */
+    if(xattrcache_list(state->xattrCache, key, list, size, &len)) {
+        return len;
+    }
+
+    if((follow ? stat(fullPath, &st) : lstat(fullPath, &st)) < 0) {
+        return -errno;
+    }
+
+    /* Read the whole list; retry if it grows in between */
+    do {
+        len = follow ? listxattr(fullPath, NULL, 0) :
+                       llistxattr(fullPath, NULL, 0);
+        if(len < 0) {
+            return -errno;
+        }
+        free(buf);
+        buf = malloc(len + 1);
+        if(!buf) {
+            return -ENOMEM;
+        }
+        len = follow ? listxattr(fullPath, buf, len + 1) :
+                       llistxattr(fullPath, buf, len + 1);
+    } while(len < 0 && errno == ERANGE);
+    if(len < 0) {
+        ret = -errno;
+        free(buf);
+        return ret;
+    }
+
+    len = filterXattrList(buf, len);
+    xattrcache_putList(state->xattrCache, key, &st, buf, len);
+
+    if(size != 0) {
+        if((size_t) len > size) {
+            len = -ERANGE;
+        }
+        else {
+            memcpy(list, buf, len);
+        }
+    }
+    free(buf);
+
+    return len;
+
+}
+
+static int removeXattr(const char* key, const char* fullPath, int follow,
+                       const char* name) {
+
+    int ret;
+
+    if(isHiddenXattr(name)) {
+        return -EPERM;
+    }
+
+    ret = follow ? removexattr(fullPath, name) : lremovexattr(fullPath, name);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR removeXattr: lremovexattr failed\n");
+        perror("ERROR removeXattr");
+        return -errno;
+    }
+
+    invalidateXattrs(key);
+
+    return RETURN_SUCCESS;
+
+}
+
+static int enc_setxattr(const char* path, const char* name, const char* value,
+                        size_t size, int flags) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_setxattr: buildPath failed\n");
+        return ret;
+    }
+    path = NULL;
+
+    return setXattr(fullPath, fullPath, 0, name, value, size, flags);
+
+}
+
+static int enc_getxattr(const char* path, const char* name, char* value,
+                        size_t size) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_getxattr: buildPath failed\n");
+        return ret;
+    }
+    path = NULL;
+
+    return getXattr(fullPath, fullPath, 0, name, value, size);
+
+}
+
+static int enc_listxattr(const char* path, char* list, size_t size) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_listxattr: buildPath failed\n");
+        return ret;
+    }
+    path = NULL;
+
+    return listXattr(fullPath, fullPath, 0, list, size);
+
+}
+
+static int enc_removexattr(const char* path, const char* name) {
+
+    int ret;
+    char fullPath[PATHBUFSIZE];
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0){
+        fprintf(stderr, "ERROR enc_removexattr: buildPath failed\n");
+        return ret;
+    }
+    path = NULL;
+
+    return removeXattr(fullPath, fullPath, 0, name);
+
+}
+
+/* Background job: bring one hot directory into the caches, as listing
+ * it and opening its files would, so the first real requests after
+ * mount find them warm. arg is the directory's mount path, malloc'd. */
+static void warmDir(workPool_t* pool, void* arg) {
+
+    int ret;
+    size_t files = 0;
+    char* path = arg;
+    DIR* dp = NULL;
+    struct dirent* entry = NULL;
+    char fullPath[PATHBUFSIZE];
+    char entryPath[PATHBUFSIZE];
+    stat_t st;
+    uuid_t keyID;
+    keyHandle_t* key = NULL;
+
+    if(workpool_stopping(pool)) {
+        goto CLEANUP;
+    }
+
+    ret = buildPath(path, fullPath, sizeof(fullPath));
+    if(ret < 0) {
+        fprintf(stderr, "ERROR warmDir: buildPath failed\n");
+        goto CLEANUP;
+    }
+
+    dp = opendir(fullPath);
+    if(!dp) {
+        fprintf(stderr, "WARNING warmDir: opendir(%s) failed\n", fullPath);
+        goto CLEANUP;
+    }
+
+    /* One batched custos request for the whole directory */
+    if(!isPassthroughPath(path) && prefetchDirKeys(dp, fullPath) < 0) {
+        fprintf(stderr, "WARNING warmDir: prefetchDirKeys failed\n");
+    }
+
+    while(!workpool_stopping(pool) && (entry = readdir(dp)) != NULL) {
+
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        ret = snprintf(entryPath, sizeof(entryPath), "%s%c%s",
+                       (strcmp(path, "/") == 0) ? "" : path,
+                       PATHDELIMINATOR, entry->d_name);
+        if(ret > (int)(sizeof(entryPath) - 1)) {
+            continue;
+        }
+
+        /* Backing inode, header and plaintext size, as stat would */
+        if(enc_getattr(entryPath, &st) < 0 || !S_ISREG(st.st_mode) ||
+           isPassthroughPath(entryPath)) {
+            continue;
+        }
+
+        /* Key contexts, as open would */
+        if(buildPath(entryPath, fullPath, sizeof(fullPath)) < 0 ||
+           getFileKeyID(fullPath, keyID) < 0) {
+            continue;
+        }
+        key = acquireKey(keyID);
+        if(key) {
+            keycache_release(key);
+            files++;
+        }
+
+    }
+
+    fprintf(stderr, "INFO warmDir: %s: %zd files warm\n", path, files);
+
+ CLEANUP:
+    if(dp) {
+        closedir(dp);
+    }
+    free(path);
+
+}
+
+/* Queue a warmDir job on the worker pool for each -o warm directory */
+static int startWarmup(fsState_t* state) {
+
+    int ret = RETURN_SUCCESS;
+    char* paths = NULL;
+    char* path = NULL;
+    char* next = NULL;
+    char* arg = NULL;
+
+    paths = strdup(state->warmPaths);
+    if(!paths) {
+        return -ENOMEM;
+    }
+
+    for(path = paths; path; path = next) {
+        next = strchr(path, PATTERN_DELIMINATOR);
+        if(next) {
+            *next++ = NULLTERM;
+        }
+        if(!*path) {
+            continue;
+        }
+        arg = strdup(path);
+        if(!arg) {
+            ret = -ENOMEM;
+            break;
+        }
+        ret = workpool_submit(state->workers, warmDir, arg);
+        if(ret < 0) {
+            free(arg);
+            break;
+        }
+    }
+    free(paths);
+
+    return ret;
+
+}
+
+/* Outcomes of rekeyFile other than errors */
+typedef enum rekeyResult {
+    REKEY_DONE = 0,
+    REKEY_CURRENT,
+    REKEY_BUSY,
+    REKEY_SKIPPED
+} rekeyResult_t;
+
+/* Has an open of the file whose write lease the rekeyer holds on fd
+ * started waiting for it */
+static int leaseBroken(void* arg) {
+    return fcntl(*(int*) arg, F_GETLEASE) != F_WRLCK;
+}
+
+/* Encrypt the plain text on clearFD, plainSize bytes, into the empty
+ * file newFD under key, in slices charged to the rekey budget. Holes in
+ * clearFD stay holes. */
+static int rekeyCopy(int clearFD, uint64_t plainSize, int newFD,
+                     const cryptKey_t* key, int* leaseFD) {
+
+    int ret;
+    ssize_t len;
+    off_t pos;
+    off_t data;
+    off_t end;
+    char* buf = NULL;
+    void* stream = NULL;
+    const encFormat_t* writer = encformat_writer();
+
+    buf = malloc(REKEY_SLICE);
+    if(!buf) {
+        return -ENOMEM;
+    }
+    ret = writer->open(newFD, key, &stream);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR rekeyCopy: %s open failed\n", writer->name);
+        free(buf);
+        return ret;
+    }
+
+    for(end = 0; end < (off_t) plainSize; ) {
+
+        data = lseek(clearFD, end, SEEK_DATA);
+        if(data < 0 && errno == ENXIO) {
+            break;
+        }
+        if(data < 0) {
+            data = end;
+            end = plainSize;
+        }
+        else {
+            end = lseek(clearFD, data, SEEK_HOLE);
+            if(end < 0) {
+                end = plainSize;
+            }
+        }
+
+        for(pos = data; pos < end; pos += len) {
+            len = (end - pos > REKEY_SLICE) ? REKEY_SLICE : end - pos;
+            ret = iobudget_charge(getState()->budget, len, leaseBroken, leaseFD);
+            if(ret < 0) {
+                goto CLEANUP;
+            }
+            len = pread(clearFD, buf, len, pos);
+            if(len <= 0) {
+                ret = (len < 0) ? -errno : -EIO;
+                goto CLEANUP;
+            }
+            len = writer->write(stream, buf, len, pos);
+            if(len < 0) {
+                ret = len;
+                goto CLEANUP;
+            }
+        }
+
+    }
+
+    ret = writer->truncate(stream, plainSize);
+
+ CLEANUP:
+    if(writer->close(stream) < 0 && ret >= 0) {
+        ret = -EIO;
+    }
+    free(buf);
+    return ret;
+
+}
+
+/* Pace a copy for the rekeyer: each slice waits for the budget, and a
+ * lease broken meanwhile (arg points at the leased fd) stops it */
+static int rekeyPace(void* arg, uint64_t len) {
+
+    if(leaseBroken(arg)) {
+        return -ECANCELED;
+    }
+
+    return iobudget_charge(getState()->budget, len, leaseBroken, arg);
+
+}
+
+/* Copy the backing file on *encFD as it is into the empty file newFD: by
+ * reflink where the FS has it, and otherwise a slice at a time, charged
+ * to the rekey budget and given up once the lease on *encFD is broken */
+static int rekeyClone(int* encFD, int newFD) {
+    return chunk_clonePaced(*encFD, newFD, REKEY_SLICE, rekeyPace, encFD);
+}
+
+/* int rewrapInPlace(int* encFD, const encFormat_t* format,
+ *                   const keyHandle_t* oldKey, const keyHandle_t* newKey,
+ *                   const char* keyID, const stat_t* st)
+ *
+ * Purpose: Move the leased file on *encFD, open for writing, to newKey
+ *          (key ID string keyID) by rewrapping its data key in its own
+ *          header, where the file can't be cloned cheaply. The new form
+ *          is staged and synced before the file names newKey, so a crash
+ *          at any point leaves it readable under the key it names. Gives
+ *          up if the lease is broken before then.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+static int rewrapInPlace(int* encFD, const encFormat_t* format,
+                         const keyHandle_t* oldKey, const keyHandle_t* newKey,
+                         const char* keyID, const stat_t* st) {
+
+    int ret;
+    timespec_t times[2];
+    const char* tag = getState()->rekeyTag;
+
+    ret = format->rewrap(*encFD, oldKey->crypt, newKey->crypt, 1);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR rewrapInPlace: %s stage failed\n", format->name);
+        return ret;
+    }
+    if(fdatasync(*encFD) < 0) {
+        perror("ERROR rewrapInPlace: fdatasync");
+        return -errno;
+    }
+
+    if(leaseBroken(encFD)) {
+        return -ECANCELED;
+    }
+    if(fsetxattr(*encFD, KEYID_XATTR, keyID, KEYIDSTRSIZE - 1, 0) < 0 ||
+       fsetxattr(*encFD, REKEY_XATTR, tag, strlen(tag), 0) < 0 ||
+       fsync(*encFD) < 0) {
+        perror("ERROR rewrapInPlace: switching key");
+        return -errno;
+    }
+
+    /* Drop the old form; until then the staged one is read */
+    ret = format->rewrap(*encFD, oldKey->crypt, newKey->crypt, 0);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR rewrapInPlace: %s rewrap failed\n", format->name);
+        return ret;
+    }
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+    if(futimens(*encFD, times) < 0 || fdatasync(*encFD) < 0) {
+        perror("ERROR rewrapInPlace: futimens/fdatasync");
+        return -errno;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* int rekeyFile(const char* fullPath)
+ *
+ * Purpose: Move the backing file at fullPath to a new key for the -o rekey
+ *          rotation: copy it with its data key rewrapped under a newly
+ *          made key ID where its format allows, or else decrypt it and
+ *          encrypt it under that key ID in the write format, and swap the
+ *          result in, keeping its xattrs, mode, owner and times and
+ *          tagging it with the rotation. Where a rewrapped file can't be
+ *          reflinked, its header is rewrapped in place (rewrapInPlace)
+ *          rather than the file copied. The
+ *          file is held under a write lease throughout, so this only
+ *          starts when no handle has it open, and any open meanwhile
+ *          (from the mount or not) makes it give up and release the file
+ *          at the next slice; the open waits until then.
+ *
+ * Return: rekeyResult_t on success, negative errno on error
+ */
+static int rekeyFile(const char* fullPath) {
+
+    int ret;
+    int encFD = -1;
+    int clearFD = -1;
+    int newFD = -1;
+    int named = 0;
+    int scratchNamed = 0;
+    int writable = 1;
+    ssize_t len;
+    char tmpPath[PATHBUFSIZE] = "";
+    char scratchPath[PATHBUFSIZE];
+    char tag[REKEY_TAGSIZE];
+    char val[KEYIDSTRSIZE];
+    timespec_t times[2];
+    stat_t st;
+    stat_t stClear;
+    stat_t stOld;
+    uuid_t keyID;
+    keyHandle_t* oldKey = NULL;
+    keyHandle_t* newKey = NULL;
+    const encFormat_t* format;
+    fsState_t* state = getState();
+
+    /* Writable if it can be, to rewrap in place */
+    encFD = open(fullPath, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if(encFD < 0 && (errno == EACCES || errno == EROFS || errno == EPERM)) {
+        writable = 0;
+        encFD = open(fullPath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if(encFD < 0) {
+        return (errno == ENOENT || errno == ELOOP) ? REKEY_SKIPPED : -errno;
+    }
+    if(fstat(encFD, &st) < 0) {
+        ret = -errno;
+        goto CLEANUP;
+    }
+
+    len = fgetxattr(encFD, REKEY_XATTR, tag, sizeof(tag));
+    if(len == (ssize_t) strlen(state->rekeyTag) &&
+       memcmp(tag, state->rekeyTag, len) == 0) {
+        ret = REKEY_CURRENT;
+        goto CLEANUP;
+    }
+
+    /* Wait for a quiet moment before taking the file; decrypting it
+       costs about what it has allocated, rewrapping it a header */
+    ret = encformat_detect(encFD, &format);
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+    ret = iobudget_charge(state->budget, format->rewrap ? CHUNK_HDRSIZE :
+                          (uint64_t) st.st_blocks * 512, NULL, NULL);
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+
+    if(fcntl(encFD, F_SETLEASE, F_WRLCK) < 0) {
+        if(errno == EAGAIN || errno == EBUSY) {
+            ret = REKEY_BUSY;
+            goto CLEANUP;
+        }
+        perror("ERROR rekeyFile: F_SETLEASE");
+        ret = -errno;
+        goto CLEANUP;
+    }
+
+    /* As of now nothing has it open, so nothing changes it */
+    if(fstat(encFD, &st) < 0) {
+        ret = -errno;
+        goto CLEANUP;
+    }
+    if(!S_ISREG(st.st_mode) || st.st_nlink != 1) {
+        ret = REKEY_SKIPPED;
+        goto CLEANUP;
+    }
+
+    ret = getFDKeyID(encFD, keyID);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR rekeyFile: getFDKeyID failed\n");
+        goto CLEANUP;
+    }
+    oldKey = acquireKey(keyID);
+    uuid_generate(keyID);
+    newKey = acquireKey(keyID);
+    if(!oldKey || !newKey) {
+        fprintf(stderr, "ERROR rekeyFile: acquireKey failed\n");
+        ret = -EIO;
+        goto CLEANUP;
+    }
+    uuid_unparse_lower(keyID, val);
+
+    /* It may have been saved in another format before the lease */
+    ret = encformat_detect(encFD, &format);
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+    newFD = openReplacement(fullPath, tmpPath, sizeof(tmpPath), &named);
+    if(newFD < 0) {
+        ret = newFD;
+        newFD = -1;
+        goto CLEANUP;
+    }
+
+    if(format->rewrap) {
+        /* Swap in a rewrapped reflink; copying the file to change a few
+           bytes of it is no cheaper than changing them in place */
+        if(ioctl(newFD, FICLONE, encFD) == 0) {
+            ret = RETURN_SUCCESS;
+        }
+        else if(writable) {
+            ret = rewrapInPlace(&encFD, format, oldKey, newKey, val, &st);
+            if(ret < 0) {
+                goto CLEANUP;
+            }
+            goto REKEYED;
+        }
+        else {
+            ret = rekeyClone(&encFD, newFD);
+        }
+        if(ret < 0) {
+            goto CLEANUP;
+        }
+        ret = format->rewrap(newFD, oldKey->crypt, newKey->crypt, 0);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR rekeyFile: %s rewrap failed\n", format->name);
+            goto CLEANUP;
+        }
+    }
+    else {
+        clearFD = openReplacement(fullPath, scratchPath, sizeof(scratchPath),
+                                  &scratchNamed);
+        if(clearFD < 0) {
+            ret = clearFD;
+            clearFD = -1;
+            goto CLEANUP;
+        }
+        if(scratchNamed) {
+            unlink(scratchPath);
+        }
+        ret = format->decrypt(encFD, clearFD, oldKey->crypt);
+        if(ret < 0) {
+            fprintf(stderr, "ERROR rekeyFile: %s decrypt failed\n",
+                    format->name);
+            goto CLEANUP;
+        }
+        if(fstat(clearFD, &stClear) < 0) {
+            ret = -errno;
+            goto CLEANUP;
+        }
+        ret = rekeyCopy(clearFD, stClear.st_size, newFD, newKey->crypt,
+                        &encFD);
+        if(ret < 0) {
+            goto CLEANUP;
+        }
+    }
+
+    ret = copyXattrs(encFD, newFD);
+    if(ret < 0) {
+        goto CLEANUP;
+    }
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    if(fsetxattr(newFD, KEYID_XATTR, val, KEYIDSTRSIZE - 1, 0) < 0 ||
+       fsetxattr(newFD, REKEY_XATTR, state->rekeyTag,
+                 strlen(state->rekeyTag), 0) < 0 ||
+       fchmod(newFD, st.st_mode & 07777) < 0 ||
+       (fchown(newFD, st.st_uid, st.st_gid) < 0 && errno != EPERM) ||
+       futimens(newFD, times) < 0 || fdatasync(newFD) < 0) {
+        perror("ERROR rekeyFile: new file");
+        ret = -errno;
+        goto CLEANUP;
+    }
+
+    if(leaseBroken(&encFD)) {
+        ret = -ECANCELED;
+        goto CLEANUP;
+    }
+    ret = nameReplacement(newFD, named, tmpPath);
+    if(ret < 0) {
+        tmpPath[0] = NULLTERM;
+        goto CLEANUP;
+    }
+    named = 1;
+
+    /* Swap rather than rename over, so that if path was renamed to
+       another file meanwhile, or the file was opened at the last
+       moment, the original can go back */
+    if(renameat2(AT_FDCWD, tmpPath, AT_FDCWD, fullPath, RENAME_EXCHANGE) == 0) {
+        if(lstat(tmpPath, &stOld) < 0 || stOld.st_dev != st.st_dev ||
+           stOld.st_ino != st.st_ino || leaseBroken(&encFD)) {
+            if(renameat2(AT_FDCWD, tmpPath, AT_FDCWD, fullPath,
+                         RENAME_EXCHANGE) < 0) {
+                perror("ERROR rekeyFile: swapping back");
+            }
+            ret = -ECANCELED;
+            goto CLEANUP;
+        }
+    }
+    else if(errno == EINVAL || errno == ENOSYS) {
+        if(rename(tmpPath, fullPath) < 0) {
+            perror("ERROR rekeyFile: rename");
+            ret = -errno;
+            goto CLEANUP;
+        }
+    }
+    else {
+        perror("ERROR rekeyFile: renameat2");
+        ret = -errno;
+        goto CLEANUP;
+    }
+
+ REKEYED:
+    invalidateXattrs(fullPath);
+
+    if(format->rewrap) {
+        __atomic_add_fetch(&state->rekeyStats.rewrapped, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_add_fetch(&state->rekeyStats.bytes,
+                           (uint64_t) st.st_blocks * 512, __ATOMIC_RELAXED);
+    }
+    ret = REKEY_DONE;
+
+ CLEANUP:
+    /* A lease broken meanwhile makes the file busy, not failed */
+    if(ret == -ECANCELED && leaseBroken(&encFD)) {
+        ret = REKEY_BUSY;
+    }
+    if(named && tmpPath[0]) {
+        unlink(tmpPath);
+    }
+    if(newFD >= 0) {
+        close(newFD);
+    }
+    if(clearFD >= 0) {
+        close(clearFD);
+    }
+    if(oldKey) {
+        keycache_release(oldKey);
+    }
+    if(newKey) {
+        keycache_release(newKey);
+    }
+    fcntl(encFD, F_SETLEASE, F_UNLCK);
+    close(encFD);
+    return ret;
+
+}
+
+/* Rotate every encrypted file below the mount path path; set *busy if
+ * any was left for another pass */
+static void rekeyDir(workPool_t* pool, const char* path, int* busy) {
+
+    int ret;
+    DIR* dp = NULL;
+    struct dirent* entry = NULL;
+    char fullPath[PATHBUFSIZE];
+    char entryPath[PATHBUFSIZE];
+    stat_t st;
+    rekeyStats_t* stats = &getState()->rekeyStats;
+
+    if(buildPath(path, fullPath, sizeof(fullPath)) < 0) {
+        return;
+    }
+    dp = opendir(fullPath);
+    if(!dp) {
+        fprintf(stderr, "WARNING rekeyDir: opendir(%s) failed\n", fullPath);
+        __atomic_add_fetch(&stats->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    while(!workpool_stopping(pool) && (entry = readdir(dp)) != NULL) {
+
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+           strncmp(entry->d_name, TMPNAME_PRE, strlen(TMPNAME_PRE)) == 0) {
+            continue;
+        }
+        ret = snprintf(entryPath, sizeof(entryPath), "%s%c%s",
+                       (strcmp(path, "/") == 0) ? "" : path,
+                       PATHDELIMINATOR, entry->d_name);
+        if(ret > (int)(sizeof(entryPath) - 1) || isPassthroughPath(entryPath) ||
+           buildPath(entryPath, fullPath, sizeof(fullPath)) < 0 ||
+           lstat(fullPath, &st) < 0) {
+            continue;
+        }
+
+        if(S_ISDIR(st.st_mode)) {
+            rekeyDir(pool, entryPath, busy);
+            continue;
+        }
+        if(!S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        ret = rekeyFile(fullPath);
+        switch(ret) {
+        case REKEY_DONE:
+            __atomic_add_fetch(&stats->files, 1, __ATOMIC_RELAXED);
+            break;
+        case REKEY_CURRENT:
+            __atomic_add_fetch(&stats->current, 1, __ATOMIC_RELAXED);
+            break;
+        case REKEY_BUSY:
+            __atomic_add_fetch(&stats->busy, 1, __ATOMIC_RELAXED);
+            *busy = 1;
+            break;
+        case REKEY_SKIPPED:
+            __atomic_add_fetch(&stats->skipped, 1, __ATOMIC_RELAXED);
+            break;
+        case -ECANCELED:
+            /* Unmounting */
+            *busy = 1;
+            break;
+        default:
+            fprintf(stderr, "ERROR rekeyDir: %s: rekeyFile failed with "
+                    "error %d\n", entryPath, -ret);
+            __atomic_add_fetch(&stats->failed, 1, __ATOMIC_RELAXED);
+        }
+
+    }
+
+    closedir(dp);
+
+}
+
+/* Background job: rotate the whole tree to new keys, in passes until no
+ * file is left busy, or the mount goes away. Rotated files carry the
+ * rotation's tag, so a later mount with the same -o rekey takes up
+ * where this one stopped. */
+static void rekeyTree(workPool_t* pool, void* arg) {
+
+    int busy;
+    unsigned int i;
+    fsState_t* state = getState();
+
+    (void) arg;
+
+    do {
+        busy = 0;
+        rekeyDir(pool, "/", &busy);
+        __atomic_add_fetch(&state->rekeyStats.passes, 1, __ATOMIC_RELAXED);
+
+        /* Files open now will likely stay open a while */
+        for(i = 0; busy && i < REKEY_RETRY_SEC * 10 && !workpool_stopping(pool);
+            i++) {
+            usleep(100000);
+        }
+    } while(busy && !workpool_stopping(pool));
+
+    fprintf(stderr, "INFO rekeyTree: rotation %s %s\n", state->rekeyTag,
+            busy ? "interrupted" : "complete");
+
+}
+
+static void* enc_init(fuse_conn_info_t* conn) {
+
+    fsState_t* state = getState();
+
+#ifdef FUSE_CAP_BIG_WRITES
+    /* Streams are encrypted per write request; take them whole */
+    conn->want |= FUSE_CAP_BIG_WRITES;
+#else
+    (void) conn;
+#endif
+
+#ifdef FUSE_CAP_SPLICE_READ
+    /* Passthrough reads go from the backing file to the kernel by splice */
+    if(state->passthroughPaths) {
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_MOVE);
+    }
+#endif
+
+    /* Runs after FUSE has daemonized, so library threads survive */
+    if(crypt_init() < 0) {
+        fprintf(stderr, "ERROR enc_init: crypt_init failed\n");
+    }
+
+    state->keyCache = keycache_create(KEY_CACHE_ENTRIES);
+    if(!state->keyCache) {
+        fprintf(stderr, "ERROR enc_init: keycache_create failed\n");
+    }
+    encformat_setKeyCache(state->keyCache);
+
+    if(state->xattrTTL > 0) {
+        state->xattrCache = xattrcache_create(XATTR_CACHE_ENTRIES, state->xattrTTL);
+        if(!state->xattrCache) {
+            fprintf(stderr, "ERROR enc_init: xattrcache_create failed\n");
+        }
+    }
+
+    if(state->useCustos) {
+        state->session = custosSession_create(state->custosURL ?
+                                              state->custosURL : SERVER_URL,
+                                              GOOD_PSK, state->custosConns);
+        if(!state->session) {
+            fprintf(stderr, "ERROR enc_init: custosSession_create failed\n");
+        }
+    }
+
+    if(state->warmPaths) {
+        state->workers = workpool_create(state->warmThreads);
+        if(!state->workers) {
+            fprintf(stderr, "ERROR enc_init: workpool_create failed\n");
+        }
+        else if(startWarmup(state) < 0) {
+            fprintf(stderr, "ERROR enc_init: startWarmup failed\n");
+        }
+    }
+
+    /* One worker is plenty under a budget. Breaking the rekeyer's
+       leases signals SIGIO, which it polls for instead. */
+    if(state->rekeyTag) {
+        signal(SIGIO, SIG_IGN);
+        state->budget = iobudget_create(state->rekeyRate * 1000000ULL,
+                                        REKEY_IDLE_MS);
+        state->rekeyer = workpool_create(1);
+        if(!state->budget || !state->rekeyer ||
+           workpool_submit(state->rekeyer, rekeyTree, NULL) < 0) {
+            fprintf(stderr, "ERROR enc_init: starting rekey failed\n");
+        }
+    }
+
+    if(state->spans && spantrace_startDumper(state->spans, SPANS_SIGNAL) < 0) {
+        fprintf(stderr, "ERROR enc_init: spantrace_startDumper failed\n");
+    }
+
+    if(state->clearBudget) {
+        state->clearCache = clearcache_create(state->clearBudget * 1024ULL * 1024);
+        if(!state->clearCache) {
+            fprintf(stderr, "ERROR enc_init: clearcache_create failed\n");
+        }
+    }
+
+    return state;
+
+}
+
+/* Dump key fetch statistics, for load testing */
+static void printKeyStats(fsState_t* state) {
+
+    keyCacheStats_t cacheStats;
+    custosSessionStats_t sessionStats;
+    custosStandinStats_t standinStats;
+
+    keycache_stats(state->keyCache, &cacheStats);
+    fprintf(stderr, "STATS keycache: hits %"PRIu64" misses %"PRIu64
+            " inserts %"PRIu64" evictions %"PRIu64" entries %zd\n",
+            cacheStats.hits, cacheStats.misses, cacheStats.inserts,
+            cacheStats.evictions, cacheStats.entries);
+    fprintf(stderr, "STATS keycache data: hits %"PRIu64" misses %"PRIu64
+            " entries %zd\n", cacheStats.dataHits, cacheStats.dataMisses,
+            cacheStats.dataEntries);
+
+    if(!state->session) {
+        return;
+    }
+
+    custosSession_stats(state->session, &sessionStats);
+    fprintf(stderr, "STATS session: requests %"PRIu64" failures %"PRIu64
+            " waits %"PRIu64" slots %zd\n", sessionStats.requests,
+            sessionStats.failures, sessionStats.waits, sessionStats.slots);
+
+    if(custosSession_standin(state->session)) {
+        custosStandin_stats(custosSession_standin(state->session), &standinStats);
+        fprintf(stderr, "STATS standin: requests %"PRIu64" errors %"PRIu64
+                " keys %"PRIu64" denied %"PRIu64"\n", standinStats.requests,
+                standinStats.errors, standinStats.keys, standinStats.denied);
+    }
+
+}
+
+static void enc_destroy(void* private_data) {
+
+    fsState_t* state = (fsState_t*) private_data;
+    xattrCacheStats_t xattrStats;
+    workPoolStats_t poolStats;
+    ioBudgetStats_t budgetStats;
+    clearCacheStats_t clearStats;
+
+    /* Background jobs use the caches and session below */
+    if(state->rekeyer) {
+        iobudget_stop(state->budget);
+        workpool_destroy(state->rekeyer);
+        state->rekeyer = NULL;
+        fprintf(stderr, "STATS rekey: files %"PRIu64" rewrapped %"PRIu64
+                " bytes %"PRIu64" current %"PRIu64" busy %"PRIu64
+                " skipped %"PRIu64" failed %"PRIu64" passes %"PRIu64"\n",
+                state->rekeyStats.files, state->rekeyStats.rewrapped,
+                state->rekeyStats.bytes, state->rekeyStats.current,
+                state->rekeyStats.busy, state->rekeyStats.skipped,
+                state->rekeyStats.failed, state->rekeyStats.passes);
+    }
+    if(state->budget) {
+        iobudget_stats(state->budget, &budgetStats);
+        fprintf(stderr, "STATS budget: bytes %"PRIu64" throttled %"PRIu64
+                "ms yielded %"PRIu64"ms cancels %"PRIu64"\n",
+                budgetStats.bytes, budgetStats.throttleNS / 1000000,
+                budgetStats.yieldNS / 1000000, budgetStats.cancels);
+        iobudget_destroy(state->budget);
+        state->budget = NULL;
+    }
+    if(state->workers) {
+        workpool_stats(state->workers, &poolStats);
+        workpool_destroy(state->workers);
+        state->workers = NULL;
+        fprintf(stderr, "STATS workers: queued %"PRIu64" done %"PRIu64
+                " unfinished %zd threads %zd\n", poolStats.queued,
+                poolStats.done, poolStats.pending, poolStats.threads);
+    }
+
+    if(state->keyCache) {
+        printKeyStats(state);
+    }
+
+    if(state->xattrCache) {
+        xattrcache_stats(state->xattrCache, &xattrStats);
+        fprintf(stderr, "STATS xattrcache: hits %"PRIu64" misses %"PRIu64
+                " invalidations %"PRIu64" evictions %"PRIu64" entries %zd\n",
+                xattrStats.hits, xattrStats.misses, xattrStats.invalidations,
+                xattrStats.evictions, xattrStats.entries);
+    }
+
+    custosSession_destroy(state->session);
+    state->session = NULL;
+
+    encformat_setKeyCache(NULL);
+    keycache_destroy(state->keyCache);
+    state->keyCache = NULL;
+
+    xattrcache_destroy(state->xattrCache);
+    state->xattrCache = NULL;
+
+    if(state->clearCache) {
+        clearcache_stats(state->clearCache, &clearStats);
+        fprintf(stderr, "STATS clearcache: budget %"PRIu64" resident %"PRIu64
+                " peak %"PRIu64" dirty %"PRIu64" fills %"PRIu64" redecrypts %"PRIu64
+                " evictions %"PRIu64" writebacks %"PRIu64" overruns %"PRIu64
+                " files %zd\n", clearStats.budget, clearStats.resident,
+                clearStats.peak, clearStats.dirty, clearStats.fills,
+                clearStats.redecrypts, clearStats.evictions,
+                clearStats.writebacks, clearStats.overruns, clearStats.files);
+        clearcache_destroy(state->clearCache);
+        state->clearCache = NULL;
+    }
+
+}
+
+static struct fuse_operations enc_oper = {
+
+    /* Setup and Teardown */
+    .init       = enc_init,         /* Initialize Filesystem */
+    .destroy    = enc_destroy,      /* Clean Up Filesystem */
+
+    /* Access Control */
+    .access     = enc_access,       /* Check File Permissions */
+    .lock       = enc_lock,         /* Lock File */
+    .flock      = enc_flock,        /* Lock Open File */
+
+    /* Metadata */
+    .chmod      = enc_chmod,        /* Change File Permissions */
+    .chown      = enc_chown,        /* Change File Owner */
+    .getattr    = enc_getattr,      /* Get File Attributes */
+    .fgetattr   = enc_fgetattr,     /* Get Open File Attributes  */
+    .statfs     = enc_statfs,       /* Get File System Statistics */
+    .utimens    = enc_utimens,      /* Change the Times of a File*/
+
+    /* Create and Delete */
+    .create     = enc_create,       /* Create and Open a Regular File */
+    .mkdir      = enc_mkdir,        /* Create a Directory */
+    .mknod      = enc_mknod,        /* Create a Non-Regular File Node */
+    .link       = enc_link,         /* Create a Hard Link */
+    .symlink    = enc_symlink,      /* Create a Symbolic Link */
+    .rmdir      = enc_rmdir,        /* Remove a Directory */
+    .unlink     = enc_unlink,       /* Remove a File */
+
+    /* Open and Close */
+    .open       = enc_open,         /* Open a File */
+    .opendir    = enc_opendir,      /* Open a Directory */
+    .release    = enc_release,      /* Release an Open File */
+    .releasedir = enc_releasedir,   /* Release an Open Directory */
+
+    /* Read and Write */
+    .read        = enc_read,        /* Read a File */
+    .read_buf    = enc_read_buf,    /* Read a File, Spliced if Mirrored */
+    .readdir     = enc_readdir,     /* Read a Directory */
+    .readlink    = enc_readlink,    /* Read the Target of a Symbolic Link */
+    .write       = enc_write,       /* Write a File*/
+
+    /* Modify */
+    .rename      = enc_rename,      /* Rename a File */
+    .truncate    = enc_truncate,    /* Change the Size of a File */
+    .ftruncate   = enc_ftruncate,   /* Change the Size of an Open File*/
+    .fallocate   = enc_fallocate,   /* Allocate or Punch File Space */
+
+    /* Buffering */
+    .flush       = enc_flush,       /* Flush Cached Data */
+    .fsync       = enc_fsync,       /* Synch Open File Contents */
+
+    /* Extended Attributes */
+    .setxattr    = enc_setxattr,    /* Set XATTR */
+    .getxattr    = enc_getxattr,    /* Get XATTR */
+    .listxattr   = enc_listxattr,   /* List XATTR */
+    .removexattr = enc_removexattr, /* Remove XATTR */
+
+    /* Flags */
+    .flag_nullpath_ok   = 1,
+    .flag_utime_omit_ok = 1,
+
+};
+
+/* Tracing (-o trace=FILE, -o spans=FILE)
+ *
+ * The same callbacks, each wrapped to add one record to an op-trace log
+ * (see op-trace.h) for enc-replay to play back, and one span to the
+ * phase spans (see span-trace.h), for whichever of the two are on. Only
+ * used when tracing, so untraced mounts run the table above unchanged.
+ */
+
+static opTrace_t* getTrace(void) {
+    return getState()->trace;
+}
+
+static void traceBegin(opTraceRecord_t* rec, span_t* span, opTraceOp_t op,
+                       const char* path) {
+
+    if(getTrace()) {
+        optrace_begin(getTrace(), rec, op, path);
+    }
+    else {
+        memset(rec, 0, sizeof(*rec));
+    }
+    spantrace_begin(getSpans(), span, SPAN_FUSE, optrace_opName(op));
+
+}
+
+static void traceEnd(opTraceRecord_t* rec, span_t* span, int64_t result) {
+
+    spantrace_end(getSpans(), span, result);
+    if(getTrace()) {
+        optrace_end(getTrace(), rec, result);
+    }
+
+}
+
+static int trace_getattr(const char* path, stat_t* stbuf) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_GETATTR, path);
+    ret = enc_getattr(path, stbuf);
+    if(ret == RETURN_SUCCESS) {
+        rec.mode = stbuf->st_mode;
+        rec.size = stbuf->st_size;
+    }
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_fgetattr(const char* path, stat_t* stbuf,
+                          fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_FGETATTR, path);
+    rec.fh = fi->fh;
+    ret = enc_fgetattr(path, stbuf, fi);
+    if(ret == RETURN_SUCCESS) {
+        rec.mode = stbuf->st_mode;
+        rec.size = stbuf->st_size;
+    }
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_access(const char* path, int mask) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_ACCESS, path);
+    rec.flags = mask;
+    ret = enc_access(path, mask);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_readlink(const char* path, char* buf, size_t size) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_READLINK, path);
+    rec.size = size;
+    ret = enc_readlink(path, buf, size);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_opendir(const char* path, fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_OPENDIR, path);
+    ret = enc_opendir(path, fi);
+    if(ret == RETURN_SUCCESS) {
+        rec.fh = fi->fh;
+    }
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
+                         off_t offset, fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_READDIR, path);
+    rec.fh = fi->fh;
+    rec.offset = offset;
+    ret = enc_readdir(path, buf, filler, offset, fi);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_releasedir(const char* path, fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_RELEASEDIR, path);
+    rec.fh = fi->fh;
+    ret = enc_releasedir(path, fi);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_mknod(const char* path, mode_t mode, dev_t rdev) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_MKNOD, path);
+    rec.mode = mode;
+    ret = enc_mknod(path, mode, rdev);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_mkdir(const char* path, mode_t mode) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_MKDIR, path);
+    rec.mode = mode;
+    ret = enc_mkdir(path, mode);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_unlink(const char* path) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_UNLINK, path);
+    ret = enc_unlink(path);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_rmdir(const char* path) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_RMDIR, path);
+    ret = enc_rmdir(path);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+/* The link's own path is recorded; its target only by length */
+static int trace_symlink(const char* from, const char* to) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_SYMLINK, to);
+    rec.size = strlen(from);
+    ret = enc_symlink(from, to);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_rename(const char* from, const char* to) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_RENAME, from);
+    rec.aux = optrace_pathHash(to);
+    ret = enc_rename(from, to);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_link(const char* from, const char* to) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_LINK, from);
+    rec.aux = optrace_pathHash(to);
+    ret = enc_link(from, to);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_chmod(const char* path, mode_t mode) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_CHMOD, path);
+    rec.mode = mode;
+    ret = enc_chmod(path, mode);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_chown(const char* path, uid_t uid, gid_t gid) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_CHOWN, path);
+    ret = enc_chown(path, uid, gid);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_truncate(const char* path, off_t size) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_TRUNCATE, path);
+    rec.size = size;
+    ret = enc_truncate(path, size);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_ftruncate(const char* path, off_t size,
+                           fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_FTRUNCATE, path);
+    rec.fh = fi->fh;
+    rec.size = size;
+    ret = enc_ftruncate(path, size, fi);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_utimens(const char* path, const timespec_t ts[2]) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_UTIMENS, path);
+    ret = enc_utimens(path, ts);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_create(const char* path, mode_t mode, fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_CREATE, path);
+    rec.flags = fi->flags;
+    rec.mode = mode;
+    ret = enc_create(path, mode, fi);
+    if(ret == RETURN_SUCCESS) {
+        rec.fh = fi->fh;
+    }
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_open(const char* path, fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_OPEN, path);
+    rec.flags = fi->flags;
+    ret = enc_open(path, fi);
+    if(ret == RETURN_SUCCESS) {
+        rec.fh = fi->fh;
+    }
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_read(const char* path, char* buf, size_t size, off_t offset,
+                      fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_READ, path);
+    rec.fh = fi->fh;
+    rec.offset = offset;
+    rec.size = size;
+    ret = enc_read(path, buf, size, offset, fi);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+/* A spliced read records the size handed to libfuse, which is only an
+ * upper bound at the end of the file */
+static int trace_read_buf(const char* path, fuse_bufvec_t** bufp, size_t size,
+                          off_t offset, fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_READ, path);
+    rec.fh = fi->fh;
+    rec.offset = offset;
+    rec.size = size;
+    ret = enc_read_buf(path, bufp, size, offset, fi);
+    traceEnd(&rec, &span, (ret < 0) ? ret : (int64_t) fuse_buf_size(*bufp));
+
+    return ret;
+
+}
+
+static int trace_write(const char* path, const char* buf, size_t size,
+                       off_t offset, fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_WRITE, path);
+    rec.fh = fi->fh;
+    rec.offset = offset;
+    rec.size = size;
+    ret = enc_write(path, buf, size, offset, fi);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_statfs(const char* path, statvfs_t* stbuf) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_STATFS, path);
+    ret = enc_statfs(path, stbuf);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_fallocate(const char* path, int mode, off_t offset,
+                           off_t length, fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_FALLOCATE, path);
+    rec.fh = fi->fh;
+    rec.flags = mode;
+    rec.offset = offset;
+    rec.size = length;
+    ret = enc_fallocate(path, mode, offset, length, fi);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_flush(const char* path, fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_FLUSH, path);
+    rec.fh = fi->fh;
+    ret = enc_flush(path, fi);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_fsync(const char* path, int isdatasync,
+                       fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_FSYNC, path);
+    rec.fh = fi->fh;
+    rec.flags = isdatasync;
+    ret = enc_fsync(path, isdatasync, fi);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_release(const char* path, fuse_file_info_t* fi) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_RELEASE, path);
+    rec.fh = fi->fh;
+    ret = enc_release(path, fi);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_lock(const char* path, fuse_file_info_t* fi, int cmd,
+                      flock_t* lock) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_LOCK, path);
+    rec.fh = fi->fh;
+    rec.flags = cmd;
+    rec.offset = lock->l_start;
+    rec.size = lock->l_len;
+    rec.mode = lock->l_type;
+    ret = enc_lock(path, fi, cmd, lock);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_flock(const char* path, fuse_file_info_t* fi, int op) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_FLOCK, path);
+    rec.fh = fi->fh;
+    rec.flags = op;
+    ret = enc_flock(path, fi, op);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+/* xattr names are recorded by hash, in aux */
+static int trace_setxattr(const char* path, const char* name, const char* value,
+                          size_t size, int flags) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_SETXATTR, path);
+    rec.aux = optrace_pathHash(name);
+    rec.size = size;
+    rec.flags = flags;
+    ret = enc_setxattr(path, name, value, size, flags);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_getxattr(const char* path, const char* name, char* value,
+                          size_t size) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_GETXATTR, path);
+    rec.aux = optrace_pathHash(name);
+    rec.size = size;
+    ret = enc_getxattr(path, name, value, size);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_listxattr(const char* path, char* list, size_t size) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_LISTXATTR, path);
+    rec.size = size;
+    ret = enc_listxattr(path, list, size);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static int trace_removexattr(const char* path, const char* name) {
+
+    int ret;
+    opTraceRecord_t rec;
+    span_t span;
+
+    traceBegin(&rec, &span, OPTRACE_REMOVEXATTR, path);
+    rec.aux = optrace_pathHash(name);
+    ret = enc_removexattr(path, name);
+    traceEnd(&rec, &span, ret);
+
+    return ret;
+
+}
+
+static struct fuse_operations enc_trace_oper = {
+
+    /* Setup and Teardown */
+    .init       = enc_init,         /* Initialize Filesystem */
+    .destroy    = enc_destroy,      /* Clean Up Filesystem */
+
+    /* Access Control */
+    .access     = trace_access,     /* Check File Permissions */
+    .lock       = trace_lock,       /* Lock File */
+    .flock      = trace_flock,      /* Lock Open File */
+
+    /* Metadata */
+    .chmod      = trace_chmod,      /* Change File Permissions */
+    .chown      = trace_chown,      /* Change File Owner */
+    .getattr    = trace_getattr,    /* Get File Attributes */
+    .fgetattr   = trace_fgetattr,   /* Get Open File Attributes  */
+    .statfs     = trace_statfs,     /* Get File System Statistics */
+    .utimens    = trace_utimens,    /* Change the Times of a File*/
+
+    /* Create and Delete */
+    .create     = trace_create,     /* Create and Open a Regular File */
+    .mkdir      = trace_mkdir,      /* Create a Directory */
+    .mknod      = trace_mknod,      /* Create a Non-Regular File Node */
+    .link       = trace_link,       /* Create a Hard Link */
+    .symlink    = trace_symlink,    /* Create a Symbolic Link */
+    .rmdir      = trace_rmdir,      /* Remove a Directory */
+    .unlink     = trace_unlink,     /* Remove a File */
+
+    /* Open and Close */
+    .open       = trace_open,       /* Open a File */
+    .opendir    = trace_opendir,    /* Open a Directory */
+    .release    = trace_release,    /* Release an Open File */
+    .releasedir = trace_releasedir, /* Release an Open Directory */
+
+    /* Read and Write */
+    .read        = trace_read,      /* Read a File */
+    .read_buf    = trace_read_buf,  /* Read a File, Spliced if Mirrored */
+    .readdir     = trace_readdir,   /* Read a Directory */
+    .readlink    = trace_readlink,  /* Read the Target of a Symbolic Link */
+    .write       = trace_write,     /* Write a File*/
+
+    /* Modify */
+    .rename      = trace_rename,    /* Rename a File */
+    .truncate    = trace_truncate,  /* Change the Size of a File */
+    .ftruncate   = trace_ftruncate, /* Change the Size of an Open File*/
+    .fallocate   = trace_fallocate, /* Allocate or Punch File Space */
+
+    /* Buffering */
+    .flush       = trace_flush,     /* Flush Cached Data */
+    .fsync       = trace_fsync,     /* Synch Open File Contents */
+
+    /* Extended Attributes */
+    .setxattr    = trace_setxattr,    /* Set XATTR */
+    .getxattr    = trace_getxattr,    /* Get XATTR */
+    .listxattr   = trace_listxattr,   /* List XATTR */
+    .removexattr = trace_removexattr, /* Remove XATTR */
+
+    /* Flags */
+    .flag_nullpath_ok   = 1,
+    .flag_utime_omit_ok = 1,
+
+};
+
+/* Low-level mount (-o lowlevel)
+ *
+ * The same overlay on the inode API: requests name inodes of the inode
+ * table instead of paths, so lookups and metadata calls are *at() calls
+ * on held fds, and libfuse keeps no path tree of its own. Open files use
+ * the same handles as above; their calls just get no path, and find
+ * their backing file through the inode they were opened on.
+ */
+
+static inodeEntry_t* getInode(fuse_ino_t ino) {
+
+    if(ino == FUSE_ROOT_ID) {
+        return inodetable_root(getState()->inodes);
+    }
+
+    return (inodeEntry_t*) (uintptr_t) ino;
+
+}
+
+static fuse_ino_t putInode(inodeEntry_t* inode) {
+
+    if(inode == inodetable_root(getState()->inodes)) {
+        return FUSE_ROOT_ID;
+    }
+
+    return (fuse_ino_t) (uintptr_t) inode;
+
+}
+
+/* /proc/self/fd link to the inode itself */
+static void inodeFDPath(const inodeEntry_t* inode, char* buf, size_t size) {
+    snprintf(buf, size, "/proc/self/fd/%d",
+             __atomic_load_n(&inode->fd, __ATOMIC_ACQUIRE));
+}
+
+/* /proc/self/fd path of name in the directory dir */
+static int childPath(const inodeEntry_t* dir, const char* name,
+                     char* buf, size_t size) {
+
+    int len;
+
+    len = snprintf(buf, size, "/proc/self/fd/%d/%s", dir->fd, name);
+    if(len < 0 || (size_t) len >= size) {
+        return -ENAMETOOLONG;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Path inside the mount of name in dir, for path pattern matching;
+ * left empty when no patterns are set or dir has no name */
+static void childMountPath(const inodeEntry_t* dir, const char* name,
+                           char* buf, size_t size) {
+
+    size_t len;
+    fsState_t* state = getState();
+
+    buf[0] = NULLTERM;
+    if((!state->streamPaths && !state->passthroughPaths) ||
+       inodetable_mountPath(state->inodes, (inodeEntry_t*) dir, buf, size) < 0) {
+        buf[0] = NULLTERM;
+        return;
+    }
+
+    len = strlen(buf);
+    if(snprintf(buf + len, size - len, "%s%s",
+                (len > 1) ? "/" : "", name) >= (int) (size - len)) {
+        buf[0] = NULLTERM;
+    }
+
+}
+
+/* Is inode under the passthrough policy, by the name it was last seen
+ * under */
+static int isPassthroughInode(inodeEntry_t* inode) {
+
+    char mountPath[PATHBUFSIZE];
+    fsState_t* state = getState();
+
+    if(!state->passthroughPaths ||
+       inodetable_mountPath(state->inodes, inode, mountPath,
+                            sizeof(mountPath)) < 0) {
+        return 0;
+    }
+
+    return isPassthroughPath(mountPath);
+
+}
+
+/* Plain text attributes of the regular file inode, whose backing
+ * attributes are in st */
+static int plainInodeAttr(inodeEntry_t* inode, stat_t* st) {
+
+    int ret;
+    int fd;
+    char procPath[PROCFDPATHSIZE];
+
+    if(isPassthroughInode(inode)) {
+        return RETURN_SUCCESS;
+    }
+
+    inodeFDPath(inode, procPath, sizeof(procPath));
+    fd = open(procPath, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        fprintf(stderr, "ERROR plainInodeAttr: open(procPath) failed\n");
+        perror("ERROR plainInodeAttr");
+        return -errno;
+    }
+
+    ret = plainAttr(fd, st);
+    close(fd);
+
+    return ret;
+
+}
+
+/* Attributes of inode as the mount shows them; open files answer from
+ * their handle */
+static int inodeAttr(inodeEntry_t* inode, fuse_file_info_t* fi, stat_t* st) {
+
+    if(fi && fi->fh) {
+        return enc_fgetattr(NULL, st, fi);
+    }
+
+    if(fstatat(inode->fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+        return -errno;
+    }
+    if(!S_ISREG(st->st_mode)) {
+        return RETURN_SUCCESS;
+    }
+
+    return plainInodeAttr(inode, st);
+
+}
+
+/* Look up name in dir for a reply entry, counting a kernel lookup */
+static int lookupEntry(inodeEntry_t* dir, const char* name,
+                       fuse_entry_param_t* e) {
+
+    int ret;
+    inodeEntry_t* inode = NULL;
+    fsState_t* state = getState();
+
+    memset(e, 0, sizeof(*e));
+
+    ret = inodetable_lookup(state->inodes, dir, name, &e->attr, &inode);
+    if(ret < 0) {
+        return ret;
+    }
+
+    if(S_ISREG(e->attr.st_mode)) {
+        ret = plainInodeAttr(inode, &e->attr);
         if(ret < 0) {
-            fprintf(stderr, "ERROR enc_flush: encryptFH failed\n");
+            fprintf(stderr, "ERROR lookupEntry: plainInodeAttr failed\n");
+            inodetable_forget(state->inodes, inode, 1);
             return ret;
         }
-        fhs->dirty = FHS_CLEAN;
+    }
 
+    e->ino = putInode(inode);
+    e->attr_timeout = LL_TIMEOUT;
+    e->entry_timeout = LL_TIMEOUT;
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Reply with e, or the error in ret; a lookup the kernel never got
+ * is not counted */
+static void replyEntry(fuse_req_t req, int ret, fuse_entry_param_t* e) {
+
+    if(ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
     }
 
-    ret = dup(fhs->clearFH);
+    if(fuse_reply_entry(req, e) != 0) {
+        inodetable_forget(getState()->inodes, getInode(e->ino), 1);
+    }
+
+}
+
+/* Reply to a request that returns no data */
+static void replyErr(fuse_req_t req, int ret) {
+    fuse_reply_err(req, (ret < 0) ? -ret : 0);
+}
+
+static void encll_init(void* userdata, fuse_conn_info_t* conn) {
+
+    (void) userdata;
+
+    enc_init(conn);
+
+}
+
+static void encll_destroy(void* userdata) {
+
+    fsState_t* state = (fsState_t*) userdata;
+
+    fprintf(stderr, "STATS inodes: entries %zd\n",
+            inodetable_entries(state->inodes));
+
+    enc_destroy(userdata);
+
+}
+
+static void encll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+
+    int ret;
+    fuse_entry_param_t e;
+
+    ret = lookupEntry(getInode(parent), name, &e);
+    replyEntry(req, ret, &e);
+
+}
+
+static void encll_forget(fuse_req_t req, fuse_ino_t ino,
+                         unsigned long nlookup) {
+
+    inodetable_forget(getState()->inodes, getInode(ino), nlookup);
+    fuse_reply_none(req);
+
+}
+
+static void encll_forget_multi(fuse_req_t req, size_t count,
+                               fuse_forget_data_t* forgets) {
+
+    size_t i;
+
+    for(i = 0; i < count; i++) {
+        inodetable_forget(getState()->inodes, getInode(forgets[i].ino),
+                          forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+
+}
+
+static void encll_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info_t* fi) {
+
+    int ret;
+    stat_t st;
+
+    ret = inodeAttr(getInode(ino), fi, &st);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_flush: dup(clearFH) failed\n");
-        perror("ERROR enc_flush");
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    fuse_reply_attr(req, &st, LL_TIMEOUT);
+
+}
+
+/* Time to set for one of the FUSE_SET_ATTR_*TIME bits */
+static timespec_t setTime(int toSet, int setBit, int nowBit,
+                          const timespec_t* value) {
+
+    timespec_t ts;
+
+    if(toSet & nowBit) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = UTIME_NOW;
+    }
+    else if(toSet & setBit) {
+        ts = *value;
+    }
+    else {
+        ts.tv_sec = 0;
+        ts.tv_nsec = UTIME_OMIT;
+    }
+
+    return ts;
+
+}
+
+static void encll_setattr(fuse_req_t req, fuse_ino_t ino, stat_t* attr,
+                          int toSet, fuse_file_info_t* fi) {
+
+    int ret = RETURN_SUCCESS;
+    inodeEntry_t* inode = getInode(ino);
+    char procPath[PROCFDPATHSIZE];
+    char fullPath[PATHBUFSIZE];
+    char key[LL_KEYSIZE];
+    timespec_t ts[2];
+    stat_t st;
+
+    if(toSet & FUSE_SET_ATTR_MODE) {
+        inodeFDPath(inode, procPath, sizeof(procPath));
+        if(chmod(procPath, attr->st_mode) < 0) {
+            fprintf(stderr, "ERROR encll_setattr: chmod failed\n");
+            ret = -errno;
+            goto REPLY;
+        }
+    }
+
+    if(toSet & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        if(fchownat(inode->fd, "",
+                    (toSet & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1,
+                    (toSet & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1,
+                    AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+            fprintf(stderr, "ERROR encll_setattr: fchownat failed\n");
+            ret = -errno;
+            goto REPLY;
+        }
+    }
+
+    if(toSet & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        xattrKey(inode->dev, inode->ino, key, sizeof(key));
+        invalidateXattrs(key);
+    }
+
+    if(toSet & FUSE_SET_ATTR_SIZE) {
+        if(fi) {
+            ret = enc_ftruncate(NULL, attr->st_size, fi);
+        }
+        else {
+            ret = inodetable_path(getState()->inodes, inode, fullPath,
+                                  sizeof(fullPath));
+            if(ret == RETURN_SUCCESS && isPassthroughInode(inode)) {
+                inodeFDPath(inode, procPath, sizeof(procPath));
+                ret = (truncate(procPath, attr->st_size) < 0) ?
+                    -errno : RETURN_SUCCESS;
+            }
+            else if(ret == RETURN_SUCCESS) {
+                ret = truncateFile(NULL, fullPath, inode, attr->st_size);
+            }
+        }
+        if(ret < 0) {
+            fprintf(stderr, "ERROR encll_setattr: truncate failed\n");
+            goto REPLY;
+        }
+    }
+
+    if(toSet & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+                FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW)) {
+
+        ts[0] = setTime(toSet, FUSE_SET_ATTR_ATIME, FUSE_SET_ATTR_ATIME_NOW,
+                        &attr->st_atim);
+        ts[1] = setTime(toSet, FUSE_SET_ATTR_MTIME, FUSE_SET_ATTR_MTIME_NOW,
+                        &attr->st_mtim);
+
+        /* The fd link leads through a symlink; its name doesn't */
+        if(inode->type == S_IFLNK) {
+            ret = inodetable_path(getState()->inodes, inode, fullPath,
+                                  sizeof(fullPath));
+            if(ret < 0) {
+                goto REPLY;
+            }
+            ret = utimensat(AT_FDCWD, fullPath, ts, AT_SYMLINK_NOFOLLOW);
+        }
+        else {
+            inodeFDPath(inode, procPath, sizeof(procPath));
+            ret = utimensat(AT_FDCWD, procPath, ts, 0);
+        }
+        if(ret < 0) {
+            fprintf(stderr, "ERROR encll_setattr: utimensat failed\n");
+            ret = -errno;
+            goto REPLY;
+        }
+
+    }
+
+    ret = inodeAttr(inode, fi, &st);
+
+ REPLY:
+    if(ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_attr(req, &st, LL_TIMEOUT);
+
+}
+
+static void encll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+
+    char procPath[PROCFDPATHSIZE];
+
+    inodeFDPath(getInode(ino), procPath, sizeof(procPath));
+    replyErr(req, (access(procPath, mask) < 0) ? -errno : RETURN_SUCCESS);
+
+}
+
+static void encll_readlink(fuse_req_t req, fuse_ino_t ino) {
+
+    ssize_t len;
+    char buf[PATHBUFSIZE];
+
+    len = readlinkat(getInode(ino)->fd, "", buf, sizeof(buf) - 1);
+    if(len < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    buf[len] = NULLTERM;
+
+    fuse_reply_readlink(req, buf);
+
+}
+
+static void encll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name,
+                        mode_t mode, dev_t rdev) {
+
+    int ret;
+    inodeEntry_t* dir = getInode(parent);
+    fuse_entry_param_t e;
+
+    ret = mknodat(dir->fd, name, mode, rdev);
+    if(ret < 0) {
+        ret = -errno;
+    }
+    else {
+        ret = lookupEntry(dir, name, &e);
+    }
+
+    replyEntry(req, ret, &e);
+
+}
+
+static void encll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name,
+                        mode_t mode) {
+
+    int ret;
+    inodeEntry_t* dir = getInode(parent);
+    fuse_entry_param_t e;
+
+    ret = mkdirat(dir->fd, name, mode);
+    if(ret < 0) {
+        ret = -errno;
+    }
+    else {
+        ret = lookupEntry(dir, name, &e);
+    }
+
+    replyEntry(req, ret, &e);
+
+}
+
+static void encll_symlink(fuse_req_t req, const char* link, fuse_ino_t parent,
+                          const char* name) {
+
+    int ret;
+    inodeEntry_t* dir = getInode(parent);
+    fuse_entry_param_t e;
+
+    ret = symlinkat(link, dir->fd, name);
+    if(ret < 0) {
+        ret = -errno;
+    }
+    else {
+        ret = lookupEntry(dir, name, &e);
+    }
+
+    replyEntry(req, ret, &e);
+
+}
+
+static void encll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                       const char* newname) {
+
+    int ret;
+    inodeEntry_t* inode = getInode(ino);
+    inodeEntry_t* dir = getInode(newparent);
+    char procPath[PROCFDPATHSIZE];
+    char key[LL_KEYSIZE];
+    char newPath[PATHBUFSIZE];
+    fuse_entry_param_t e;
+
+    childMountPath(dir, newname, newPath, sizeof(newPath));
+    if(isPassthroughInode(inode) != isPassthroughPath(newPath)) {
+        fuse_reply_err(req, EXDEV);
+        return;
+    }
+
+    inodeFDPath(inode, procPath, sizeof(procPath));
+    ret = linkat(AT_FDCWD, procPath, dir->fd, newname, AT_SYMLINK_FOLLOW);
+    if(ret < 0) {
+        ret = -errno;
+    }
+    else {
+        /* The link count cached with the inode is now wrong */
+        xattrKey(inode->dev, inode->ino, key, sizeof(key));
+        invalidateXattrs(key);
+        ret = lookupEntry(dir, newname, &e);
+    }
+
+    replyEntry(req, ret, &e);
+
+}
+
+/* Remove name from dir with unlinkat(flags) */
+static int removeName(inodeEntry_t* dir, const char* name, int flags) {
+
+    int known;
+    char key[LL_KEYSIZE];
+    stat_t st;
+
+    known = (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0);
+
+    if(unlinkat(dir->fd, name, flags) < 0) {
         return -errno;
     }
-    ret = close(ret);
+
+    if(known) {
+        inodetable_unlinked(getState()->inodes, &st, dir, name);
+        xattrKey(st.st_dev, st.st_ino, key, sizeof(key));
+        invalidateXattrs(key);
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+static void encll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    replyErr(req, removeName(getInode(parent), name, 0));
+}
+
+static void encll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    replyErr(req, removeName(getInode(parent), name, AT_REMOVEDIR));
+}
+
+static void encll_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+                         fuse_ino_t newparent, const char* newname) {
+
+    int replaced;
+    inodeEntry_t* dir = getInode(parent);
+    inodeEntry_t* newDir = getInode(newparent);
+    char key[LL_KEYSIZE];
+    char fromPath[PATHBUFSIZE];
+    char toPath[PATHBUFSIZE];
+    stat_t st;
+    stat_t stOld;
+    fsState_t* state = getState();
+
+    childMountPath(dir, name, fromPath, sizeof(fromPath));
+    childMountPath(newDir, newname, toPath, sizeof(toPath));
+    if(checkPolicy(fromPath, toPath) < 0) {
+        fuse_reply_err(req, EXDEV);
+        return;
+    }
+
+    replaced = (fstatat(newDir->fd, newname, &stOld, AT_SYMLINK_NOFOLLOW) == 0);
+
+    if(renameat(dir->fd, name, newDir->fd, newname) < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    if(fstatat(newDir->fd, newname, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        if(replaced &&
+           (stOld.st_dev != st.st_dev || stOld.st_ino != st.st_ino)) {
+            inodetable_unlinked(state->inodes, &stOld, newDir, newname);
+            xattrKey(stOld.st_dev, stOld.st_ino, key, sizeof(key));
+            invalidateXattrs(key);
+        }
+        inodetable_moved(state->inodes, &st, newDir, newname);
+        xattrKey(st.st_dev, st.st_ino, key, sizeof(key));
+        invalidateXattrs(key);
+    }
+
+    fuse_reply_err(req, 0);
+
+}
+
+static void encll_create(fuse_req_t req, fuse_ino_t parent, const char* name,
+                         mode_t mode, fuse_file_info_t* fi) {
+
+    int ret;
+    inodeEntry_t* dir = getInode(parent);
+    enc_fhs_t* fhs;
+    char fullPath[PATHBUFSIZE];
+    char mountPath[PATHBUFSIZE];
+    fuse_entry_param_t e;
+
+    ret = childPath(dir, name, fullPath, sizeof(fullPath));
+    if(ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    childMountPath(dir, name, mountPath, sizeof(mountPath));
+
+    ret = openFile(mountPath, fullPath, 1, mode, fi);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR encll_create: openFile failed\n");
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fhs = get_fhs(fi->fh);
+
+    ret = lookupEntry(dir, name, &e);
+    if(ret < 0) {
+        fprintf(stderr, "ERROR encll_create: lookupEntry failed\n");
+        closeFilePair(fhs);
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fhs->inode = getInode(e.ino);
+
+    if(fuse_reply_create(req, &e, fi) != 0) {
+        closeFilePair(fhs);
+        inodetable_forget(getState()->inodes, fhs->inode, 1);
+    }
+
+}
+
+static void encll_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info_t* fi) {
+
+    int ret;
+    inodeEntry_t* inode = getInode(ino);
+    enc_fhs_t* fhs;
+    char fullPath[PATHBUFSIZE];
+    char mountPath[PATHBUFSIZE];
+    fsState_t* state = getState();
+
+    ret = inodetable_path(state->inodes, inode, fullPath, sizeof(fullPath));
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_flush: close(dup(clearFH)) failed\n");
-        perror("ERROR enc_flush");
-        return -errno;
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    if((!state->streamPaths && !state->passthroughPaths) ||
+       inodetable_mountPath(state->inodes, inode, mountPath,
+                            sizeof(mountPath)) < 0) {
+        mountPath[0] = NULLTERM;
     }
 
-    ret = dup(fhs->encFH);
+    ret = openFile(mountPath, fullPath, 0, 0, fi);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_flush: dup(encFH) failed\n");
-        perror("ERROR enc_flush");
-        return -errno;
+        fprintf(stderr, "ERROR encll_open: openFile failed\n");
+        fuse_reply_err(req, -ret);
+        return;
     }
-    ret = close(ret);
+    fhs = get_fhs(fi->fh);
+    fhs->inode = inode;
+
+    /* The name may have been reused outside the mount; the kernel looks
+       it up again on ESTALE */
+    ret = checkInode(fhs);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_flush: close(dup(encFH)) failed\n");
-        perror("ERROR enc_flush");
-        return -errno;
+        closeFilePair(fhs);
+        fuse_reply_err(req, -ret);
+        return;
     }
 
-    return RETURN_SUCCESS;
+    if(fuse_reply_open(req, fi) != 0) {
+        closeFilePair(fhs);
+    }
 
 }
 
-static int enc_fsync(const char* path, int isdatasync,
-                     fuse_file_info_t* fi) {
+static void encll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       fuse_file_info_t* fi) {
 
-    (void) path;
+    (void) ino;
 
     int ret;
-    enc_fhs_t* fhs;
+    char* buf = NULL;
+    enc_fhs_t* fhs = get_fhs(fi->fh);
+    fuse_bufvec_t bufv = FUSE_BUFVEC_INIT(size);
 
-    if(!fi) {
-        fprintf(stderr, "ERROR enc_fsync: fi is NULL");
-        return -EINVAL;
+    /* Spliced from the backing file where the kernel allows */
+    if(fhs->passthrough) {
+        bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv.buf[0].fd = fhs->encFH;
+        bufv.buf[0].pos = off;
+        fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+        return;
     }
 
-    fhs = get_fhs(fi->fh);
-
-    if(fhs->dirty == FHS_DIRTY) {
-
-        ret = encryptFH(fhs->clearFH, fhs->encFH);
-        if(ret < 0) {
-            fprintf(stderr, "ERROR enc_fsync: encryptFH failed\n");
-            return ret;
-        }
-        fhs->dirty = FHS_CLEAN;
-
+    buf = malloc(size ? size : 1);
+    if(!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
 
-    if(isdatasync) {
-        ret = fdatasync(fhs->encFH);
+    ret = enc_read(NULL, buf, size, off, fi);
+    if(ret < 0) {
+        fuse_reply_err(req, -ret);
     }
     else {
-        ret = fsync(fhs->encFH);
+        fuse_reply_buf(req, buf, ret);
     }
+    free(buf);
+
+}
+
+static void encll_write(fuse_req_t req, fuse_ino_t ino, const char* buf,
+                        size_t size, off_t off, fuse_file_info_t* fi) {
+
+    (void) ino;
+
+    int ret;
 
+    ret = enc_write(NULL, buf, size, off, fi);
     if(ret < 0) {
-        fprintf(stderr, "ERROR enc_fsync: fdatasync/fsync failed\n");
-        perror("ERROR enc_fsync");
-        return -errno;
+        fuse_reply_err(req, -ret);
+        return;
     }
 
-    return RETURN_SUCCESS;
+    fuse_reply_write(req, ret);
 
 }
 
-static int enc_release(const char* path, fuse_file_info_t* fi) {
+static void encll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                            off_t offset, off_t length, fuse_file_info_t* fi) {
 
-    (void) path;
+    (void) ino;
+
+    replyErr(req, enc_fallocate(NULL, mode, offset, length, fi));
+
+}
+
+static void encll_flush(fuse_req_t req, fuse_ino_t ino, fuse_file_info_t* fi) {
+
+    (void) ino;
+
+    replyErr(req, enc_flush(NULL, fi));
+
+}
+
+static void encll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                        fuse_file_info_t* fi) {
+
+    (void) ino;
+
+    replyErr(req, enc_fsync(NULL, datasync, fi));
+
+}
+
+static void encll_release(fuse_req_t req, fuse_ino_t ino, fuse_file_info_t* fi) {
+
+    (void) ino;
+
+    replyErr(req, enc_release(NULL, fi));
+
+}
+
+static void encll_flock(fuse_req_t req, fuse_ino_t ino, fuse_file_info_t* fi,
+                        int op) {
+
+    (void) ino;
+
+    replyErr(req, enc_flock(NULL, fi, op));
+
+}
+
+static void encll_opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info_t* fi) {
 
     int ret;
-    enc_fhs_t* fhs;
+    int fd;
+    enc_dirp_t* d = NULL;
+    char dirPath[PROCFDPATHSIZE];
 
-    if(!fi) {
-        fprintf(stderr, "ERROR enc_release: fi is NULL");
-        return -EINVAL;
+    d = malloc(sizeof(*d));
+    if(d == NULL) {
+        fprintf(stderr, "ERROR encll_opendir: malloc failed\n");
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
 
-    fhs = get_fhs(fi->fh);
-
-    if(fhs->dirty == FHS_DIRTY) {
+    fd = openat(getInode(ino)->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    d->dp = (fd < 0) ? NULL : fdopendir(fd);
+    if(d->dp == NULL) {
+        fprintf(stderr, "ERROR encll_opendir: opendir failed\n");
+        perror("ERROR encll_opendir");
+        ret = errno;
+        if(fd >= 0) {
+            close(fd);
+        }
+        free(d);
+        fuse_reply_err(req, ret);
+        return;
+    }
+    d->offset = 0;
+    d->entry = NULL;
 
-        ret = encryptFH(fhs->clearFH, fhs->encFH);
+    /* Warm the key cache for the files we are about to list */
+    if(!isPassthroughInode(getInode(ino))) {
+        snprintf(dirPath, sizeof(dirPath), "/proc/self/fd/%d", fd);
+        ret = prefetchDirKeys(d->dp, dirPath);
         if(ret < 0) {
-            fprintf(stderr, "ERROR enc_release: encryptFH failed\n");
-            return ret;
+            fprintf(stderr, "WARNING encll_opendir: prefetchDirKeys failed\n");
         }
-
     }
 
-    ret = closeFilePair(fhs);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_release: closeFilePair failed\n");
-        return ret;
+    fi->fh = (unsigned long) d;
+
+    if(fuse_reply_open(req, fi) != 0) {
+        closedir(d->dp);
+        free(d);
     }
 
-    return RETURN_SUCCESS;
+}
+
+/* Add entry to the reply buffer p of rem bytes. Return the size it
+ * takes, more than rem if it didn't fit (and so wasn't added). */
+static size_t addDirEntry(fuse_req_t req, struct dirent* entry, char* p,
+                          size_t rem, off_t nextoff) {
+
+    stat_t st;
+
+    memset(&st, 0, sizeof(st));
+    st.st_ino = entry->d_ino;
+    st.st_mode = entry->d_type << 12;
+
+    return fuse_add_direntry(req, p, rem, entry->d_name, &st, nextoff);
 
 }
 
-static int enc_lock(const char* path, fuse_file_info_t* fi, int cmd,
-                    flock_t* lock) {
+static void encll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t offset, fuse_file_info_t* fi) {
 
-    (void) path;
+    (void) ino;
 
-    int ret;
-    enc_fhs_t* fhs;
+    int ret = RETURN_SUCCESS;
+    size_t rem = size;
+    size_t len;
+    off_t nextoff;
+    char* buf = NULL;
+    enc_dirp_t* d = get_dirp(fi);
 
-    fhs = get_fhs(fi->fh);
+    buf = malloc(size ? size : 1);
+    if(!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-    ret = ulockmgr_op(fhs->clearFH, cmd, lock, &fi->lock_owner,
-                      sizeof(fi->lock_owner));
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_lock: ulockmgr_op failed\n");
-        return ret;
+    if (offset != d->offset) {
+        seekdir(d->dp, offset);
+        d->entry = NULL;
+        d->offset = offset;
     }
+    while (1) {
 
-    return ret;
+        if (!d->entry) {
+            errno = 0;
+            d->entry = readdir(d->dp);
+            if (!d->entry) {
+                ret = errno ? -errno : RETURN_SUCCESS;
+                break;
+            }
+        }
+
+        nextoff = telldir(d->dp);
+        len = addDirEntry(req, d->entry, buf + (size - rem), rem, nextoff);
+        if (len > rem) {
+            break;
+        }
+        rem -= len;
+
+        d->entry = NULL;
+        d->offset = nextoff;
+    }
+
+    /* An error only shows when there is nothing to return */
+    if(ret < 0 && rem == size) {
+        fuse_reply_err(req, -ret);
+    }
+    else {
+        fuse_reply_buf(req, buf, size - rem);
+    }
+    free(buf);
 
 }
 
-static int enc_flock(const char* path, fuse_file_info_t* fi, int op) {
+static void encll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                             fuse_file_info_t* fi) {
 
-    (void) path;
+    (void) ino;
 
-    int ret;
-    enc_fhs_t* fhs;
+    replyErr(req, enc_releasedir(NULL, fi));
 
-    fhs = get_fhs(fi->fh);
+}
 
-    ret = flock(fhs->clearFH, op);
-    if(ret < 0) {
-        fprintf(stderr, "ERROR enc_flock: flock failed\n");
-        perror("ERROR enc_flock");
-        return -errno;
+static void encll_statfs(fuse_req_t req, fuse_ino_t ino) {
+
+    statvfs_t st;
+
+    if(fstatvfs(getInode(ino)->fd, &st) < 0) {
+        fuse_reply_err(req, errno);
+        return;
     }
 
-    return RETURN_SUCCESS;
+    fuse_reply_statfs(req, &st);
 
 }
 
-/* xattr operations are optional and can safely be left unimplemented */
-/* static int enc_setxattr(const char* path, const char* name, const char* value, */
-/*                         size_t size, int flags) { */
+/* xattrs of symlinks aren't reachable through their fd link */
+static void encll_setxattr(fuse_req_t req, fuse_ino_t ino, const char* name,
+                           const char* value, size_t size, int flags) {
 
-/*     int ret; */
-/*     char fullPath[PATHBUFSIZE]; */
+    inodeEntry_t* inode = getInode(ino);
+    char procPath[PROCFDPATHSIZE];
+    char key[LL_KEYSIZE];
 
-/*     ret = buildPath(path, fullPath, sizeof(fullPath)); */
-/*     if(ret < 0){ */
-/*         fprintf(stderr, "ERROR enc_setxattr: buildPath failed\n"); */
-/*         return ret; */
-/*     } */
-/*     path = NULL; */
+    if(inode->type == S_IFLNK) {
+        fuse_reply_err(req, ENOTSUP);
+        return;
+    }
 
-/*     ret = lsetxattr(fullPath, name, value, size, flags); */
-/*     if(ret < 0) { */
-/*         fprintf(stderr, "ERROR enc_setxattr: lsetxattr failed\n"); */
-/*         perror("ERROR enc_setxattr"); */
-/*         return -errno; */
-/*     } */
+    inodeFDPath(inode, procPath, sizeof(procPath));
+    xattrKey(inode->dev, inode->ino, key, sizeof(key));
+    replyErr(req, setXattr(key, procPath, 1, name, value, size, flags));
 
-/*     return RETURN_SUCCESS; */
+}
 
-/* } */
+static void encll_getxattr(fuse_req_t req, fuse_ino_t ino, const char* name,
+                           size_t size) {
 
-/* static int enc_getxattr(const char* path, const char* name, char* value, */
-/*                         size_t size) { */
+    int len;
+    inodeEntry_t* inode = getInode(ino);
+    char* value = NULL;
+    char procPath[PROCFDPATHSIZE];
+    char key[LL_KEYSIZE];
 
-/*     int ret; */
-/*     char fullPath[PATHBUFSIZE]; */
+    if(inode->type == S_IFLNK) {
+        fuse_reply_err(req, ENOTSUP);
+        return;
+    }
 
-/*     ret = buildPath(path, fullPath, sizeof(fullPath)); */
-/*     if(ret < 0){ */
-/*         fprintf(stderr, "ERROR enc_getxattr: buildPath failed\n"); */
-/*         return ret; */
-/*     } */
-/*     path = NULL; */
+    if(size) {
+        value = malloc(size);
+        if(!value) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+    }
 
-/*     ret = lgetxattr(fullPath, name, value, size); */
-/*     if(ret < 0) { */
-/*         fprintf(stderr, "ERROR enc_getxattr: lgetxattr failed\n"); */
-/*         perror("ERROR enc_getxattr"); */
-/*         return -errno; */
-/*     } */
+    inodeFDPath(inode, procPath, sizeof(procPath));
+    xattrKey(inode->dev, inode->ino, key, sizeof(key));
+    len = getXattr(key, procPath, 1, name, value, size);
+    if(len < 0) {
+        fuse_reply_err(req, -len);
+    }
+    else if(size == 0) {
+        fuse_reply_xattr(req, len);
+    }
+    else {
+        fuse_reply_buf(req, value, len);
+    }
+    free(value);
 
-/*     return ret; */
+}
 
-/* } */
+static void encll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
 
-/* static int enc_listxattr(const char* path, char* list, size_t size) { */
+    int len;
+    inodeEntry_t* inode = getInode(ino);
+    char* list = NULL;
+    char procPath[PROCFDPATHSIZE];
+    char key[LL_KEYSIZE];
 
-/*     int ret; */
-/*     char fullPath[PATHBUFSIZE]; */
+    if(inode->type == S_IFLNK) {
+        fuse_reply_err(req, ENOTSUP);
+        return;
+    }
 
-/*     ret = buildPath(path, fullPath, sizeof(fullPath)); */
-/*     if(ret < 0){ */
-/*         fprintf(stderr, "ERROR enc_listxattr: buildPath failed\n"); */
-/*         return ret; */
-/*     } */
-/*     path = NULL; */
+    if(size) {
+        list = malloc(size);
+        if(!list) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+    }
 
-/*     ret = llistxattr(fullPath, list, size); */
-/*     if(ret < 0) { */
-/*         fprintf(stderr, "ERROR enc_listxattr: llistxattr failed\n"); */
-/*         perror("ERROR enc_listxattr"); */
-/*         return -errno; */
-/*     } */
+    inodeFDPath(inode, procPath, sizeof(procPath));
+    xattrKey(inode->dev, inode->ino, key, sizeof(key));
+    len = listXattr(key, procPath, 1, list, size);
+    if(len < 0) {
+        fuse_reply_err(req, -len);
+    }
+    else if(size == 0) {
+        fuse_reply_xattr(req, len);
+    }
+    else {
+        fuse_reply_buf(req, list, len);
+    }
+    free(list);
 
-/*     return ret; */
+}
 
-/* } */
+static void encll_removexattr(fuse_req_t req, fuse_ino_t ino, const char* name) {
 
-/* static int enc_removexattr(const char* path, const char* name) { */
+    inodeEntry_t* inode = getInode(ino);
+    char procPath[PROCFDPATHSIZE];
+    char key[LL_KEYSIZE];
 
-/*     int ret; */
-/*     char fullPath[PATHBUFSIZE]; */
+    if(inode->type == S_IFLNK) {
+        fuse_reply_err(req, ENOTSUP);
+        return;
+    }
 
-/*     ret = buildPath(path, fullPath, sizeof(fullPath)); */
-/*     if(ret < 0){ */
-/*         fprintf(stderr, "ERROR enc_removexattr: buildPath failed\n"); */
-/*         return RETURN_FAILURE; */
-/*     } */
-/*     path = NULL; */
+    inodeFDPath(inode, procPath, sizeof(procPath));
+    xattrKey(inode->dev, inode->ino, key, sizeof(key));
+    replyErr(req, removeXattr(key, procPath, 1, name));
 
-/*     ret = lremovexattr(fullPath, name); */
-/*     if(ret < 0) { */
-/*         fprintf(stderr, "ERROR enc_removexattr: lremovexattr failed\n"); */
-/*         perror("ERROR enc_removexattr"); */
-/*         return -errno; */
-/*     } */
+}
 
-/*     return RETURN_SUCCESS; */
+/* POSIX locks (getlk/setlk) are left to the kernel, which keeps them
+ * for the mount as ulockmgr does for the high-level one */
+static fuse_lowlevel_ops_t enc_ll_oper = {
 
-/* } */
+    /* Setup and Teardown */
+    .init         = encll_init,          /* Initialize Filesystem */
+    .destroy      = encll_destroy,       /* Clean Up Filesystem */
 
-static struct fuse_operations enc_oper = {
+    /* Inodes */
+    .lookup       = encll_lookup,        /* Look Up a Directory Entry */
+    .forget       = encll_forget,        /* Forget an Inode */
+    .forget_multi = encll_forget_multi,  /* Forget Many Inodes */
 
     /* Access Control */
-    .access     = enc_access,       /* Check File Permissions */
-    .lock       = enc_lock,         /* Lock File */
-    .flock      = enc_flock,        /* Lock Open File */
+    .access       = encll_access,        /* Check File Permissions */
+    .flock        = encll_flock,         /* Lock Open File */
 
     /* Metadata */
-    .chmod      = enc_chmod,        /* Change File Permissions */
-    .chown      = enc_chown,        /* Change File Owner */
-    .getattr    = enc_getattr,      /* Get File Attributes */
-    .fgetattr   = enc_fgetattr,     /* Get Open File Attributes  */
-    .statfs     = enc_statfs,       /* Get File System Statistics */
-    .utimens    = enc_utimens,      /* Change the Times of a File*/
+    .getattr      = encll_getattr,       /* Get File Attributes */
+    .setattr      = encll_setattr,       /* Change Mode, Owner, Size, Times */
+    .statfs       = encll_statfs,        /* Get File System Statistics */
 
     /* Create and Delete */
-    .create     = enc_create,       /* Create and Open a Regular File */
-    .mkdir      = enc_mkdir,        /* Create a Directory */
-    .mknod      = enc_mknod,        /* Create a Non-Regular File Node */
-    .link       = enc_link,         /* Create a Hard Link */
-    .symlink    = enc_symlink,      /* Create a Symbolic Link */
-    .rmdir      = enc_rmdir,        /* Remove a Directory */
-    .unlink     = enc_unlink,       /* Remove a File */
+    .create       = encll_create,        /* Create and Open a Regular File */
+    .mkdir        = encll_mkdir,         /* Create a Directory */
+    .mknod        = encll_mknod,         /* Create a Non-Regular File Node */
+    .link         = encll_link,          /* Create a Hard Link */
+    .symlink      = encll_symlink,       /* Create a Symbolic Link */
+    .rmdir        = encll_rmdir,         /* Remove a Directory */
+    .unlink       = encll_unlink,        /* Remove a File */
 
     /* Open and Close */
-    .open       = enc_open,         /* Open a File */
-    .opendir    = enc_opendir,      /* Open a Directory */
-    .release    = enc_release,      /* Release an Open File */
-    .releasedir = enc_releasedir,   /* Release an Open Directory */
+    .open         = encll_open,          /* Open a File */
+    .opendir      = encll_opendir,       /* Open a Directory */
+    .release      = encll_release,       /* Release an Open File */
+    .releasedir   = encll_releasedir,    /* Release an Open Directory */
 
     /* Read and Write */
-    .read        = enc_read,        /* Read a File */
-    .readdir     = enc_readdir,     /* Read a Directory */
-    .readlink    = enc_readlink,    /* Read the Target of a Symbolic Link */
-    .write       = enc_write,       /* Write a File*/
+    .read         = encll_read,          /* Read a File */
+    .readdir      = encll_readdir,       /* Read a Directory */
+    .readlink     = encll_readlink,      /* Read the Target of a Symbolic Link */
+    .write        = encll_write,         /* Write a File */
 
     /* Modify */
-    .rename      = enc_rename,      /* Rename a File */
-    .truncate    = enc_truncate,    /* Change the Size of a File */
-    .ftruncate   = enc_ftruncate,   /* Change the Size of an Open File*/
+    .rename       = encll_rename,        /* Rename a File */
+    .fallocate    = encll_fallocate,     /* Allocate or Punch File Space */
 
     /* Buffering */
-    .flush       = enc_flush,       /* Flush Cached Data */
-    .fsync       = enc_fsync,       /* Synch Open File Contents */
+    .flush        = encll_flush,         /* Flush Cached Data */
+    .fsync        = encll_fsync,         /* Synch Open File Contents */
 
     /* Extended Attributes */
-    /* .setxattr    = enc_setxattr,    /\* Set XATTR *\/ */
-    /* .getxattr    = enc_getxattr,    /\* Get XATTR *\/ */
-    /* .listxattr   = enc_listxattr,   /\* List XATTR *\/ */
-    /* .removexattr = enc_removexattr, /\* Remove XATTR *\/ */
+    .setxattr     = encll_setxattr,      /* Set XATTR */
+    .getxattr     = encll_getxattr,      /* Get XATTR */
+    .listxattr    = encll_listxattr,     /* List XATTR */
+    .removexattr  = encll_removexattr,   /* Remove XATTR */
 
-    /* Flags */
-    .flag_nullpath_ok   = 1,
-    .flag_utime_omit_ok = 1,
+};
+
+/* int llMain(fuse_args_t* args, fsState_t* state)
+ *
+ * Purpose: Mount the low-level variant and serve it until unmounted
+ *
+ * Return: 0 on success, 1 on error (as fuse_main)
+ */
+static int llMain(fuse_args_t* args, fsState_t* state) {
+
+    int ret = 1;
+    int multithreaded = 0;
+    int foreground = 0;
+    char* mountpoint = NULL;
+    struct fuse_chan* ch = NULL;
+    struct fuse_session* se = NULL;
+
+    if(fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) < 0 ||
+       !mountpoint) {
+        fprintf(stderr, "ERROR llMain: fuse_parse_cmdline failed\n");
+        goto CLEANUP;
+    }
+
+    state->inodes = inodetable_create(state->basePath);
+    if(!state->inodes) {
+        fprintf(stderr, "ERROR llMain: inodetable_create failed\n");
+        goto CLEANUP;
+    }
+
+    ch = fuse_mount(mountpoint, args);
+    if(!ch) {
+        fprintf(stderr, "ERROR llMain: fuse_mount failed\n");
+        goto CLEANUP;
+    }
+
+    se = fuse_lowlevel_new(args, &enc_ll_oper, sizeof(enc_ll_oper), state);
+    if(!se) {
+        fprintf(stderr, "ERROR llMain: fuse_lowlevel_new failed\n");
+        goto CLEANUP_MOUNT;
+    }
+    if(fuse_set_signal_handlers(se) != 0) {
+        fprintf(stderr, "ERROR llMain: fuse_set_signal_handlers failed\n");
+        goto CLEANUP_SESSION;
+    }
+    fuse_session_add_chan(se, ch);
+
+    fuse_daemonize(foreground);
+    if(multithreaded) {
+        ret = fuse_session_loop_mt(se);
+    }
+    else {
+        ret = fuse_session_loop(se);
+    }
+    ret = (ret != 0);
+
+    fuse_remove_signal_handlers(se);
+    fuse_session_remove_chan(ch);
+
+ CLEANUP_SESSION:
+    fuse_session_destroy(se);
+
+ CLEANUP_MOUNT:
+    fuse_unmount(mountpoint, ch);
+
+ CLEANUP:
+    inodetable_destroy(state->inodes);
+    state->inodes = NULL;
+    free(mountpoint);
+    return ret;
 
+}
+
+static struct fuse_opt enc_opts[] = {
+    { "custos", offsetof(fsState_t, useCustos), 1 },
+    { "custos_url=%s",   offsetof(fsState_t, custosURL),   0 },
+    { "custos_conns=%u", offsetof(fsState_t, custosConns), 0 },
+    { "xattr_ttl=%d",    offsetof(fsState_t, xattrTTL),    0 },
+    { "atomic_replace=%d", offsetof(fsState_t, atomicReplace), 0 },
+    { "stream=%s",       offsetof(fsState_t, streamPaths), 0 },
+    { "passthrough=%s",  offsetof(fsState_t, passthroughPaths), 0 },
+    { "compress=%s",     offsetof(fsState_t, compress),    0 },
+    { "compress_level=%d", offsetof(fsState_t, compressLevel), 0 },
+    { "integrity=%d",    offsetof(fsState_t, integrity),   0 },
+    { "lowlevel",        offsetof(fsState_t, lowLevel),    1 },
+    { "trace=%s",        offsetof(fsState_t, tracePath),   0 },
+    { "warm=%s",         offsetof(fsState_t, warmPaths),   0 },
+    { "warm_threads=%u", offsetof(fsState_t, warmThreads), 0 },
+    { "rekey=%s",        offsetof(fsState_t, rekeyTag),    0 },
+    { "rekey_rate=%u",   offsetof(fsState_t, rekeyRate),   0 },
+    { "clear_budget=%u", offsetof(fsState_t, clearBudget), 0 },
+    { "spans=%s",        offsetof(fsState_t, spansPath),   0 },
+    FUSE_OPT_END
 };
 
 int main(int argc, char *argv[]) {
 
     fuse_args_t args = FUSE_ARGS_INIT(0, NULL);
     fsState_t state;
+    opTraceStats_t traceStats;
+    spanTraceStats_t spanStats;
+    sigset_t sigs;
     int i;
+    int ret;
 
     if(argc < 3){
 	fprintf(stderr,
-		"Usage:\n %s <Mount Point> <Mirrored Directory>\n",
+		"Usage:\n %s <Mount Point> <Mirrored Directory>\n"
+		"    [-o custos[,custos_url=URL][,custos_conns=N]]\n"
+		"    [-o xattr_ttl=MS]\n"
+		"    [-o atomic_replace=0|1]\n"
+		"    [-o stream=PATTERN[:PATTERN...]]\n"
+		"    [-o passthrough=PATTERN[:PATTERN...]]\n"
+		"    [-o compress=none|lz4|zstd[,compress_level=N]]\n"
+		"    [-o integrity=0|1]\n"
+		"    [-o lowlevel]\n"
+		"    [-o trace=FILE]\n"
+		"    [-o warm=DIR[:DIR...][,warm_threads=N]]\n"
+		"    [-o rekey=TAG[,rekey_rate=MB/s]]\n"
+		"    [-o clear_budget=MiB]\n"
+		"    [-o spans=FILE]\n",
 		argv[0]);
 	exit(EXIT_FAILURE);
     }
 
+    memset(&state, 0, sizeof(state));
+    fsState = &state;
+    state.xattrTTL = XATTR_TTL_DEFAULT;
+    state.atomicReplace = ATOMIC_REPLACE_DEFAULT;
+    state.integrity = INTEGRITY_DEFAULT;
+    state.warmThreads = WARM_THREADS_DEFAULT;
+    state.rekeyRate = REKEY_RATE_DEFAULT;
     for(i = 0; i < argc; i++) {
 	if (i == 2)
 	    state.basePath = realpath(argv[i], NULL);
@@ -1872,8 +6101,116 @@ int main(int argc, char *argv[]) {
 	    fuse_opt_add_arg(&args, argv[i]);
     }
 
+    if(fuse_opt_parse(&args, &state, enc_opts, NULL) < 0) {
+	fprintf(stderr, "ERROR main: fuse_opt_parse failed\n");
+	exit(EXIT_FAILURE);
+    }
+
+    if(state.compress) {
+        if(strcmp(state.compress, "lz4") == 0) {
+            ret = chunk_setCodec(CHUNK_CODEC_LZ4, state.compressLevel);
+        }
+        else if(strcmp(state.compress, "zstd") == 0) {
+            ret = chunk_setCodec(CHUNK_CODEC_ZSTD, state.compressLevel);
+        }
+        else if(strcmp(state.compress, "none") == 0) {
+            ret = chunk_setCodec(CHUNK_CODEC_NONE, 0);
+        }
+        else {
+            ret = -EINVAL;
+        }
+        if(ret < 0) {
+            fprintf(stderr, "ERROR main: compress=%s not available\n",
+                    state.compress);
+            exit(EXIT_FAILURE);
+        }
+    }
+    chunk_setIntegrity(state.integrity);
+
+    /* Opened before fuse_main, which may daemonize and leave the cwd */
+    if(state.tracePath) {
+        if(state.lowLevel) {
+            fprintf(stderr, "ERROR main: trace needs the path API, "
+                    "not lowlevel\n");
+            exit(EXIT_FAILURE);
+        }
+        state.trace = optrace_create(state.tracePath);
+        if(!state.trace) {
+            fprintf(stderr, "ERROR main: optrace_create failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Every thread started from here on inherits the dump signal blocked,
+       so only the dump thread enc_init starts ever takes it */
+    if(state.spansPath) {
+        state.spans = spantrace_create(state.spansPath);
+        if(!state.spans) {
+            fprintf(stderr, "ERROR main: spantrace_create failed\n");
+            exit(EXIT_FAILURE);
+        }
+        chunk_setSpans(state.spans);
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SPANS_SIGNAL);
+        pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    }
+
+    /* Swapping in rekeyed files would leave inodes on the old ones */
+    if(state.rekeyTag) {
+        if(state.lowLevel) {
+            fprintf(stderr, "ERROR main: rekey needs the path API, "
+                    "not lowlevel\n");
+            exit(EXIT_FAILURE);
+        }
+        if(!*state.rekeyTag || strlen(state.rekeyTag) >= REKEY_TAGSIZE) {
+            fprintf(stderr, "ERROR main: rekey tag must be 1 to %d bytes\n",
+                    REKEY_TAGSIZE - 1);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     umask(0);
 
-    return fuse_main(args.argc, args.argv, &enc_oper, &state);
+    if(state.lowLevel) {
+        ret = llMain(&args, &state);
+    }
+    else {
+        ret = fuse_main(args.argc, args.argv,
+                        (state.trace || state.spans) ? &enc_trace_oper : &enc_oper,
+                        &state);
+    }
+
+    if(state.trace) {
+        optrace_flush(state.trace);
+        optrace_stats(state.trace, &traceStats);
+        fprintf(stderr, "STATS trace: records %"PRIu64" dropped %"PRIu64
+                " threads %zd\n", traceStats.records, traceStats.dropped,
+                traceStats.threads);
+        optrace_destroy(state.trace);
+    }
+
+    if(state.spans) {
+        if(spantrace_dump(state.spans) < 0) {
+            fprintf(stderr, "ERROR main: spantrace_dump failed\n");
+        }
+        spantrace_stats(state.spans, &spanStats);
+        fprintf(stderr, "STATS spans: spans %"PRIu64" lost %"PRIu64
+                " dumps %"PRIu64" threads %zd\n", spanStats.spans,
+                spanStats.lost, spanStats.dumps, spanStats.threads);
+        chunk_setSpans(NULL);
+        spantrace_destroy(state.spans);
+    }
+
+    fuse_opt_free_args(&args);
+    free(state.custosURL);
+    free(state.streamPaths);
+    free(state.passthroughPaths);
+    free(state.tracePath);
+    free(state.spansPath);
+    free(state.warmPaths);
+    free(state.rekeyTag);
+    free(state.compress);
+
+    return ret;
 
 }
@@ -0,0 +1,510 @@
+/* inode-table.c
+ * Backing inodes of a low-level FUSE mount, by (dev, ino)
+ *
+ * Chained hash table on (dev, ino) that doubles as it fills. One mutex
+ * guards the table and every entry's parent and name; fds are only
+ * swapped by a rebind, with the old one kept open for a while.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "inode-table.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+#define PROCFDPATHSIZE 64
+#define INITIAL_BUCKETS 1024
+
+struct inodeTable {
+    pthread_mutex_t lock;
+    inodeEntry_t**  buckets;
+    size_t          numBuckets;
+    size_t          entries;
+    inodeEntry_t*   root;
+};
+
+static size_t hashInode(const inodeTable_t* table, dev_t dev, ino_t ino) {
+
+    uint64_t h = ((uint64_t) dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) ino;
+
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+
+    return h & (table->numBuckets - 1);
+
+}
+
+static inodeEntry_t* findEntry(inodeTable_t* table, dev_t dev, ino_t ino) {
+
+    inodeEntry_t* entry = table->buckets[hashInode(table, dev, ino)];
+
+    while(entry && (entry->dev != dev || entry->ino != ino)) {
+        entry = entry->hnext;
+    }
+
+    return entry;
+
+}
+
+static void insertEntry(inodeTable_t* table, inodeEntry_t* entry) {
+
+    inodeEntry_t** bucket = &table->buckets[hashInode(table, entry->dev,
+                                                      entry->ino)];
+
+    entry->hnext = *bucket;
+    *bucket = entry;
+
+}
+
+static void removeEntry(inodeTable_t* table, inodeEntry_t* entry) {
+
+    inodeEntry_t** pp = &table->buckets[hashInode(table, entry->dev,
+                                                  entry->ino)];
+
+    while(*pp != entry) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = entry->hnext;
+
+}
+
+/* Double the buckets once there are more entries than buckets; stay
+ * as is if memory is short */
+static void growTable(inodeTable_t* table) {
+
+    size_t i;
+    inodeEntry_t* entry = NULL;
+    inodeEntry_t** old = table->buckets;
+    inodeEntry_t** buckets = NULL;
+    size_t oldSize = table->numBuckets;
+
+    if(table->entries <= table->numBuckets) {
+        return;
+    }
+
+    buckets = calloc(oldSize * 2, sizeof(*buckets));
+    if(!buckets) {
+        return;
+    }
+    table->buckets = buckets;
+    table->numBuckets = oldSize * 2;
+
+    for(i = 0; i < oldSize; i++) {
+        while(old[i]) {
+            entry = old[i];
+            old[i] = entry->hnext;
+            insertEntry(table, entry);
+        }
+    }
+    free(old);
+
+}
+
+/* Drop n references to entry, and to each parent left unreferenced */
+static void unrefEntry(inodeTable_t* table, inodeEntry_t* entry, uint64_t n) {
+
+    inodeEntry_t* parent = NULL;
+
+    while(entry && entry != table->root) {
+
+        entry->refs -= n;
+        if(entry->refs > 0) {
+            return;
+        }
+
+        parent = entry->parent;
+        removeEntry(table, entry);
+        table->entries--;
+        close(entry->fd);
+        if(entry->oldFD >= 0) {
+            close(entry->oldFD);
+        }
+        free(entry->name);
+        free(entry);
+
+        entry = parent;
+        n = 1;
+
+    }
+
+}
+
+/* Record that entry is now known as name in parent (or by no name) */
+static void setName(inodeTable_t* table, inodeEntry_t* entry,
+                    inodeEntry_t* parent, const char* name) {
+
+    char* copy = NULL;
+
+    if(entry == table->root) {
+        return;
+    }
+
+    if(parent && name) {
+        copy = strdup(name);
+        if(!copy) {
+            parent = NULL;
+        }
+    }
+
+    free(entry->name);
+    entry->name = copy;
+    if(parent != entry->parent) {
+        if(parent) {
+            parent->refs++;
+        }
+        unrefEntry(table, entry->parent, 1);
+        entry->parent = parent;
+    }
+
+}
+
+extern inodeTable_t* inodetable_create(const char* basePath) {
+
+    struct stat st;
+    inodeTable_t* table = NULL;
+
+    if(!basePath) {
+        fprintf(stderr, "ERROR inodetable_create: basePath must not be NULL\n");
+        return NULL;
+    }
+
+    table = calloc(1, sizeof(*table));
+    if(!table) {
+        fprintf(stderr, "ERROR inodetable_create: calloc failed\n");
+        return NULL;
+    }
+    table->buckets = calloc(INITIAL_BUCKETS, sizeof(*table->buckets));
+    table->root = calloc(1, sizeof(*table->root));
+    if(!table->buckets || !table->root) {
+        fprintf(stderr, "ERROR inodetable_create: calloc failed\n");
+        goto CLEANUP;
+    }
+    table->numBuckets = INITIAL_BUCKETS;
+
+    table->root->fd = open(basePath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(table->root->fd < 0) {
+        perror("ERROR inodetable_create: open(basePath)");
+        goto CLEANUP;
+    }
+    if(fstat(table->root->fd, &st) < 0) {
+        perror("ERROR inodetable_create: fstat(basePath)");
+        close(table->root->fd);
+        goto CLEANUP;
+    }
+    table->root->oldFD = -1;
+    table->root->dev = st.st_dev;
+    table->root->ino = st.st_ino;
+    table->root->type = st.st_mode & S_IFMT;
+    table->root->refs = 1;
+    insertEntry(table, table->root);
+    table->entries = 1;
+
+    pthread_mutex_init(&table->lock, NULL);
+
+    return table;
+
+ CLEANUP:
+    free(table->buckets);
+    free(table->root);
+    free(table);
+    return NULL;
+
+}
+
+extern void inodetable_destroy(inodeTable_t* table) {
+
+    size_t i;
+    inodeEntry_t* entry = NULL;
+
+    if(!table) {
+        return;
+    }
+
+    for(i = 0; i < table->numBuckets; i++) {
+        while(table->buckets[i]) {
+            entry = table->buckets[i];
+            table->buckets[i] = entry->hnext;
+            close(entry->fd);
+            if(entry->oldFD >= 0) {
+                close(entry->oldFD);
+            }
+            free(entry->name);
+            free(entry);
+        }
+    }
+
+    pthread_mutex_destroy(&table->lock);
+    free(table->buckets);
+    free(table);
+
+}
+
+extern inodeEntry_t* inodetable_root(inodeTable_t* table) {
+    return table ? table->root : NULL;
+}
+
+extern int inodetable_lookup(inodeTable_t* table, inodeEntry_t* parent,
+                             const char* name, struct stat* st,
+                             inodeEntry_t** pentry) {
+
+    int ret;
+    int fd;
+    inodeEntry_t* entry = NULL;
+
+    if(!table || !parent || !name || !st || !pentry) {
+        fprintf(stderr, "ERROR inodetable_lookup: arguments must not be NULL\n");
+        return -EINVAL;
+    }
+
+    fd = openat(parent->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0) {
+        return -errno;
+    }
+    if(fstatat(fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    pthread_mutex_lock(&table->lock);
+
+    entry = findEntry(table, st->st_dev, st->st_ino);
+    if(entry) {
+        close(fd);
+    }
+    else {
+        entry = calloc(1, sizeof(*entry));
+        if(!entry) {
+            pthread_mutex_unlock(&table->lock);
+            close(fd);
+            return -ENOMEM;
+        }
+        entry->fd = fd;
+        entry->oldFD = -1;
+        entry->dev = st->st_dev;
+        entry->ino = st->st_ino;
+        entry->type = st->st_mode & S_IFMT;
+        insertEntry(table, entry);
+        table->entries++;
+        growTable(table);
+    }
+    entry->nlookup++;
+    entry->refs++;
+    setName(table, entry, parent, name);
+
+    pthread_mutex_unlock(&table->lock);
+
+    *pentry = entry;
+    return RETURN_SUCCESS;
+
+}
+
+extern void inodetable_forget(inodeTable_t* table, inodeEntry_t* entry,
+                              uint64_t nlookup) {
+
+    if(!table || !entry || entry == table->root) {
+        return;
+    }
+
+    pthread_mutex_lock(&table->lock);
+
+    if(nlookup > entry->nlookup) {
+        fprintf(stderr, "WARNING inodetable_forget: forgetting %lu of %lu "
+                "lookups\n", (unsigned long) nlookup,
+                (unsigned long) entry->nlookup);
+        nlookup = entry->nlookup;
+    }
+    entry->nlookup -= nlookup;
+    unrefEntry(table, entry, nlookup);
+
+    pthread_mutex_unlock(&table->lock);
+
+}
+
+extern void inodetable_moved(inodeTable_t* table, const struct stat* st,
+                             inodeEntry_t* parent, const char* name) {
+
+    inodeEntry_t* entry = NULL;
+
+    if(!table || !st) {
+        return;
+    }
+
+    pthread_mutex_lock(&table->lock);
+
+    entry = findEntry(table, st->st_dev, st->st_ino);
+    if(entry) {
+        setName(table, entry, parent, name);
+    }
+
+    pthread_mutex_unlock(&table->lock);
+
+}
+
+extern void inodetable_unlinked(inodeTable_t* table, const struct stat* st,
+                                inodeEntry_t* parent, const char* name) {
+
+    inodeEntry_t* entry = NULL;
+
+    if(!table || !st || !name) {
+        return;
+    }
+
+    pthread_mutex_lock(&table->lock);
+
+    /* Known by another of its links, that name still works */
+    entry = findEntry(table, st->st_dev, st->st_ino);
+    if(entry && entry->parent == parent && entry->name &&
+       strcmp(entry->name, name) == 0) {
+        setName(table, entry, NULL, NULL);
+    }
+
+    pthread_mutex_unlock(&table->lock);
+
+}
+
+extern int inodetable_path(inodeTable_t* table, inodeEntry_t* entry,
+                           char* buf, size_t size) {
+
+    int ret = RETURN_SUCCESS;
+    int len;
+
+    if(!table || !entry || !buf) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&table->lock);
+
+    if(entry == table->root) {
+        len = snprintf(buf, size, "/proc/self/fd/%d", entry->fd);
+    }
+    else if(entry->parent && entry->name) {
+        len = snprintf(buf, size, "/proc/self/fd/%d/%s",
+                       entry->parent->fd, entry->name);
+    }
+    else {
+        len = 0;
+        ret = -ESTALE;
+    }
+    if(len < 0 || (size_t) len >= size) {
+        ret = -ENAMETOOLONG;
+    }
+
+    pthread_mutex_unlock(&table->lock);
+
+    return ret;
+
+}
+
+extern int inodetable_mountPath(inodeTable_t* table, inodeEntry_t* entry,
+                                char* buf, size_t size) {
+
+    int ret = RETURN_SUCCESS;
+    size_t len;
+    size_t pos = size - 1;
+
+    if(!table || !entry || !buf || size < 2) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&table->lock);
+
+    /* Fill buf from the end, one name per step up to the root */
+    buf[pos] = '\0';
+    for(; entry != table->root; entry = entry->parent) {
+        if(!entry->parent || !entry->name) {
+            ret = -ESTALE;
+            break;
+        }
+        len = strlen(entry->name);
+        if(len + 1 > pos) {
+            ret = -ENAMETOOLONG;
+            break;
+        }
+        pos -= len;
+        memcpy(buf + pos, entry->name, len);
+        buf[--pos] = '/';
+    }
+
+    pthread_mutex_unlock(&table->lock);
+
+    if(ret < 0) {
+        return ret;
+    }
+    if(pos == size - 1) {
+        buf[--pos] = '/';
+    }
+    memmove(buf, buf + pos, size - pos);
+
+    return RETURN_SUCCESS;
+
+}
+
+extern int inodetable_rebind(inodeTable_t* table, inodeEntry_t* entry, int fd) {
+
+    int ret;
+    int newFD;
+    char procPath[PROCFDPATHSIZE];
+    struct stat st;
+
+    if(!table || !entry || entry == table->root) {
+        return -EINVAL;
+    }
+
+    snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", fd);
+    newFD = open(procPath, O_PATH | O_CLOEXEC);
+    if(newFD < 0) {
+        perror("ERROR inodetable_rebind: open");
+        return -errno;
+    }
+    if(fstat(newFD, &st) < 0) {
+        perror("ERROR inodetable_rebind: fstat");
+        ret = -errno;
+        close(newFD);
+        return ret;
+    }
+
+    pthread_mutex_lock(&table->lock);
+
+    removeEntry(table, entry);
+    if(entry->oldFD >= 0) {
+        close(entry->oldFD);
+    }
+    entry->oldFD = entry->fd;
+    __atomic_store_n(&entry->fd, newFD, __ATOMIC_RELEASE);
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    insertEntry(table, entry);
+
+    pthread_mutex_unlock(&table->lock);
+
+    return RETURN_SUCCESS;
+
+}
+
+extern size_t inodetable_entries(inodeTable_t* table) {
+
+    size_t entries;
+
+    if(!table) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    entries = table->entries;
+    pthread_mutex_unlock(&table->lock);
+
+    return entries;
+
+}
@@ -0,0 +1,109 @@
+/* inode-table.h
+ * Backing inodes of a low-level FUSE mount, by (dev, ino)
+ *
+ * Each inode the kernel has looked up is held open with an O_PATH fd, so
+ * requests on it go straight to the backing inode with *at() calls
+ * instead of rebuilding and re-resolving a path. The table counts the
+ * kernel's lookups and drops an inode once they are all forgotten.
+ *
+ * Opening a file still needs a name: its clear-text temp file and any
+ * atomic replacement are created next to it. So every inode remembers
+ * the directory and name it was last looked up, created or renamed
+ * under; a name unlinked through the mount is forgotten, and one
+ * changed outside it is corrected by the kernel's next lookup.
+ *
+ */
+
+#ifndef INODE_TABLE_H
+#define INODE_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+typedef struct inodeTable inodeTable_t;
+
+typedef struct inodeEntry {
+    int                fd;      /* O_PATH fd of the backing inode */
+    int                oldFD;   /* fd replaced by the last rebind */
+    dev_t              dev;
+    ino_t              ino;
+    mode_t             type;    /* S_IFMT bits */
+    uint64_t           nlookup; /* lookups the kernel hasn't forgotten */
+    uint64_t           refs;    /* nlookup, plus one per named child */
+    struct inodeEntry* parent;  /* directory name is in, NULL if none */
+    char*              name;
+    struct inodeEntry* hnext;
+} inodeEntry_t;
+
+/* inodeTable_t* inodetable_create(const char* basePath)
+ *
+ * Purpose: Create a table whose root inode is the directory basePath
+ *
+ * Return: New table on success, NULL on error
+ */
+extern inodeTable_t* inodetable_create(const char* basePath);
+
+extern void inodetable_destroy(inodeTable_t* table);
+
+extern inodeEntry_t* inodetable_root(inodeTable_t* table);
+
+/* int inodetable_lookup(inodeTable_t* table, inodeEntry_t* parent,
+ *                       const char* name, struct stat* st,
+ *                       inodeEntry_t** pentry)
+ *
+ * Purpose: Look up name in the directory parent, without following a
+ *          symlink, and count one kernel lookup of the inode found.
+ *          The inode is now known by this name.
+ *
+ * Return: 0 with *st and *pentry set on success, negative errno on error
+ */
+extern int inodetable_lookup(inodeTable_t* table, inodeEntry_t* parent,
+                             const char* name, struct stat* st,
+                             inodeEntry_t** pentry);
+
+/* Drop nlookup kernel lookups of entry, freeing it after the last one */
+extern void inodetable_forget(inodeTable_t* table, inodeEntry_t* entry,
+                              uint64_t nlookup);
+
+/* The inode st describes is now known as name in parent (after a
+ * rename), if the table holds it */
+extern void inodetable_moved(inodeTable_t* table, const struct stat* st,
+                             inodeEntry_t* parent, const char* name);
+
+/* name in parent, which named the inode st describes, is gone */
+extern void inodetable_unlinked(inodeTable_t* table, const struct stat* st,
+                                inodeEntry_t* parent, const char* name);
+
+/* int inodetable_path(inodeTable_t* table, inodeEntry_t* entry,
+ *                     char* buf, size_t size)
+ *
+ * Purpose: Write a backing path for entry to buf: its name under its
+ *          parent's fd in /proc/self/fd, or for the root its own fd
+ *
+ * Return: 0 on success, -ESTALE if entry has no name,
+ *         -ENAMETOOLONG if buf is too small
+ */
+extern int inodetable_path(inodeTable_t* table, inodeEntry_t* entry,
+                           char* buf, size_t size);
+
+/* Write entry's path inside the mount ("/" for the root) to buf;
+ * 0 on success, negative errno as for inodetable_path */
+extern int inodetable_mountPath(inodeTable_t* table, inodeEntry_t* entry,
+                                char* buf, size_t size);
+
+/* int inodetable_rebind(inodeTable_t* table, inodeEntry_t* entry, int fd)
+ *
+ * Purpose: Point entry at the backing file open as fd, which has taken
+ *          its place under its name (an atomic replace). The old fd stays
+ *          open until the next rebind, for requests already using it.
+ *
+ * Return: 0 on success, negative errno on error (entry is unchanged)
+ */
+extern int inodetable_rebind(inodeTable_t* table, inodeEntry_t* entry, int fd);
+
+/* Number of inodes held, root included */
+extern size_t inodetable_entries(inodeTable_t* table);
+
+#endif
@@ -0,0 +1,194 @@
+/* io-budget.c
+ * Bandwidth budget for background work, yielding to foreground requests
+ *
+ * The bucket is kept as the time the next charge may start: each charge
+ * moves it on by bytes / rate. Foreground requests only store the time
+ * they were seen, so noting one never takes the lock.
+ *
+ */
+
+#include "io-budget.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+#define NS_PER_SEC  1000000000ULL
+#define NS_PER_MS   1000000ULL
+#define WAIT_STEPNS (10 * NS_PER_MS)
+
+struct ioBudget {
+    pthread_mutex_t lock;
+    uint64_t        bytesPerSec;
+    uint64_t        idleNS;
+    uint64_t        nextIO;         /* under lock */
+    uint64_t        lastForeground; /* atomic */
+    int             stopped;        /* atomic */
+
+    uint64_t        bytes;          /* atomic, as are the stats below */
+    uint64_t        throttleNS;
+    uint64_t        yieldNS;
+    uint64_t        cancels;
+};
+
+static uint64_t nowNS(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+
+}
+
+static void count(uint64_t* counter, uint64_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Sleep until the earlier of until and one wait step from now */
+static void sleepStep(uint64_t now, uint64_t until) {
+
+    struct timespec ts;
+
+    if(until > now + WAIT_STEPNS) {
+        until = now + WAIT_STEPNS;
+    }
+    ts.tv_sec = until / NS_PER_SEC;
+    ts.tv_nsec = until % NS_PER_SEC;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        continue;
+    }
+
+}
+
+static int cancelled(ioBudget_t* budget, ioCancelFunc_t cancel, void* arg) {
+
+    if(__atomic_load_n(&budget->stopped, __ATOMIC_RELAXED) ||
+       (cancel && cancel(arg))) {
+        count(&budget->cancels, 1);
+        return 1;
+    }
+
+    return 0;
+
+}
+
+extern ioBudget_t* iobudget_create(uint64_t bytesPerSec, unsigned int idleMS) {
+
+    ioBudget_t* budget = NULL;
+
+    budget = calloc(1, sizeof(*budget));
+    if(!budget) {
+        fprintf(stderr, "ERROR iobudget_create: calloc failed\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&budget->lock, NULL);
+    budget->bytesPerSec = bytesPerSec;
+    budget->idleNS = idleMS * NS_PER_MS;
+
+    return budget;
+
+}
+
+extern void iobudget_destroy(ioBudget_t* budget) {
+
+    if(!budget) {
+        return;
+    }
+
+    pthread_mutex_destroy(&budget->lock);
+    free(budget);
+
+}
+
+extern void iobudget_foreground(ioBudget_t* budget) {
+
+    if(!budget || !budget->idleNS) {
+        return;
+    }
+
+    __atomic_store_n(&budget->lastForeground, nowNS(), __ATOMIC_RELAXED);
+
+}
+
+extern int iobudget_charge(ioBudget_t* budget, uint64_t bytes,
+                           ioCancelFunc_t cancel, void* arg) {
+
+    uint64_t now;
+    uint64_t start;
+    uint64_t quiet;
+
+    if(!budget) {
+        return RETURN_SUCCESS;
+    }
+
+    /* Foreground first: a charge that waited out the rate and then
+       found requests waiting would have held its turn for nothing */
+    now = nowNS();
+    for(;;) {
+        quiet = __atomic_load_n(&budget->lastForeground, __ATOMIC_RELAXED) +
+            budget->idleNS;
+        if(!budget->idleNS || quiet <= now) {
+            break;
+        }
+        if(cancelled(budget, cancel, arg)) {
+            return -ECANCELED;
+        }
+        sleepStep(now, quiet);
+        count(&budget->yieldNS, nowNS() - now);
+        now = nowNS();
+    }
+
+    if(budget->bytesPerSec) {
+
+        pthread_mutex_lock(&budget->lock);
+        start = (budget->nextIO > now) ? budget->nextIO : now;
+        budget->nextIO = start + bytes * NS_PER_SEC / budget->bytesPerSec;
+        pthread_mutex_unlock(&budget->lock);
+
+        while(start > now) {
+            if(cancelled(budget, cancel, arg)) {
+                return -ECANCELED;
+            }
+            sleepStep(now, start);
+            count(&budget->throttleNS, nowNS() - now);
+            now = nowNS();
+        }
+
+    }
+
+    if(cancelled(budget, cancel, arg)) {
+        return -ECANCELED;
+    }
+    count(&budget->bytes, bytes);
+
+    return RETURN_SUCCESS;
+
+}
+
+extern void iobudget_stop(ioBudget_t* budget) {
+
+    if(budget) {
+        __atomic_store_n(&budget->stopped, 1, __ATOMIC_RELAXED);
+    }
+
+}
+
+extern void iobudget_stats(ioBudget_t* budget, ioBudgetStats_t* stats) {
+
+    if(!budget) {
+        stats->bytes = stats->throttleNS = stats->yieldNS = stats->cancels = 0;
+        return;
+    }
+
+    stats->bytes = __atomic_load_n(&budget->bytes, __ATOMIC_RELAXED);
+    stats->throttleNS = __atomic_load_n(&budget->throttleNS, __ATOMIC_RELAXED);
+    stats->yieldNS = __atomic_load_n(&budget->yieldNS, __ATOMIC_RELAXED);
+    stats->cancels = __atomic_load_n(&budget->cancels, __ATOMIC_RELAXED);
+
+}
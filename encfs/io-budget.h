@@ -0,0 +1,63 @@
+/* io-budget.h
+ * Bandwidth budget for background work, yielding to foreground requests
+ *
+ * A token bucket shared by every thread charging it: each charge of n
+ * bytes waits until the budget's rate covers them. With an idle period
+ * set, a charge also waits until no foreground request has been noted
+ * for that long, so background work only runs in the gaps between
+ * requests. Waits are taken in short steps so that a stopped budget, or
+ * a caller's cancel check, ends them promptly.
+ *
+ */
+
+#ifndef IO_BUDGET_H
+#define IO_BUDGET_H
+
+#include <stdint.h>
+
+typedef struct ioBudget ioBudget_t;
+
+/* Return nonzero to abandon a wait, e.g. when the caller's file is
+ * wanted in the foreground */
+typedef int (*ioCancelFunc_t)(void* arg);
+
+typedef struct ioBudgetStats {
+    uint64_t bytes;      /* charged */
+    uint64_t throttleNS; /* waited for the rate */
+    uint64_t yieldNS;    /* waited for foreground requests to pause */
+    uint64_t cancels;
+} ioBudgetStats_t;
+
+/* ioBudget_t* iobudget_create(uint64_t bytesPerSec, unsigned int idleMS)
+ *
+ * Purpose: Create a budget of bytesPerSec (0: no limit) that, if idleMS
+ *          is nonzero, also waits for idleMS without foreground requests
+ *
+ * Return: New budget on success, NULL on error
+ */
+extern ioBudget_t* iobudget_create(uint64_t bytesPerSec, unsigned int idleMS);
+
+extern void iobudget_destroy(ioBudget_t* budget);
+
+/* Note a foreground request; cheap enough for every read and write.
+ * budget may be NULL. */
+extern void iobudget_foreground(ioBudget_t* budget);
+
+/* int iobudget_charge(ioBudget_t* budget, uint64_t bytes,
+ *                     ioCancelFunc_t cancel, void* arg)
+ *
+ * Purpose: Wait until bytes of background I/O may start. cancel, if not
+ *          NULL, is called with arg between wait steps.
+ *
+ * Return: 0 when the I/O may start, -ECANCELED if the budget was
+ *         stopped or cancel returned nonzero
+ */
+extern int iobudget_charge(ioBudget_t* budget, uint64_t bytes,
+                           ioCancelFunc_t cancel, void* arg);
+
+/* End every wait, now and from now on, with -ECANCELED */
+extern void iobudget_stop(ioBudget_t* budget);
+
+extern void iobudget_stats(ioBudget_t* budget, ioBudgetStats_t* stats);
+
+#endif
@@ -0,0 +1,605 @@
+/* key-cache.c
+ * Thread-safe in-memory cache of custos keys, indexed by key UUID
+ *
+ * Open addressing with linear probing over a power-of-two table, kept at
+ * most half full. Lookups take a shared lock; inserts an exclusive one.
+ * Each hit stamps its entry from a shared clock; once the cache is at
+ * capacity, an insert evicts the entry with the oldest stamp, found by a
+ * scan, and closes the gap by shifting back the entries probed past it.
+ *
+ * Data keys go in a separate direct-mapped table of DATA_SLOTS, since
+ * there is one per file: a new key takes its slot from whatever was
+ * there. Slots are found by a SHA-256 of the master's wrap key and the
+ * wrapped form, so a data key is only found under the master it was
+ * unwrapped with.
+ *
+ */
+
+#include "key-cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+#include <openssl/sha.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+#define MIN_CAPACITY 16
+#define DATA_SLOTS   4096   /* power of two */
+
+typedef struct keyEntry {
+    uuid_t       uuid;
+    int          used;
+    uint64_t     lastUse;       /* clock at the last hit or insert */
+    size_t       size;
+    uint8_t*     val;
+    keyHandle_t* handle;
+} keyEntry_t;
+
+typedef struct dataEntry {
+    unsigned char id[SHA256_DIGEST_LENGTH];
+    keyHandle_t*  handle;       /* NULL if unused */
+} dataEntry_t;
+
+struct keyCache {
+    pthread_rwlock_t lock;
+    keyEntry_t*      table;
+    size_t           capacity;
+    size_t           entries;
+    size_t           maxEntries;    /* 0 for no limit */
+    uint64_t         clock;
+    uint64_t         hits;
+    uint64_t         misses;
+    uint64_t         inserts;
+    uint64_t         evictions;
+
+    dataEntry_t*     data;
+    size_t           dataEntries;
+    uint64_t         dataHits;
+    uint64_t         dataMisses;
+};
+
+static inline uint64_t hashUUID(const uuid_t uuid) {
+
+    uint64_t lo;
+    uint64_t hi;
+
+    memcpy(&lo, uuid, sizeof(lo));
+    memcpy(&hi, uuid + sizeof(lo), sizeof(hi));
+
+    /* Mix both halves; time-based UUIDs differ mostly in the low bytes */
+    lo ^= hi * 0x9e3779b97f4a7c15ULL;
+    lo ^= lo >> 29;
+    lo *= 0xbf58476d1ce4e5b9ULL;
+    lo ^= lo >> 32;
+
+    return lo;
+
+}
+
+/* Return the slot holding uuid, or the empty slot where it would go */
+static keyEntry_t* findSlot(keyEntry_t* table, size_t capacity, const uuid_t uuid) {
+
+    size_t i = hashUUID(uuid) & (capacity - 1);
+
+    while(table[i].used && uuid_compare(table[i].uuid, uuid) != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+
+    return &table[i];
+
+}
+
+/* Stamp entry as just used; callers may hold the lock only shared */
+static inline void touchEntry(keyCache_t* cache, keyEntry_t* entry) {
+    __atomic_store_n(&entry->lastUse, __sync_add_and_fetch(&cache->clock, 1),
+                     __ATOMIC_RELAXED);
+}
+
+/* Empty slot i, then move back any entries that probed past it, so
+ * every entry stays reachable from its home slot */
+static void removeSlot(keyEntry_t* table, size_t capacity, size_t i) {
+
+    size_t j = i;
+    size_t home;
+
+    memset(&table[i], 0, sizeof(table[i]));
+
+    for(;;) {
+        j = (j + 1) & (capacity - 1);
+        if(!table[j].used) {
+            return;
+        }
+        /* table[j] may fill the gap if the gap lies between its home and j */
+        home = hashUUID(table[j].uuid) & (capacity - 1);
+        if(((j - home) & (capacity - 1)) >= ((j - i) & (capacity - 1))) {
+            table[i] = table[j];
+            memset(&table[j], 0, sizeof(table[j]));
+            i = j;
+        }
+    }
+
+}
+
+/* Remove the least recently used entry, under the exclusive lock
+ * Return: Its handle, to release once unlocked */
+static keyHandle_t* evictOldest(keyCache_t* cache) {
+
+    size_t i;
+    size_t oldest = cache->capacity;
+    keyHandle_t* handle = NULL;
+    keyEntry_t* entry = NULL;
+
+    for(i = 0; i < cache->capacity; i++) {
+        if(cache->table[i].used &&
+           (oldest == cache->capacity ||
+            cache->table[i].lastUse < cache->table[oldest].lastUse)) {
+            oldest = i;
+        }
+    }
+    if(oldest == cache->capacity) {
+        return NULL;
+    }
+
+    entry = &cache->table[oldest];
+    handle = entry->handle;
+    memset(entry->val, 0, entry->size);
+    free(entry->val);
+    removeSlot(cache->table, cache->capacity, oldest);
+    cache->entries--;
+    cache->evictions++;
+
+    return handle;
+
+}
+
+static keyHandle_t* createHandle(const uuid_t uuid, const uint8_t* key,
+                                 size_t keySize) {
+
+    char* keyStr = NULL;
+    keyHandle_t* handle = NULL;
+
+    handle = calloc(1, sizeof(*handle));
+    keyStr = malloc(keySize + 1);
+    if(!handle || !keyStr) {
+        fprintf(stderr, "ERROR createHandle: malloc failed\n");
+        goto CLEANUP;
+    }
+    memcpy(keyStr, key, keySize);
+    keyStr[keySize] = '\0';
+
+    handle->crypt = crypt_createKey(keyStr);
+    if(!handle->crypt) {
+        fprintf(stderr, "ERROR createHandle: crypt_createKey() failed\n");
+        goto CLEANUP;
+    }
+    uuid_copy(handle->uuid, uuid);
+    handle->refs = 1;
+
+    memset(keyStr, 0, keySize);
+    free(keyStr);
+    return handle;
+
+ CLEANUP:
+    if(keyStr) {
+        memset(keyStr, 0, keySize);
+    }
+    free(keyStr);
+    free(handle);
+    return NULL;
+
+}
+
+extern void keycache_release(keyHandle_t* handle) {
+
+    if(!handle) {
+        return;
+    }
+
+    if(__sync_sub_and_fetch(&handle->refs, 1) == 0) {
+        crypt_destroyKey(handle->crypt);
+        free(handle);
+    }
+
+}
+
+static int growTable(keyCache_t* cache) {
+
+    size_t i;
+    size_t newCapacity = cache->capacity * 2;
+    keyEntry_t* newTable = NULL;
+
+    newTable = calloc(newCapacity, sizeof(*newTable));
+    if(!newTable) {
+        fprintf(stderr, "ERROR growTable: calloc failed\n");
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < cache->capacity; i++) {
+        if(cache->table[i].used) {
+            *findSlot(newTable, newCapacity, cache->table[i].uuid) = cache->table[i];
+        }
+    }
+
+    free(cache->table);
+    cache->table = newTable;
+    cache->capacity = newCapacity;
+
+    return RETURN_SUCCESS;
+
+}
+
+extern keyCache_t* keycache_create(size_t capacity) {
+
+    keyCache_t* cache = NULL;
+    size_t size = MIN_CAPACITY;
+
+    while(size < capacity * 2) {
+        size *= 2;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    if(!cache) {
+        fprintf(stderr, "ERROR keycache_create: calloc failed\n");
+        return NULL;
+    }
+
+    cache->table = calloc(size, sizeof(*cache->table));
+    cache->data = calloc(DATA_SLOTS, sizeof(*cache->data));
+    if(!cache->table || !cache->data) {
+        fprintf(stderr, "ERROR keycache_create: calloc(table) failed\n");
+        free(cache->table);
+        free(cache->data);
+        free(cache);
+        return NULL;
+    }
+    cache->capacity = size;
+    cache->maxEntries = capacity;
+
+    if(pthread_rwlock_init(&cache->lock, NULL)) {
+        fprintf(stderr, "ERROR keycache_create: pthread_rwlock_init failed\n");
+        free(cache->table);
+        free(cache->data);
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+
+}
+
+extern void keycache_destroy(keyCache_t* cache) {
+
+    size_t i;
+
+    if(!cache) {
+        return;
+    }
+
+    for(i = 0; i < cache->capacity; i++) {
+        if(cache->table[i].used) {
+            memset(cache->table[i].val, 0, cache->table[i].size);
+            free(cache->table[i].val);
+            keycache_release(cache->table[i].handle);
+        }
+    }
+    for(i = 0; i < DATA_SLOTS; i++) {
+        keycache_release(cache->data[i].handle);
+    }
+
+    pthread_rwlock_destroy(&cache->lock);
+    free(cache->table);
+    free(cache->data);
+    free(cache);
+
+}
+
+extern int keycache_get(keyCache_t* cache, const uuid_t uuid,
+                        char* buf, size_t bufSize) {
+
+    int ret = RETURN_SUCCESS;
+    keyEntry_t* entry = NULL;
+
+    if(!cache || !buf) {
+        fprintf(stderr, "ERROR keycache_get: cache and buf must not be NULL\n");
+        return -EINVAL;
+    }
+
+    pthread_rwlock_rdlock(&cache->lock);
+
+    entry = findSlot(cache->table, cache->capacity, uuid);
+    if(!entry->used) {
+        __sync_fetch_and_add(&cache->misses, 1);
+        ret = -ENOENT;
+    }
+    else if(entry->size >= bufSize) {
+        fprintf(stderr, "ERROR keycache_get: keySize %zd larger than bufSize %zd\n",
+                entry->size, bufSize);
+        ret = -ENAMETOOLONG;
+    }
+    else {
+        __sync_fetch_and_add(&cache->hits, 1);
+        touchEntry(cache, entry);
+        memcpy(buf, entry->val, entry->size);
+        buf[entry->size] = '\0';
+    }
+
+    pthread_rwlock_unlock(&cache->lock);
+
+    return ret;
+
+}
+
+extern int keycache_contains(keyCache_t* cache, const uuid_t uuid) {
+
+    int found;
+
+    if(!cache) {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&cache->lock);
+    found = findSlot(cache->table, cache->capacity, uuid)->used;
+    pthread_rwlock_unlock(&cache->lock);
+
+    return found;
+
+}
+
+extern int keycache_put(keyCache_t* cache, const uuid_t uuid,
+                        const uint8_t* key, size_t keySize) {
+
+    int ret;
+    uint8_t* val = NULL;
+    keyHandle_t* handle = NULL;
+    keyHandle_t* old = NULL;
+    keyHandle_t* evicted = NULL;
+    keyEntry_t* entry = NULL;
+
+    if(!cache || !key) {
+        fprintf(stderr, "ERROR keycache_put: cache and key must not be NULL\n");
+        return -EINVAL;
+    }
+
+    val = malloc(keySize ? keySize : 1);
+    if(!val) {
+        fprintf(stderr, "ERROR keycache_put: malloc failed\n");
+        return -ENOMEM;
+    }
+    memcpy(val, key, keySize);
+
+    /* Derive outside the lock; this is the expensive part */
+    handle = createHandle(uuid, key, keySize);
+    if(!handle) {
+        fprintf(stderr, "ERROR keycache_put: createHandle() failed\n");
+        memset(val, 0, keySize);
+        free(val);
+        return -ENOMEM;
+    }
+
+    pthread_rwlock_wrlock(&cache->lock);
+
+    if((cache->entries + 1) * 2 > cache->capacity) {
+        ret = growTable(cache);
+        if(ret < 0) {
+            pthread_rwlock_unlock(&cache->lock);
+            free(val);
+            keycache_release(handle);
+            return ret;
+        }
+    }
+
+    entry = findSlot(cache->table, cache->capacity, uuid);
+    if(!entry->used && cache->maxEntries &&
+       cache->entries >= cache->maxEntries) {
+        /* Eviction shifts entries, so look the slot up again */
+        evicted = evictOldest(cache);
+        entry = findSlot(cache->table, cache->capacity, uuid);
+    }
+    if(entry->used) {
+        memset(entry->val, 0, entry->size);
+        free(entry->val);
+        old = entry->handle;
+    }
+    else {
+        uuid_copy(entry->uuid, uuid);
+        entry->used = 1;
+        cache->entries++;
+    }
+    entry->val = val;
+    entry->size = keySize;
+    entry->handle = handle;
+    touchEntry(cache, entry);
+    cache->inserts++;
+
+    pthread_rwlock_unlock(&cache->lock);
+
+    keycache_release(old);
+    keycache_release(evicted);
+
+    return RETURN_SUCCESS;
+
+}
+
+extern keyHandle_t* keycache_acquire(keyCache_t* cache, const uuid_t uuid) {
+
+    keyEntry_t* entry = NULL;
+    keyHandle_t* handle = NULL;
+
+    if(!cache) {
+        return NULL;
+    }
+
+    pthread_rwlock_rdlock(&cache->lock);
+
+    entry = findSlot(cache->table, cache->capacity, uuid);
+    if(entry->used) {
+        handle = entry->handle;
+        __sync_fetch_and_add(&handle->refs, 1);
+        __sync_fetch_and_add(&cache->hits, 1);
+        touchEntry(cache, entry);
+    }
+    else {
+        __sync_fetch_and_add(&cache->misses, 1);
+    }
+
+    pthread_rwlock_unlock(&cache->lock);
+
+    return handle;
+
+}
+
+extern void keycache_stats(keyCache_t* cache, keyCacheStats_t* stats) {
+
+    if(!cache || !stats) {
+        return;
+    }
+
+    pthread_rwlock_rdlock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->inserts = cache->inserts;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->entries;
+    stats->dataHits = cache->dataHits;
+    stats->dataMisses = cache->dataMisses;
+    stats->dataEntries = cache->dataEntries;
+    pthread_rwlock_unlock(&cache->lock);
+
+}
+
+/* Cache slot id of the data key wrapped under master */
+static void dataID(const cryptKey_t* master, const unsigned char* wrapped,
+                   unsigned char* id) {
+
+    unsigned char buf[sizeof(master->wrapKey) + CRYPT_WRAPSIZE];
+
+    memcpy(buf, master->wrapKey, sizeof(master->wrapKey));
+    memcpy(buf + sizeof(master->wrapKey), wrapped, CRYPT_WRAPSIZE);
+    SHA256(buf, sizeof(buf), id);
+    OPENSSL_cleanse(buf, sizeof(buf));
+
+}
+
+static dataEntry_t* dataSlot(keyCache_t* cache, const unsigned char* id) {
+
+    uint64_t h;
+
+    memcpy(&h, id, sizeof(h));
+
+    return &cache->data[h & (DATA_SLOTS - 1)];
+
+}
+
+/* Wrap crypt in a handle with one reference for the caller, and put it
+ * in cache (if any) under master */
+static keyHandle_t* putData(keyCache_t* cache, const cryptKey_t* master,
+                            cryptKey_t* crypt) {
+
+    keyHandle_t* handle = NULL;
+    keyHandle_t* old = NULL;
+    dataEntry_t* entry = NULL;
+    unsigned char id[SHA256_DIGEST_LENGTH];
+
+    handle = calloc(1, sizeof(*handle));
+    if(!handle) {
+        fprintf(stderr, "ERROR putData: calloc failed\n");
+        crypt_destroyKey(crypt);
+        return NULL;
+    }
+    handle->crypt = crypt;
+    handle->refs = 1;
+    if(!cache) {
+        return handle;
+    }
+
+    dataID(master, crypt->wrapped, id);
+
+    pthread_rwlock_wrlock(&cache->lock);
+
+    entry = dataSlot(cache, id);
+    old = entry->handle;
+    if(!old) {
+        cache->dataEntries++;
+    }
+    memcpy(entry->id, id, sizeof(id));
+    entry->handle = handle;
+    handle->refs++;
+
+    pthread_rwlock_unlock(&cache->lock);
+
+    keycache_release(old);
+
+    return handle;
+
+}
+
+extern keyHandle_t* keycache_acquireData(keyCache_t* cache,
+                                         const cryptKey_t* master,
+                                         const unsigned char* wrapped) {
+
+    cryptKey_t* crypt = NULL;
+    dataEntry_t* entry = NULL;
+    keyHandle_t* handle = NULL;
+    unsigned char id[SHA256_DIGEST_LENGTH];
+
+    if(!master || !wrapped) {
+        fprintf(stderr, "ERROR keycache_acquireData: master and wrapped "
+                "must not be NULL\n");
+        return NULL;
+    }
+
+    if(cache) {
+
+        dataID(master, wrapped, id);
+
+        pthread_rwlock_rdlock(&cache->lock);
+        entry = dataSlot(cache, id);
+        if(entry->handle && memcmp(entry->id, id, sizeof(id)) == 0) {
+            handle = entry->handle;
+            __sync_fetch_and_add(&handle->refs, 1);
+            __sync_fetch_and_add(&cache->dataHits, 1);
+        }
+        else {
+            __sync_fetch_and_add(&cache->dataMisses, 1);
+        }
+        pthread_rwlock_unlock(&cache->lock);
+
+        if(handle) {
+            return handle;
+        }
+
+    }
+
+    /* Unwrap outside the lock; this is the expensive part */
+    crypt = crypt_unwrapDataKey(master, wrapped);
+    if(!crypt) {
+        fprintf(stderr, "ERROR keycache_acquireData: "
+                "crypt_unwrapDataKey() failed\n");
+        return NULL;
+    }
+
+    return putData(cache, master, crypt);
+
+}
+
+extern keyHandle_t* keycache_createData(keyCache_t* cache,
+                                        const cryptKey_t* master) {
+
+    cryptKey_t* crypt = NULL;
+
+    crypt = crypt_createDataKey(master);
+    if(!crypt) {
+        fprintf(stderr, "ERROR keycache_createData: "
+                "crypt_createDataKey() failed\n");
+        return NULL;
+    }
+
+    return putData(cache, master, crypt);
+
+}
@@ -0,0 +1,125 @@
+/* key-cache.h
+ * Thread-safe in-memory cache of custos keys, indexed by key UUID
+ *
+ * Keys are fetched from the custos server (see custos-keys.h) and kept
+ * here, so opening a file whose key has already been seen costs no round
+ * trip. Each key is also kept as a ready cryptKey_t handle, derived once
+ * when the key is inserted. Every new file has a key of its own, so the
+ * cache is bounded: beyond its capacity the least recently used key is
+ * dropped, and fetched again if needed.
+ *
+ * Files under data keys (aes-crypt.h) keep them wrapped under a custos
+ * key. The cache also holds a bounded set of data keys once unwrapped,
+ * looked up by the master key and wrapped form, so reopening a file
+ * whose data key is still cached costs no unwrap or key setup.
+ *
+ */
+
+#ifndef KEY_CACHE_H
+#define KEY_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uuid/uuid.h>
+
+#include "aes-crypt.h"
+
+typedef struct keyCache keyCache_t;
+
+/* Reference-counted key handle; valid until released, even if the key
+ * is replaced in or evicted from the cache meanwhile. Data key handles
+ * have a null uuid. */
+typedef struct keyHandle {
+    uuid_t      uuid;
+    int         refs;
+    cryptKey_t* crypt;
+} keyHandle_t;
+
+typedef struct keyCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    size_t   entries;
+    uint64_t dataHits;
+    uint64_t dataMisses;
+    size_t   dataEntries;
+} keyCacheStats_t;
+
+/* keyCache_t* keycache_create(size_t capacity)
+ *
+ * Purpose: Create an empty cache holding at most capacity keys, least
+ *          recently used evicted first (0: no limit, grows as needed)
+ *
+ * Return: New cache on success, NULL on error
+ */
+extern keyCache_t* keycache_create(size_t capacity);
+
+extern void keycache_destroy(keyCache_t* cache);
+
+/* int keycache_get(keyCache_t* cache, const uuid_t uuid, char* buf, size_t bufSize)
+ *
+ * Purpose: Copy the cached key for uuid into buf as a C-string
+ *
+ * Return: 0 on hit, -ENOENT on miss, -ENAMETOOLONG if buf is too small
+ */
+extern int keycache_get(keyCache_t* cache, const uuid_t uuid,
+                        char* buf, size_t bufSize);
+
+/* int keycache_contains(keyCache_t* cache, const uuid_t uuid)
+ *
+ * Purpose: Check for uuid without copying (and without counting a hit/miss)
+ *
+ * Return: 1 if present, 0 if not
+ */
+extern int keycache_contains(keyCache_t* cache, const uuid_t uuid);
+
+/* int keycache_put(keyCache_t* cache, const uuid_t uuid,
+ *                  const uint8_t* key, size_t keySize)
+ *
+ * Purpose: Insert or replace the key for uuid
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int keycache_put(keyCache_t* cache, const uuid_t uuid,
+                        const uint8_t* key, size_t keySize);
+
+/* keyHandle_t* keycache_acquire(keyCache_t* cache, const uuid_t uuid)
+ *
+ * Purpose: Take a reference to the ready key handle for uuid
+ *
+ * Return: Handle on hit (release with keycache_release), NULL on miss
+ */
+extern keyHandle_t* keycache_acquire(keyCache_t* cache, const uuid_t uuid);
+
+extern void keycache_release(keyHandle_t* handle);
+
+/* keyHandle_t* keycache_acquireData(keyCache_t* cache,
+ *                                   const cryptKey_t* master,
+ *                                   const unsigned char* wrapped)
+ *
+ * Purpose: Take a reference to the data key wrapped (CRYPT_WRAPSIZE
+ *          bytes) under master, unwrapping and caching it on a miss.
+ *          cache may be NULL, to unwrap without caching.
+ *
+ * Return: Handle (release with keycache_release), NULL if wrapped was not
+ *         wrapped under master or on error
+ */
+extern keyHandle_t* keycache_acquireData(keyCache_t* cache,
+                                         const cryptKey_t* master,
+                                         const unsigned char* wrapped);
+
+/* keyHandle_t* keycache_createData(keyCache_t* cache,
+ *                                  const cryptKey_t* master)
+ *
+ * Purpose: Make a new data key wrapped under master and take a reference
+ *          to it, caching it unless cache is NULL
+ *
+ * Return: Handle (release with keycache_release), NULL on error
+ */
+extern keyHandle_t* keycache_createData(keyCache_t* cache,
+                                        const cryptKey_t* master);
+
+extern void keycache_stats(keyCache_t* cache, keyCacheStats_t* stats);
+
+#endif
@@ -0,0 +1,60 @@
+#!/bin/sh
+# File: loadtest.sh
+# Mount fuseenc_fh against the local custos stand-in and run enc-loadtest
+#
+# Settings (environment):
+#   LATENCY  stand-in latency per request in ms  (default 20)
+#   JITTER   extra random latency in ms          (default 5)
+#   ERROR    request failure probability         (default 0)
+#   DENY     fraction of keys refused            (default 0)
+#   CONNS    custos_conns request slots          (default 8)
+#   THREADS  load threads                        (default 8)
+#   FILES    files in the test directory         (default 256)
+#   DURATION  load duration                       (default 5)
+#
+# Key cache and stand-in counters are printed when the FS unmounts.
+
+set -e
+
+LATENCY=${LATENCY:-20}
+JITTER=${JITTER:-5}
+ERROR=${ERROR:-0}
+DENY=${DENY:-0}
+CONNS=${CONNS:-8}
+THREADS=${THREADS:-8}
+FILES=${FILES:-256}
+DURATION=${DURATION:-5}
+
+HERE=`dirname "$0"`
+WORK=`mktemp -d`
+MNT="$WORK/mnt"
+BASE="$WORK/base"
+LOG="$WORK/fuseenc_fh.log"
+URL="local:latency=$LATENCY:jitter=$JITTER:error=$ERROR:deny=$DENY"
+
+mkdir "$MNT" "$BASE"
+
+cleanup() {
+    fusermount -u "$MNT" 2>/dev/null || true
+    sleep 1
+    grep '^STATS' "$LOG" || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+"$HERE/fuseenc_fh" "$MNT" "$BASE" -f -o custos,custos_url=$URL,custos_conns=$CONNS \
+    2> "$LOG" &
+
+i=0
+until mountpoint -q "$MNT"; do
+    i=$((i + 1))
+    if [ $i -gt 50 ]; then
+        echo "fuseenc_fh did not mount, see log:" >&2
+        tail "$LOG" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+echo "stand-in: $URL, $CONNS slots"
+"$HERE/enc-loadtest" -t "$THREADS" -n "$FILES" -d "$DURATION" "$MNT"
@@ -0,0 +1,367 @@
+/* op-trace.c
+ * Binary trace of FUSE callbacks
+ *
+ * Every thread that records gets a buffer of its own, found through a
+ * pthread key. Buffers are kept on a list pushed with compare-and-swap
+ * and never unlinked: when a thread exits its buffer is written out and
+ * marked free, and the next new thread claims it instead of allocating.
+ * So the record path takes no lock, and the list stays as long as the
+ * most threads that were ever live at once.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "op-trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+/* 88 KiB per thread, written out in one pwrite */
+#define TRACE_BUFFER_RECORDS 1024
+
+typedef struct traceBuffer {
+    opTraceRecord_t     recs[TRACE_BUFFER_RECORDS];
+    size_t              used;
+    int                 owned;  /* a live thread records into it */
+    uint16_t            thread;
+    opTrace_t*          trace;
+    struct traceBuffer* next;
+} traceBuffer_t;
+
+struct opTrace {
+    int            fd;
+    uint64_t       startNS;
+    pthread_key_t  key;
+    traceBuffer_t* buffers;
+    uint64_t       offset;      /* end of the log, reserved atomically */
+    uint32_t       threads;
+
+    uint64_t       records;
+    uint64_t       dropped;
+};
+
+static const char* opNames[OPTRACE_OPS] = {
+    [OPTRACE_NONE]            = "none",
+    [OPTRACE_GETATTR]         = "getattr",
+    [OPTRACE_FGETATTR]        = "fgetattr",
+    [OPTRACE_ACCESS]          = "access",
+    [OPTRACE_READLINK]        = "readlink",
+    [OPTRACE_OPENDIR]         = "opendir",
+    [OPTRACE_READDIR]         = "readdir",
+    [OPTRACE_RELEASEDIR]      = "releasedir",
+    [OPTRACE_MKNOD]           = "mknod",
+    [OPTRACE_MKDIR]           = "mkdir",
+    [OPTRACE_UNLINK]          = "unlink",
+    [OPTRACE_RMDIR]           = "rmdir",
+    [OPTRACE_SYMLINK]         = "symlink",
+    [OPTRACE_RENAME]          = "rename",
+    [OPTRACE_LINK]            = "link",
+    [OPTRACE_CHMOD]           = "chmod",
+    [OPTRACE_CHOWN]           = "chown",
+    [OPTRACE_TRUNCATE]        = "truncate",
+    [OPTRACE_FTRUNCATE]       = "ftruncate",
+    [OPTRACE_UTIMENS]         = "utimens",
+    [OPTRACE_CREATE]          = "create",
+    [OPTRACE_OPEN]            = "open",
+    [OPTRACE_READ]            = "read",
+    [OPTRACE_WRITE]           = "write",
+    [OPTRACE_STATFS]          = "statfs",
+    [OPTRACE_FALLOCATE]       = "fallocate",
+    [OPTRACE_COPY_FILE_RANGE] = "copy_file_range",
+    [OPTRACE_LSEEK]           = "lseek",
+    [OPTRACE_FLUSH]           = "flush",
+    [OPTRACE_FSYNC]           = "fsync",
+    [OPTRACE_RELEASE]         = "release",
+    [OPTRACE_LOCK]            = "lock",
+    [OPTRACE_FLOCK]           = "flock",
+    [OPTRACE_SETXATTR]        = "setxattr",
+    [OPTRACE_GETXATTR]        = "getxattr",
+    [OPTRACE_LISTXATTR]       = "listxattr",
+    [OPTRACE_REMOVEXATTR]     = "removexattr",
+};
+
+static uint64_t nowNS(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+/* Write size bytes of buf to fd at offset, retrying short writes */
+static int pwriteFull(int fd, const void* buf, size_t size, off_t offset) {
+
+    ssize_t ret;
+    size_t done = 0;
+
+    while(done < size) {
+        ret = pwrite(fd, (const char*) buf + done, size - done, offset + done);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret <= 0) {
+            return (ret < 0) ? -errno : -EIO;
+        }
+        done += ret;
+    }
+
+    return RETURN_SUCCESS;
+
+}
+
+/* Append the records in buffer to the log and empty it */
+static void flushBuffer(traceBuffer_t* buffer) {
+
+    opTrace_t* trace = buffer->trace;
+    size_t bytes = buffer->used * sizeof(opTraceRecord_t);
+    uint64_t offset;
+
+    if(buffer->used == 0) {
+        return;
+    }
+
+    offset = __atomic_fetch_add(&trace->offset, bytes, __ATOMIC_RELAXED);
+    if(pwriteFull(trace->fd, buffer->recs, bytes, offset) < 0) {
+        fprintf(stderr, "ERROR flushBuffer: pwrite failed\n");
+        __atomic_add_fetch(&trace->dropped, buffer->used, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_add_fetch(&trace->records, buffer->used, __ATOMIC_RELAXED);
+    }
+    buffer->used = 0;
+
+}
+
+/* Thread exit: hand the buffer on to a later thread */
+static void releaseBuffer(void* arg) {
+
+    traceBuffer_t* buffer = arg;
+
+    flushBuffer(buffer);
+    __atomic_store_n(&buffer->owned, 0, __ATOMIC_RELEASE);
+
+}
+
+/* The calling thread's buffer: its own, a free one, or a new one */
+static traceBuffer_t* getBuffer(opTrace_t* trace) {
+
+    int idle;
+    traceBuffer_t* buffer;
+
+    buffer = pthread_getspecific(trace->key);
+    if(buffer) {
+        return buffer;
+    }
+
+    for(buffer = __atomic_load_n(&trace->buffers, __ATOMIC_ACQUIRE);
+        buffer; buffer = buffer->next) {
+        idle = 0;
+        if(__atomic_compare_exchange_n(&buffer->owned, &idle, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if(!buffer) {
+        buffer = calloc(1, sizeof(*buffer));
+        if(!buffer) {
+            return NULL;
+        }
+        buffer->owned = 1;
+        buffer->trace = trace;
+        buffer->thread = __atomic_fetch_add(&trace->threads, 1, __ATOMIC_RELAXED);
+        buffer->next = __atomic_load_n(&trace->buffers, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&trace->buffers, &buffer->next,
+                                           buffer, 0, __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED)) {
+            continue;
+        }
+    }
+
+    if(pthread_setspecific(trace->key, buffer) != 0) {
+        __atomic_store_n(&buffer->owned, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    return buffer;
+
+}
+
+extern opTrace_t* optrace_create(const char* logPath) {
+
+    opTrace_t* trace = NULL;
+    opTraceHeader_t hdr;
+
+    trace = calloc(1, sizeof(*trace));
+    if(!trace) {
+        fprintf(stderr, "ERROR optrace_create: calloc failed\n");
+        return NULL;
+    }
+
+    trace->fd = open(logPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(trace->fd < 0) {
+        fprintf(stderr, "ERROR optrace_create: open(%s) failed\n", logPath);
+        perror("ERROR optrace_create");
+        free(trace);
+        return NULL;
+    }
+
+    if(pthread_key_create(&trace->key, releaseBuffer) != 0) {
+        fprintf(stderr, "ERROR optrace_create: pthread_key_create failed\n");
+        close(trace->fd);
+        free(trace);
+        return NULL;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, OPTRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = OPTRACE_VERSION;
+    hdr.recordSize = sizeof(opTraceRecord_t);
+    hdr.startNS = trace->startNS = nowNS();
+    if(pwriteFull(trace->fd, &hdr, sizeof(hdr), 0) < 0) {
+        fprintf(stderr, "ERROR optrace_create: writing header failed\n");
+        pthread_key_delete(trace->key);
+        close(trace->fd);
+        free(trace);
+        return NULL;
+    }
+    trace->offset = sizeof(hdr);
+
+    return trace;
+
+}
+
+extern void optrace_flush(opTrace_t* trace) {
+
+    traceBuffer_t* buffer;
+
+    for(buffer = __atomic_load_n(&trace->buffers, __ATOMIC_ACQUIRE);
+        buffer; buffer = buffer->next) {
+        flushBuffer(buffer);
+    }
+
+}
+
+extern void optrace_destroy(opTrace_t* trace) {
+
+    traceBuffer_t* buffer;
+    traceBuffer_t* next;
+
+    if(!trace) {
+        return;
+    }
+
+    pthread_key_delete(trace->key);
+
+    optrace_flush(trace);
+    for(buffer = trace->buffers; buffer; buffer = next) {
+        next = buffer->next;
+        free(buffer);
+    }
+
+    if(fsync(trace->fd) < 0 || close(trace->fd) < 0) {
+        perror("ERROR optrace_destroy");
+    }
+    free(trace);
+
+}
+
+extern void optrace_begin(opTrace_t* trace, opTraceRecord_t* rec,
+                          opTraceOp_t op, const char* path) {
+
+    memset(rec, 0, sizeof(*rec));
+    rec->op = op;
+    if(path) {
+        rec->path = optrace_pathHash(path);
+        rec->dir = optrace_dirHash(path);
+    }
+    rec->start = nowNS() - trace->startNS;
+
+}
+
+extern void optrace_end(opTrace_t* trace, opTraceRecord_t* rec,
+                        int64_t result) {
+
+    traceBuffer_t* buffer;
+
+    rec->end = nowNS() - trace->startNS;
+    rec->result = (result > INT32_MAX) ? INT32_MAX : (int32_t) result;
+
+    buffer = getBuffer(trace);
+    if(!buffer) {
+        __atomic_add_fetch(&trace->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec->thread = buffer->thread;
+    buffer->recs[buffer->used++] = *rec;
+    if(buffer->used == TRACE_BUFFER_RECORDS) {
+        flushBuffer(buffer);
+    }
+
+}
+
+extern void optrace_stats(opTrace_t* trace, opTraceStats_t* stats) {
+
+    memset(stats, 0, sizeof(*stats));
+    if(!trace) {
+        return;
+    }
+
+    stats->records = __atomic_load_n(&trace->records, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&trace->dropped, __ATOMIC_RELAXED);
+    stats->threads = __atomic_load_n(&trace->threads, __ATOMIC_RELAXED);
+
+}
+
+extern uint64_t optrace_hash(const char* s, size_t len) {
+
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+
+}
+
+extern uint64_t optrace_pathHash(const char* path) {
+    return optrace_hash(path, strlen(path));
+}
+
+extern uint64_t optrace_dirHash(const char* path) {
+
+    const char* last = strrchr(path, '/');
+
+    if(!last || last == path) {
+        return optrace_hash("/", 1);
+    }
+
+    return optrace_hash(path, last - path);
+
+}
+
+extern const char* optrace_opName(unsigned int op) {
+
+    if(op >= OPTRACE_OPS || !opNames[op]) {
+        return "?";
+    }
+
+    return opNames[op];
+
+}
@@ -0,0 +1,142 @@
+/* op-trace.h
+ * Binary trace of FUSE callbacks, for replaying production access
+ * patterns against a test mount (see enc-replay.c)
+ *
+ * Each callback becomes one fixed-size record: the operation, hashes of
+ * its path and that path's directory, the file handle, offsets, size,
+ * flags, result, recording thread and start/end times. Paths themselves
+ * are never written, only their 64-bit FNV-1a hashes.
+ *
+ * Records go into a buffer owned by the calling thread, with no lock or
+ * shared counter on the way; a full buffer is written to the log with
+ * one pwrite at an offset reserved by an atomic add. So records are in
+ * order per thread, but the threads' blocks interleave in the file.
+ *
+ */
+
+#ifndef OP_TRACE_H
+#define OP_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OPTRACE_MAGIC   "ENCTRACE"
+#define OPTRACE_VERSION 1
+
+typedef enum opTraceOp {
+    OPTRACE_NONE = 0,
+    OPTRACE_GETATTR,
+    OPTRACE_FGETATTR,
+    OPTRACE_ACCESS,
+    OPTRACE_READLINK,
+    OPTRACE_OPENDIR,
+    OPTRACE_READDIR,
+    OPTRACE_RELEASEDIR,
+    OPTRACE_MKNOD,
+    OPTRACE_MKDIR,
+    OPTRACE_UNLINK,
+    OPTRACE_RMDIR,
+    OPTRACE_SYMLINK,
+    OPTRACE_RENAME,
+    OPTRACE_LINK,
+    OPTRACE_CHMOD,
+    OPTRACE_CHOWN,
+    OPTRACE_TRUNCATE,
+    OPTRACE_FTRUNCATE,
+    OPTRACE_UTIMENS,
+    OPTRACE_CREATE,
+    OPTRACE_OPEN,
+    OPTRACE_READ,
+    OPTRACE_WRITE,
+    OPTRACE_STATFS,
+    OPTRACE_FALLOCATE,
+    OPTRACE_COPY_FILE_RANGE,
+    OPTRACE_LSEEK,
+    OPTRACE_FLUSH,
+    OPTRACE_FSYNC,
+    OPTRACE_RELEASE,
+    OPTRACE_LOCK,
+    OPTRACE_FLOCK,
+    OPTRACE_SETXATTR,
+    OPTRACE_GETXATTR,
+    OPTRACE_LISTXATTR,
+    OPTRACE_REMOVEXATTR,
+    OPTRACE_OPS
+} opTraceOp_t;
+
+/* Log file header; records follow it */
+typedef struct opTraceHeader {
+    char     magic[8];      /* OPTRACE_MAGIC, not terminated */
+    uint32_t version;
+    uint32_t recordSize;    /* sizeof(opTraceRecord_t) */
+    uint64_t startNS;       /* CLOCK_MONOTONIC when tracing began */
+} opTraceHeader_t;
+
+typedef struct opTraceRecord {
+    uint64_t start;         /* ns since the header's startNS */
+    uint64_t end;
+    uint64_t path;          /* hash of the path, 0 if none */
+    uint64_t dir;           /* hash of the path's directory */
+    uint64_t aux;           /* rename/link target hash, copy destination fh */
+    uint64_t fh;            /* open file or directory handle, 0 if none */
+    uint64_t offset;
+    uint64_t offset2;       /* copy destination offset */
+    uint64_t size;          /* bytes asked for, new size, or file size */
+    uint32_t flags;         /* open flags, mask, whence, lock op, ... */
+    uint32_t mode;          /* mode created or changed, st_mode found */
+    int32_t  result;        /* return value: bytes, or negative errno */
+    uint16_t op;            /* opTraceOp_t */
+    uint16_t thread;        /* recording thread, numbered from 0 */
+} opTraceRecord_t;
+
+typedef struct opTrace opTrace_t;
+
+typedef struct opTraceStats {
+    uint64_t records;       /* records written to the log */
+    uint64_t dropped;       /* records lost to failed log writes */
+    size_t   threads;       /* thread buffers created */
+} opTraceStats_t;
+
+/* opTrace_t* optrace_create(const char* logPath)
+ *
+ * Purpose: Start a trace, truncating logPath and writing its header
+ *
+ * Return: New trace on success, NULL on error
+ */
+extern opTrace_t* optrace_create(const char* logPath);
+
+/* Write out every thread's buffered records. No callback may still
+ * be recording. */
+extern void optrace_flush(opTrace_t* trace);
+
+/* Flush and close the log */
+extern void optrace_destroy(opTrace_t* trace);
+
+/* void optrace_begin(opTrace_t* trace, opTraceRecord_t* rec,
+ *                    opTraceOp_t op, const char* path)
+ *
+ * Purpose: Start a record of op on path (which may be NULL): clear rec,
+ *          hash path and its directory and stamp the start time. The
+ *          caller fills in the fields op uses before optrace_end.
+ */
+extern void optrace_begin(opTrace_t* trace, opTraceRecord_t* rec,
+                          opTraceOp_t op, const char* path);
+
+/* Stamp the end time and result of rec and append it to the calling
+ * thread's buffer */
+extern void optrace_end(opTrace_t* trace, opTraceRecord_t* rec,
+                        int64_t result);
+
+extern void optrace_stats(opTrace_t* trace, opTraceStats_t* stats);
+
+/* 64-bit FNV-1a hash of the first len bytes of s */
+extern uint64_t optrace_hash(const char* s, size_t len);
+
+/* Hashes of path and of its directory ("/" for top-level names) */
+extern uint64_t optrace_pathHash(const char* path);
+extern uint64_t optrace_dirHash(const char* path);
+
+/* Name of op, for reports; "?" if unknown */
+extern const char* optrace_opName(unsigned int op);
+
+#endif
@@ -0,0 +1,465 @@
+/* span-trace.c
+ * Timed spans of the phases of FUSE callbacks
+ *
+ * Rings are found and handed on between threads as op-trace.c does its
+ * buffers: one per thread through a pthread key, on a list pushed with
+ * compare-and-swap and never unlinked, claimed again once their thread
+ * exits. A ring's owner writes a slot, then publishes it by advancing the
+ * ring's head; a dump copies the slots behind the head and then drops
+ * any the owner may have reached again meanwhile.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "span-trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+/* 192 KiB per thread */
+#define SPAN_RING_SIZE 4096
+
+typedef struct spanRecord {
+    uint64_t    start;
+    uint64_t    end;
+    uint64_t    ioNS;
+    int64_t     result;
+    const char* name;
+    int         cat;
+} spanRecord_t;
+
+typedef struct spanRing {
+    spanRecord_t     recs[SPAN_RING_SIZE];
+    uint64_t         head;      /* spans ever recorded, published */
+    uint64_t         ioNS;      /* I/O time counted by its thread */
+    int              owned;     /* a live thread records into it */
+    uint32_t         thread;
+    struct spanRing* next;
+} spanRing_t;
+
+struct spanTrace {
+    int             fd;
+    uint64_t        startNS;
+    pthread_key_t   key;
+    spanRing_t*     rings;
+    uint32_t        threads;
+    pthread_mutex_t dumpLock;
+    uint64_t        dumps;
+
+    pthread_t       dumper;
+    int             dumperRunning;
+    int             signo;
+    int             stop;
+};
+
+static const char* catNames[SPAN_CATS] = {
+    [SPAN_FUSE]   = "fuse",
+    [SPAN_KEY]    = "key",
+    [SPAN_CRYPTO] = "crypto",
+    [SPAN_IO]     = "io",
+};
+
+static uint64_t nowNS(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+/* Thread exit: hand the ring on to a later thread, spans and all */
+static void releaseRing(void* arg) {
+
+    spanRing_t* ring = arg;
+
+    __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+
+}
+
+/* The calling thread's ring: its own, a free one, or a new one */
+static spanRing_t* getRing(spanTrace_t* trace) {
+
+    int idle;
+    spanRing_t* ring;
+
+    ring = pthread_getspecific(trace->key);
+    if(ring) {
+        return ring;
+    }
+
+    for(ring = __atomic_load_n(&trace->rings, __ATOMIC_ACQUIRE);
+        ring; ring = ring->next) {
+        idle = 0;
+        if(__atomic_compare_exchange_n(&ring->owned, &idle, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if(!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if(!ring) {
+            return NULL;
+        }
+        ring->owned = 1;
+        ring->thread = __atomic_fetch_add(&trace->threads, 1, __ATOMIC_RELAXED);
+        ring->next = __atomic_load_n(&trace->rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&trace->rings, &ring->next,
+                                           ring, 0, __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED)) {
+            continue;
+        }
+    }
+
+    if(pthread_setspecific(trace->key, ring) != 0) {
+        __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    return ring;
+
+}
+
+/* Copy the spans of ring still intact into recs (SPAN_RING_SIZE of them)
+ * in order, returning how many */
+static size_t copyRing(spanRing_t* ring, spanRecord_t* recs) {
+
+    uint64_t i;
+    uint64_t first;
+    uint64_t head;
+    uint64_t after;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    first = (head > SPAN_RING_SIZE) ? head - SPAN_RING_SIZE : 0;
+    for(i = first; i < head; i++) {
+        recs[i - first] = ring->recs[i % SPAN_RING_SIZE];
+    }
+
+    /* The owner may be writing slot after, which held span
+       after - SPAN_RING_SIZE: that one and older are suspect */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if(after + 1 > first + SPAN_RING_SIZE) {
+        i = after + 1 - SPAN_RING_SIZE - first;
+        if(i >= head - first) {
+            return 0;
+        }
+        memmove(recs, recs + i, (head - first - i) * sizeof(*recs));
+        return head - first - i;
+    }
+
+    return head - first;
+
+}
+
+/* Print ns as microseconds, as trace events want */
+static void printUS(FILE* out, uint64_t ns) {
+    fprintf(out, "%"PRIu64".%03u", ns / 1000, (unsigned int) (ns % 1000));
+}
+
+static int writeEvents(spanTrace_t* trace, FILE* out) {
+
+    size_t i;
+    size_t count;
+    int first = 1;
+    pid_t pid = getpid();
+    spanRing_t* ring;
+    spanRecord_t* recs = NULL;
+    spanRecord_t* rec;
+
+    recs = malloc(SPAN_RING_SIZE * sizeof(*recs));
+    if(!recs) {
+        return -ENOMEM;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for(ring = __atomic_load_n(&trace->rings, __ATOMIC_ACQUIRE);
+        ring; ring = ring->next) {
+
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                first ? "" : ",", (int) pid, ring->thread, ring->thread);
+        first = 0;
+
+        count = copyRing(ring, recs);
+        for(i = 0; i < count; i++) {
+            rec = &recs[i];
+            fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                    "\"pid\":%d,\"tid\":%u,\"ts\":", rec->name,
+                    catNames[rec->cat], (int) pid, ring->thread);
+            printUS(out, rec->start);
+            fprintf(out, ",\"dur\":");
+            printUS(out, rec->end - rec->start);
+            fprintf(out, ",\"args\":{\"result\":%"PRId64, rec->result);
+            if(rec->ioNS) {
+                fprintf(out, ",\"io_us\":");
+                printUS(out, rec->ioNS);
+            }
+            if(rec->cat == SPAN_CRYPTO) {
+                fprintf(out, ",\"crypto_us\":");
+                printUS(out, rec->end - rec->start - rec->ioNS);
+            }
+            fprintf(out, "}}");
+        }
+
+    }
+
+    fprintf(out, "\n]}\n");
+    free(recs);
+
+    return ferror(out) ? -EIO : RETURN_SUCCESS;
+
+}
+
+static void* dumpLoop(void* arg) {
+
+    int sig;
+    sigset_t set;
+    spanTrace_t* trace = arg;
+
+    sigemptyset(&set);
+    sigaddset(&set, trace->signo);
+
+    for(;;) {
+        if(sigwait(&set, &sig) != 0) {
+            continue;
+        }
+        if(__atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if(spantrace_dump(trace) < 0) {
+            fprintf(stderr, "ERROR dumpLoop: spantrace_dump failed\n");
+        }
+    }
+
+    return NULL;
+
+}
+
+extern spanTrace_t* spantrace_create(const char* dumpPath) {
+
+    spanTrace_t* trace = NULL;
+
+    trace = calloc(1, sizeof(*trace));
+    if(!trace) {
+        fprintf(stderr, "ERROR spantrace_create: calloc failed\n");
+        return NULL;
+    }
+
+    trace->fd = open(dumpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(trace->fd < 0) {
+        fprintf(stderr, "ERROR spantrace_create: open(%s) failed\n", dumpPath);
+        perror("ERROR spantrace_create");
+        free(trace);
+        return NULL;
+    }
+
+    if(pthread_key_create(&trace->key, releaseRing) != 0) {
+        fprintf(stderr, "ERROR spantrace_create: pthread_key_create failed\n");
+        close(trace->fd);
+        free(trace);
+        return NULL;
+    }
+
+    pthread_mutex_init(&trace->dumpLock, NULL);
+    trace->startNS = nowNS();
+
+    return trace;
+
+}
+
+extern void spantrace_destroy(spanTrace_t* trace) {
+
+    spanRing_t* ring;
+    spanRing_t* next;
+
+    if(!trace) {
+        return;
+    }
+
+    if(trace->dumperRunning) {
+        __atomic_store_n(&trace->stop, 1, __ATOMIC_RELEASE);
+        pthread_kill(trace->dumper, trace->signo);
+        pthread_join(trace->dumper, NULL);
+    }
+
+    pthread_key_delete(trace->key);
+    for(ring = trace->rings; ring; ring = next) {
+        next = ring->next;
+        free(ring);
+    }
+
+    pthread_mutex_destroy(&trace->dumpLock);
+    if(close(trace->fd) < 0) {
+        perror("ERROR spantrace_destroy");
+    }
+    free(trace);
+
+}
+
+extern int spantrace_dump(spanTrace_t* trace) {
+
+    int ret;
+    int fd;
+    FILE* out;
+
+    pthread_mutex_lock(&trace->dumpLock);
+
+    if(ftruncate(trace->fd, 0) < 0 || lseek(trace->fd, 0, SEEK_SET) < 0 ||
+       (fd = dup(trace->fd)) < 0) {
+        perror("ERROR spantrace_dump");
+        ret = -errno;
+        goto CLEANUP;
+    }
+    out = fdopen(fd, "w");
+    if(!out) {
+        perror("ERROR spantrace_dump: fdopen");
+        ret = -errno;
+        close(fd);
+        goto CLEANUP;
+    }
+
+    ret = writeEvents(trace, out);
+    if(fclose(out) != 0 && ret == RETURN_SUCCESS) {
+        ret = -errno;
+    }
+    if(ret < 0) {
+        fprintf(stderr, "ERROR spantrace_dump: writing spans failed\n");
+    }
+    else {
+        trace->dumps++;
+    }
+
+ CLEANUP:
+    pthread_mutex_unlock(&trace->dumpLock);
+    return ret;
+
+}
+
+extern int spantrace_startDumper(spanTrace_t* trace, int signo) {
+
+    int ret;
+
+    if(trace->dumperRunning) {
+        return -EBUSY;
+    }
+
+    trace->signo = signo;
+    ret = pthread_create(&trace->dumper, NULL, dumpLoop, trace);
+    if(ret != 0) {
+        fprintf(stderr, "ERROR spantrace_startDumper: pthread_create failed\n");
+        return -ret;
+    }
+    trace->dumperRunning = 1;
+
+    return RETURN_SUCCESS;
+
+}
+
+extern void spantrace_begin(spanTrace_t* trace, span_t* span, spanCat_t cat,
+                            const char* name) {
+
+    int saved = errno;
+    spanRing_t* ring;
+
+    if(!trace) {
+        return;
+    }
+
+    ring = getRing(trace);
+    span->ioNS = ring ? ring->ioNS : 0;
+    span->name = name;
+    span->cat = cat;
+    span->start = nowNS() - trace->startNS;
+    errno = saved;
+
+}
+
+extern void spantrace_end(spanTrace_t* trace, span_t* span, int64_t result) {
+
+    int saved = errno;
+    uint64_t end;
+    spanRing_t* ring;
+    spanRecord_t* rec;
+
+    if(!trace) {
+        return;
+    }
+
+    end = nowNS() - trace->startNS;
+    ring = getRing(trace);
+    errno = saved;
+    if(!ring) {
+        return;
+    }
+
+    rec = &ring->recs[ring->head % SPAN_RING_SIZE];
+    rec->start = span->start;
+    rec->end = end;
+    rec->ioNS = ring->ioNS - span->ioNS;
+    rec->result = result;
+    rec->name = span->name;
+    rec->cat = span->cat;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+}
+
+extern uint64_t spantrace_ioBegin(spanTrace_t* trace) {
+    return trace ? nowNS() : 0;
+}
+
+extern void spantrace_ioEnd(spanTrace_t* trace, uint64_t begun) {
+
+    int saved = errno;
+    spanRing_t* ring;
+
+    if(!trace) {
+        return;
+    }
+
+    ring = getRing(trace);
+    if(ring) {
+        ring->ioNS += nowNS() - begun;
+    }
+    errno = saved;
+
+}
+
+extern void spantrace_stats(spanTrace_t* trace, spanTraceStats_t* stats) {
+
+    uint64_t head;
+    spanRing_t* ring;
+
+    memset(stats, 0, sizeof(*stats));
+    if(!trace) {
+        return;
+    }
+
+    for(ring = __atomic_load_n(&trace->rings, __ATOMIC_ACQUIRE);
+        ring; ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        stats->spans += head;
+        if(head > SPAN_RING_SIZE) {
+            stats->lost += head - SPAN_RING_SIZE;
+        }
+    }
+    pthread_mutex_lock(&trace->dumpLock);
+    stats->dumps = trace->dumps;
+    pthread_mutex_unlock(&trace->dumpLock);
+    stats->threads = __atomic_load_n(&trace->threads, __ATOMIC_RELAXED);
+
+}
@@ -0,0 +1,102 @@
+/* span-trace.h
+ * Timed spans of the phases of FUSE callbacks, dumped on demand as
+ * Chrome trace-event JSON (chrome://tracing, Perfetto)
+ *
+ * A span is one phase of the work behind a callback (fetching a key,
+ * decrypting, saving, setting up the clear file) or the callback itself,
+ * with its start and end times and the thread that ran it. Spans nest by
+ * time, so a viewer shows each callback above the phases it went through.
+ *
+ * Each thread records into a ring of its own, with no lock or shared
+ * counter on the way; once full, a ring overwrites its oldest spans. So
+ * a dump shows the most recent stretch of every thread's timeline. Dumps
+ * rewrite the file given at creation, from a thread of their own woken
+ * by a signal.
+ *
+ * Time spent reading and writing files inside a span is also counted,
+ * by whoever does that I/O calling spantrace_ioBegin/spantrace_ioEnd, and
+ * given in the span's args beside its CPU share. chunk-crypt counts its
+ * reads and writes this way, so a decrypt or save span tells its crypto
+ * time from its backing and clear file I/O.
+ *
+ */
+
+#ifndef SPAN_TRACE_H
+#define SPAN_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum spanCat {
+    SPAN_FUSE = 0,      /* a FUSE callback */
+    SPAN_KEY,           /* fetching or unwrapping keys */
+    SPAN_CRYPTO,        /* decrypting or encrypting, with its file I/O */
+    SPAN_IO,            /* file I/O alone: clear files, syncs, renames */
+    SPAN_CATS
+} spanCat_t;
+
+/* A span in progress, on the stack of its caller */
+typedef struct span {
+    uint64_t    start;  /* ns since the trace began */
+    uint64_t    ioNS;   /* the thread's I/O count at the start */
+    const char* name;   /* static string; may be changed before the end */
+    int         cat;    /* spanCat_t */
+} span_t;
+
+typedef struct spanTrace spanTrace_t;
+
+typedef struct spanTraceStats {
+    uint64_t spans;     /* spans recorded */
+    uint64_t lost;      /* of them, since overwritten by newer ones */
+    uint64_t dumps;
+    size_t   threads;   /* thread rings created */
+} spanTraceStats_t;
+
+/* spanTrace_t* spantrace_create(const char* dumpPath)
+ *
+ * Purpose: Start recording spans, to be dumped to dumpPath (created or
+ *          truncated now, so a bad path fails here)
+ *
+ * Return: New trace on success, NULL on error
+ */
+extern spanTrace_t* spantrace_create(const char* dumpPath);
+
+/* Stop any dump thread; the trace is not dumped again */
+extern void spantrace_destroy(spanTrace_t* trace);
+
+/* int spantrace_dump(spanTrace_t* trace)
+ *
+ * Purpose: Rewrite the dump file with every thread's spans. Threads may
+ *          keep recording meanwhile.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int spantrace_dump(spanTrace_t* trace);
+
+/* int spantrace_startDumper(spanTrace_t* trace, int signo)
+ *
+ * Purpose: Start a thread that dumps trace each time the process gets
+ *          signo. signo must be blocked in every thread of the process,
+ *          so it is only ever taken by that thread's sigwait.
+ *
+ * Return: 0 on success, negative errno on error
+ */
+extern int spantrace_startDumper(spanTrace_t* trace, int signo);
+
+/* Start span of category cat named name (a static string). A NULL trace
+ * records nothing. Neither this nor the calls below change errno. */
+extern void spantrace_begin(spanTrace_t* trace, span_t* span, spanCat_t cat,
+                            const char* name);
+
+/* Stamp the end of span and add it to the calling thread's ring, with
+ * result (a return value, or bytes) among its args */
+extern void spantrace_end(spanTrace_t* trace, span_t* span, int64_t result);
+
+/* Count file I/O done by the calling thread: spantrace_ioEnd with what
+ * spantrace_ioBegin returned. Both do nothing with a NULL trace. */
+extern uint64_t spantrace_ioBegin(spanTrace_t* trace);
+extern void spantrace_ioEnd(spanTrace_t* trace, uint64_t begun);
+
+extern void spantrace_stats(spanTrace_t* trace, spanTraceStats_t* stats);
+
+#endif
@@ -0,0 +1,211 @@
+/* work-pool.c
+ * Fixed set of worker threads running queued background jobs
+ *
+ * A FIFO list of jobs under one mutex, with one condition variable for
+ * workers waiting for jobs and one for callers waiting for the queue to
+ * drain. Jobs are few and long (a directory each), so the lock is not
+ * contended.
+ *
+ */
+
+#include "work-pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+typedef struct workJob {
+    workFunc_t      func;
+    void*           arg;
+    struct workJob* next;
+} workJob_t;
+
+struct workPool {
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;      /* a job was queued, or the pool is stopping */
+    pthread_cond_t  idle;       /* a job finished */
+    workJob_t*      head;
+    workJob_t*      tail;
+    size_t          pending;
+    int             stopping;
+    pthread_t*      threads;
+    size_t          numThreads;
+
+    uint64_t        queued;
+    uint64_t        done;
+};
+
+static void* worker(void* arg) {
+
+    workPool_t* pool = arg;
+    workJob_t* job;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+
+        while(!pool->head && !pool->stopping) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        job = pool->head;
+        if(!job) {
+            break;
+        }
+        pool->head = job->next;
+        if(!pool->head) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        job->func(pool, job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done++;
+        pool->pending--;
+        pthread_cond_broadcast(&pool->idle);
+
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+
+}
+
+extern workPool_t* workpool_create(size_t threads) {
+
+    workPool_t* pool = NULL;
+
+    if(threads == 0) {
+        threads = 1;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if(!pool) {
+        fprintf(stderr, "ERROR workpool_create: calloc failed\n");
+        return NULL;
+    }
+    pool->threads = calloc(threads, sizeof(*pool->threads));
+    if(!pool->threads) {
+        fprintf(stderr, "ERROR workpool_create: calloc(threads) failed\n");
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for(pool->numThreads = 0; pool->numThreads < threads; pool->numThreads++) {
+        if(pthread_create(&pool->threads[pool->numThreads], NULL,
+                          worker, pool) != 0) {
+            fprintf(stderr, "ERROR workpool_create: pthread_create failed\n");
+            workpool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+
+}
+
+extern void workpool_destroy(workPool_t* pool) {
+
+    size_t i;
+
+    if(!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(i = 0; i < pool->numThreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+
+}
+
+extern int workpool_submit(workPool_t* pool, workFunc_t func, void* arg) {
+
+    workJob_t* job = NULL;
+
+    if(!pool || !func) {
+        return -EINVAL;
+    }
+
+    job = malloc(sizeof(*job));
+    if(!job) {
+        fprintf(stderr, "ERROR workpool_submit: malloc failed\n");
+        return -ENOMEM;
+    }
+    job->func = func;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->tail) {
+        pool->tail->next = job;
+    }
+    else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pool->pending++;
+    pool->queued++;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    return RETURN_SUCCESS;
+
+}
+
+extern void workpool_wait(workPool_t* pool) {
+    workpool_waitPending(pool, 0);
+}
+
+extern void workpool_waitPending(workPool_t* pool, size_t max) {
+
+    if(!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->pending > max) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+}
+
+extern int workpool_stopping(workPool_t* pool) {
+    return __atomic_load_n(&pool->stopping, __ATOMIC_RELAXED);
+}
+
+extern void workpool_stats(workPool_t* pool, workPoolStats_t* stats) {
+
+    if(!pool) {
+        stats->queued = stats->done = 0;
+        stats->pending = stats->threads = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    stats->queued = pool->queued;
+    stats->done = pool->done;
+    stats->pending = pool->pending;
+    stats->threads = pool->numThreads;
+    pthread_mutex_unlock(&pool->lock);
+
+}
@@ -0,0 +1,61 @@
+/* work-pool.h
+ * Fixed set of worker threads running queued background jobs
+ *
+ * For work started by the filesystem itself rather than by a request,
+ * such as warming caches after mount. Jobs run in the order queued, on
+ * whichever worker is free. Destroying the pool still runs every queued
+ * job, but with workpool_stopping set, so a job can skip its work and
+ * just free its argument; long jobs should also check it between steps
+ * so they don't hold up unmount.
+ *
+ */
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct workPool workPool_t;
+
+typedef void (*workFunc_t)(workPool_t* pool, void* arg);
+
+typedef struct workPoolStats {
+    uint64_t queued;
+    uint64_t done;
+    size_t   pending;   /* queued or running now */
+    size_t   threads;
+} workPoolStats_t;
+
+/* workPool_t* workpool_create(size_t threads)
+ *
+ * Purpose: Start a pool of threads workers (at least one)
+ *
+ * Return: New pool on success, NULL on error
+ */
+extern workPool_t* workpool_create(size_t threads);
+
+/* Stop the pool, run out its queue and free it */
+extern void workpool_destroy(workPool_t* pool);
+
+/* int workpool_submit(workPool_t* pool, workFunc_t func, void* arg)
+ *
+ * Purpose: Queue func(pool, arg) to run on a worker
+ *
+ * Return: 0 on success, negative errno on error (func won't be called)
+ */
+extern int workpool_submit(workPool_t* pool, workFunc_t func, void* arg);
+
+/* Wait until every job queued so far has finished */
+extern void workpool_wait(workPool_t* pool);
+
+/* Wait until at most max jobs are queued or running, to bound the queue
+ * of a producer that can outrun the workers */
+extern void workpool_waitPending(workPool_t* pool, size_t max);
+
+/* Nonzero once the pool is being destroyed */
+extern int workpool_stopping(workPool_t* pool);
+
+extern void workpool_stats(workPool_t* pool, workPoolStats_t* stats);
+
+#endif
@@ -0,0 +1,497 @@
+/* xattr-cache.c
+ * Short-lived cache of backing file xattrs
+ *
+ * Chained hash table on path, plus an LRU list for eviction. One mutex
+ * guards both; every operation is a handful of pointer moves.
+ *
+ */
+
+#include "xattr-cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define RETURN_FAILURE -1
+#define RETURN_SUCCESS 0
+
+typedef struct xattrValue {
+    char*              name;
+    char*              value;
+    ssize_t            len;     /* value length, or -errno */
+    struct xattrValue* next;
+} xattrValue_t;
+
+typedef struct xattrEntry {
+    char*              path;
+    uint64_t           hash;
+    dev_t              dev;
+    ino_t              ino;
+    nlink_t            nlink;
+    uint64_t           expires;
+    char*              list;
+    ssize_t            listLen; /* -1 when the list isn't cached */
+    xattrValue_t*      values;
+    struct xattrEntry* hnext;
+    struct xattrEntry* lprev;
+    struct xattrEntry* lnext;
+} xattrEntry_t;
+
+struct xattrCache {
+    pthread_mutex_t lock;
+    xattrEntry_t**  buckets;
+    size_t          numBuckets;
+    xattrEntry_t*   lruHead;    /* most recently used */
+    xattrEntry_t*   lruTail;
+    size_t          entries;
+    size_t          maxEntries;
+    unsigned int    ttlMS;
+
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        invalidations;
+    uint64_t        evictions;
+};
+
+static uint64_t nowMS(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+}
+
+static uint64_t hashPath(const char* path) {
+
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while(*path) {
+        h ^= (unsigned char) *path++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+
+}
+
+static void lruUnlink(xattrCache_t* cache, xattrEntry_t* entry) {
+
+    if(entry->lprev) {
+        entry->lprev->lnext = entry->lnext;
+    }
+    else {
+        cache->lruHead = entry->lnext;
+    }
+    if(entry->lnext) {
+        entry->lnext->lprev = entry->lprev;
+    }
+    else {
+        cache->lruTail = entry->lprev;
+    }
+    entry->lprev = NULL;
+    entry->lnext = NULL;
+
+}
+
+static void lruPushHead(xattrCache_t* cache, xattrEntry_t* entry) {
+
+    entry->lprev = NULL;
+    entry->lnext = cache->lruHead;
+    if(cache->lruHead) {
+        cache->lruHead->lprev = entry;
+    }
+    cache->lruHead = entry;
+    if(!cache->lruTail) {
+        cache->lruTail = entry;
+    }
+
+}
+
+static void freeEntry(xattrEntry_t* entry) {
+
+    xattrValue_t* val = NULL;
+
+    while(entry->values) {
+        val = entry->values;
+        entry->values = val->next;
+        free(val->name);
+        free(val->value);
+        free(val);
+    }
+    free(entry->list);
+    free(entry->path);
+    free(entry);
+
+}
+
+static void removeEntry(xattrCache_t* cache, xattrEntry_t* entry) {
+
+    xattrEntry_t** pp = &cache->buckets[entry->hash & (cache->numBuckets - 1)];
+
+    while(*pp != entry) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = entry->hnext;
+
+    lruUnlink(cache, entry);
+    cache->entries--;
+    freeEntry(entry);
+
+}
+
+/* Find the live entry for path, dropping it if it has expired */
+static xattrEntry_t* findEntry(xattrCache_t* cache, const char* path) {
+
+    uint64_t h = hashPath(path);
+    xattrEntry_t* entry = cache->buckets[h & (cache->numBuckets - 1)];
+
+    while(entry && (entry->hash != h || strcmp(entry->path, path) != 0)) {
+        entry = entry->hnext;
+    }
+
+    if(entry && entry->expires <= nowMS()) {
+        removeEntry(cache, entry);
+        return NULL;
+    }
+
+    return entry;
+
+}
+
+/* Find or create the entry for path as filled from the file st describes */
+static xattrEntry_t* fillEntry(xattrCache_t* cache, const char* path,
+                               const struct stat* st) {
+
+    xattrEntry_t* entry = NULL;
+    xattrEntry_t** bucket = NULL;
+
+    entry = findEntry(cache, path);
+    if(entry && entry->dev == st->st_dev && entry->ino == st->st_ino) {
+        return entry;
+    }
+    if(entry) {
+        /* path now names another file */
+        removeEntry(cache, entry);
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if(!entry) {
+        return NULL;
+    }
+    entry->path = strdup(path);
+    if(!entry->path) {
+        free(entry);
+        return NULL;
+    }
+    entry->hash = hashPath(path);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->nlink = st->st_nlink;
+    entry->expires = nowMS() + cache->ttlMS;
+    entry->listLen = -1;
+
+    bucket = &cache->buckets[entry->hash & (cache->numBuckets - 1)];
+    entry->hnext = *bucket;
+    *bucket = entry;
+    lruPushHead(cache, entry);
+    cache->entries++;
+
+    while(cache->entries > cache->maxEntries) {
+        removeEntry(cache, cache->lruTail);
+        cache->evictions++;
+    }
+
+    return entry;
+
+}
+
+extern xattrCache_t* xattrcache_create(size_t maxEntries, unsigned int ttlMS) {
+
+    size_t size = 16;
+    xattrCache_t* cache = NULL;
+
+    if(maxEntries == 0) {
+        fprintf(stderr, "ERROR xattrcache_create: maxEntries must not be 0\n");
+        return NULL;
+    }
+    while(size < maxEntries) {
+        size *= 2;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    if(!cache) {
+        fprintf(stderr, "ERROR xattrcache_create: calloc failed\n");
+        return NULL;
+    }
+
+    cache->buckets = calloc(size, sizeof(*cache->buckets));
+    if(!cache->buckets) {
+        fprintf(stderr, "ERROR xattrcache_create: calloc(buckets) failed\n");
+        free(cache);
+        return NULL;
+    }
+    cache->numBuckets = size;
+    cache->maxEntries = maxEntries;
+    cache->ttlMS = ttlMS;
+
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+
+}
+
+extern void xattrcache_destroy(xattrCache_t* cache) {
+
+    if(!cache) {
+        return;
+    }
+
+    while(cache->lruHead) {
+        removeEntry(cache, cache->lruHead);
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+
+}
+
+/* Copy a cached blob out the way getxattr/listxattr would */
+static ssize_t copyOut(const char* src, ssize_t len, char* dst, size_t size) {
+
+    if(len < 0 || size == 0) {
+        return len;
+    }
+    if((size_t) len > size) {
+        return -ERANGE;
+    }
+    memcpy(dst, src, len);
+
+    return len;
+
+}
+
+extern int xattrcache_get(xattrCache_t* cache, const char* path, const char* name,
+                          char* value, size_t size, ssize_t* result) {
+
+    int hit = 0;
+    xattrEntry_t* entry = NULL;
+    xattrValue_t* val = NULL;
+
+    if(!cache) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = findEntry(cache, path);
+    if(entry) {
+        for(val = entry->values; val; val = val->next) {
+            if(strcmp(val->name, name) == 0) {
+                *result = copyOut(val->value, val->len, value, size);
+                lruUnlink(cache, entry);
+                lruPushHead(cache, entry);
+                hit = 1;
+                break;
+            }
+        }
+    }
+    if(hit) {
+        cache->hits++;
+    }
+    else {
+        cache->misses++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return hit;
+
+}
+
+extern int xattrcache_list(xattrCache_t* cache, const char* path,
+                           char* list, size_t size, ssize_t* result) {
+
+    int hit = 0;
+    xattrEntry_t* entry = NULL;
+
+    if(!cache) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = findEntry(cache, path);
+    if(entry && entry->listLen >= 0) {
+        *result = copyOut(entry->list, entry->listLen, list, size);
+        lruUnlink(cache, entry);
+        lruPushHead(cache, entry);
+        hit = 1;
+        cache->hits++;
+    }
+    else {
+        cache->misses++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return hit;
+
+}
+
+extern void xattrcache_putValue(xattrCache_t* cache, const char* path,
+                                const struct stat* st, const char* name,
+                                const char* value, ssize_t len) {
+
+    xattrEntry_t* entry = NULL;
+    xattrValue_t* val = NULL;
+
+    if(!cache || len > XATTR_CACHE_MAXVAL || (len < 0 && len != -ENODATA)) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = fillEntry(cache, path, st);
+    if(!entry) {
+        goto UNLOCK;
+    }
+    for(val = entry->values; val; val = val->next) {
+        if(strcmp(val->name, name) == 0) {
+            goto UNLOCK;
+        }
+    }
+
+    val = calloc(1, sizeof(*val));
+    if(!val) {
+        goto UNLOCK;
+    }
+    val->name = strdup(name);
+    val->value = malloc(len > 0 ? len : 1);
+    if(!val->name || !val->value) {
+        free(val->name);
+        free(val->value);
+        free(val);
+        goto UNLOCK;
+    }
+    if(len > 0) {
+        memcpy(val->value, value, len);
+    }
+    val->len = len;
+    val->next = entry->values;
+    entry->values = val;
+
+ UNLOCK:
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+extern void xattrcache_putList(xattrCache_t* cache, const char* path,
+                               const struct stat* st,
+                               const char* list, ssize_t len) {
+
+    char* copy = NULL;
+    xattrEntry_t* entry = NULL;
+
+    if(!cache || len < 0) {
+        return;
+    }
+
+    copy = malloc(len > 0 ? len : 1);
+    if(!copy) {
+        return;
+    }
+    memcpy(copy, list, len);
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = fillEntry(cache, path, st);
+    if(entry) {
+        free(entry->list);
+        entry->list = copy;
+        entry->listLen = len;
+        copy = NULL;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    free(copy);
+
+}
+
+extern void xattrcache_invalidate(xattrCache_t* cache, const char* path) {
+
+    int known = 0;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    nlink_t nlink = 1;
+    xattrEntry_t* entry = NULL;
+    xattrEntry_t* next = NULL;
+    struct stat st;
+
+    if(!cache) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = findEntry(cache, path);
+    if(entry) {
+        known = 1;
+        dev = entry->dev;
+        ino = entry->ino;
+        nlink = entry->nlink;
+        removeEntry(cache, entry);
+        cache->invalidations++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Other paths to the same inode may be cached too */
+    if(!known) {
+        if(lstat(path, &st) < 0) {
+            return;
+        }
+        dev = st.st_dev;
+        ino = st.st_ino;
+        nlink = st.st_nlink;
+    }
+    if(nlink < 2) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    for(entry = cache->lruHead; entry; entry = next) {
+        next = entry->lnext;
+        if(entry->dev == dev && entry->ino == ino) {
+            removeEntry(cache, entry);
+            cache->invalidations++;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+extern void xattrcache_stats(xattrCache_t* cache, xattrCacheStats_t* stats) {
+
+    if(!cache || !stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->invalidations = cache->invalidations;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->entries;
+    pthread_mutex_unlock(&cache->lock);
+
+}
@@ -0,0 +1,82 @@
+/* xattr-cache.h
+ * Short-lived cache of backing file xattrs, so xattr-heavy tools (cp -a,
+ * rsync -X, SELinux labeling) don't cost a backing syscall per query
+ *
+ * Entries are looked up by backing path and remember the (dev, ino) they
+ * were filled from, so a change through one hard link invalidates every
+ * path to that inode. Values and lists (including "no such attribute"
+ * answers) expire after a TTL, which bounds staleness from changes made
+ * to the backing directory outside the mount.
+ *
+ */
+
+#ifndef XATTR_CACHE_H
+#define XATTR_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Values longer than this are always read from the backing file */
+#define XATTR_CACHE_MAXVAL 256
+
+typedef struct xattrCache xattrCache_t;
+
+typedef struct xattrCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t evictions;
+    size_t   entries;
+} xattrCacheStats_t;
+
+/* xattrCache_t* xattrcache_create(size_t maxEntries, unsigned int ttlMS)
+ *
+ * Purpose: Create a cache holding xattrs for up to maxEntries files,
+ *          each valid for ttlMS milliseconds after it is read
+ *
+ * Return: New cache on success, NULL on error
+ */
+extern xattrCache_t* xattrcache_create(size_t maxEntries, unsigned int ttlMS);
+
+extern void xattrcache_destroy(xattrCache_t* cache);
+
+/* int xattrcache_get(xattrCache_t* cache, const char* path, const char* name,
+ *                    char* value, size_t size, ssize_t* result)
+ *
+ * Purpose: Answer getxattr(path, name, value, size) from the cache
+ *
+ * Return: 1 on hit with *result set as getxattr would (length or -errno),
+ *         0 on miss
+ */
+extern int xattrcache_get(xattrCache_t* cache, const char* path, const char* name,
+                          char* value, size_t size, ssize_t* result);
+
+/* int xattrcache_list(xattrCache_t* cache, const char* path,
+ *                     char* list, size_t size, ssize_t* result)
+ *
+ * Purpose: Answer listxattr(path, list, size) from the cache
+ *
+ * Return: 1 on hit with *result set as listxattr would, 0 on miss
+ */
+extern int xattrcache_list(xattrCache_t* cache, const char* path,
+                           char* list, size_t size, ssize_t* result);
+
+/* Remember the value of name (len bytes), or len = -ENODATA for none,
+ * as read from the file st describes */
+extern void xattrcache_putValue(xattrCache_t* cache, const char* path,
+                                const struct stat* st, const char* name,
+                                const char* value, ssize_t len);
+
+/* Remember the full name list of path */
+extern void xattrcache_putList(xattrCache_t* cache, const char* path,
+                               const struct stat* st,
+                               const char* list, ssize_t len);
+
+/* Forget everything about path, and about any other path to its inode */
+extern void xattrcache_invalidate(xattrCache_t* cache, const char* path);
+
+extern void xattrcache_stats(xattrCache_t* cache, xattrCacheStats_t* stats);
+
+#endif
@@ -0,0 +1,233 @@
+/*
+benchmark.cc - c++ source to a reproducible libb64 throughput benchmark
+
+This is part of the libb64 project, and has been placed in the public domain.
+For details, see http://sourceforge.net/projects/libb64
+
+Times the C block interface and the C++ wrappers over generated input of
+several sizes, once per vector kernel supported by the running CPU.
+Encoding and decoding are measured both with the default line-wrapped
+format and with unwrapped (wrap_none) output. Throughput is always
+reported per byte of plain (unencoded) data.
+*/
+
+#include <b64/encode.h>
+#include <b64/decode.h>
+
+extern "C"
+{
+#include <b64/csimd.h>
+}
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <time.h>
+
+// Sink so the compiler cannot drop the timed work
+static volatile int sink;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Deterministic pseudo-random input, identical on every run
+static void generate(std::vector<char>& data, size_t size)
+{
+	unsigned long long x = 0x9e3779b97f4a7c15ULL;
+	data.resize(size);
+	for (size_t i = 0; i < size; ++i)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		data[i] = (char)(x >> 24);
+	}
+}
+
+struct context
+{
+	const std::vector<char>* plain;
+	const std::vector<char>* code;
+	std::vector<char>* out;
+};
+
+typedef void (*workload)(context&);
+
+static void c_encode_wrap(context& c, base64::base64_encodewrap wrap)
+{
+	base64::base64_encodestate s;
+	base64::base64_init_encodestate_wrap(&s, wrap);
+	char* o = &(*c.out)[0];
+	int n = base64::base64_encode_block(&(*c.plain)[0], (int)c.plain->size(), o, &s);
+	n += base64::base64_encode_blockend(o + n, &s);
+	sink = n;
+}
+
+static void c_encode(context& c)
+{
+	c_encode_wrap(c, base64::wrap_lines);
+}
+
+static void c_encode_unwrapped(context& c)
+{
+	c_encode_wrap(c, base64::wrap_none);
+}
+
+static void c_decode(context& c)
+{
+	base64::base64_decodestate s;
+	base64::base64_init_decodestate(&s);
+	sink = base64::base64_decode_block(&(*c.code)[0], (int)c.code->size(), &(*c.out)[0], &s);
+}
+
+static void cxx_encode(context& c)
+{
+	base64::encoder E((int)c.plain->size());
+	char* o = &(*c.out)[0];
+	int n = E.encode(&(*c.plain)[0], (int)c.plain->size(), o);
+	n += E.encode_end(o + n);
+	sink = n;
+}
+
+static void cxx_decode(context& c)
+{
+	base64::decoder D((int)c.code->size());
+	sink = D.decode(&(*c.code)[0], (int)c.code->size(), &(*c.out)[0]);
+}
+
+static void cxx_encode_unwrapped(context& c)
+{
+	base64::encoder E((int)c.plain->size(), base64::wrap_none);
+	char* o = &(*c.out)[0];
+	int n = E.encode(&(*c.plain)[0], (int)c.plain->size(), o);
+	n += E.encode_end(o + n);
+	sink = n;
+}
+
+static void cxx_stream_encode(context& c)
+{
+	std::istringstream in(std::string(&(*c.plain)[0], c.plain->size()));
+	std::ostringstream out;
+	base64::encoder E(65536);
+	E.encode(in, out);
+	sink = (int)out.tellp();
+}
+
+static void cxx_stream_decode(context& c)
+{
+	std::istringstream in(std::string(&(*c.code)[0], c.code->size()));
+	std::ostringstream out;
+	base64::decoder D(65536);
+	D.decode(in, out);
+	sink = (int)out.tellp();
+}
+
+// Repeat a workload until min_time has passed; return the best time per call
+static double measure(workload w, context& c, double min_time)
+{
+	double best = 1e30;
+	double start = now();
+	int calls = 0;
+	do
+	{
+		double t0 = now();
+		w(c);
+		double t = now() - t0;
+		if (t < best) best = t;
+		++calls;
+	}
+	while (now() - start < min_time || calls < 3);
+	return best;
+}
+
+static void report(const char* kernel, const char* name, size_t size, double seconds)
+{
+	std::printf("%-5s %-22s %10lu %10.3f %10.3f\n", kernel, name, (unsigned long)size,
+	            size / seconds * 1e-9, seconds * 1e9 / size);
+}
+
+static void usage()
+{
+	std::cerr <<
+		"benchmark: Measures libb64 encode/decode throughput\n"
+		"Usage: benchmark [-t seconds] [size ...]\n"
+		"   Where [-t] is the minimum time spent on each case (default 0.25), and\n"
+		"         [size] are the plain input sizes in bytes (default 64 4096 262144 16777216).\n";
+}
+
+int main(int argc, char** argv)
+{
+	double min_time = 0.25;
+	std::vector<size_t> sizes;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			min_time = std::atof(argv[++i]);
+		else if (argv[i][0] >= '0' && argv[i][0] <= '9')
+			sizes.push_back(std::strtoul(argv[i], 0, 10));
+		else
+		{
+			usage();
+			return -1;
+		}
+	}
+	if (sizes.empty())
+	{
+		sizes.push_back(64);
+		sizes.push_back(4096);
+		sizes.push_back(262144);
+		sizes.push_back(16777216);
+	}
+
+	base64_simdlevel best = base64_simd_detect();
+	std::printf("# libb64 benchmark, best kernel: %s, min time per case: %.2fs\n",
+	            base64_simd_name(best), min_time);
+	std::printf("%-5s %-22s %10s %10s %10s\n", "simd", "case", "bytes", "GB/s", "ns/byte");
+
+	for (int level = simd_none; level <= best; ++level)
+	{
+		const char* kernel = base64_simd_name(base64_set_simd((base64_simdlevel)level));
+
+		for (size_t s = 0; s < sizes.size(); ++s)
+		{
+			std::vector<char> plain, wrapped, unwrapped, out;
+			generate(plain, sizes[s]);
+			out.resize(base64::base64_encode_length((int)sizes[s], base64::wrap_lines));
+
+			// Produce the encoded input for the decode cases
+			context c = { &plain, 0, &out };
+			c_encode(c);
+			wrapped.assign(out.begin(), out.begin() + sink);
+			c_encode_unwrapped(c);
+			unwrapped.assign(out.begin(), out.begin() + sink);
+
+			report(kernel, "c encode", sizes[s], measure(c_encode, c, min_time));
+			report(kernel, "c++ encode", sizes[s], measure(cxx_encode, c, min_time));
+			report(kernel, "c++ stream encode", sizes[s], measure(cxx_stream_encode, c, min_time));
+			report(kernel, "c encode unwrapped", sizes[s], measure(c_encode_unwrapped, c, min_time));
+			report(kernel, "c++ encode unwrapped", sizes[s], measure(cxx_encode_unwrapped, c, min_time));
+
+			c.code = &wrapped;
+			report(kernel, "c decode wrapped", sizes[s], measure(c_decode, c, min_time));
+			report(kernel, "c++ decode wrapped", sizes[s], measure(cxx_decode, c, min_time));
+			report(kernel, "c++ stream decode", sizes[s], measure(cxx_stream_decode, c, min_time));
+
+			c.code = &unwrapped;
+			report(kernel, "c decode unwrapped", sizes[s], measure(c_decode, c, min_time));
+			report(kernel, "c++ decode unwrapped", sizes[s], measure(cxx_decode, c, min_time));
+		}
+	}
+
+	return 0;
+}
+
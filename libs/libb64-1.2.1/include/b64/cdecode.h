@@ -23,6 +23,15 @@ void base64_init_decodestate(base64_decodestate* state_in);
 
 int base64_decode_value(char value_in);
 
+/* exact number of bytes base64_decode_block produces for code_in, provided it
+   holds no line breaks other than a single trailing one. Only the last few
+   characters are inspected. */
+int base64_decode_length(const char* code_in, const int length_in);
+
+/* upper bound on the bytes produced from length_in characters of any input */
+int base64_decode_maxlength(const int length_in);
+
+/* never writes more than the returned number of bytes to plaintext_out */
 int base64_decode_block(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in);
 
 #endif /* BASE64_CDECODE_H */
@@ -13,15 +13,29 @@ typedef enum
 	step_A, step_B, step_C
 } base64_encodestep;
 
+typedef enum
+{
+	wrap_lines, wrap_none
+} base64_encodewrap;
+
 typedef struct
 {
 	base64_encodestep step;
 	char result;
 	int stepcount;
+	base64_encodewrap wrap;
 } base64_encodestate;
 
+/* line-wrapped output (a newline every 72 characters and at the end) */
 void base64_init_encodestate(base64_encodestate* state_in);
 
+/* wrap_none produces a single unbroken line with no trailing newline */
+void base64_init_encodestate_wrap(base64_encodestate* state_in, base64_encodewrap wrap_in);
+
+/* exact number of characters base64_encode_block plus base64_encode_blockend
+   produce for length_in bytes of input */
+int base64_encode_length(int length_in, base64_encodewrap wrap_in);
+
 char base64_encode_value(char value_in);
 
 int base64_encode_block(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in);
@@ -0,0 +1,29 @@
+/*
+csimd.h - c header for selecting the vectorised base64 kernels
+
+This is part of the libb64 project, and has been placed in the public domain.
+For details, see http://sourceforge.net/projects/libb64
+*/
+
+#ifndef BASE64_CSIMD_H
+#define BASE64_CSIMD_H
+
+typedef enum
+{
+	simd_none, simd_sse4, simd_avx2
+} base64_simdlevel;
+
+/* best kernel supported by the running CPU */
+base64_simdlevel base64_simd_detect(void);
+
+/* kernel currently used by base64_encode_block and base64_decode_block */
+base64_simdlevel base64_get_simd(void);
+
+/* select a kernel; levels the CPU does not support are lowered to the
+   best supported one. Returns the level actually selected. */
+base64_simdlevel base64_set_simd(base64_simdlevel level_in);
+
+const char* base64_simd_name(base64_simdlevel level_in);
+
+#endif /* BASE64_CSIMD_H */
+
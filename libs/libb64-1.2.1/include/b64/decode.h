@@ -24,7 +24,15 @@ namespace base64
 
 		decoder(int buffersize_in = BUFFERSIZE)
 		: _buffersize(buffersize_in)
-		{}
+		{
+			base64_init_decodestate(&_state);
+		}
+
+		// exact size of the output of decode(code_in, length_in, ...) for unwrapped input
+		static int decoded_length(const char* code_in, const int length_in)
+		{
+			return base64_decode_length(code_in, length_in);
+		}
 
 		int decode(char value_in)
 		{
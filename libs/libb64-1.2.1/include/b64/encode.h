@@ -21,10 +21,20 @@ namespace base64
 	{
 		base64_encodestate _state;
 		int _buffersize;
+		base64_encodewrap _wrap;
 
-		encoder(int buffersize_in = BUFFERSIZE)
+		encoder(int buffersize_in = BUFFERSIZE, base64_encodewrap wrap_in = wrap_lines)
 		: _buffersize(buffersize_in)
-		{}
+		, _wrap(wrap_in)
+		{
+			base64_init_encodestate_wrap(&_state, _wrap);
+		}
+
+		// exact size of the output of encode(...) + encode_end(...) for length_in bytes
+		int encoded_length(int length_in) const
+		{
+			return base64_encode_length(length_in, _wrap);
+		}
 
 		int encode(char value_in)
 		{
@@ -43,7 +53,7 @@ namespace base64
 
 		void encode(std::istream& istream_in, std::ostream& ostream_in)
 		{
-			base64_init_encodestate(&_state);
+			base64_init_encodestate_wrap(&_state, _wrap);
 			//
 			const int N = _buffersize;
 			char* plaintext = new char[N];
@@ -64,7 +74,7 @@ namespace base64
 			codelength = encode_end(code);
 			ostream_in.write(code, codelength);
 			//
-			base64_init_encodestate(&_state);
+			base64_init_encodestate_wrap(&_state, _wrap);
 
 			delete [] code;
 			delete [] plaintext;
@@ -7,6 +7,8 @@ For details, see http://sourceforge.net/projects/libb64
 
 #include <b64/cdecode.h>
 
+#include "ckernels.h"
+
 int base64_decode_value(char value_in)
 {
 	static const char decoding[] = {62,-1,-1,-1,63,52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-2,-1,-1,-1,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,-1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51};
@@ -22,64 +24,96 @@ void base64_init_decodestate(base64_decodestate* state_in)
 	state_in->plainchar = 0;
 }
 
+int base64_decode_length(const char* code_in, const int length_in)
+{
+	int length = length_in;
+	int quads;
+	/* ignore the trailing newline and padding an encoder leaves behind */
+	if (length > 0 && code_in[length - 1] == '\n') --length;
+	if (length > 0 && code_in[length - 1] == '=') --length;
+	if (length > 0 && code_in[length - 1] == '=') --length;
+	quads = length / 4;
+	switch (length % 4)
+	{
+	case 2: return quads * 3 + 1;
+	case 3: return quads * 3 + 2;
+	}
+	return quads * 3;
+}
+
+int base64_decode_maxlength(const int length_in)
+{
+	return ((length_in + 3) / 4) * 3;
+}
+
 int base64_decode_block(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in)
 {
 	const char* codechar = code_in;
 	char* plainchar = plaintext_out;
 	char fragment;
-	
-	*plainchar = state_in->plainchar;
+	/* bits of the byte in progress; kept out of plaintext_out so that no
+	   more than the returned number of bytes is ever written */
+	char pending = state_in->plainchar;
+	const int bulk = base64_decode_quads_active();
+	int consumed;
 	
 	switch (state_in->step)
 	{
 		while (1)
 		{
 	case step_a:
+			/* runs of clean alphabet characters go through the bulk kernel */
+			if (bulk)
+			{
+				consumed = base64_decode_quads(codechar, code_in+length_in - codechar, plainchar);
+				codechar += consumed;
+				plainchar += (consumed / 4) * 3;
+			}
 			do {
 				if (codechar == code_in+length_in)
 				{
 					state_in->step = step_a;
-					state_in->plainchar = *plainchar;
+					state_in->plainchar = pending;
 					return plainchar - plaintext_out;
 				}
 				fragment = (char)base64_decode_value(*codechar++);
 			} while (fragment < 0);
-			*plainchar    = (fragment & 0x03f) << 2;
+			pending       = (fragment & 0x03f) << 2;
 	case step_b:
 			do {
 				if (codechar == code_in+length_in)
 				{
 					state_in->step = step_b;
-					state_in->plainchar = *plainchar;
+					state_in->plainchar = pending;
 					return plainchar - plaintext_out;
 				}
 				fragment = (char)base64_decode_value(*codechar++);
 			} while (fragment < 0);
-			*plainchar++ |= (fragment & 0x030) >> 4;
-			*plainchar    = (fragment & 0x00f) << 4;
+			*plainchar++  = pending | ((fragment & 0x030) >> 4);
+			pending       = (fragment & 0x00f) << 4;
 	case step_c:
 			do {
 				if (codechar == code_in+length_in)
 				{
 					state_in->step = step_c;
-					state_in->plainchar = *plainchar;
+					state_in->plainchar = pending;
 					return plainchar - plaintext_out;
 				}
 				fragment = (char)base64_decode_value(*codechar++);
 			} while (fragment < 0);
-			*plainchar++ |= (fragment & 0x03c) >> 2;
-			*plainchar    = (fragment & 0x003) << 6;
+			*plainchar++  = pending | ((fragment & 0x03c) >> 2);
+			pending       = (fragment & 0x003) << 6;
 	case step_d:
 			do {
 				if (codechar == code_in+length_in)
 				{
 					state_in->step = step_d;
-					state_in->plainchar = *plainchar;
+					state_in->plainchar = pending;
 					return plainchar - plaintext_out;
 				}
 				fragment = (char)base64_decode_value(*codechar++);
 			} while (fragment < 0);
-			*plainchar++   |= (fragment & 0x03f);
+			*plainchar++  = pending | (fragment & 0x03f);
 		}
 	}
 	/* control should not reach here */
@@ -7,13 +7,33 @@ For details, see http://sourceforge.net/projects/libb64
 
 #include <b64/cencode.h>
 
+#include "ckernels.h"
+
 const int CHARS_PER_LINE = 72;
 
 void base64_init_encodestate(base64_encodestate* state_in)
+{
+	base64_init_encodestate_wrap(state_in, wrap_lines);
+}
+
+void base64_init_encodestate_wrap(base64_encodestate* state_in, base64_encodewrap wrap_in)
 {
 	state_in->step = step_A;
 	state_in->result = 0;
 	state_in->stepcount = 0;
+	state_in->wrap = wrap_in;
+}
+
+int base64_encode_length(int length_in, base64_encodewrap wrap_in)
+{
+	/* every started group becomes 4 characters (padded) */
+	int length = 4 * ((length_in + 2) / 3);
+	if (wrap_in == wrap_lines)
+	{
+		/* a break after each full line, plus the one base64_encode_blockend adds */
+		length += (length_in / 3) / (CHARS_PER_LINE/4) + 1;
+	}
+	return length;
 }
 
 char base64_encode_value(char value_in)
@@ -30,6 +50,7 @@ int base64_encode_block(const char* plaintext_in, int length_in, char* code_out,
 	char* codechar = code_out;
 	char result;
 	char fragment;
+	int groups;
 	
 	result = state_in->result;
 	
@@ -38,6 +59,26 @@ int base64_encode_block(const char* plaintext_in, int length_in, char* code_out,
 		while (1)
 		{
 	case step_A:
+			/* whole groups up to the next line break go through the bulk kernel */
+			groups = (plaintextend - plainchar) / 3;
+			if (state_in->wrap == wrap_lines && groups > CHARS_PER_LINE/4 - state_in->stepcount)
+				groups = CHARS_PER_LINE/4 - state_in->stepcount;
+			if (groups > 0)
+			{
+				base64_encode_groups(plainchar, groups, plaintextend - plainchar, codechar);
+				plainchar += 3*groups;
+				codechar += 4*groups;
+				if (state_in->wrap == wrap_lines)
+				{
+					state_in->stepcount += groups;
+					if (state_in->stepcount == CHARS_PER_LINE/4)
+					{
+						*codechar++ = '\n';
+						state_in->stepcount = 0;
+					}
+				}
+				continue;
+			}
 			if (plainchar == plaintextend)
 			{
 				state_in->result = result;
@@ -72,8 +113,7 @@ int base64_encode_block(const char* plaintext_in, int length_in, char* code_out,
 			result  = (fragment & 0x03f) >> 0;
 			*codechar++ = base64_encode_value(result);
 			
-			++(state_in->stepcount);
-			if (state_in->stepcount == CHARS_PER_LINE/4)
+			if (state_in->wrap == wrap_lines && ++(state_in->stepcount) == CHARS_PER_LINE/4)
 			{
 				*codechar++ = '\n';
 				state_in->stepcount = 0;
@@ -102,7 +142,8 @@ int base64_encode_blockend(char* code_out, base64_encodestate* state_in)
 	case step_A:
 		break;
 	}
-	*codechar++ = '\n';
+	if (state_in->wrap == wrap_lines)
+		*codechar++ = '\n';
 	
 	return codechar - code_out;
 }
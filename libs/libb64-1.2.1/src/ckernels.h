@@ -0,0 +1,29 @@
+/*
+ckernels.h - internal interface between the base64 state machines and
+the bulk (vectorised) kernels in csimd.c
+
+This is part of the libb64 project, and has been placed in the public domain.
+For details, see http://sourceforge.net/projects/libb64
+*/
+
+#ifndef BASE64_CKERNELS_H
+#define BASE64_CKERNELS_H
+
+/* Encode groups_in whole 3-byte groups from plaintext_in into 4*groups_in
+   characters at code_out, without line breaks. avail_in is the number of
+   bytes readable from plaintext_in (at least 3*groups_in); kernels may read
+   ahead up to that limit but never write past the encoded groups. */
+void base64_encode_groups(const char* plaintext_in, int groups_in, int avail_in, char* code_out);
+
+/* Decode whole quads of valid base64 alphabet characters from the front of
+   code_in, stopping at the first padding, whitespace or junk character (or
+   when less than one vector block is left). Returns the number of characters
+   consumed (a multiple of 4); exactly 3/4 of that many bytes are written to
+   plaintext_out. Returns 0 when no kernel is active. */
+int base64_decode_quads(const char* code_in, int length_in, char* plaintext_out);
+
+/* non-zero when base64_decode_quads has a vector kernel behind it */
+int base64_decode_quads_active(void);
+
+#endif /* BASE64_CKERNELS_H */
+
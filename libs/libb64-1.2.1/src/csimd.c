@@ -0,0 +1,347 @@
+/*
+csimd.c - c source for the vectorised base64 kernels and their runtime
+selection
+
+This is part of the libb64 project, and has been placed in the public domain.
+For details, see http://sourceforge.net/projects/libb64
+
+The kernels only ever handle whole 3-byte groups (encoding) or whole blocks
+of clean alphabet characters (decoding). Everything stateful - partial
+groups, line breaks, padding, skipping of junk characters - stays in the
+co-routines in cencode.c and cdecode.c, so chunk boundaries between calls
+behave exactly as before.
+
+The encode reshuffle and the translation lookup follow Wojciech Mula's
+SSSE3 base64 work (http://0x80.pl/articles/index.html#base64-algorithm-new).
+*/
+
+#include <b64/csimd.h>
+
+#include "ckernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(BASE64_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+static const char encoding[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+typedef int (*encode_kernel)(const char*, int, int, char*);
+typedef int (*decode_kernel)(const char*, int, char*);
+
+static encode_kernel active_encode = 0;
+static decode_kernel active_decode = 0;
+static base64_simdlevel active_level = simd_none;
+static int initialised = 0;
+
+static void encode_groups_scalar(const char* plaintext_in, int groups_in, char* code_out)
+{
+	const unsigned char* in = (const unsigned char*)plaintext_in;
+	int i;
+	for (i = 0; i < groups_in; ++i)
+	{
+		code_out[0] = encoding[in[0] >> 2];
+		code_out[1] = encoding[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+		code_out[2] = encoding[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+		code_out[3] = encoding[in[2] & 0x3f];
+		in += 3;
+		code_out += 4;
+	}
+}
+
+#ifdef BASE64_HAVE_X86_KERNELS
+
+/* ---------- SSE4 (uses SSSE3 pshufb/pmaddubsw) ---------- */
+
+__attribute__((target("sse4.1")))
+static __m128i enc_reshuffle_sse4(__m128i in)
+{
+	__m128i t0, t1, t2, t3;
+	/* spread the 12 input bytes over 4 dwords, each holding one group in
+	   the middle two bytes (b1 b0 b2 b1, big end first) */
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	/* move the four 6-bit fields of each group into their own bytes */
+	t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("sse4.1")))
+static __m128i enc_translate_sse4(__m128i in)
+{
+	/* offsets for: A-Z, a-z, 0-9 (x10), '+', '/' */
+	const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+	__m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+	indices = _mm_sub_epi8(indices, mask);
+	return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+}
+
+__attribute__((target("sse4.1")))
+static int encode_sse4(const char* plaintext_in, int groups_in, int avail_in, char* code_out)
+{
+	int done = 0;
+	/* each step loads 16 bytes and consumes 12 */
+	while (groups_in - done >= 4 && avail_in - 3*done >= 16)
+	{
+		__m128i str = _mm_loadu_si128((const __m128i*)(plaintext_in + 3*done));
+		str = enc_translate_sse4(enc_reshuffle_sse4(str));
+		_mm_storeu_si128((__m128i*)(code_out + 4*done), str);
+		done += 4;
+	}
+	return done;
+}
+
+__attribute__((target("sse4.1")))
+static __m128i dec_lookup_sse4(__m128i str, int* valid_mask)
+{
+	const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(str, _mm_set1_epi8('A' - 1)),
+	                                    _mm_cmplt_epi8(str, _mm_set1_epi8('Z' + 1)));
+	const __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(str, _mm_set1_epi8('a' - 1)),
+	                                    _mm_cmplt_epi8(str, _mm_set1_epi8('z' + 1)));
+	const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(str, _mm_set1_epi8('0' - 1)),
+	                                    _mm_cmplt_epi8(str, _mm_set1_epi8('9' + 1)));
+	const __m128i plus  = _mm_cmpeq_epi8(str, _mm_set1_epi8('+'));
+	const __m128i slash = _mm_cmpeq_epi8(str, _mm_set1_epi8('/'));
+	__m128i shift;
+
+	*valid_mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower),
+	                                             _mm_or_si128(digit, _mm_or_si128(plus, slash))));
+
+	shift = _mm_and_si128(upper, _mm_set1_epi8(-65));
+	shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(-71)));
+	shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(4)));
+	shift = _mm_or_si128(shift, _mm_and_si128(plus, _mm_set1_epi8(19)));
+	shift = _mm_or_si128(shift, _mm_and_si128(slash, _mm_set1_epi8(16)));
+	return _mm_add_epi8(str, shift);
+}
+
+__attribute__((target("sse4.1")))
+static __m128i dec_reshuffle_sse4(__m128i in)
+{
+	/* 00aaaaaa 00bbbbbb -> 0000aaaa aabbbbbb per word, then words to dwords */
+	const __m128i ab = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+	const __m128i abcd = _mm_madd_epi16(ab, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(abcd, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("sse4.1")))
+static void store12_sse4(char* out, __m128i v)
+{
+	int tail = _mm_extract_epi32(v, 2);
+	_mm_storel_epi64((__m128i*)out, v);
+	memcpy(out + 8, &tail, 4);
+}
+
+__attribute__((target("sse4.1")))
+static int decode_sse4(const char* code_in, int length_in, char* plaintext_out)
+{
+	int done = 0;
+	int valid;
+	while (length_in - done >= 16)
+	{
+		__m128i str = _mm_loadu_si128((const __m128i*)(code_in + done));
+		char* out = plaintext_out + (done / 4) * 3;
+		str = dec_reshuffle_sse4(dec_lookup_sse4(str, &valid));
+		if (valid != 0xffff)
+		{
+			/* keep the whole quads in front of the first junk character */
+			int clean = __builtin_ctz(~valid) & ~3;
+			char tmp[16];
+			_mm_storeu_si128((__m128i*)tmp, str);
+			memcpy(out, tmp, (clean / 4) * 3);
+			return done + clean;
+		}
+		store12_sse4(out, str);
+		done += 16;
+	}
+	return done;
+}
+
+/* ---------- AVX2 ---------- */
+
+__attribute__((target("avx2")))
+static int encode_avx2(const char* plaintext_in, int groups_in, int avail_in, char* code_out)
+{
+	const __m256i shuf = _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m256i lut = _mm256_setr_epi8(
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	int done = 0;
+	/* each step loads 12+16 bytes and consumes 24 */
+	while (groups_in - done >= 8 && avail_in - 3*done >= 28)
+	{
+		const char* in = plaintext_in + 3*done;
+		__m256i str, t0, t1, t2, t3, indices, mask;
+		str = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)in)),
+		                              _mm_loadu_si128((const __m128i*)(in + 12)), 1);
+		str = _mm256_shuffle_epi8(str, shuf);
+		t0 = _mm256_and_si256(str, _mm256_set1_epi32(0x0fc0fc00));
+		t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		t2 = _mm256_and_si256(str, _mm256_set1_epi32(0x003f03f0));
+		t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		str = _mm256_or_si256(t1, t3);
+		indices = _mm256_subs_epu8(str, _mm256_set1_epi8(51));
+		mask = _mm256_cmpgt_epi8(str, _mm256_set1_epi8(25));
+		indices = _mm256_sub_epi8(indices, mask);
+		str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut, indices));
+		_mm256_storeu_si256((__m256i*)(code_out + 4*done), str);
+		done += 8;
+	}
+	done += encode_sse4(plaintext_in + 3*done, groups_in - done, avail_in - 3*done, code_out + 4*done);
+	return done;
+}
+
+__attribute__((target("avx2")))
+static int decode_avx2(const char* code_in, int length_in, char* plaintext_out)
+{
+	const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	unsigned int valid;
+	int done = 0;
+	while (length_in - done >= 32)
+	{
+		__m256i str = _mm256_loadu_si256((const __m256i*)(code_in + done));
+		__m256i upper, lower, digit, plus, slash, shift;
+		char* out = plaintext_out + (done / 4) * 3;
+
+		upper = _mm256_and_si256(_mm256_cmpgt_epi8(str, _mm256_set1_epi8('A' - 1)),
+		                         _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), str));
+		lower = _mm256_and_si256(_mm256_cmpgt_epi8(str, _mm256_set1_epi8('a' - 1)),
+		                         _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), str));
+		digit = _mm256_and_si256(_mm256_cmpgt_epi8(str, _mm256_set1_epi8('0' - 1)),
+		                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), str));
+		plus  = _mm256_cmpeq_epi8(str, _mm256_set1_epi8('+'));
+		slash = _mm256_cmpeq_epi8(str, _mm256_set1_epi8('/'));
+		valid = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(upper, lower),
+		                                           _mm256_or_si256(digit, _mm256_or_si256(plus, slash))));
+
+		shift = _mm256_and_si256(upper, _mm256_set1_epi8(-65));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(lower, _mm256_set1_epi8(-71)));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(digit, _mm256_set1_epi8(4)));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(plus, _mm256_set1_epi8(19)));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(slash, _mm256_set1_epi8(16)));
+		str = _mm256_add_epi8(str, shift);
+
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		/* close the 4-byte gap between the lanes: 24 contiguous bytes */
+		str = _mm256_permutevar8x32_epi32(str, pack);
+		if (valid != 0xffffffffu)
+		{
+			/* keep the whole quads in front of the first junk character */
+			int clean = __builtin_ctz(~valid) & ~3;
+			char tmp[32];
+			_mm256_storeu_si256((__m256i*)tmp, str);
+			memcpy(out, tmp, (clean / 4) * 3);
+			return done + clean;
+		}
+		_mm_storeu_si128((__m128i*)out, _mm256_castsi256_si128(str));
+		_mm_storel_epi64((__m128i*)(out + 16), _mm256_extracti128_si256(str, 1));
+		done += 32;
+	}
+	done += decode_sse4(code_in + done, length_in - done, plaintext_out + (done / 4) * 3);
+	return done;
+}
+
+#endif /* BASE64_HAVE_X86_KERNELS */
+
+base64_simdlevel base64_simd_detect(void)
+{
+#ifdef BASE64_HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return simd_avx2;
+	if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3")) return simd_sse4;
+#endif
+	return simd_none;
+}
+
+base64_simdlevel base64_set_simd(base64_simdlevel level_in)
+{
+	base64_simdlevel best = base64_simd_detect();
+	if (level_in > best) level_in = best;
+
+	switch (level_in)
+	{
+#ifdef BASE64_HAVE_X86_KERNELS
+	case simd_avx2:
+		active_encode = encode_avx2;
+		active_decode = decode_avx2;
+		break;
+	case simd_sse4:
+		active_encode = encode_sse4;
+		active_decode = decode_sse4;
+		break;
+#endif
+	default:
+		level_in = simd_none;
+		active_encode = 0;
+		active_decode = 0;
+		break;
+	}
+	active_level = level_in;
+	initialised = 1;
+	return level_in;
+}
+
+static void base64_simd_init(void)
+{
+	/* LIBB64_SIMD=none|sse4|avx2 caps the automatically selected kernel */
+	const char* env = getenv("LIBB64_SIMD");
+	base64_simdlevel level = simd_avx2;
+	if (env)
+	{
+		if (strcmp(env, "none") == 0) level = simd_none;
+		else if (strcmp(env, "sse4") == 0) level = simd_sse4;
+	}
+	base64_set_simd(level);
+}
+
+base64_simdlevel base64_get_simd(void)
+{
+	if (!initialised) base64_simd_init();
+	return active_level;
+}
+
+const char* base64_simd_name(base64_simdlevel level_in)
+{
+	switch (level_in)
+	{
+	case simd_avx2: return "avx2";
+	case simd_sse4: return "sse4";
+	case simd_none: break;
+	}
+	return "none";
+}
+
+void base64_encode_groups(const char* plaintext_in, int groups_in, int avail_in, char* code_out)
+{
+	int done = 0;
+	if (!initialised) base64_simd_init();
+	if (active_encode)
+		done = active_encode(plaintext_in, groups_in, avail_in, code_out);
+	encode_groups_scalar(plaintext_in + 3*done, groups_in - done, code_out + 4*done);
+}
+
+int base64_decode_quads(const char* code_in, int length_in, char* plaintext_out)
+{
+	if (!initialised) base64_simd_init();
+	if (!active_decode) return 0;
+	return active_decode(code_in, length_in, plaintext_out);
+}
+
+int base64_decode_quads_active(void)
+{
+	if (!initialised) base64_simd_init();
+	return active_decode != 0;
+}
+